@@ -38,6 +38,10 @@ typedef enum SIRGlobalFlags {
     SIRGlobalFlags_Initialized = 1 << 1,
 } SIRGlobalFlags;
 
+typedef enum SIRFunctionFlags {
+    SIRFunctionFlags_AlwaysInline = 1 << 0,
+} SIRFunctionFlags;
+
 typedef enum SIRBinaryOperation {
     SIRBinaryOperation_Unknown = 0,
 
@@ -137,6 +141,35 @@ typedef struct SIRInstRef {
     uint32_t id;
 } SIRInstRef;
 
+typedef struct SIRFunctionStats {
+    SIRInstRef func_ref;
+    double time;        // Seconds spent generating machine code
+    size_t alloc_count; // Allocations made while generating machine code
+    size_t inst_count;  // Machine instructions emitted
+    size_t code_size;   // Bytes of machine code emitted
+} SIRFunctionStats;
+
+typedef enum SIROptLevel {
+    SIROptLevel_O0, // No transformations, fastest compile
+    SIROptLevel_O1, // Cheap passes with the largest payoff
+    SIROptLevel_O2, // Every pass, spends compile time on runtime performance
+} SIROptLevel;
+
+typedef struct SIRPassStats {
+    const char *name;     // Null terminated, static
+    double time;          // Seconds spent in the pass
+    size_t insts_removed; // Net instructions removed from blocks
+    size_t blocks_merged; // Net blocks removed from functions
+} SIRPassStats;
+
+typedef struct SIRObjectSectionInfo {
+    const char *name; // Null terminated, owned by the object builder
+    size_t size;      // Bytes of data in the section
+} SIRObjectSectionInfo;
+
+// Number of allocations made by SIR allocators so far
+size_t SIRGetAllocCount(void);
+
 /*
  *  SIRModule functions
  */
@@ -187,6 +220,8 @@ SIRInstRef SIRModuleAddFunction(
     SIRType **param_types,
     size_t param_types_len,
     SIRType *return_type);
+void SIRModuleSetFunctionFlags(
+    SIRModule *module, SIRInstRef func_ref, uint32_t flags);
 SIRInstRef SIRModuleAddGlobal(
     SIRModule *module,
     SIRType *type,
@@ -208,6 +243,7 @@ uint32_t SIRTypeSizeOf(SIRModule *module, SIRType *type);
 uint32_t SIRTypeAlignOf(SIRModule *module, SIRType *type);
 uint32_t
 SIRTypeStructOffsetOf(SIRModule *module, SIRType *type, uint32_t field_index);
+uint32_t SIRModuleGetInstCount(SIRModule *module);
 uint32_t
 SIRModuleGetBlockInstructionCount(SIRModule *module, SIRInstRef block_ref);
 SIRInstRef SIRModuleGetBlockInstruction(
@@ -215,6 +251,70 @@ SIRInstRef SIRModuleGetBlockInstruction(
 
 char *SIRModulePrintToString(SIRModule *module, size_t *str_len);
 
+// Promotes stack slots that are only loaded from and stored to as scalars into
+// SSA values, inserting phis where needed. Returns the number of promoted
+// slots.
+size_t SIRModulePromoteStackSlots(SIRModule *module);
+
+// Splits struct and small array stack slots whose address does not escape
+// into one stack slot per field, so the fields can be promoted by mem2reg.
+// Returns the number of split slots.
+size_t SIRModuleSplitStackSlots(SIRModule *module);
+
+// Inlines calls to functions flagged SIRFunctionFlags_AlwaysInline, and to
+// leaf functions of at most max_leaf_size instructions (0 disables the size
+// heuristic). Returns the number of inlined calls.
+size_t SIRModuleInlineCalls(SIRModule *module, uint32_t max_leaf_size);
+
+// Turns calls of functions to themselves that are directly followed by a
+// return of their result into jumps back to the start of the function.
+// Returns the number of converted calls.
+size_t SIRModuleEliminateTailCalls(SIRModule *module);
+
+// Replaces instructions whose operands are all constants, and branches on
+// constant conditions, with their results. Returns the number of folded
+// instructions.
+size_t SIRModuleFoldConstants(SIRModule *module);
+
+// Removes unused instructions without side effects, and stack slots nothing
+// refers to anymore. Returns the number of removed instructions.
+size_t SIRModuleRemoveDeadCode(SIRModule *module);
+
+// Replaces pure instructions with an equivalent instruction that dominates
+// them, and duplicate constants with a single one. Returns the number of
+// removed instructions.
+size_t SIRModuleNumberValues(SIRModule *module);
+
+// Replaces loads with the value an earlier store or load left in memory, and
+// removes stores that are overwritten or never read. Returns the number of
+// removed instructions.
+size_t SIRModuleOptimizeMemory(SIRModule *module);
+
+// Gives every loop a preheader and hoists loop invariant pure instructions,
+// and loads from stack slots whose address does not escape, into it. Returns
+// the number of changes made.
+size_t SIRModuleHoistLoopInvariants(SIRModule *module);
+
+// Replaces array accesses indexed by an induction variable with a pointer
+// that advances by the stride on every iteration. Returns the number of
+// changes made.
+size_t SIRModuleReduceStrength(SIRModule *module);
+
+// Removes unreachable blocks, folds branches with a known target into jumps,
+// merges blocks into their only predecessor and threads jumps through empty
+// blocks. Returns the number of removed blocks.
+size_t SIRModuleSimplifyCFG(SIRModule *module);
+
+// Runs the pass pipeline of the given level. In debug builds the IR is
+// verified after every pass. Returns the stats of every pass that ran, owned
+// by the module.
+const SIRPassStats *SIRModuleOptimize(
+    SIRModule *module, SIROptLevel level, size_t *stats_len);
+
+// Checks the structure and SSA form of every function, printing the problems
+// found to stderr. Returns whether the module is valid.
+bool SIRModuleVerify(SIRModule *module);
+
 /*
  *  SIRBuilder functions
  */
@@ -296,11 +396,20 @@ SIRObjectBuilder *SIRCreateELF64Builder(SIRModule *module);
 void SIRObjectBuilderDestroy(SIRObjectBuilder *obj_builder);
 void SIRObjectBuilderOutputToFile(
     SIRObjectBuilder *obj_builder, const char *path, size_t path_len);
+size_t SIRObjectBuilderGetSectionCount(SIRObjectBuilder *obj_builder);
+SIRObjectSectionInfo SIRObjectBuilderGetSectionInfo(
+    SIRObjectBuilder *obj_builder, size_t section_index);
+size_t SIRObjectBuilderGetRelocationCount(SIRObjectBuilder *obj_builder);
 
 SIRAsmBuilder *
 SIRCreateX64Builder(SIRModule *module, SIRObjectBuilder *obj_builder);
+void SIRAsmBuilderSetOmitFramePointer(
+    SIRAsmBuilder *asm_builder, bool omit_frame_pointer);
+void SIRAsmBuilderSetOptLevel(SIRAsmBuilder *asm_builder, SIROptLevel level);
 void SIRAsmBuilderGenerate(SIRAsmBuilder *asm_builder);
 void SIRAsmBuilderDestroy(SIRAsmBuilder *asm_builder);
+const SIRFunctionStats *
+SIRAsmBuilderGetFunctionStats(SIRAsmBuilder *asm_builder, size_t *stats_len);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,602 @@
+#include "sir_analysis.hpp"
+#include "sir_ir.hpp"
+
+// Turns per-item counts stored at offsets[i + 1] into the start offsets of a
+// flat list. Filling the list with offsets[i]++ leaves every offset pointing
+// at the end of its range, which shift_offsets undoes.
+static void accumulate_offsets(SIRArray<uint32_t> *offsets)
+{
+    for (size_t i = 1; i < offsets->len; ++i) {
+        (*offsets)[i] += (*offsets)[i - 1];
+    }
+}
+
+static void shift_offsets(SIRArray<uint32_t> *offsets)
+{
+    for (size_t i = offsets->len - 1; i > 0; --i) {
+        (*offsets)[i] = (*offsets)[i - 1];
+    }
+    (*offsets)[0] = 0;
+}
+
+static void fill_array(SIRArray<uint32_t> *array, size_t len, uint32_t value)
+{
+    array->resize(len);
+    for (size_t i = 0; i < len; ++i) {
+        (*array)[i] = value;
+    }
+}
+
+SIRInstRef SIRBlockGetTerminator(SIRModule *module, SIRInstRef block_ref)
+{
+    SIRBlock *block = module->insts[block_ref.id].block;
+    for (SIRInstRef inst_ref : block->inst_refs) {
+        if (SIRInstIsTerminator(module->insts[inst_ref.id].kind)) {
+            return inst_ref;
+        }
+    }
+    return {0};
+}
+
+static void compute_cfg(SIRModule *module, SIRFunction *func)
+{
+    ZoneScoped;
+
+    SIRFunctionAnalysis *a = &func->analysis;
+    uint32_t block_count = (uint32_t)func->blocks.len;
+
+    for (uint32_t i = 0; i < block_count; ++i) {
+        module->insts[func->blocks[i].id].block->index = i;
+    }
+
+    // Successors, taken from the first terminator of each block
+    a->succ_offsets.resize(block_count + 1);
+    a->succs.len = 0;
+    for (uint32_t i = 0; i < block_count; ++i) {
+        a->succ_offsets[i] = (uint32_t)a->succs.len;
+
+        SIRInstRef term_ref = SIRBlockGetTerminator(module, func->blocks[i]);
+        if (!term_ref.id) continue;
+
+        SIRInst term = module->insts[term_ref.id];
+        if (term.kind == SIRInstKind_Jump) {
+            a->succs.push_back(module->insts[term.op1.id].block->index);
+        } else if (term.kind == SIRInstKind_Branch) {
+            a->succs.push_back(module->insts[term.op1.id].block->index);
+            if (term.op2.id != term.op1.id) {
+                a->succs.push_back(module->insts[term.op2.id].block->index);
+            }
+        }
+    }
+    a->succ_offsets[block_count] = (uint32_t)a->succs.len;
+
+    // Predecessors
+    fill_array(&a->pred_offsets, block_count + 1, 0);
+    for (uint32_t succ : a->succs) {
+        a->pred_offsets[succ + 1]++;
+    }
+    accumulate_offsets(&a->pred_offsets);
+    a->preds.resize(a->succs.len);
+    for (uint32_t i = 0; i < block_count; ++i) {
+        for (uint32_t succ : SIRAnalysisGetSuccs(a, i)) {
+            a->preds[a->pred_offsets[succ]++] = i;
+        }
+    }
+    shift_offsets(&a->pred_offsets);
+
+    // Reverse postorder of the blocks reachable from the entry block, the
+    // RPO indices double as the visited markers of the depth first search
+    fill_array(&a->rpo_indices, block_count, SIR_NO_INDEX);
+    a->rpo.len = 0;
+    if (block_count == 0) return;
+
+    SIRArray<uint32_t> stack =
+        SIRArray<uint32_t>::create(&SIR_MALLOC_ALLOCATOR);
+    SIRArray<uint32_t> succ_pos =
+        SIRArray<uint32_t>::create(&SIR_MALLOC_ALLOCATOR);
+
+    stack.push_back(0);
+    succ_pos.push_back(0);
+    a->rpo_indices[0] = 0;
+    while (stack.len > 0) {
+        uint32_t block = stack[stack.len - 1];
+        SIRSlice<uint32_t> succs = SIRAnalysisGetSuccs(a, block);
+        uint32_t *pos = &succ_pos[succ_pos.len - 1];
+        if (*pos < succs.len) {
+            uint32_t succ = succs[(*pos)++];
+            if (a->rpo_indices[succ] == SIR_NO_INDEX) {
+                a->rpo_indices[succ] = 0;
+                stack.push_back(succ);
+                succ_pos.push_back(0);
+            }
+        } else {
+            a->rpo.push_back(block);
+            stack.pop();
+            succ_pos.pop();
+        }
+    }
+
+    stack.destroy();
+    succ_pos.destroy();
+
+    for (size_t i = 0; i < a->rpo.len / 2; ++i) {
+        uint32_t tmp = a->rpo[i];
+        a->rpo[i] = a->rpo[a->rpo.len - 1 - i];
+        a->rpo[a->rpo.len - 1 - i] = tmp;
+    }
+    for (uint32_t i = 0; i < a->rpo.len; ++i) {
+        a->rpo_indices[a->rpo[i]] = i;
+    }
+}
+
+static uint32_t
+intersect_doms(SIRFunctionAnalysis *a, uint32_t block1, uint32_t block2)
+{
+    while (block1 != block2) {
+        while (a->rpo_indices[block1] > a->rpo_indices[block2]) {
+            block1 = a->idoms[block1];
+        }
+        while (a->rpo_indices[block2] > a->rpo_indices[block1]) {
+            block2 = a->idoms[block2];
+        }
+    }
+    return block1;
+}
+
+// Cooper, Harvey and Kennedy, "A Simple, Fast Dominance Algorithm"
+static void compute_dominators(SIRFunction *func)
+{
+    ZoneScoped;
+
+    SIRFunctionAnalysis *a = &func->analysis;
+    uint32_t block_count = (uint32_t)func->blocks.len;
+
+    fill_array(&a->idoms, block_count, SIR_NO_INDEX);
+    if (block_count > 0) a->idoms[0] = 0;
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t i = 1; i < a->rpo.len; ++i) {
+            uint32_t block = a->rpo[i];
+            uint32_t new_idom = SIR_NO_INDEX;
+            for (uint32_t pred : SIRAnalysisGetPreds(a, block)) {
+                if (a->idoms[pred] == SIR_NO_INDEX) continue;
+                new_idom = (new_idom == SIR_NO_INDEX)
+                               ? pred
+                               : intersect_doms(a, pred, new_idom);
+            }
+            if (a->idoms[block] != new_idom) {
+                a->idoms[block] = new_idom;
+                changed = true;
+            }
+        }
+    }
+
+    // Dominator tree
+    fill_array(&a->dom_child_offsets, block_count + 1, 0);
+    for (size_t i = 1; i < a->rpo.len; ++i) {
+        a->dom_child_offsets[a->idoms[a->rpo[i]] + 1]++;
+    }
+    accumulate_offsets(&a->dom_child_offsets);
+    a->dom_children.resize(a->rpo.len > 0 ? a->rpo.len - 1 : 0);
+    for (size_t i = 1; i < a->rpo.len; ++i) {
+        uint32_t block = a->rpo[i];
+        a->dom_children[a->dom_child_offsets[a->idoms[block]]++] = block;
+    }
+    shift_offsets(&a->dom_child_offsets);
+
+    // Preorder numbering of the tree for constant time dominance queries
+    fill_array(&a->dom_pre, block_count, SIR_NO_INDEX);
+    fill_array(&a->dom_last, block_count, SIR_NO_INDEX);
+    if (a->rpo.len > 0) {
+        SIRArray<uint32_t> stack =
+            SIRArray<uint32_t>::create(&SIR_MALLOC_ALLOCATOR);
+        SIRArray<uint32_t> child_pos =
+            SIRArray<uint32_t>::create(&SIR_MALLOC_ALLOCATOR);
+
+        uint32_t counter = 0;
+        stack.push_back(0);
+        child_pos.push_back(0);
+        a->dom_pre[0] = counter++;
+        while (stack.len > 0) {
+            uint32_t block = stack[stack.len - 1];
+            SIRSlice<uint32_t> children = SIRAnalysisGetDomChildren(a, block);
+            uint32_t *pos = &child_pos[child_pos.len - 1];
+            if (*pos < children.len) {
+                uint32_t child = children[(*pos)++];
+                a->dom_pre[child] = counter++;
+                stack.push_back(child);
+                child_pos.push_back(0);
+            } else {
+                a->dom_last[block] = counter - 1;
+                stack.pop();
+                child_pos.pop();
+            }
+        }
+
+        stack.destroy();
+        child_pos.destroy();
+    }
+
+    // Dominance frontiers, found by walking up from the predecessors of every
+    // join point. Pairs are collected first and then grouped per block.
+    SIRArray<uint32_t> pairs =
+        SIRArray<uint32_t>::create(&SIR_MALLOC_ALLOCATOR);
+    SIRArray<uint32_t> last_join =
+        SIRArray<uint32_t>::create(&SIR_MALLOC_ALLOCATOR);
+    fill_array(&last_join, block_count, SIR_NO_INDEX);
+
+    for (uint32_t block : a->rpo) {
+        SIRSlice<uint32_t> preds = SIRAnalysisGetPreds(a, block);
+        if (preds.len < 2) continue;
+
+        for (uint32_t pred : preds) {
+            if (!SIRAnalysisIsReachable(a, pred)) continue;
+
+            uint32_t runner = pred;
+            while (runner != a->idoms[block]) {
+                if (last_join[runner] != block) {
+                    last_join[runner] = block;
+                    pairs.push_back(runner);
+                    pairs.push_back(block);
+                }
+                runner = a->idoms[runner];
+            }
+        }
+    }
+
+    fill_array(&a->frontier_offsets, block_count + 1, 0);
+    for (size_t i = 0; i < pairs.len; i += 2) {
+        a->frontier_offsets[pairs[i] + 1]++;
+    }
+    accumulate_offsets(&a->frontier_offsets);
+    a->frontiers.resize(pairs.len / 2);
+    for (size_t i = 0; i < pairs.len; i += 2) {
+        a->frontiers[a->frontier_offsets[pairs[i]]++] = pairs[i + 1];
+    }
+    shift_offsets(&a->frontier_offsets);
+
+    pairs.destroy();
+    last_join.destroy();
+}
+
+// A natural loop is a header together with every block that reaches one of
+// its back edges without going through the header
+static void compute_loops(SIRFunction *func)
+{
+    ZoneScoped;
+
+    SIRFunctionAnalysis *a = &func->analysis;
+    uint32_t block_count = (uint32_t)func->blocks.len;
+
+    a->loops.len = 0;
+    a->loop_blocks.len = 0;
+    fill_array(&a->block_loops, block_count, SIR_NO_INDEX);
+
+    SIRArray<uint32_t> markers =
+        SIRArray<uint32_t>::create(&SIR_MALLOC_ALLOCATOR);
+    SIRArray<uint32_t> worklist =
+        SIRArray<uint32_t>::create(&SIR_MALLOC_ALLOCATOR);
+    fill_array(&markers, block_count, SIR_NO_INDEX);
+
+    for (uint32_t header : a->rpo) {
+        uint32_t loop_index = (uint32_t)a->loops.len;
+
+        worklist.len = 0;
+        for (uint32_t pred : SIRAnalysisGetPreds(a, header)) {
+            if (!SIRAnalysisIsReachable(a, pred)) continue;
+            if (!SIRAnalysisDominates(a, header, pred)) continue;
+            if (markers[pred] == loop_index) continue;
+
+            markers[pred] = loop_index;
+            worklist.push_back(pred);
+        }
+        if (worklist.len == 0) continue;
+
+        SIRLoop loop = {};
+        loop.header = header;
+        loop.parent = SIR_NO_INDEX;
+        loop.blocks_offset = (uint32_t)a->loop_blocks.len;
+
+        markers[header] = loop_index;
+        a->loop_blocks.push_back(header);
+        for (uint32_t latch : worklist) {
+            if (latch != header) a->loop_blocks.push_back(latch);
+        }
+
+        while (worklist.len > 0) {
+            uint32_t block = worklist[worklist.len - 1];
+            worklist.pop();
+            if (block == header) continue;
+
+            for (uint32_t pred : SIRAnalysisGetPreds(a, block)) {
+                if (!SIRAnalysisIsReachable(a, pred)) continue;
+                if (markers[pred] == loop_index) continue;
+
+                markers[pred] = loop_index;
+                a->loop_blocks.push_back(pred);
+                worklist.push_back(pred);
+            }
+        }
+
+        loop.blocks_len = (uint32_t)a->loop_blocks.len - loop.blocks_offset;
+        a->loops.push_back(loop);
+    }
+
+    markers.destroy();
+    worklist.destroy();
+
+    // An enclosing loop always has more blocks than the loops nested in it,
+    // so sorting by size puts parents first
+    for (size_t i = 1; i < a->loops.len; ++i) {
+        SIRLoop loop = a->loops[i];
+        size_t j = i;
+        while (j > 0 && a->loops[j - 1].blocks_len < loop.blocks_len) {
+            a->loops[j] = a->loops[j - 1];
+            j--;
+        }
+        a->loops[j] = loop;
+    }
+
+    for (uint32_t i = 0; i < a->loops.len; ++i) {
+        SIRLoop *loop = &a->loops[i];
+        loop->parent = a->block_loops[loop->header];
+        loop->depth =
+            (loop->parent == SIR_NO_INDEX) ? 1
+                                           : a->loops[loop->parent].depth + 1;
+        for (uint32_t block : SIRAnalysisGetLoopBlocks(a, i)) {
+            a->block_loops[block] = i;
+        }
+    }
+}
+
+SIRFunctionAnalysis *
+SIRFunctionGetAnalysis(SIRModule *module, SIRInstRef func_ref, uint32_t kinds)
+{
+    ZoneScoped;
+
+    SIRInst func_inst = SIRModuleGetInst(module, func_ref);
+    SIR_ASSERT(func_inst.kind == SIRInstKind_Function);
+    SIRFunction *func = func_inst.func;
+    SIRFunctionAnalysis *a = &func->analysis;
+
+    if (kinds & SIRAnalysis_Loops) kinds |= SIRAnalysis_Dominators;
+    if (kinds & SIRAnalysis_Dominators) kinds |= SIRAnalysis_CFG;
+
+    uint32_t missing = kinds & ~a->valid;
+    if (missing & SIRAnalysis_CFG) {
+        compute_cfg(module, func);
+        a->valid |= SIRAnalysis_CFG;
+    }
+    if (missing & SIRAnalysis_Dominators) {
+        compute_dominators(func);
+        a->valid |= SIRAnalysis_Dominators;
+    }
+    if (missing & SIRAnalysis_Loops) {
+        compute_loops(func);
+        a->valid |= SIRAnalysis_Loops;
+    }
+
+    return a;
+}
+
+void SIRFunctionInvalidateAnalysis(
+    SIRModule *module, SIRInstRef func_ref, uint32_t kinds)
+{
+    SIRInst func_inst = SIRModuleGetInst(module, func_ref);
+    SIR_ASSERT(func_inst.kind == SIRInstKind_Function);
+
+    // Dominators are derived from the CFG and loops from the dominators
+    if (kinds & SIRAnalysis_CFG) kinds |= SIRAnalysis_Dominators;
+    if (kinds & SIRAnalysis_Dominators) kinds |= SIRAnalysis_Loops;
+
+    func_inst.func->analysis.valid &= ~kinds;
+}
+
+SIRSlice<SIRInstRef> SIRModuleGetUses(SIRModule *module, SIRInstRef inst_ref)
+{
+    SIRUseAnalysis *uses = &module->uses;
+
+    if (!uses->valid) {
+        ZoneScoped;
+
+        fill_array(&uses->offsets, module->insts.len + 1, 0);
+
+        for (int pass = 0; pass < 2; ++pass) {
+            for (SIRInstRef func_ref : module->functions) {
+                SIRFunction *func = module->insts[func_ref.id].func;
+                for (SIRInstRef block_ref : func->blocks) {
+                    SIRBlock *block = module->insts[block_ref.id].block;
+                    for (SIRInstRef user_ref : block->inst_refs) {
+                        SIRInstRef *operands[2];
+                        uint32_t operand_count = SIRInstGetOperands(
+                            &module->insts[user_ref.id], operands);
+                        for (uint32_t i = 0; i < operand_count; ++i) {
+                            uint32_t id = operands[i]->id;
+                            if (pass == 0) {
+                                uses->offsets[id + 1]++;
+                            } else {
+                                uses->users[uses->offsets[id]++] = user_ref;
+                            }
+                        }
+                    }
+                }
+            }
+
+            if (pass == 0) {
+                accumulate_offsets(&uses->offsets);
+                uses->users.resize(uses->offsets[module->insts.len]);
+            }
+        }
+        shift_offsets(&uses->offsets);
+
+        uses->slot_escapes.resize(module->insts.len);
+        for (size_t i = 0; i < module->insts.len; ++i) {
+            uses->slot_escapes[i] = SIRSlotEscape_Unknown;
+        }
+
+        uses->valid = true;
+    }
+
+    // Instructions added after the uses were computed have none
+    if (inst_ref.id + 1 >= uses->offsets.len) return {};
+
+    uint32_t offset = uses->offsets[inst_ref.id];
+    return {&uses->users.ptr[offset], uses->offsets[inst_ref.id + 1] - offset};
+}
+
+void SIRModuleInvalidateUses(SIRModule *module)
+{
+    module->uses.valid = false;
+}
+
+static bool pointer_escapes(SIRModule *module, SIRInstRef ptr_ref)
+{
+    for (SIRInstRef user_ref : SIRModuleGetUses(module, ptr_ref)) {
+        SIRInst user = module->insts[user_ref.id];
+        switch (user.kind) {
+        case SIRInstKind_Load: break;
+        case SIRInstKind_Store: {
+            if (user.store.value_ref.id == ptr_ref.id) return true;
+            break;
+        }
+        case SIRInstKind_ArrayElemPtr:
+        case SIRInstKind_StructElemPtr: {
+            if (user.op1.id != ptr_ref.id) return true;
+            if (pointer_escapes(module, user_ref)) return true;
+            break;
+        }
+        default: return true;
+        }
+    }
+    return false;
+}
+
+bool SIRModuleIsLocalSlot(SIRModule *module, SIRInstRef slot_ref)
+{
+    // Make sure the use lists are up to date
+    SIRModuleGetUses(module, slot_ref);
+
+    // Slots added since then have no use lists to look at
+    SIRUseAnalysis *uses = &module->uses;
+    if (slot_ref.id >= uses->slot_escapes.len) return false;
+
+    if (uses->slot_escapes[slot_ref.id] == SIRSlotEscape_Unknown) {
+        uses->slot_escapes[slot_ref.id] = pointer_escapes(module, slot_ref)
+                                              ? SIRSlotEscape_Escaping
+                                              : SIRSlotEscape_Local;
+    }
+    return uses->slot_escapes[slot_ref.id] == SIRSlotEscape_Local;
+}
+
+SIRMemLoc
+SIRModuleGetMemLoc(SIRModule *module, SIRInstRef ptr_ref, uint64_t size)
+{
+    SIRMemLoc loc = {};
+    loc.offset = 0;
+    loc.size = size;
+
+    for (;;) {
+        SIRInst ptr = module->insts[ptr_ref.id];
+        switch (ptr.kind) {
+        case SIRInstKind_StructElemPtr: {
+            SIRType *struct_type = module->insts[ptr.op1.id].type->pointer.sub;
+            uint32_t field_index =
+                (uint32_t)module->insts[ptr.op2.id].const_int.u64;
+            if (loc.offset != SIR_UNKNOWN_OFFSET) {
+                loc.offset += SIRTypeStructOffsetOf(
+                    module, struct_type, field_index);
+            }
+            ptr_ref = ptr.op1;
+            continue;
+        }
+        case SIRInstKind_ArrayElemPtr: {
+            SIRInst index = module->insts[ptr.op2.id];
+            if (index.kind != SIRInstKind_ConstInt) {
+                loc.offset = SIR_UNKNOWN_OFFSET;
+            } else if (loc.offset != SIR_UNKNOWN_OFFSET) {
+                uint64_t elem_size =
+                    SIRTypeSizeOf(module, ptr.type->pointer.sub);
+                loc.offset += index.const_int.u64 * elem_size;
+            }
+            ptr_ref = ptr.op1;
+            continue;
+        }
+        case SIRInstKind_BitCast: {
+            if (module->insts[ptr.op1.id].type->kind != SIRTypeKind_Pointer) {
+                break;
+            }
+            ptr_ref = ptr.op1;
+            continue;
+        }
+        default: break;
+        }
+        break;
+    }
+
+    // Negative constant indices wrap around
+    if (loc.offset != SIR_UNKNOWN_OFFSET && loc.offset >= (1ULL << 62)) {
+        loc.offset = SIR_UNKNOWN_OFFSET;
+    }
+
+    loc.base = ptr_ref;
+    switch (module->insts[ptr_ref.id].kind) {
+    case SIRInstKind_StackSlot: {
+        loc.base_kind = SIRMemBase_StackSlot;
+        loc.local = SIRModuleIsLocalSlot(module, ptr_ref);
+        break;
+    }
+    case SIRInstKind_Global: loc.base_kind = SIRMemBase_Global; break;
+    default: loc.base_kind = SIRMemBase_Unknown; break;
+    }
+    return loc;
+}
+
+bool SIRMemLocMayAlias(const SIRMemLoc &a, const SIRMemLoc &b)
+{
+    if (a.base.id == b.base.id) {
+        if (a.offset == SIR_UNKNOWN_OFFSET || b.offset == SIR_UNKNOWN_OFFSET) {
+            return true;
+        }
+        return a.offset < b.offset + b.size && b.offset < a.offset + a.size;
+    }
+
+    // Distinct objects never overlap, and only pointers derived from a
+    // stack slot can reach it when its address does not escape
+    if (a.base_kind != SIRMemBase_Unknown &&
+        b.base_kind != SIRMemBase_Unknown) {
+        return false;
+    }
+    return !a.local && !b.local;
+}
+
+bool SIRFunctionIsTailCall(
+    SIRModule *module,
+    SIRInstRef func_ref,
+    SIRInstRef block_ref,
+    size_t call_pos)
+{
+    SIRFunction *func = module->insts[func_ref.id].func;
+    SIRBlock *block = module->insts[block_ref.id].block;
+    if (func->variadic || call_pos + 1 >= block->inst_refs.len) return false;
+
+    SIRInstRef call_ref = block->inst_refs[call_pos];
+    if (module->insts[call_ref.id].kind != SIRInstKind_FuncCall) return false;
+
+    SIRInst ret = module->insts[block->inst_refs[call_pos + 1].id];
+    switch (ret.kind) {
+    case SIRInstKind_ReturnVoid: break;
+    case SIRInstKind_ReturnValue: {
+        if (ret.op1.id != call_ref.id) return false;
+        break;
+    }
+    default: return false;
+    }
+
+    // The callee runs after the frame of the caller is gone
+    for (SIRInstRef slot_ref : func->stack_slots) {
+        if (!SIRModuleIsLocalSlot(module, slot_ref)) return false;
+    }
+    return true;
+}
@@ -0,0 +1,183 @@
+#pragma once
+
+#include "sir_base.hpp"
+#include "sir.h"
+
+struct SIRModule;
+
+// Analyses are computed on demand and cached until they are invalidated.
+// Builder functions invalidate the analyses of the function they insert into,
+// passes that rewrite the IR directly have to invalidate what they change.
+
+enum SIRAnalysisKind : uint32_t {
+    SIRAnalysis_CFG = 1 << 0,        // Predecessors, successors and RPO
+    SIRAnalysis_Dominators = 1 << 1, // Dominator tree and frontiers
+    SIRAnalysis_Loops = 1 << 2,      // Natural loop nesting
+    SIRAnalysis_All =
+        SIRAnalysis_CFG | SIRAnalysis_Dominators | SIRAnalysis_Loops,
+};
+
+static const uint32_t SIR_NO_INDEX = UINT32_MAX;
+
+struct SIRLoop {
+    uint32_t header;
+    uint32_t parent; // SIR_NO_INDEX for outermost loops
+    uint32_t depth;  // 1 for outermost loops
+    uint32_t blocks_offset;
+    uint32_t blocks_len;
+};
+
+// Blocks are identified by their index in SIRFunction::blocks. Edge lists are
+// stored flat, the lists of block i are in [offsets[i], offsets[i + 1]).
+struct SIRFunctionAnalysis {
+    uint32_t valid; // SIRAnalysisKind flags
+
+    SIRArray<uint32_t> pred_offsets;
+    SIRArray<uint32_t> preds;
+    SIRArray<uint32_t> succ_offsets;
+    SIRArray<uint32_t> succs;
+    SIRArray<uint32_t> rpo;         // Reachable blocks in reverse postorder
+    SIRArray<uint32_t> rpo_indices; // SIR_NO_INDEX for unreachable blocks
+
+    SIRArray<uint32_t> idoms; // The entry block is its own idom
+    SIRArray<uint32_t> dom_child_offsets;
+    SIRArray<uint32_t> dom_children;
+    SIRArray<uint32_t> dom_pre;  // Preorder number in the dominator tree
+    SIRArray<uint32_t> dom_last; // Last preorder number in the subtree
+    SIRArray<uint32_t> frontier_offsets;
+    SIRArray<uint32_t> frontiers;
+
+    SIRArray<SIRLoop> loops; // Parents come before their children
+    SIRArray<uint32_t> loop_blocks;
+    SIRArray<uint32_t> block_loops; // Innermost loop, or SIR_NO_INDEX
+};
+
+enum SIRSlotEscape : uint8_t {
+    SIRSlotEscape_Unknown,
+    SIRSlotEscape_Local,
+    SIRSlotEscape_Escaping,
+};
+
+// Use lists of every instruction of the module, only instructions inside
+// blocks are counted as users
+struct SIRUseAnalysis {
+    bool valid;
+    SIRArray<uint32_t> offsets;
+    SIRArray<SIRInstRef> users;
+    SIRArray<SIRSlotEscape> slot_escapes; // Filled by SIRModuleIsLocalSlot
+};
+
+static const uint64_t SIR_UNKNOWN_OFFSET = UINT64_MAX;
+
+enum SIRMemBaseKind : uint8_t {
+    SIRMemBase_StackSlot,
+    SIRMemBase_Global,
+    SIRMemBase_Unknown, // The base is a pointer of unknown origin
+};
+
+// Bytes accessed through a pointer, relative to the object it points into
+struct SIRMemLoc {
+    SIRInstRef base;
+    SIRMemBaseKind base_kind;
+    bool local; // Stack slot whose address never escapes
+    uint64_t offset; // SIR_UNKNOWN_OFFSET when indexed at runtime
+    uint64_t size;
+};
+
+SIRFunctionAnalysis *
+SIRFunctionGetAnalysis(SIRModule *module, SIRInstRef func_ref, uint32_t kinds);
+void SIRFunctionInvalidateAnalysis(
+    SIRModule *module, SIRInstRef func_ref, uint32_t kinds);
+
+SIRSlice<SIRInstRef> SIRModuleGetUses(SIRModule *module, SIRInstRef inst_ref);
+void SIRModuleInvalidateUses(SIRModule *module);
+
+// Whether the address of the stack slot is only used to load from and store
+// to it, so no other pointer or function call can reach it
+bool SIRModuleIsLocalSlot(SIRModule *module, SIRInstRef slot_ref);
+
+SIRMemLoc
+SIRModuleGetMemLoc(SIRModule *module, SIRInstRef ptr_ref, uint64_t size);
+bool SIRMemLocMayAlias(const SIRMemLoc &a, const SIRMemLoc &b);
+
+// Whether a function call may read or write the location
+SIR_INLINE
+bool SIRMemLocIsCallVisible(const SIRMemLoc &loc)
+{
+    return !loc.local;
+}
+
+// Whether every byte of b is also accessed by a
+SIR_INLINE
+bool SIRMemLocContains(const SIRMemLoc &a, const SIRMemLoc &b)
+{
+    return a.base.id == b.base.id && a.offset != SIR_UNKNOWN_OFFSET &&
+           b.offset != SIR_UNKNOWN_OFFSET && a.offset <= b.offset &&
+           b.offset + b.size <= a.offset + a.size;
+}
+
+// First terminator of the block, instructions after it are never executed
+SIRInstRef SIRBlockGetTerminator(SIRModule *module, SIRInstRef block_ref);
+
+// Whether the call at call_pos of the block is directly followed by a return
+// of its result, and no stack slot of the function is reachable from the
+// callee, so the frame of the function can be released before the call
+bool SIRFunctionIsTailCall(
+    SIRModule *module,
+    SIRInstRef func_ref,
+    SIRInstRef block_ref,
+    size_t call_pos);
+
+SIR_INLINE
+SIRSlice<uint32_t> SIRAnalysisGetPreds(SIRFunctionAnalysis *a, uint32_t block)
+{
+    uint32_t offset = a->pred_offsets[block];
+    return {&a->preds.ptr[offset], a->pred_offsets[block + 1] - offset};
+}
+
+SIR_INLINE
+SIRSlice<uint32_t> SIRAnalysisGetSuccs(SIRFunctionAnalysis *a, uint32_t block)
+{
+    uint32_t offset = a->succ_offsets[block];
+    return {&a->succs.ptr[offset], a->succ_offsets[block + 1] - offset};
+}
+
+SIR_INLINE
+SIRSlice<uint32_t>
+SIRAnalysisGetDomChildren(SIRFunctionAnalysis *a, uint32_t block)
+{
+    uint32_t offset = a->dom_child_offsets[block];
+    return {
+        &a->dom_children.ptr[offset],
+        a->dom_child_offsets[block + 1] - offset};
+}
+
+SIR_INLINE
+SIRSlice<uint32_t>
+SIRAnalysisGetFrontier(SIRFunctionAnalysis *a, uint32_t block)
+{
+    uint32_t offset = a->frontier_offsets[block];
+    return {&a->frontiers.ptr[offset], a->frontier_offsets[block + 1] - offset};
+}
+
+SIR_INLINE
+SIRSlice<uint32_t>
+SIRAnalysisGetLoopBlocks(SIRFunctionAnalysis *a, uint32_t loop)
+{
+    return {&a->loop_blocks.ptr[a->loops[loop].blocks_offset],
+            a->loops[loop].blocks_len};
+}
+
+SIR_INLINE
+bool SIRAnalysisIsReachable(SIRFunctionAnalysis *a, uint32_t block)
+{
+    return a->rpo_indices[block] != SIR_NO_INDEX;
+}
+
+// Whether block a dominates block b, both have to be reachable
+SIR_INLINE
+bool SIRAnalysisDominates(SIRFunctionAnalysis *an, uint32_t a, uint32_t b)
+{
+    return an->dom_pre[a] <= an->dom_pre[b] &&
+           an->dom_pre[b] <= an->dom_last[a];
+}
@@ -1,5 +1,13 @@
+#include "sir.h"
 #include "sir_base.hpp"
 
+size_t SIR_ALLOC_COUNT = 0;
+
+size_t SIRGetAllocCount(void)
+{
+    return SIR_ALLOC_COUNT;
+}
+
 struct alignas(16) SIRArenaHeader {
     size_t size;
 };
@@ -99,6 +107,7 @@ static void *SIRArenaAlloc(SIRAllocator *allocator, size_t size)
     header->size = size;
 
     chunk->offset = new_offset;
+    SIR_ALLOC_COUNT++;
 
     return (void *)ptr;
 }
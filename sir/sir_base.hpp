@@ -8,8 +8,14 @@
 #include <stdarg.h>
 #include "stb_sprintf.h"
 
-#ifdef TRACY_ENABLE
+#ifdef __linux__
+#include <time.h>
+#endif
+
+#if defined(TRACY_ENABLE)
 #include <Tracy.hpp>
+#elif defined(SIR_TRACE_ENABLE)
+#include "sir_trace.hpp"
 #else
 #define ZoneScoped
 #endif
@@ -37,6 +43,20 @@
 
 #define SIR_MACRO_STR(x) #x
 
+// Incremented on every allocation made through a SIRAllocator
+extern size_t SIR_ALLOC_COUNT;
+
+SIR_INLINE static double SIRGetTimeSeconds()
+{
+#ifdef __linux__
+    timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec / 1000000000.0;
+#else
+#error Unsupported OS
+#endif
+}
+
 #define SIR_ASSERT(x)                                                          \
     do {                                                                       \
         if (!(x)) {                                                            \
@@ -129,6 +149,7 @@ struct SIRAllocator {
 SIR_INLINE static void *SIRCMalloc(SIRAllocator *allocator, size_t size)
 {
     (void)allocator;
+    SIR_ALLOC_COUNT++;
     return malloc(size);
 }
 
@@ -136,6 +157,7 @@ SIR_INLINE static void *
 SIRCRealloc(SIRAllocator *allocator, void *ptr, size_t size)
 {
     (void)allocator;
+    SIR_ALLOC_COUNT++;
     return realloc(ptr, size);
 }
 
@@ -0,0 +1,161 @@
+#include "sir_base.hpp"
+#include "sir_ir.hpp"
+
+// Mark and sweep dead code elimination. Instructions with side effects are
+// live, and so is everything they use, transitively. A phi keeps its
+// incoming values alive only while the phi itself is live. Everything else
+// is removed from its block, along with instructions after the first
+// terminator and stack slots that no live instruction refers to.
+
+struct DCEContext {
+    SIRModule *module;
+
+    // Indexed by instruction id, shared by all functions of the module
+    SIRArray<bool> live;
+    SIRArray<SIRInstRef> blocks; // Block holding each inst
+    SIRArray<uint32_t> positions;
+
+    SIRArray<SIRInstRef> worklist;
+    SIRArray<SIRInstRef> inst_refs;
+    size_t removed_count;
+};
+
+SIR_INLINE
+static bool dce_has_side_effects(SIRInstKind kind)
+{
+    switch (kind) {
+    case SIRInstKind_PushFunctionParameter:
+    case SIRInstKind_FuncCall:
+    case SIRInstKind_Store:
+    case SIRInstKind_SetCond:
+    case SIRInstKind_Jump:
+    case SIRInstKind_Branch:
+    case SIRInstKind_ReturnVoid:
+    case SIRInstKind_ReturnValue: return true;
+    default: return false;
+    }
+}
+
+SIR_INLINE
+static void dce_mark(DCEContext *ctx, SIRInstRef inst_ref)
+{
+    if (ctx->live[inst_ref.id]) return;
+    ctx->live[inst_ref.id] = true;
+    ctx->worklist.push_back(inst_ref);
+}
+
+static void dce_function(DCEContext *ctx, SIRInstRef func_ref)
+{
+    ZoneScoped;
+
+    SIRModule *module = ctx->module;
+    SIRFunction *func = module->insts[func_ref.id].func;
+    if (func->blocks.len == 0) return;
+
+    ctx->worklist.len = 0;
+
+    for (SIRInstRef block_ref : func->blocks) {
+        SIRBlock *block = module->insts[block_ref.id].block;
+        for (uint32_t i = 0; i < block->inst_refs.len; ++i) {
+            SIRInstRef inst_ref = block->inst_refs[i];
+            SIRInstKind kind = module->insts[inst_ref.id].kind;
+
+            ctx->blocks[inst_ref.id] = block_ref;
+            ctx->positions[inst_ref.id] = i;
+            if (dce_has_side_effects(kind)) dce_mark(ctx, inst_ref);
+            if (SIRInstIsTerminator(kind)) break;
+        }
+    }
+
+    while (ctx->worklist.len > 0) {
+        SIRInstRef inst_ref = ctx->worklist[ctx->worklist.len - 1];
+        ctx->worklist.pop();
+
+        SIRInst *inst = &module->insts[inst_ref.id];
+
+        SIRInstRef *operands[2];
+        uint32_t operand_count = SIRInstGetOperands(inst, operands);
+        for (uint32_t i = 0; i < operand_count; ++i) {
+            dce_mark(ctx, *operands[i]);
+        }
+
+        // The incoming values follow the phi in its block
+        if (inst->kind == SIRInstKind_Phi) {
+            // Phis after a terminator were never visited
+            SIRInstRef block_ref = ctx->blocks[inst_ref.id];
+            if (!block_ref.id) continue;
+
+            SIRBlock *block = module->insts[block_ref.id].block;
+            for (uint32_t i = ctx->positions[inst_ref.id] + 1;
+                 i < block->inst_refs.len;
+                 ++i) {
+                SIRInstRef incoming_ref = block->inst_refs[i];
+                if (module->insts[incoming_ref.id].kind !=
+                    SIRInstKind_PhiIncoming) {
+                    break;
+                }
+                dce_mark(ctx, incoming_ref);
+            }
+        }
+    }
+
+    for (SIRInstRef block_ref : func->blocks) {
+        SIRBlock *block = module->insts[block_ref.id].block;
+
+        ctx->inst_refs.len = 0;
+        for (SIRInstRef inst_ref : block->inst_refs) {
+            if (ctx->live[inst_ref.id]) {
+                ctx->inst_refs.push_back(inst_ref);
+            } else {
+                ctx->removed_count++;
+            }
+        }
+
+        block->inst_refs.len = 0;
+        block->inst_refs.push_many(ctx->inst_refs.as_slice());
+    }
+
+    size_t slot_count = 0;
+    for (SIRInstRef slot_ref : func->stack_slots) {
+        if (!ctx->live[slot_ref.id]) continue;
+        func->stack_slots[slot_count++] = slot_ref;
+    }
+    func->stack_slots.len = slot_count;
+}
+
+size_t SIRModuleRemoveDeadCode(SIRModule *module)
+{
+    ZoneScoped;
+
+    DCEContext ctx = {};
+    ctx.module = module;
+    ctx.live = SIRArray<bool>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.blocks = SIRArray<SIRInstRef>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.positions = SIRArray<uint32_t>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.worklist = SIRArray<SIRInstRef>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.inst_refs = SIRArray<SIRInstRef>::create(&SIR_MALLOC_ALLOCATOR);
+
+    ctx.live.resize(module->insts.len);
+    ctx.blocks.resize(module->insts.len);
+    ctx.positions.resize(module->insts.len);
+    for (size_t i = 0; i < module->insts.len; ++i) {
+        ctx.live[i] = false;
+        ctx.blocks[i] = {0};
+    }
+
+    for (size_t i = 0; i < module->functions.len; ++i) {
+        dce_function(&ctx, module->functions[i]);
+    }
+
+    if (ctx.removed_count > 0) {
+        SIRModuleInvalidateUses(module);
+    }
+
+    ctx.live.destroy();
+    ctx.blocks.destroy();
+    ctx.positions.destroy();
+    ctx.worklist.destroy();
+    ctx.inst_refs.destroy();
+
+    return ctx.removed_count;
+}
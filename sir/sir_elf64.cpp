@@ -332,6 +332,32 @@ static bool output_to_file(SIRObjectBuilder *obj_builder, SIRString path)
     return true;
 }
 
+static size_t get_section_count(SIRObjectBuilder *obj_builder)
+{
+    Elf64Builder *builder = (Elf64Builder *)obj_builder;
+    return builder->sections.len;
+}
+
+static SIRObjectSectionInfo
+get_section_info(SIRObjectBuilder *obj_builder, size_t section_index)
+{
+    Elf64Builder *builder = (Elf64Builder *)obj_builder;
+    Section *section = &builder->sections[section_index];
+    Section *shstrtab = &builder->sections[builder->shstrtab_index];
+
+    SIRObjectSectionInfo info = {};
+    info.name = (const char *)&shstrtab->data[section->header.sh_name];
+    info.size = section->data.len;
+    return info;
+}
+
+static size_t get_relocation_count(SIRObjectBuilder *obj_builder)
+{
+    Elf64Builder *builder = (Elf64Builder *)obj_builder;
+    Section *rela_text_section = &builder->sections[builder->rela_text_index];
+    return rela_text_section->data.len / sizeof(Elf64Rela);
+}
+
 static void destroy(SIRObjectBuilder *obj_builder)
 {
     Elf64Builder *builder = (Elf64Builder *)obj_builder;
@@ -412,6 +438,41 @@ get_section_size(SIRObjectBuilder *obj_builder, SIRSectionType type)
     return section->data.len;
 }
 
+static void truncate_section(
+    SIRObjectBuilder *obj_builder, SIRSectionType type, size_t size)
+{
+    ZoneScoped;
+    Elf64Builder *builder = (Elf64Builder *)obj_builder;
+
+    size_t section_index = 0;
+    switch (type) {
+    case SIRSectionType_None: SIR_ASSERT(0); break;
+    case SIRSectionType_Text: section_index = builder->text_index; break;
+    case SIRSectionType_Data: section_index = builder->data_index; break;
+    case SIRSectionType_BSS: section_index = builder->bss_index; break;
+    case SIRSectionType_ROData: section_index = builder->rodata_index; break;
+    }
+
+    Section *section = &builder->sections[section_index];
+    SIR_ASSERT(size <= section->data.len);
+    section->data.len = size;
+
+    if (type != SIRSectionType_Text) return;
+
+    // Relocations are added in code order, so the dropped ones are at the end
+    Section *rela_text_section = &builder->sections[builder->rela_text_index];
+    while (rela_text_section->data.len >= sizeof(Elf64Rela)) {
+        Elf64Rela rela;
+        memcpy(
+            &rela,
+            &rela_text_section->data
+                 .ptr[rela_text_section->data.len - sizeof(Elf64Rela)],
+            sizeof(rela));
+        if (rela.r_offset < size) break;
+        rela_text_section->data.len -= sizeof(Elf64Rela);
+    }
+}
+
 static void add_data_relocation(
     SIRObjectBuilder *obj_builder,
     SIRSectionType source_section,
@@ -539,11 +600,15 @@ SIRObjectBuilder *SIRCreateELF64Builder(SIRModule *module)
     builder->vt.add_to_section = add_to_section;
     builder->vt.set_section_data = set_section_data;
     builder->vt.get_section_size = get_section_size;
+    builder->vt.truncate_section = truncate_section;
     builder->vt.add_data_relocation = add_data_relocation;
     builder->vt.add_procedure_relocation = add_procedure_relocation;
     builder->vt.add_symbol = add_symbol;
     builder->vt.set_symbol_region = set_symbol_region;
     builder->vt.output_to_file = output_to_file;
+    builder->vt.get_section_count = get_section_count;
+    builder->vt.get_section_info = get_section_info;
+    builder->vt.get_relocation_count = get_relocation_count;
     builder->vt.destroy = destroy;
 
     builder->module = module;
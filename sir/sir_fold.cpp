@@ -0,0 +1,503 @@
+#include "sir_base.hpp"
+#include "sir_ir.hpp"
+
+// Replaces instructions whose operands are all constants with the constant
+// they compute, and branches on a constant condition with jumps. Blocks are
+// visited in reverse postorder so operands are folded before their uses.
+// Folding never changes what the program does at runtime, so divisions by
+// zero, oversized shifts and out of range float conversions are left alone.
+
+struct FoldContext {
+    SIRModule *module;
+    SIRInstRef func_ref;
+    SIRFunction *func;
+
+    // Indexed by instruction id, shared by all functions of the module
+    SIRArray<SIRInstRef> replacements;
+    SIRArray<bool> removed;
+
+    SIRArray<SIRInstRef> inst_refs;
+    size_t folded_count;
+    bool cfg_changed;
+};
+
+static void fold_grow_maps(FoldContext *ctx)
+{
+    size_t inst_count = ctx->module->insts.len;
+    while (ctx->removed.len < inst_count) {
+        ctx->replacements.push_back({0});
+        ctx->removed.push_back(false);
+    }
+}
+
+SIR_INLINE
+static SIRInstRef fold_resolve(FoldContext *ctx, SIRInstRef inst_ref)
+{
+    while (ctx->replacements[inst_ref.id].id) {
+        inst_ref = ctx->replacements[inst_ref.id];
+    }
+    return inst_ref;
+}
+
+SIR_INLINE
+static uint64_t fold_int_mask(uint32_t bits)
+{
+    return (bits >= 64) ? UINT64_MAX : ((uint64_t)1 << bits) - 1;
+}
+
+SIR_INLINE
+static uint64_t fold_sign_extend(uint64_t value, uint32_t bits)
+{
+    if (bits >= 64) return value;
+    value &= fold_int_mask(bits);
+    if ((value >> (bits - 1)) & 1) value |= ~fold_int_mask(bits);
+    return value;
+}
+
+// Integers are compared and stored sign extended for signed types and zero
+// extended for unsigned types, like the frontend creates them
+static uint64_t fold_normalize_int(SIRType *type, uint64_t value)
+{
+    uint32_t bits = type->int_.bits;
+    if (type->int_.is_signed) return fold_sign_extend(value, bits);
+    return value & fold_int_mask(bits);
+}
+
+SIR_INLINE
+static double fold_normalize_float(SIRType *type, double value)
+{
+    return (type->float_.bits == 32) ? (double)(float)value : value;
+}
+
+static SIRInstRef fold_int(FoldContext *ctx, SIRType *type, uint64_t value)
+{
+    SIRInstRef const_ref = SIRModuleAddConstInt(
+        ctx->module, type, fold_normalize_int(type, value));
+    fold_grow_maps(ctx);
+    return const_ref;
+}
+
+static SIRInstRef fold_float(FoldContext *ctx, SIRType *type, double value)
+{
+    SIRInstRef const_ref = SIRModuleAddConstFloat(
+        ctx->module, type, fold_normalize_float(type, value));
+    fold_grow_maps(ctx);
+    return const_ref;
+}
+
+static SIRInstRef fold_bool(FoldContext *ctx, bool value)
+{
+    SIRInstRef const_ref = SIRModuleAddConstBool(ctx->module, value);
+    fold_grow_maps(ctx);
+    return const_ref;
+}
+
+static SIRInstRef
+fold_int_binop(FoldContext *ctx, SIRInst *inst, SIRInst left, SIRInst right)
+{
+    SIRType *type = left.type;
+    uint32_t bits = type->int_.bits;
+    uint64_t a = fold_normalize_int(type, left.const_int.u64);
+    uint64_t b = fold_normalize_int(type, right.const_int.u64);
+    int64_t sa = (int64_t)fold_sign_extend(a, bits);
+    int64_t sb = (int64_t)fold_sign_extend(b, bits);
+    uint64_t ua = a & fold_int_mask(bits);
+    uint64_t ub = b & fold_int_mask(bits);
+
+    switch (inst->binop) {
+    case SIRBinaryOperation_IAdd: return fold_int(ctx, type, a + b);
+    case SIRBinaryOperation_ISub: return fold_int(ctx, type, a - b);
+    case SIRBinaryOperation_IMul: return fold_int(ctx, type, a * b);
+    case SIRBinaryOperation_SDiv: {
+        if (sb == 0 || (sb == -1 && ua == ((uint64_t)1 << (bits - 1)))) {
+            return {0};
+        }
+        return fold_int(ctx, type, (uint64_t)(sa / sb));
+    }
+    case SIRBinaryOperation_SRem: {
+        if (sb == 0 || (sb == -1 && ua == ((uint64_t)1 << (bits - 1)))) {
+            return {0};
+        }
+        return fold_int(ctx, type, (uint64_t)(sa % sb));
+    }
+    case SIRBinaryOperation_UDiv: {
+        if (ub == 0) return {0};
+        return fold_int(ctx, type, ua / ub);
+    }
+    case SIRBinaryOperation_URem: {
+        if (ub == 0) return {0};
+        return fold_int(ctx, type, ua % ub);
+    }
+
+    case SIRBinaryOperation_IEQ: return fold_bool(ctx, ua == ub);
+    case SIRBinaryOperation_INE: return fold_bool(ctx, ua != ub);
+    case SIRBinaryOperation_UGT: return fold_bool(ctx, ua > ub);
+    case SIRBinaryOperation_UGE: return fold_bool(ctx, ua >= ub);
+    case SIRBinaryOperation_ULT: return fold_bool(ctx, ua < ub);
+    case SIRBinaryOperation_ULE: return fold_bool(ctx, ua <= ub);
+    case SIRBinaryOperation_SGT: return fold_bool(ctx, sa > sb);
+    case SIRBinaryOperation_SGE: return fold_bool(ctx, sa >= sb);
+    case SIRBinaryOperation_SLT: return fold_bool(ctx, sa < sb);
+    case SIRBinaryOperation_SLE: return fold_bool(ctx, sa <= sb);
+
+    case SIRBinaryOperation_Shl: {
+        if (ub >= bits) return {0};
+        return fold_int(ctx, type, ua << ub);
+    }
+    case SIRBinaryOperation_AShr: {
+        if (ub >= bits) return {0};
+        return fold_int(ctx, type, (uint64_t)(sa >> ub));
+    }
+    case SIRBinaryOperation_LShr: {
+        if (ub >= bits) return {0};
+        return fold_int(ctx, type, ua >> ub);
+    }
+
+    case SIRBinaryOperation_And: return fold_int(ctx, type, a & b);
+    case SIRBinaryOperation_Or: return fold_int(ctx, type, a | b);
+    case SIRBinaryOperation_Xor: return fold_int(ctx, type, a ^ b);
+
+    default: return {0};
+    }
+}
+
+static SIRInstRef
+fold_float_binop(FoldContext *ctx, SIRInst *inst, SIRInst left, SIRInst right)
+{
+    SIRType *type = left.type;
+    double a = left.const_float.f64;
+    double b = right.const_float.f64;
+
+    switch (inst->binop) {
+    case SIRBinaryOperation_FAdd: return fold_float(ctx, type, a + b);
+    case SIRBinaryOperation_FSub: return fold_float(ctx, type, a - b);
+    case SIRBinaryOperation_FMul: return fold_float(ctx, type, a * b);
+    case SIRBinaryOperation_FDiv: return fold_float(ctx, type, a / b);
+
+    case SIRBinaryOperation_FEQ: return fold_bool(ctx, a == b);
+    case SIRBinaryOperation_FNE: return fold_bool(ctx, a != b);
+    case SIRBinaryOperation_FGT: return fold_bool(ctx, a > b);
+    case SIRBinaryOperation_FGE: return fold_bool(ctx, a >= b);
+    case SIRBinaryOperation_FLT: return fold_bool(ctx, a < b);
+    case SIRBinaryOperation_FLE: return fold_bool(ctx, a <= b);
+
+    default: return {0};
+    }
+}
+
+static SIRInstRef
+fold_bool_binop(FoldContext *ctx, SIRInst *inst, SIRInst left, SIRInst right)
+{
+    bool a = left.const_bool.value;
+    bool b = right.const_bool.value;
+
+    switch (inst->binop) {
+    case SIRBinaryOperation_IEQ: return fold_bool(ctx, a == b);
+    case SIRBinaryOperation_INE: return fold_bool(ctx, a != b);
+    case SIRBinaryOperation_And: return fold_bool(ctx, a && b);
+    case SIRBinaryOperation_Or: return fold_bool(ctx, a || b);
+    case SIRBinaryOperation_Xor: return fold_bool(ctx, a != b);
+    default: return {0};
+    }
+}
+
+// Whether a float converts to the integer type without overflowing. The
+// backend converts to unsigned integers with a signed conversion of at least
+// 32 bits, so only values in range of both are folded.
+static bool fold_float_fits_int(double value, SIRType *type, bool is_signed)
+{
+    if (value != value) return false; // NaN
+
+    uint32_t bits = type->int_.bits;
+    if (is_signed) {
+        double limit = (double)((uint64_t)1 << (bits - 1));
+        return value > -limit - 1.0 && value < limit;
+    }
+    double limit = (bits >= 32) ? (double)((uint64_t)1 << (bits - 1))
+                                : (double)((uint64_t)1 << bits);
+    return value > -1.0 && value < limit;
+}
+
+static SIRInstRef fold_cast(FoldContext *ctx, SIRInst *inst, SIRInst operand)
+{
+    SIRType *dest_type = inst->type;
+
+    // Booleans are 0 or 1 when extended
+    uint64_t int_value = 0;
+    if (operand.kind == SIRInstKind_ConstInt) {
+        int_value = fold_normalize_int(operand.type, operand.const_int.u64);
+    } else if (operand.kind == SIRInstKind_ConstBool) {
+        int_value = operand.const_bool.value ? 1 : 0;
+    }
+
+    switch (inst->kind) {
+    case SIRInstKind_ZExt:
+    case SIRInstKind_SExt:
+    case SIRInstKind_Trunc: {
+        if (operand.kind == SIRInstKind_ConstFloat) return {0};
+
+        if (operand.kind == SIRInstKind_ConstInt) {
+            uint32_t source_bits = operand.type->int_.bits;
+            if (inst->kind == SIRInstKind_ZExt) {
+                int_value &= fold_int_mask(source_bits);
+            } else if (inst->kind == SIRInstKind_SExt) {
+                int_value = fold_sign_extend(int_value, source_bits);
+            }
+        }
+
+        if (dest_type->kind == SIRTypeKind_Bool) {
+            return fold_bool(ctx, (int_value & 1) != 0);
+        }
+        if (dest_type->kind != SIRTypeKind_Int) return {0};
+        return fold_int(ctx, dest_type, int_value);
+    }
+
+    case SIRInstKind_FPTrunc:
+    case SIRInstKind_FPExt: {
+        if (operand.kind != SIRInstKind_ConstFloat) return {0};
+        return fold_float(ctx, dest_type, operand.const_float.f64);
+    }
+
+    case SIRInstKind_SIToFP: {
+        if (operand.kind != SIRInstKind_ConstInt) return {0};
+        int_value = fold_sign_extend(int_value, operand.type->int_.bits);
+        return fold_float(ctx, dest_type, (double)(int64_t)int_value);
+    }
+    case SIRInstKind_UIToFP: {
+        if (operand.kind != SIRInstKind_ConstInt) return {0};
+        int_value &= fold_int_mask(operand.type->int_.bits);
+        // 64 bit sources are converted as signed by the backend
+        if (int_value >> 63) return {0};
+        return fold_float(ctx, dest_type, (double)int_value);
+    }
+
+    case SIRInstKind_FPToSI:
+    case SIRInstKind_FPToUI: {
+        bool is_signed = inst->kind == SIRInstKind_FPToSI;
+        if (operand.kind != SIRInstKind_ConstFloat ||
+            dest_type->kind != SIRTypeKind_Int ||
+            !fold_float_fits_int(
+                operand.const_float.f64, dest_type, is_signed)) {
+            return {0};
+        }
+        double value = operand.const_float.f64;
+        if (is_signed) {
+            return fold_int(ctx, dest_type, (uint64_t)(int64_t)value);
+        }
+        return fold_int(ctx, dest_type, (uint64_t)value);
+    }
+
+    case SIRInstKind_FNeg: {
+        if (operand.kind != SIRInstKind_ConstFloat) return {0};
+        return fold_float(ctx, dest_type, -operand.const_float.f64);
+    }
+
+    default: return {0};
+    }
+}
+
+SIR_INLINE
+static bool fold_is_const(SIRInstKind kind)
+{
+    return kind == SIRInstKind_ConstInt || kind == SIRInstKind_ConstFloat ||
+           kind == SIRInstKind_ConstBool;
+}
+
+// Returns the constant the instruction evaluates to, or a null ref
+static SIRInstRef fold_inst(FoldContext *ctx, SIRInstRef inst_ref)
+{
+    SIRModule *module = ctx->module;
+
+    // Folding appends constants, which can move the instruction array
+    SIRInst inst_copy = module->insts[inst_ref.id];
+    SIRInst *inst = &inst_copy;
+
+    switch (inst->kind) {
+    case SIRInstKind_Binop: {
+        SIRInst left = module->insts[inst->op1.id];
+        SIRInst right = module->insts[inst->op2.id];
+        if (left.kind != right.kind || !fold_is_const(left.kind)) {
+            return {0};
+        }
+
+        switch (left.kind) {
+        case SIRInstKind_ConstInt:
+            return fold_int_binop(ctx, inst, left, right);
+        case SIRInstKind_ConstFloat:
+            return fold_float_binop(ctx, inst, left, right);
+        case SIRInstKind_ConstBool:
+            return fold_bool_binop(ctx, inst, left, right);
+        default: return {0};
+        }
+    }
+
+    case SIRInstKind_ZExt:
+    case SIRInstKind_SExt:
+    case SIRInstKind_Trunc:
+    case SIRInstKind_FPTrunc:
+    case SIRInstKind_FPExt:
+    case SIRInstKind_SIToFP:
+    case SIRInstKind_UIToFP:
+    case SIRInstKind_FPToSI:
+    case SIRInstKind_FPToUI:
+    case SIRInstKind_FNeg: {
+        SIRInst operand = module->insts[inst->op1.id];
+        if (!fold_is_const(operand.kind)) return {0};
+        return fold_cast(ctx, inst, operand);
+    }
+
+    default: return {0};
+    }
+}
+
+// Turns a branch on a constant into a jump, dropping the incoming values
+// the untaken successor had for this block
+static void fold_branch(
+    FoldContext *ctx,
+    SIRInstRef block_ref,
+    SIRInstRef set_cond_ref,
+    SIRInstRef branch_ref)
+{
+    SIRModule *module = ctx->module;
+
+    SIRInstRef cond_ref = module->insts[set_cond_ref.id].op1;
+    SIRInst cond = module->insts[cond_ref.id];
+    if (cond.kind != SIRInstKind_ConstBool) return;
+
+    SIRInst *branch = &module->insts[branch_ref.id];
+    SIRInstRef taken_ref = cond.const_bool.value ? branch->op1 : branch->op2;
+    SIRInstRef untaken_ref = cond.const_bool.value ? branch->op2 : branch->op1;
+
+    branch->kind = SIRInstKind_Jump;
+    branch->op1 = taken_ref;
+    branch->op2 = {0};
+    ctx->removed[set_cond_ref.id] = true;
+
+    if (untaken_ref.id != taken_ref.id) {
+        SIRBlock *untaken = module->insts[untaken_ref.id].block;
+        for (SIRInstRef inst_ref : untaken->inst_refs) {
+            SIRInst inst = module->insts[inst_ref.id];
+            if (inst.kind == SIRInstKind_Phi) continue;
+            if (inst.kind != SIRInstKind_PhiIncoming) break;
+            if (inst.phi_incoming.block_ref.id == block_ref.id) {
+                ctx->removed[inst_ref.id] = true;
+            }
+        }
+    }
+
+    ctx->folded_count++;
+    ctx->cfg_changed = true;
+}
+
+static void fold_block(FoldContext *ctx, uint32_t block_index)
+{
+    SIRModule *module = ctx->module;
+    SIRInstRef block_ref = ctx->func->blocks[block_index];
+    SIRBlock *block = module->insts[block_ref.id].block;
+
+    for (size_t i = 0; i < block->inst_refs.len; ++i) {
+        SIRInstRef inst_ref = block->inst_refs[i];
+        if (ctx->removed[inst_ref.id]) continue;
+
+        SIRInst *inst = &module->insts[inst_ref.id];
+
+        SIRInstRef *operands[2];
+        uint32_t operand_count = SIRInstGetOperands(inst, operands);
+        for (uint32_t j = 0; j < operand_count; ++j) {
+            *operands[j] = fold_resolve(ctx, *operands[j]);
+        }
+
+        if (inst->kind == SIRInstKind_Branch) {
+            if (i > 0) {
+                SIRInstRef prev_ref = block->inst_refs[i - 1];
+                if (module->insts[prev_ref.id].kind == SIRInstKind_SetCond) {
+                    fold_branch(ctx, block_ref, prev_ref, inst_ref);
+                }
+            }
+            continue;
+        }
+
+        SIRInstRef const_ref = fold_inst(ctx, inst_ref);
+        if (const_ref.id) {
+            ctx->replacements[inst_ref.id] = const_ref;
+            ctx->removed[inst_ref.id] = true;
+            ctx->folded_count++;
+        }
+    }
+}
+
+static void fold_function(FoldContext *ctx, SIRInstRef func_ref)
+{
+    ZoneScoped;
+
+    SIRModule *module = ctx->module;
+    SIRFunction *func = module->insts[func_ref.id].func;
+    if (func->blocks.len == 0) return;
+
+    ctx->func_ref = func_ref;
+    ctx->func = func;
+    ctx->cfg_changed = false;
+
+    SIRFunctionAnalysis *analysis =
+        SIRFunctionGetAnalysis(module, func_ref, SIRAnalysis_CFG);
+
+    // Unreachable blocks last, their operands may come from anywhere
+    for (uint32_t b : analysis->rpo) {
+        fold_block(ctx, b);
+    }
+    for (uint32_t b = 0; b < func->blocks.len; ++b) {
+        if (!SIRAnalysisIsReachable(analysis, b)) fold_block(ctx, b);
+    }
+
+    // Phi incomings can refer to values folded later in reverse postorder
+    for (SIRInstRef block_ref : func->blocks) {
+        SIRBlock *block = module->insts[block_ref.id].block;
+
+        ctx->inst_refs.len = 0;
+        for (SIRInstRef inst_ref : block->inst_refs) {
+            if (ctx->removed[inst_ref.id]) continue;
+            ctx->inst_refs.push_back(inst_ref);
+
+            SIRInstRef *operands[2];
+            uint32_t operand_count =
+                SIRInstGetOperands(&module->insts[inst_ref.id], operands);
+            for (uint32_t i = 0; i < operand_count; ++i) {
+                *operands[i] = fold_resolve(ctx, *operands[i]);
+            }
+        }
+
+        block->inst_refs.len = 0;
+        block->inst_refs.push_many(ctx->inst_refs.as_slice());
+    }
+
+    if (ctx->cfg_changed) {
+        SIRFunctionInvalidateAnalysis(module, func_ref, SIRAnalysis_CFG);
+    }
+}
+
+size_t SIRModuleFoldConstants(SIRModule *module)
+{
+    ZoneScoped;
+
+    FoldContext ctx = {};
+    ctx.module = module;
+    ctx.replacements = SIRArray<SIRInstRef>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.removed = SIRArray<bool>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.inst_refs = SIRArray<SIRInstRef>::create(&SIR_MALLOC_ALLOCATOR);
+
+    fold_grow_maps(&ctx);
+
+    for (size_t i = 0; i < module->functions.len; ++i) {
+        fold_function(&ctx, module->functions[i]);
+    }
+
+    if (ctx.folded_count > 0) {
+        SIRModuleInvalidateUses(module);
+    }
+
+    ctx.replacements.destroy();
+    ctx.removed.destroy();
+    ctx.inst_refs.destroy();
+
+    return ctx.folded_count;
+}
@@ -0,0 +1,379 @@
+#include "sir_base.hpp"
+#include "sir_ir.hpp"
+
+// Global value numbering of pure instructions. Blocks are visited in
+// preorder of the dominator tree, and an instruction computing the same
+// value as an earlier one whose block dominates it is replaced by it.
+// Constants are numbered by value, so the index constants codegen creates
+// for every element access compare equal.
+
+static const uint32_t GVN_NONE = UINT32_MAX;
+
+struct GVNKey {
+    SIRInstKind kind;
+    SIRBinaryOperation binop;
+    SIRType *type;
+    uint64_t a;
+    uint64_t b;
+};
+
+struct GVNContext {
+    SIRModule *module;
+    SIRInstRef func_ref;
+    SIRFunction *func;
+    SIRFunctionAnalysis *analysis;
+
+    // Indexed by instruction id, shared by all functions of the module
+    SIRArray<SIRInstRef> replacements;
+    SIRArray<bool> removed;
+    SIRArray<uint32_t> inst_blocks; // GVN_NONE for constants
+
+    // Open addressing table from keys to the instruction computing them,
+    // entries from other functions are stale
+    SIRArray<GVNKey> keys;
+    SIRArray<SIRInstRef> leaders;
+    SIRArray<uint32_t> table_funcs;
+    size_t table_count;
+    uint32_t func_index;
+
+    SIRArray<uint32_t> block_stack;
+    SIRArray<SIRInstRef> inst_refs;
+    size_t removed_count;
+};
+
+static void gvn_grow_maps(GVNContext *ctx)
+{
+    size_t inst_count = ctx->module->insts.len;
+    while (ctx->removed.len < inst_count) {
+        ctx->replacements.push_back({0});
+        ctx->removed.push_back(false);
+        ctx->inst_blocks.push_back(GVN_NONE);
+    }
+}
+
+SIR_INLINE
+static SIRInstRef gvn_resolve(GVNContext *ctx, SIRInstRef inst_ref)
+{
+    while (ctx->replacements[inst_ref.id].id) {
+        inst_ref = ctx->replacements[inst_ref.id];
+    }
+    return inst_ref;
+}
+
+SIR_INLINE
+static uint64_t gvn_hash(const GVNKey &key)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    uint64_t parts[5] = {
+        (uint64_t)key.kind,
+        (uint64_t)key.binop,
+        (uint64_t)(uintptr_t)key.type,
+        key.a,
+        key.b,
+    };
+    for (uint64_t part : parts) {
+        hash = (hash ^ part) * 1099511628211ULL;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+SIR_INLINE
+static bool gvn_key_equal(const GVNKey &a, const GVNKey &b)
+{
+    return a.kind == b.kind && a.binop == b.binop && a.type == b.type &&
+           a.a == b.a && a.b == b.b;
+}
+
+// Returns the table slot holding the key, or the empty slot to put it in
+SIR_INLINE
+static size_t gvn_table_find(GVNContext *ctx, const GVNKey &key)
+{
+    size_t mask = ctx->keys.len - 1;
+    size_t i = gvn_hash(key) & mask;
+    while (ctx->table_funcs[i] == ctx->func_index &&
+           !gvn_key_equal(ctx->keys[i], key)) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static void gvn_table_grow(GVNContext *ctx)
+{
+    SIRArray<GVNKey> old_keys = ctx->keys;
+    SIRArray<SIRInstRef> old_leaders = ctx->leaders;
+    SIRArray<uint32_t> old_funcs = ctx->table_funcs;
+
+    size_t size = (old_keys.len > 0) ? old_keys.len * 2 : 256;
+    ctx->keys = SIRArray<GVNKey>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx->leaders = SIRArray<SIRInstRef>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx->table_funcs = SIRArray<uint32_t>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx->keys.resize(size);
+    ctx->leaders.resize(size);
+    ctx->table_funcs.resize(size);
+    for (size_t i = 0; i < size; ++i) {
+        ctx->table_funcs[i] = GVN_NONE;
+    }
+
+    for (size_t i = 0; i < old_keys.len; ++i) {
+        if (old_funcs[i] != ctx->func_index) continue;
+        size_t j = gvn_table_find(ctx, old_keys[i]);
+        ctx->keys[j] = old_keys[i];
+        ctx->leaders[j] = old_leaders[i];
+        ctx->table_funcs[j] = ctx->func_index;
+    }
+
+    old_keys.destroy();
+    old_leaders.destroy();
+    old_funcs.destroy();
+}
+
+// Returns the instruction already computing the key, or registers inst_ref
+// as computing it
+static SIRInstRef gvn_lookup(
+    GVNContext *ctx, const GVNKey &key, SIRInstRef inst_ref, uint32_t block)
+{
+    if ((ctx->table_count + 1) * 2 > ctx->keys.len) {
+        gvn_table_grow(ctx);
+    }
+
+    size_t i = gvn_table_find(ctx, key);
+    if (ctx->table_funcs[i] == ctx->func_index) {
+        SIRInstRef leader_ref = ctx->leaders[i];
+        uint32_t leader_block = ctx->inst_blocks[leader_ref.id];
+        if (leader_block == GVN_NONE || leader_block == block ||
+            SIRAnalysisDominates(ctx->analysis, leader_block, block)) {
+            return leader_ref;
+        }
+
+        // Blocks are visited in dominator tree preorder, so no block left to
+        // visit is dominated by the old leader
+        ctx->leaders[i] = inst_ref;
+        return inst_ref;
+    }
+
+    ctx->keys[i] = key;
+    ctx->leaders[i] = inst_ref;
+    ctx->table_funcs[i] = ctx->func_index;
+    ctx->table_count++;
+    return inst_ref;
+}
+
+SIR_INLINE
+static bool gvn_is_commutative(SIRBinaryOperation binop)
+{
+    switch (binop) {
+    case SIRBinaryOperation_IAdd:
+    case SIRBinaryOperation_IMul:
+    case SIRBinaryOperation_FAdd:
+    case SIRBinaryOperation_FMul:
+    case SIRBinaryOperation_IEQ:
+    case SIRBinaryOperation_INE:
+    case SIRBinaryOperation_FEQ:
+    case SIRBinaryOperation_FNE:
+    case SIRBinaryOperation_And:
+    case SIRBinaryOperation_Or:
+    case SIRBinaryOperation_Xor: return true;
+    default: return false;
+    }
+}
+
+// Builds the key of a constant or a pure instruction, returns false for
+// everything else
+static bool gvn_make_key(SIRInst *inst, GVNKey *key)
+{
+    *key = {};
+    key->kind = inst->kind;
+    key->type = inst->type;
+
+    switch (inst->kind) {
+    case SIRInstKind_ConstInt: {
+        key->a = inst->const_int.u64;
+        return true;
+    }
+    case SIRInstKind_ConstFloat: {
+        memcpy(&key->a, &inst->const_float.f64, sizeof(double));
+        return true;
+    }
+    case SIRInstKind_ConstBool: {
+        key->a = inst->const_bool.value;
+        return true;
+    }
+    case SIRInstKind_BitCast:
+    case SIRInstKind_ZExt:
+    case SIRInstKind_SExt:
+    case SIRInstKind_Trunc:
+    case SIRInstKind_FPTrunc:
+    case SIRInstKind_FPExt:
+    case SIRInstKind_SIToFP:
+    case SIRInstKind_UIToFP:
+    case SIRInstKind_FPToSI:
+    case SIRInstKind_FPToUI:
+    case SIRInstKind_FNeg: {
+        key->a = inst->op1.id;
+        return true;
+    }
+    case SIRInstKind_ArrayElemPtr:
+    case SIRInstKind_StructElemPtr:
+    case SIRInstKind_ExtractArrayElem:
+    case SIRInstKind_ExtractStructElem: {
+        key->a = inst->op1.id;
+        key->b = inst->op2.id;
+        return true;
+    }
+    case SIRInstKind_Binop: {
+        key->binop = inst->binop;
+        key->a = inst->op1.id;
+        key->b = inst->op2.id;
+        if (gvn_is_commutative(inst->binop) && key->a > key->b) {
+            uint64_t tmp = key->a;
+            key->a = key->b;
+            key->b = tmp;
+        }
+        return true;
+    }
+    default: return false;
+    }
+}
+
+// Maps an operand to the instruction numbering its value
+static SIRInstRef gvn_operand(GVNContext *ctx, SIRInstRef operand_ref)
+{
+    operand_ref = gvn_resolve(ctx, operand_ref);
+
+    SIRInst *operand = &ctx->module->insts[operand_ref.id];
+    switch (operand->kind) {
+    case SIRInstKind_ConstInt:
+    case SIRInstKind_ConstFloat:
+    case SIRInstKind_ConstBool: break;
+    default: return operand_ref;
+    }
+
+    GVNKey key;
+    gvn_make_key(operand, &key);
+    SIRInstRef leader_ref = gvn_lookup(ctx, key, operand_ref, GVN_NONE);
+    if (leader_ref.id != operand_ref.id) {
+        ctx->replacements[operand_ref.id] = leader_ref;
+    }
+    return leader_ref;
+}
+
+static void gvn_block(GVNContext *ctx, uint32_t block_index)
+{
+    SIRModule *module = ctx->module;
+    SIRBlock *block = module->insts[ctx->func->blocks[block_index].id].block;
+
+    for (SIRInstRef inst_ref : block->inst_refs) {
+        SIRInst *inst = &module->insts[inst_ref.id];
+        ctx->inst_blocks[inst_ref.id] = block_index;
+
+        SIRInstRef *operands[2];
+        uint32_t operand_count = SIRInstGetOperands(inst, operands);
+        for (uint32_t i = 0; i < operand_count; ++i) {
+            *operands[i] = gvn_operand(ctx, *operands[i]);
+        }
+
+        if (SIRInstIsTerminator(inst->kind)) break;
+
+        GVNKey key;
+        if (!gvn_make_key(inst, &key)) continue;
+
+        SIRInstRef leader_ref = gvn_lookup(ctx, key, inst_ref, block_index);
+        if (leader_ref.id != inst_ref.id) {
+            ctx->replacements[inst_ref.id] = leader_ref;
+            ctx->removed[inst_ref.id] = true;
+            ctx->removed_count++;
+        }
+    }
+}
+
+static void gvn_function(GVNContext *ctx, SIRInstRef func_ref)
+{
+    ZoneScoped;
+
+    SIRModule *module = ctx->module;
+    ctx->func_ref = func_ref;
+    ctx->func = module->insts[func_ref.id].func;
+    if (ctx->func->blocks.len == 0) return;
+
+    ctx->func_index++;
+    ctx->table_count = 0;
+    ctx->analysis = SIRFunctionGetAnalysis(
+        module, func_ref, SIRAnalysis_CFG | SIRAnalysis_Dominators);
+
+    // Subtrees are finished before their siblings are popped, which keeps
+    // the visit in preorder
+    ctx->block_stack.len = 0;
+    ctx->block_stack.push_back(0);
+    while (ctx->block_stack.len > 0) {
+        uint32_t block_index = ctx->block_stack[ctx->block_stack.len - 1];
+        ctx->block_stack.pop();
+
+        gvn_block(ctx, block_index);
+
+        for (uint32_t child :
+             SIRAnalysisGetDomChildren(ctx->analysis, block_index)) {
+            ctx->block_stack.push_back(child);
+        }
+    }
+
+    // Unreachable blocks and phi incoming values may still use replaced
+    // instructions
+    for (SIRInstRef block_ref : ctx->func->blocks) {
+        SIRBlock *block = module->insts[block_ref.id].block;
+
+        ctx->inst_refs.len = 0;
+        for (SIRInstRef inst_ref : block->inst_refs) {
+            if (ctx->removed[inst_ref.id]) continue;
+            ctx->inst_refs.push_back(inst_ref);
+
+            SIRInstRef *operands[2];
+            uint32_t operand_count =
+                SIRInstGetOperands(&module->insts[inst_ref.id], operands);
+            for (uint32_t i = 0; i < operand_count; ++i) {
+                *operands[i] = gvn_resolve(ctx, *operands[i]);
+            }
+        }
+
+        block->inst_refs.len = 0;
+        block->inst_refs.push_many(ctx->inst_refs.as_slice());
+    }
+}
+
+size_t SIRModuleNumberValues(SIRModule *module)
+{
+    ZoneScoped;
+
+    GVNContext ctx = {};
+    ctx.module = module;
+    ctx.replacements = SIRArray<SIRInstRef>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.removed = SIRArray<bool>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.inst_blocks = SIRArray<uint32_t>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.keys = SIRArray<GVNKey>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.leaders = SIRArray<SIRInstRef>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.table_funcs = SIRArray<uint32_t>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.block_stack = SIRArray<uint32_t>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.inst_refs = SIRArray<SIRInstRef>::create(&SIR_MALLOC_ALLOCATOR);
+
+    gvn_grow_maps(&ctx);
+    gvn_table_grow(&ctx);
+
+    for (size_t i = 0; i < module->functions.len; ++i) {
+        gvn_function(&ctx, module->functions[i]);
+    }
+
+    if (ctx.removed_count > 0) {
+        SIRModuleInvalidateUses(module);
+    }
+
+    ctx.replacements.destroy();
+    ctx.removed.destroy();
+    ctx.inst_blocks.destroy();
+    ctx.keys.destroy();
+    ctx.leaders.destroy();
+    ctx.table_funcs.destroy();
+    ctx.block_stack.destroy();
+    ctx.inst_refs.destroy();
+
+    return ctx.removed_count;
+}
@@ -0,0 +1,415 @@
+#include "sir_base.hpp"
+#include "sir_ir.hpp"
+
+// Inlines calls by cloning the blocks of the callee into the caller. The
+// block holding the call is split, its first half jumps to the cloned entry
+// block and every return jumps to the second half, where a phi merges the
+// returned values. Parameters are replaced by the pushed arguments and stack
+// slots of the callee become stack slots of the caller.
+//
+// Functions are visited callees first, so inlined bodies are already final.
+// Calls back into a function that is still being visited are never inlined,
+// which is what stops recursion.
+
+enum InlineState : uint8_t {
+    InlineState_NotVisited,
+    InlineState_InProgress,
+    InlineState_Done,
+};
+
+struct InlineContext {
+    SIRModule *module;
+    uint32_t max_leaf_size;
+
+    // Indexed by instruction id
+    SIRArray<InlineState> states; // For function instructions
+    SIRArray<SIRInstRef> value_map; // Callee instructions to their clones
+    SIRArray<SIRInstRef> replacements;
+
+    SIRArray<SIRInstRef> mapped_refs;
+    SIRArray<SIRInstRef> worklist;
+    SIRArray<SIRInstRef> return_blocks;
+    SIRArray<SIRInstRef> return_values;
+    SIRArray<SIRInstRef> args;
+    size_t inlined_count;
+};
+
+static void inline_grow_maps(InlineContext *ctx)
+{
+    size_t inst_count = ctx->module->insts.len;
+    while (ctx->replacements.len < inst_count) {
+        ctx->states.push_back(InlineState_NotVisited);
+        ctx->value_map.push_back({0});
+        ctx->replacements.push_back({0});
+    }
+}
+
+SIR_INLINE
+static SIRInstRef inline_resolve(InlineContext *ctx, SIRInstRef inst_ref)
+{
+    while (ctx->replacements[inst_ref.id].id) {
+        inst_ref = ctx->replacements[inst_ref.id];
+    }
+    return inst_ref;
+}
+
+SIR_INLINE
+static SIRInstRef inline_map(InlineContext *ctx, SIRInstRef inst_ref)
+{
+    SIRInstRef mapped_ref = ctx->value_map[inst_ref.id];
+    return mapped_ref.id ? mapped_ref : inst_ref;
+}
+
+SIR_INLINE
+static void
+inline_set_map(InlineContext *ctx, SIRInstRef inst_ref, SIRInstRef clone_ref)
+{
+    ctx->value_map[inst_ref.id] = clone_ref;
+    ctx->mapped_refs.push_back(inst_ref);
+}
+
+// Aggregates are passed and returned through memory, which inlining would
+// have to replicate, so only scalar signatures are inlined
+SIR_INLINE
+static bool inline_is_scalar(SIRType *type, bool allow_void)
+{
+    switch (type->kind) {
+    case SIRTypeKind_Int:
+    case SIRTypeKind_Float:
+    case SIRTypeKind_Bool:
+    case SIRTypeKind_Pointer: return true;
+    case SIRTypeKind_Void: return allow_void;
+    default: return false;
+    }
+}
+
+static bool inline_is_small_leaf(InlineContext *ctx, SIRFunction *callee)
+{
+    SIRModule *module = ctx->module;
+
+    size_t inst_count = 0;
+    for (SIRInstRef block_ref : callee->blocks) {
+        SIRBlock *block = module->insts[block_ref.id].block;
+        for (SIRInstRef inst_ref : block->inst_refs) {
+            SIRInstKind kind = module->insts[inst_ref.id].kind;
+            if (kind == SIRInstKind_FuncCall) return false;
+            inst_count++;
+            if (SIRInstIsTerminator(kind)) break;
+        }
+    }
+    return inst_count <= ctx->max_leaf_size;
+}
+
+static bool inline_should_inline(
+    InlineContext *ctx,
+    SIRBlock *block,
+    size_t call_pos,
+    SIRInstRef callee_ref)
+{
+    SIRModule *module = ctx->module;
+    SIRFunction *callee = module->insts[callee_ref.id].func;
+
+    if (callee->blocks.len == 0 || callee->variadic ||
+        ctx->states[callee_ref.id] != InlineState_Done ||
+        !inline_is_scalar(callee->return_type, true)) {
+        return false;
+    }
+    for (size_t i = 0; i < callee->param_types_len; ++i) {
+        if (!inline_is_scalar(callee->param_types[i], false)) return false;
+    }
+
+    // The arguments are pushed right before the call
+    if (call_pos < callee->param_types_len) return false;
+    for (size_t i = call_pos - callee->param_types_len; i < call_pos; ++i) {
+        if (module->insts[block->inst_refs[i].id].kind !=
+            SIRInstKind_PushFunctionParameter) {
+            return false;
+        }
+    }
+
+    if (callee->flags & SIRFunctionFlags_AlwaysInline) return true;
+    return ctx->max_leaf_size > 0 && inline_is_small_leaf(ctx, callee);
+}
+
+// Points the incoming values a block has for from_ref at to_ref
+static void inline_rename_incoming(
+    SIRModule *module,
+    SIRInstRef block_ref,
+    SIRInstRef from_ref,
+    SIRInstRef to_ref)
+{
+    SIRBlock *block = module->insts[block_ref.id].block;
+    for (SIRInstRef inst_ref : block->inst_refs) {
+        SIRInst *inst = &module->insts[inst_ref.id];
+        if (inst->kind == SIRInstKind_Phi) continue;
+        if (inst->kind != SIRInstKind_PhiIncoming) break;
+        if (inst->phi_incoming.block_ref.id == from_ref.id) {
+            inst->phi_incoming.block_ref = to_ref;
+        }
+    }
+}
+
+// Returns the block holding the instructions that followed the call
+static SIRInstRef inline_call(
+    InlineContext *ctx,
+    SIRInstRef caller_ref,
+    SIRInstRef block_ref,
+    size_t call_pos)
+{
+    ZoneScoped;
+
+    SIRModule *module = ctx->module;
+    SIRBlock *block = module->insts[block_ref.id].block;
+    SIRInstRef call_ref = block->inst_refs[call_pos];
+    SIRInstRef callee_ref = module->insts[call_ref.id].op1;
+    SIRFunction *callee = module->insts[callee_ref.id].func;
+
+    size_t param_count = callee->param_types_len;
+    size_t push_pos = call_pos - param_count;
+
+    ctx->args.len = 0;
+    for (size_t i = 0; i < param_count; ++i) {
+        SIRInstRef push_ref = block->inst_refs[push_pos + i];
+        SIRInstRef arg_ref = module->insts[push_ref.id].op1;
+        ctx->args.push_back(inline_resolve(ctx, arg_ref));
+    }
+
+    // Second half of the split block
+    SIRInstRef cont_ref = SIRModuleInsertBlockAtEnd(module, caller_ref);
+    SIRBlock *cont = module->insts[cont_ref.id].block;
+    for (size_t i = call_pos + 1; i < block->inst_refs.len; ++i) {
+        cont->inst_refs.push_back(block->inst_refs[i]);
+    }
+    block->inst_refs.len = push_pos;
+
+    SIRInstRef term_ref = SIRBlockGetTerminator(module, cont_ref);
+    SIRInst term = module->insts[term_ref.id];
+    if (term.kind == SIRInstKind_Jump) {
+        inline_rename_incoming(module, term.op1, block_ref, cont_ref);
+    } else if (term.kind == SIRInstKind_Branch) {
+        inline_rename_incoming(module, term.op1, block_ref, cont_ref);
+        if (term.op2.id != term.op1.id) {
+            inline_rename_incoming(module, term.op2, block_ref, cont_ref);
+        }
+    }
+
+    // Clones of everything the callee defines
+    ctx->mapped_refs.len = 0;
+    for (size_t i = 0; i < param_count; ++i) {
+        inline_set_map(ctx, callee->param_insts[i], ctx->args[i]);
+    }
+    for (SIRInstRef slot_ref : callee->stack_slots) {
+        SIRType *type = module->insts[slot_ref.id].type->pointer.sub;
+        inline_set_map(
+            ctx, slot_ref, SIRModuleAddStackSlot(module, caller_ref, type));
+    }
+    for (SIRInstRef callee_block_ref : callee->blocks) {
+        inline_set_map(
+            ctx,
+            callee_block_ref,
+            SIRModuleInsertBlockAtEnd(module, caller_ref));
+    }
+    for (SIRInstRef callee_block_ref : callee->blocks) {
+        SIRBlock *callee_block = module->insts[callee_block_ref.id].block;
+        for (SIRInstRef inst_ref : callee_block->inst_refs) {
+            SIRInst inst = module->insts[inst_ref.id];
+            inline_set_map(ctx, inst_ref, SIRModuleAddInst(module, inst));
+            if (SIRInstIsTerminator(inst.kind)) break;
+        }
+    }
+    inline_grow_maps(ctx);
+
+    ctx->return_blocks.len = 0;
+    ctx->return_values.len = 0;
+    for (SIRInstRef callee_block_ref : callee->blocks) {
+        SIRBlock *callee_block = module->insts[callee_block_ref.id].block;
+        SIRInstRef clone_block_ref = inline_map(ctx, callee_block_ref);
+        SIRBlock *clone_block = module->insts[clone_block_ref.id].block;
+
+        for (SIRInstRef inst_ref : callee_block->inst_refs) {
+            SIRInstRef clone_ref = inline_map(ctx, inst_ref);
+            SIRInst *clone = &module->insts[clone_ref.id];
+            clone_block->inst_refs.push_back(clone_ref);
+
+            SIRInstRef *operands[2];
+            uint32_t operand_count = SIRInstGetOperands(clone, operands);
+            for (uint32_t i = 0; i < operand_count; ++i) {
+                *operands[i] = inline_map(ctx, *operands[i]);
+            }
+
+            switch (clone->kind) {
+            case SIRInstKind_Jump: {
+                clone->op1 = inline_map(ctx, clone->op1);
+                break;
+            }
+            case SIRInstKind_Branch: {
+                clone->op1 = inline_map(ctx, clone->op1);
+                clone->op2 = inline_map(ctx, clone->op2);
+                break;
+            }
+            case SIRInstKind_PhiIncoming: {
+                clone->phi_incoming.block_ref =
+                    inline_map(ctx, clone->phi_incoming.block_ref);
+                break;
+            }
+            case SIRInstKind_ReturnValue: {
+                ctx->return_blocks.push_back(clone_block_ref);
+                ctx->return_values.push_back(clone->op1);
+                clone->kind = SIRInstKind_Jump;
+                clone->op1 = cont_ref;
+                break;
+            }
+            case SIRInstKind_ReturnVoid: {
+                clone->kind = SIRInstKind_Jump;
+                clone->op1 = cont_ref;
+                break;
+            }
+            default: break;
+            }
+
+            if (SIRInstIsTerminator(clone->kind)) break;
+        }
+    }
+
+    {
+        SIRInst jump = {};
+        jump.kind = SIRInstKind_Jump;
+        jump.op1 = inline_map(ctx, callee->blocks[0]);
+        block->inst_refs.push_back(SIRModuleAddInst(module, jump));
+    }
+
+    // A single return block is the only predecessor of the continuation, so
+    // its value dominates every use of the call
+    if (ctx->return_values.len == 1) {
+        ctx->replacements[call_ref.id] = ctx->return_values[0];
+    } else if (ctx->return_values.len > 1) {
+        SIRInst phi = {};
+        phi.kind = SIRInstKind_Phi;
+        phi.type = callee->return_type;
+        SIRInstRef phi_ref = SIRModuleAddInst(module, phi);
+
+        SIRArray<SIRInstRef> cont_insts = cont->inst_refs;
+        cont->inst_refs =
+            SIRArray<SIRInstRef>::create((SIRAllocator *)module->arena);
+        cont->inst_refs.push_back(phi_ref);
+        for (size_t i = 0; i < ctx->return_values.len; ++i) {
+            SIRInst incoming = {};
+            incoming.kind = SIRInstKind_PhiIncoming;
+            incoming.phi_incoming.block_ref = ctx->return_blocks[i];
+            incoming.phi_incoming.value_ref = ctx->return_values[i];
+            cont->inst_refs.push_back(SIRModuleAddInst(module, incoming));
+        }
+        cont->inst_refs.push_many(cont_insts.as_slice());
+
+        inline_grow_maps(ctx);
+        ctx->replacements[call_ref.id] = phi_ref;
+    }
+    inline_grow_maps(ctx);
+
+    for (SIRInstRef inst_ref : ctx->mapped_refs) {
+        ctx->value_map[inst_ref.id] = {0};
+    }
+
+    ctx->inlined_count++;
+    return cont_ref;
+}
+
+static void inline_function(InlineContext *ctx, SIRInstRef func_ref)
+{
+    ZoneScoped;
+
+    SIRModule *module = ctx->module;
+    SIRFunction *func = module->insts[func_ref.id].func;
+
+    ctx->states[func_ref.id] = InlineState_InProgress;
+
+    for (SIRInstRef block_ref : func->blocks) {
+        SIRBlock *block = module->insts[block_ref.id].block;
+        for (SIRInstRef inst_ref : block->inst_refs) {
+            SIRInst inst = module->insts[inst_ref.id];
+            if (inst.kind != SIRInstKind_FuncCall) continue;
+            if (ctx->states[inst.op1.id] == InlineState_NotVisited) {
+                inline_function(ctx, inst.op1);
+            }
+        }
+    }
+
+    // Cloned blocks are final, only the continuations need another look
+    ctx->worklist.len = 0;
+    for (SIRInstRef block_ref : func->blocks) {
+        ctx->worklist.push_back(block_ref);
+    }
+
+    size_t inlined_count = ctx->inlined_count;
+    for (size_t w = 0; w < ctx->worklist.len; ++w) {
+        SIRInstRef block_ref = ctx->worklist[w];
+        SIRBlock *block = module->insts[block_ref.id].block;
+
+        for (size_t i = 0; i < block->inst_refs.len; ++i) {
+            SIRInst inst = module->insts[block->inst_refs[i].id];
+            if (SIRInstIsTerminator(inst.kind)) break;
+            if (inst.kind != SIRInstKind_FuncCall) continue;
+            if (!inline_should_inline(ctx, block, i, inst.op1)) continue;
+
+            ctx->worklist.push_back(inline_call(ctx, func_ref, block_ref, i));
+            break;
+        }
+    }
+
+    if (ctx->inlined_count > inlined_count) {
+        for (SIRInstRef block_ref : func->blocks) {
+            SIRBlock *block = module->insts[block_ref.id].block;
+            for (SIRInstRef inst_ref : block->inst_refs) {
+                SIRInstRef *operands[2];
+                uint32_t operand_count =
+                    SIRInstGetOperands(&module->insts[inst_ref.id], operands);
+                for (uint32_t i = 0; i < operand_count; ++i) {
+                    *operands[i] = inline_resolve(ctx, *operands[i]);
+                }
+            }
+        }
+    }
+
+    ctx->states[func_ref.id] = InlineState_Done;
+}
+
+size_t SIRModuleInlineCalls(SIRModule *module, uint32_t max_leaf_size)
+{
+    ZoneScoped;
+
+    InlineContext ctx = {};
+    ctx.module = module;
+    ctx.max_leaf_size = max_leaf_size;
+    ctx.states = SIRArray<InlineState>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.value_map = SIRArray<SIRInstRef>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.replacements = SIRArray<SIRInstRef>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.mapped_refs = SIRArray<SIRInstRef>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.worklist = SIRArray<SIRInstRef>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.return_blocks = SIRArray<SIRInstRef>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.return_values = SIRArray<SIRInstRef>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.args = SIRArray<SIRInstRef>::create(&SIR_MALLOC_ALLOCATOR);
+
+    inline_grow_maps(&ctx);
+
+    for (size_t i = 0; i < module->functions.len; ++i) {
+        SIRInstRef func_ref = module->functions[i];
+        if (ctx.states[func_ref.id] == InlineState_NotVisited) {
+            inline_function(&ctx, func_ref);
+        }
+    }
+
+    if (ctx.inlined_count > 0) {
+        SIRModuleInvalidateUses(module);
+    }
+
+    ctx.states.destroy();
+    ctx.value_map.destroy();
+    ctx.replacements.destroy();
+    ctx.mapped_refs.destroy();
+    ctx.worklist.destroy();
+    ctx.return_blocks.destroy();
+    ctx.return_values.destroy();
+    ctx.args.destroy();
+
+    return ctx.inlined_count;
+}
@@ -534,6 +534,8 @@ SIRModule *SIRModuleCreate(SIRTargetArch target_arch, SIREndianness endianness)
         .named_struct_map = named_struct_map,
         .target_arch = target_arch,
         .endianness = endianness,
+        .uses = {},
+        .pass_stats = SIRArray<SIRPassStats>::create(&SIR_MALLOC_ALLOCATOR),
 
         .void_type = nullptr,
         .bool_type = nullptr,
@@ -642,8 +644,36 @@ SIRModule *SIRModuleCreate(SIRTargetArch target_arch, SIREndianness endianness)
     return module;
 }
 
+static void function_analysis_destroy(SIRFunctionAnalysis *a)
+{
+    a->pred_offsets.destroy();
+    a->preds.destroy();
+    a->succ_offsets.destroy();
+    a->succs.destroy();
+    a->rpo.destroy();
+    a->rpo_indices.destroy();
+    a->idoms.destroy();
+    a->dom_child_offsets.destroy();
+    a->dom_children.destroy();
+    a->dom_pre.destroy();
+    a->dom_last.destroy();
+    a->frontier_offsets.destroy();
+    a->frontiers.destroy();
+    a->loops.destroy();
+    a->loop_blocks.destroy();
+    a->block_loops.destroy();
+}
+
 void SIRModuleDestroy(SIRModule *module)
 {
+    for (SIRInstRef func_ref : module->functions) {
+        function_analysis_destroy(&module->insts[func_ref.id].func->analysis);
+    }
+    module->uses.offsets.destroy();
+    module->uses.users.destroy();
+    module->uses.slot_escapes.destroy();
+    module->pass_stats.destroy();
+
     module->insts.destroy();
     module->consts.destroy();
     module->functions.destroy();
@@ -822,6 +852,10 @@ void SIRStructTypeSetBody(
 {
     SIR_ASSERT(struct_type->struct_.fields_len == 0);
     SIR_ASSERT(struct_type->struct_.fields == NULL);
+    // Layouts are never invalidated, since the types containing this one
+    // would keep theirs, so the body has to be set before any layout query
+    SIR_ASSERT(struct_type->struct_.offsets == NULL);
+    SIR_ASSERT(struct_type->size == 0 && struct_type->alignment == 0);
     struct_type->struct_.fields_len = field_count;
     struct_type->struct_.fields =
         (SIRType **)SIRAllocSliceClone(module->arena, fields, field_count);
@@ -850,6 +884,11 @@ static SIRInstRef module_add_inst(SIRModule *module, const SIRInst &inst)
     return ref;
 }
 
+SIRInstRef SIRModuleAddInst(SIRModule *module, const SIRInst &inst)
+{
+    return module_add_inst(module, inst);
+}
+
 SIRInstRef
 SIRModuleAddConstInt(SIRModule *module, SIRType *type, uint64_t value)
 {
@@ -948,6 +987,8 @@ SIRInstRef SIRModuleAddFunction(
 
         .linkage = linkage,
         .calling_convention = calling_convention,
+        .flags = 0,
+        .analysis = {},
     };
 
     for (uint32_t i = 0; i < param_types_len; ++i) {
@@ -975,6 +1016,14 @@ SIRInstRef SIRModuleAddFunction(
     return func_ref;
 }
 
+void SIRModuleSetFunctionFlags(
+    SIRModule *module, SIRInstRef func_ref, uint32_t flags)
+{
+    SIRInst func_inst = SIRModuleGetInst(module, func_ref);
+    SIR_ASSERT(func_inst.kind == SIRInstKind_Function);
+    func_inst.func->flags = flags;
+}
+
 SIRInstRef SIRModuleAddGlobal(
     SIRModule *module,
     SIRType *type,
@@ -1080,9 +1129,11 @@ SIRInstRef SIRModuleInsertBlockAtEnd(SIRModule *module, SIRInstRef func_ref)
     block.block = SIRAllocInit(module->arena, SIRBlock);
     block.block->inst_refs =
         SIRArray<SIRInstRef>::create((SIRAllocator *)module->arena);
+    block.block->index = (uint32_t)func->blocks.len;
     SIRInstRef block_ref = module_add_inst(module, block);
 
     func->blocks.push_back(block_ref);
+    func->analysis.valid = 0;
 
     return block_ref;
 }
@@ -1127,6 +1178,12 @@ static SIRInstRef builder_insert_inst(SIRBuilder *builder, const SIRInst &inst)
     SIRInst *block = &builder->module->insts[builder->current_block_ref.id];
     block->block->inst_refs.push_back(ref);
 
+    if (builder->current_func_ref.id != UINT32_MAX) {
+        SIRInst *func = &builder->module->insts[builder->current_func_ref.id];
+        func->func->analysis.valid = 0;
+    }
+    builder->module->uses.valid = false;
+
     return ref;
 }
 
@@ -1616,6 +1673,11 @@ SIRTypeKind SIRModuleGetTypeKind(SIRModule *module, SIRType *type)
     return type->kind;
 }
 
+uint32_t SIRModuleGetInstCount(SIRModule *module)
+{
+    return (uint32_t)module->insts.len;
+}
+
 uint32_t
 SIRModuleGetBlockInstructionCount(SIRModule *module, SIRInstRef block_ref)
 {
@@ -1732,10 +1794,16 @@ uint32_t SIRTypeSizeOf(SIRModule *module, SIRType *type)
     case SIRTypeKind_Struct: {
         type->size = 0;
 
+        if (!type->struct_.offsets) {
+            type->struct_.offsets = SIRAllocSlice(
+                module->arena, uint32_t, type->struct_.fields_len);
+        }
+
         for (size_t i = 0; i < type->struct_.fields_len; ++i) {
             SIRType *field_type = type->struct_.fields[i];
             uint32_t field_align = SIRTypeAlignOf(module, field_type);
             type->size = SIR_ROUND_UP(field_align, type->size); // Add padding
+            type->struct_.offsets[i] = type->size;
 
             uint32_t field_size = SIRTypeSizeOf(module, field_type);
             type->size += field_size;
@@ -1746,8 +1814,10 @@ uint32_t SIRTypeSizeOf(SIRModule *module, SIRType *type)
     }
 
     uint32_t self_alignment = SIRTypeAlignOf(module, type);
-    type->size =
-        SIR_ROUND_UP(self_alignment, type->size); // Round size up for alignment
+    if (self_alignment > 0) {
+        // Round size up for alignment
+        type->size = SIR_ROUND_UP(self_alignment, type->size);
+    }
 
     return type->size;
 }
@@ -1792,16 +1862,9 @@ uint32_t SIRTypeAlignOf(SIRModule *module, SIRType *type)
 uint32_t SIRTypeStructOffsetOf(
     SIRModule *module, SIRType *struct_type, uint32_t field_index)
 {
-    uint32_t field_offset = 0;
-    for (uint32_t i = 0; i <= field_index; ++i) {
-        SIRType *field_type = struct_type->struct_.fields[i];
-        uint32_t field_align = SIRTypeAlignOf(module, field_type);
-        field_offset = SIR_ROUND_UP(field_align, field_offset); // Add padding
-
-        if (i != field_index) {
-            field_offset += SIRTypeSizeOf(module, field_type);
-        }
+    SIR_ASSERT(field_index < struct_type->struct_.fields_len);
+    if (!struct_type->struct_.offsets) {
+        SIRTypeSizeOf(module, struct_type);
     }
-
-    return field_offset;
+    return struct_type->struct_.offsets[field_index];
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "sir_base.hpp"
+#include "sir_analysis.hpp"
 #include "sir.h"
 
 struct SIRModule;
@@ -31,6 +32,7 @@ struct SIRType {
         } array;
         struct {
             SIRType **fields;
+            uint32_t *offsets; // Filled in by SIRTypeSizeOf
             uint32_t fields_len;
             bool packed;
         } struct_;
@@ -52,10 +54,14 @@ struct SIRFunction {
 
     SIRLinkage linkage;
     SIRCallingConvention calling_convention;
+    uint32_t flags;
+
+    SIRFunctionAnalysis analysis;
 };
 
 struct SIRBlock {
     SIRArray<SIRInstRef> inst_refs;
+    uint32_t index; // Position in SIRFunction::blocks
 };
 
 struct SIRGlobal {
@@ -130,6 +136,8 @@ struct SIRModule {
     SIRStringMap named_struct_map;
     SIRTargetArch target_arch;
     SIREndianness endianness;
+    SIRUseAnalysis uses;
+    SIRArray<SIRPassStats> pass_stats;
 
     SIRType *void_type;
     SIRType *bool_type;
@@ -159,6 +167,64 @@ SIRInst SIRModuleGetInst(SIRModule *module, SIRInstRef inst_ref)
 
 SIRType *SIRModuleGetCachedType(SIRModule *module, SIRType *type);
 
+// Appends an instruction to the module without inserting it into a block
+SIRInstRef SIRModuleAddInst(SIRModule *module, const SIRInst &inst);
+
+SIR_INLINE
+bool SIRInstIsTerminator(SIRInstKind kind)
+{
+    switch (kind) {
+    case SIRInstKind_Jump:
+    case SIRInstKind_Branch:
+    case SIRInstKind_ReturnVoid:
+    case SIRInstKind_ReturnValue: return true;
+    default: return false;
+    }
+}
+
+// Gets pointers to the value operands of an instruction, so they can be read
+// or rewritten. Block and function operands are not included.
+SIR_INLINE
+uint32_t SIRInstGetOperands(SIRInst *inst, SIRInstRef *operands[2])
+{
+    switch (inst->kind) {
+    case SIRInstKind_Alias:
+    case SIRInstKind_PushFunctionParameter:
+    case SIRInstKind_ReturnValue:
+    case SIRInstKind_Load:
+    case SIRInstKind_SetCond:
+    case SIRInstKind_BitCast:
+    case SIRInstKind_ZExt:
+    case SIRInstKind_SExt:
+    case SIRInstKind_Trunc:
+    case SIRInstKind_FPTrunc:
+    case SIRInstKind_FPExt:
+    case SIRInstKind_SIToFP:
+    case SIRInstKind_UIToFP:
+    case SIRInstKind_FPToSI:
+    case SIRInstKind_FPToUI:
+    case SIRInstKind_FNeg: {
+        operands[0] = &inst->op1;
+        return 1;
+    }
+    case SIRInstKind_Store:
+    case SIRInstKind_ArrayElemPtr:
+    case SIRInstKind_StructElemPtr:
+    case SIRInstKind_ExtractArrayElem:
+    case SIRInstKind_ExtractStructElem:
+    case SIRInstKind_Binop: {
+        operands[0] = &inst->op1;
+        operands[1] = &inst->op2;
+        return 2;
+    }
+    case SIRInstKind_PhiIncoming: {
+        operands[0] = &inst->phi_incoming.value_ref;
+        return 1;
+    }
+    default: return 0;
+    }
+}
+
 typedef void(SIRAuxInstPrinter)(
     void *user_data, SIRInstRef inst_ref, size_t inst_pos, SIRStringBuilder *sb);
 
@@ -0,0 +1,668 @@
+#include "sir_base.hpp"
+#include "sir_ir.hpp"
+
+// Loop optimizations. Every loop first gets a preheader, a block outside the
+// loop that jumps to the header and is its only predecessor from outside
+// the loop. Loop invariant code is hoisted into the preheader, and array
+// accesses indexed by an induction variable are replaced by a pointer that
+// is advanced by the stride on every iteration.
+
+struct LoopContext {
+    SIRModule *module;
+    SIRInstRef func_ref;
+    SIRFunction *func;
+    SIRFunctionAnalysis *analysis;
+
+    // Indexed by instruction id, shared by all functions of the module
+    SIRArray<uint32_t> inst_blocks; // SIR_NO_INDEX outside of blocks
+    SIRArray<bool> moved;
+    SIRArray<uint32_t> slot_stores; // Last loop storing to the slot
+
+    // Indexed by block index
+    SIRArray<uint32_t> block_loops; // Last loop the block was marked for
+    SIRArray<SIRInstRef> preheaders; // Preheader inserted for the header
+
+    SIRArray<uint32_t> outside_preds;
+    SIRArray<SIRInstRef> hoisted;
+    SIRArray<SIRInstRef> pointers; // Strength reduced pointers of a loop
+    SIRArray<SIRInstRef> bases;
+    SIRArray<SIRInstRef> inst_refs;
+    uint32_t stamp;
+    size_t changed_count;
+};
+
+static void loop_grow_maps(LoopContext *ctx)
+{
+    size_t inst_count = ctx->module->insts.len;
+    while (ctx->moved.len < inst_count) {
+        ctx->inst_blocks.push_back(SIR_NO_INDEX);
+        ctx->moved.push_back(false);
+        ctx->slot_stores.push_back(0);
+    }
+}
+
+static SIRInstRef loop_add_inst(LoopContext *ctx, const SIRInst &inst)
+{
+    SIRInstRef inst_ref = SIRModuleAddInst(ctx->module, inst);
+    loop_grow_maps(ctx);
+    return inst_ref;
+}
+
+SIR_INLINE
+static SIRBlock *loop_get_block(LoopContext *ctx, uint32_t block_index)
+{
+    return ctx->module->insts[ctx->func->blocks[block_index].id].block;
+}
+
+// Appends to a block, keeping its terminator and set_cond at the end
+static void
+loop_insert_at_end(LoopContext *ctx, uint32_t block_index, SIRInstRef inst_ref)
+{
+    SIRModule *module = ctx->module;
+    SIRBlock *block = loop_get_block(ctx, block_index);
+
+    size_t pos = 0;
+    while (pos < block->inst_refs.len &&
+           !SIRInstIsTerminator(module->insts[block->inst_refs[pos].id].kind)) {
+        pos++;
+    }
+    if (pos > 0 && pos < block->inst_refs.len &&
+        module->insts[block->inst_refs[pos - 1].id].kind ==
+            SIRInstKind_SetCond) {
+        pos--;
+    }
+
+    block->inst_refs.push_back(inst_ref);
+    for (size_t i = block->inst_refs.len - 1; i > pos; --i) {
+        block->inst_refs[i] = block->inst_refs[i - 1];
+    }
+    block->inst_refs[pos] = inst_ref;
+
+    ctx->inst_blocks[inst_ref.id] = block_index;
+}
+
+static void
+loop_mark_blocks(LoopContext *ctx, uint32_t loop_index, uint32_t block_count)
+{
+    while (ctx->block_loops.len < block_count) {
+        ctx->block_loops.push_back(0);
+    }
+
+    ctx->stamp++;
+    for (uint32_t block : SIRAnalysisGetLoopBlocks(ctx->analysis, loop_index)) {
+        ctx->block_loops[block] = ctx->stamp;
+    }
+}
+
+SIR_INLINE
+static bool loop_contains(LoopContext *ctx, SIRInstRef inst_ref)
+{
+    uint32_t block = ctx->inst_blocks[inst_ref.id];
+    return block != SIR_NO_INDEX && ctx->block_loops[block] == ctx->stamp;
+}
+
+// Predecessors of the header that enter the loop. Unreachable blocks left
+// behind by inlining or folding a branch never enter it, so they keep
+// jumping to the header.
+SIR_INLINE
+static bool loop_is_outside_pred(LoopContext *ctx, uint32_t pred)
+{
+    return ctx->block_loops[pred] != ctx->stamp &&
+           SIRAnalysisIsReachable(ctx->analysis, pred);
+}
+
+// The block jumping to the header from outside the loop, or SIR_NO_INDEX
+static uint32_t loop_get_preheader(LoopContext *ctx, uint32_t loop_index)
+{
+    SIRModule *module = ctx->module;
+    uint32_t header = ctx->analysis->loops[loop_index].header;
+
+    uint32_t preheader = SIR_NO_INDEX;
+    for (uint32_t pred : SIRAnalysisGetPreds(ctx->analysis, header)) {
+        if (!loop_is_outside_pred(ctx, pred)) continue;
+        if (preheader != SIR_NO_INDEX) return SIR_NO_INDEX;
+        preheader = pred;
+    }
+    if (preheader == SIR_NO_INDEX) return SIR_NO_INDEX;
+
+    SIRInstRef term_ref =
+        SIRBlockGetTerminator(module, ctx->func->blocks[preheader]);
+    if (module->insts[term_ref.id].kind != SIRInstKind_Jump) {
+        return SIR_NO_INDEX;
+    }
+    return preheader;
+}
+
+static void loop_insert_preheader(LoopContext *ctx, uint32_t loop_index)
+{
+    ZoneScoped;
+
+    SIRModule *module = ctx->module;
+    uint32_t header = ctx->analysis->loops[loop_index].header;
+    SIRInstRef header_ref = ctx->func->blocks[header];
+
+    ctx->outside_preds.len = 0;
+    for (uint32_t pred : SIRAnalysisGetPreds(ctx->analysis, header)) {
+        if (!loop_is_outside_pred(ctx, pred)) continue;
+        ctx->outside_preds.push_back(pred);
+    }
+
+    // The entry block can not have a preheader
+    if (ctx->outside_preds.len == 0) return;
+
+    SIRInstRef preheader_ref =
+        SIRModuleInsertBlockAtEnd(module, ctx->func_ref);
+    SIRBlock *preheader = module->insts[preheader_ref.id].block;
+    ctx->preheaders[header] = preheader_ref;
+
+    for (uint32_t pred : ctx->outside_preds) {
+        SIRInstRef term_ref =
+            SIRBlockGetTerminator(module, ctx->func->blocks[pred]);
+        SIRInst *term = &module->insts[term_ref.id];
+        if (term->op1.id == header_ref.id) term->op1 = preheader_ref;
+        if (term->kind == SIRInstKind_Branch &&
+            term->op2.id == header_ref.id) {
+            term->op2 = preheader_ref;
+        }
+    }
+
+    // Values coming from outside the loop are merged in the preheader, the
+    // first outside incoming of each phi takes the merged value and the
+    // others are dropped
+    SIRBlock *header_block = module->insts[header_ref.id].block;
+    SIRType *phi_type = nullptr;
+    SIRInstRef merge_ref = {0};
+    bool dropped = false;
+    for (SIRInstRef inst_ref : header_block->inst_refs) {
+        SIRInst incoming = module->insts[inst_ref.id];
+        if (incoming.kind == SIRInstKind_Phi) {
+            phi_type = incoming.type;
+            merge_ref = {0};
+            continue;
+        }
+        if (incoming.kind != SIRInstKind_PhiIncoming) break;
+
+        SIRInstRef from_ref = incoming.phi_incoming.block_ref;
+        uint32_t from = module->insts[from_ref.id].block->index;
+        if (!loop_is_outside_pred(ctx, from)) continue;
+
+        if (ctx->outside_preds.len == 1) {
+            module->insts[inst_ref.id].phi_incoming.block_ref = preheader_ref;
+            continue;
+        }
+
+        if (merge_ref.id) {
+            ctx->moved[inst_ref.id] = true;
+            dropped = true;
+        } else {
+            SIRInst phi = {};
+            phi.kind = SIRInstKind_Phi;
+            phi.type = phi_type;
+            merge_ref = loop_add_inst(ctx, phi);
+            preheader->inst_refs.push_back(merge_ref);
+
+            SIRInst *header_incoming = &module->insts[inst_ref.id];
+            header_incoming->phi_incoming.block_ref = preheader_ref;
+            header_incoming->phi_incoming.value_ref = merge_ref;
+        }
+        preheader->inst_refs.push_back(loop_add_inst(ctx, incoming));
+    }
+
+    if (dropped) {
+        ctx->inst_refs.len = 0;
+        for (SIRInstRef inst_ref : header_block->inst_refs) {
+            if (ctx->moved[inst_ref.id]) {
+                ctx->moved[inst_ref.id] = false;
+                continue;
+            }
+            ctx->inst_refs.push_back(inst_ref);
+        }
+        header_block->inst_refs.len = 0;
+        header_block->inst_refs.push_many(ctx->inst_refs.as_slice());
+    }
+
+    SIRInst jump = {};
+    jump.kind = SIRInstKind_Jump;
+    jump.op1 = header_ref;
+    preheader->inst_refs.push_back(loop_add_inst(ctx, jump));
+}
+
+// Gives every loop a preheader and recomputes the analysis if needed
+static void loop_prepare_function(LoopContext *ctx)
+{
+    ZoneScoped;
+
+    SIRModule *module = ctx->module;
+    ctx->analysis =
+        SIRFunctionGetAnalysis(module, ctx->func_ref, SIRAnalysis_Loops);
+
+    bool inserted = false;
+    uint32_t block_count = (uint32_t)ctx->func->blocks.len;
+    ctx->preheaders.len = 0;
+    for (uint32_t b = 0; b < block_count; ++b) {
+        ctx->preheaders.push_back({0});
+    }
+    for (uint32_t i = 0; i < ctx->analysis->loops.len; ++i) {
+        loop_mark_blocks(ctx, i, block_count);
+        if (loop_get_preheader(ctx, i) != SIR_NO_INDEX) continue;
+        loop_insert_preheader(ctx, i);
+        inserted = true;
+    }
+
+    if (inserted) {
+        // Preheaders go right before their header instead of at the end, so
+        // the code hoisted into them comes before the loop in the block
+        // order too
+        ctx->inst_refs.len = 0;
+        for (uint32_t b = 0; b < block_count; ++b) {
+            if (ctx->preheaders[b].id) {
+                ctx->inst_refs.push_back(ctx->preheaders[b]);
+            }
+            ctx->inst_refs.push_back(ctx->func->blocks[b]);
+        }
+        SIR_ASSERT(ctx->inst_refs.len == ctx->func->blocks.len);
+        for (uint32_t b = 0; b < ctx->func->blocks.len; ++b) {
+            ctx->func->blocks[b] = ctx->inst_refs[b];
+        }
+
+        SIRFunctionInvalidateAnalysis(module, ctx->func_ref, SIRAnalysis_CFG);
+        ctx->analysis =
+            SIRFunctionGetAnalysis(module, ctx->func_ref, SIRAnalysis_Loops);
+        ctx->changed_count++;
+    }
+
+    for (uint32_t b = 0; b < ctx->func->blocks.len; ++b) {
+        for (SIRInstRef inst_ref : loop_get_block(ctx, b)->inst_refs) {
+            ctx->inst_blocks[inst_ref.id] = b;
+        }
+    }
+}
+
+// The stack slot a pointer points into, or a null ref
+static SIRInstRef loop_get_base_slot(LoopContext *ctx, SIRInstRef ptr_ref)
+{
+    SIRModule *module = ctx->module;
+    for (;;) {
+        SIRInst ptr = module->insts[ptr_ref.id];
+        switch (ptr.kind) {
+        case SIRInstKind_StackSlot: return ptr_ref;
+        case SIRInstKind_ArrayElemPtr:
+        case SIRInstKind_StructElemPtr: ptr_ref = ptr.op1; break;
+        default: return {0};
+        }
+    }
+}
+
+// Whether nothing but the loads and stores of this function can access
+// the memory behind the pointer
+static SIRInstRef loop_get_local_slot(LoopContext *ctx, SIRInstRef ptr_ref)
+{
+    SIRInstRef slot_ref = loop_get_base_slot(ctx, ptr_ref);
+    if (!slot_ref.id) return {0};
+
+    if (!SIRModuleIsLocalSlot(ctx->module, slot_ref)) return {0};
+    return slot_ref;
+}
+
+// Pure instructions that can run even when the loop would not have run them
+static bool loop_can_hoist(LoopContext *ctx, SIRInstRef inst_ref)
+{
+    SIRModule *module = ctx->module;
+    SIRInst inst = module->insts[inst_ref.id];
+
+    switch (inst.kind) {
+    case SIRInstKind_BitCast:
+    case SIRInstKind_ZExt:
+    case SIRInstKind_SExt:
+    case SIRInstKind_Trunc:
+    case SIRInstKind_FPTrunc:
+    case SIRInstKind_FPExt:
+    case SIRInstKind_SIToFP:
+    case SIRInstKind_UIToFP:
+    case SIRInstKind_FPToSI:
+    case SIRInstKind_FPToUI:
+    case SIRInstKind_FNeg:
+    case SIRInstKind_ArrayElemPtr:
+    case SIRInstKind_StructElemPtr:
+    case SIRInstKind_ExtractArrayElem:
+    case SIRInstKind_ExtractStructElem: break;
+    case SIRInstKind_Binop: {
+        switch (inst.binop) {
+        case SIRBinaryOperation_SDiv:
+        case SIRBinaryOperation_UDiv:
+        case SIRBinaryOperation_SRem:
+        case SIRBinaryOperation_URem: {
+            // Dividing by zero or INT_MIN by -1 traps
+            SIRInst divisor = module->insts[inst.op2.id];
+            if (divisor.kind != SIRInstKind_ConstInt) return false;
+            if (divisor.const_int.u64 == 0) return false;
+            if (divisor.const_int.u64 == UINT64_MAX) return false;
+            break;
+        }
+        default: break;
+        }
+        break;
+    }
+    case SIRInstKind_Load: {
+        // Stack memory can always be read, and only stores to the same slot
+        // change what the load sees
+        SIRInstRef slot_ref = loop_get_local_slot(ctx, inst.op1);
+        if (!slot_ref.id) return false;
+        if (ctx->slot_stores[slot_ref.id] == ctx->stamp) return false;
+        break;
+    }
+    default: return false;
+    }
+
+    SIRInstRef *operands[2];
+    uint32_t operand_count =
+        SIRInstGetOperands(&module->insts[inst_ref.id], operands);
+    for (uint32_t i = 0; i < operand_count; ++i) {
+        if (loop_contains(ctx, *operands[i])) return false;
+    }
+    return true;
+}
+
+static void loop_hoist(LoopContext *ctx, uint32_t loop_index)
+{
+    ZoneScoped;
+
+    SIRModule *module = ctx->module;
+    SIRFunctionAnalysis *a = ctx->analysis;
+
+    loop_mark_blocks(ctx, loop_index, (uint32_t)ctx->func->blocks.len);
+    uint32_t preheader = loop_get_preheader(ctx, loop_index);
+    if (preheader == SIR_NO_INDEX) return;
+
+    // Stores through pointers that may escape can not reach local slots
+    for (uint32_t block : SIRAnalysisGetLoopBlocks(a, loop_index)) {
+        for (SIRInstRef inst_ref : loop_get_block(ctx, block)->inst_refs) {
+            SIRInst inst = module->insts[inst_ref.id];
+            if (SIRInstIsTerminator(inst.kind)) break;
+            if (inst.kind != SIRInstKind_Store) continue;
+
+            SIRInstRef slot_ref = loop_get_base_slot(ctx, inst.store.ptr_ref);
+            if (slot_ref.id) ctx->slot_stores[slot_ref.id] = ctx->stamp;
+        }
+    }
+
+    // Operands are defined before their uses in reverse postorder, so they
+    // are hoisted first
+    ctx->hoisted.len = 0;
+    for (uint32_t block : a->rpo) {
+        if (ctx->block_loops[block] != ctx->stamp) continue;
+        for (SIRInstRef inst_ref : loop_get_block(ctx, block)->inst_refs) {
+            SIRInstKind kind = module->insts[inst_ref.id].kind;
+            if (SIRInstIsTerminator(kind)) break;
+            if (!loop_can_hoist(ctx, inst_ref)) continue;
+
+            ctx->moved[inst_ref.id] = true;
+            ctx->inst_blocks[inst_ref.id] = preheader;
+            ctx->hoisted.push_back(inst_ref);
+        }
+    }
+    if (ctx->hoisted.len == 0) return;
+
+    for (uint32_t block : SIRAnalysisGetLoopBlocks(a, loop_index)) {
+        SIRBlock *loop_block = loop_get_block(ctx, block);
+        ctx->inst_refs.len = 0;
+        for (SIRInstRef inst_ref : loop_block->inst_refs) {
+            if (ctx->moved[inst_ref.id]) continue;
+            ctx->inst_refs.push_back(inst_ref);
+        }
+        loop_block->inst_refs.len = 0;
+        loop_block->inst_refs.push_many(ctx->inst_refs.as_slice());
+    }
+
+    for (SIRInstRef inst_ref : ctx->hoisted) {
+        ctx->moved[inst_ref.id] = false;
+        loop_insert_at_end(ctx, preheader, inst_ref);
+    }
+
+    ctx->changed_count += ctx->hoisted.len;
+}
+
+// Replaces base[i] by a pointer phi advanced by the stride of i, for
+// induction variables i stepping by a constant once per iteration
+static void loop_reduce(LoopContext *ctx, uint32_t loop_index)
+{
+    ZoneScoped;
+
+    SIRModule *module = ctx->module;
+    SIRFunctionAnalysis *a = ctx->analysis;
+    SIRLoop loop = a->loops[loop_index];
+
+    loop_mark_blocks(ctx, loop_index, (uint32_t)ctx->func->blocks.len);
+    uint32_t preheader = loop_get_preheader(ctx, loop_index);
+    if (preheader == SIR_NO_INDEX) return;
+
+    uint32_t latch = SIR_NO_INDEX;
+    for (uint32_t pred : SIRAnalysisGetPreds(a, loop.header)) {
+        if (ctx->block_loops[pred] != ctx->stamp) continue;
+        if (latch != SIR_NO_INDEX) return;
+        latch = pred;
+    }
+
+    SIRInstRef header_ref = ctx->func->blocks[loop.header];
+    SIRInstRef preheader_ref = ctx->func->blocks[preheader];
+    SIRInstRef latch_ref = ctx->func->blocks[latch];
+    SIRBlock *header = module->insts[header_ref.id].block;
+
+    ctx->pointers.len = 0;
+    ctx->bases.len = 0;
+    size_t phi_end = 0;
+    while (phi_end < header->inst_refs.len) {
+        SIRInstKind kind = module->insts[header->inst_refs[phi_end].id].kind;
+        if (kind != SIRInstKind_Phi && kind != SIRInstKind_PhiIncoming) break;
+        phi_end++;
+    }
+
+    for (size_t i = 0; i < phi_end; ++i) {
+        SIRInstRef phi_ref = header->inst_refs[i];
+        SIRInst phi = module->insts[phi_ref.id];
+        if (phi.kind != SIRInstKind_Phi) continue;
+        if (phi.type->kind != SIRTypeKind_Int) continue;
+        if (SIRTypeSizeOf(module, phi.type) != 8) continue;
+
+        SIRInstRef init_ref = {0};
+        SIRInstRef next_ref = {0};
+        for (size_t j = i + 1; j < phi_end; ++j) {
+            SIRInst incoming = module->insts[header->inst_refs[j].id];
+            if (incoming.kind != SIRInstKind_PhiIncoming) break;
+            if (incoming.phi_incoming.block_ref.id == preheader_ref.id) {
+                init_ref = incoming.phi_incoming.value_ref;
+            } else if (incoming.phi_incoming.block_ref.id == latch_ref.id) {
+                next_ref = incoming.phi_incoming.value_ref;
+            }
+        }
+        if (!init_ref.id || !next_ref.id) continue;
+
+        SIRInst next = module->insts[next_ref.id];
+        if (next.kind != SIRInstKind_Binop ||
+            next.binop != SIRBinaryOperation_IAdd) {
+            continue;
+        }
+        SIRInstRef step_ref = {0};
+        if (next.op1.id == phi_ref.id) step_ref = next.op2;
+        if (next.op2.id == phi_ref.id) step_ref = next.op1;
+        if (!step_ref.id ||
+            module->insts[step_ref.id].kind != SIRInstKind_ConstInt) {
+            continue;
+        }
+
+        for (SIRInstRef user_ref : SIRModuleGetUses(module, phi_ref)) {
+            SIRInst user = module->insts[user_ref.id];
+            if (user.kind != SIRInstKind_ArrayElemPtr) continue;
+            if (user.op2.id != phi_ref.id) continue;
+            if (ctx->moved[user_ref.id] || !loop_contains(ctx, user_ref) ||
+                loop_contains(ctx, user.op1)) {
+                continue;
+            }
+
+            SIRType *elem_type = user.type->pointer.sub;
+
+            SIRInst init_ptr = user;
+            init_ptr.op2 = init_ref;
+            SIRInstRef init_ptr_ref = loop_add_inst(ctx, init_ptr);
+            loop_insert_at_end(ctx, preheader, init_ptr_ref);
+
+            SIRInst ptr_phi = {};
+            ptr_phi.kind = SIRInstKind_Phi;
+            ptr_phi.type = user.type;
+            SIRInstRef ptr_phi_ref = loop_add_inst(ctx, ptr_phi);
+            // Accesses based on this pointer are no longer invariant
+            ctx->inst_blocks[ptr_phi_ref.id] = loop.header;
+
+            // Stepping through a one element array moves by a whole element
+            SIRInst cast = {};
+            cast.kind = SIRInstKind_BitCast;
+            cast.type = SIRModuleCreatePointerType(
+                module, SIRModuleCreateArrayType(module, elem_type, 1));
+            cast.op1 = ptr_phi_ref;
+            SIRInstRef cast_ref = loop_add_inst(ctx, cast);
+            loop_insert_at_end(ctx, latch, cast_ref);
+
+            SIRInst next_ptr = user;
+            next_ptr.op1 = cast_ref;
+            next_ptr.op2 = step_ref;
+            SIRInstRef next_ptr_ref = loop_add_inst(ctx, next_ptr);
+            loop_insert_at_end(ctx, latch, next_ptr_ref);
+
+            SIRInst incoming = {};
+            incoming.kind = SIRInstKind_PhiIncoming;
+            incoming.phi_incoming.block_ref = preheader_ref;
+            incoming.phi_incoming.value_ref = init_ptr_ref;
+            SIRInstRef init_incoming_ref = loop_add_inst(ctx, incoming);
+            incoming.phi_incoming.block_ref = latch_ref;
+            incoming.phi_incoming.value_ref = next_ptr_ref;
+            SIRInstRef next_incoming_ref = loop_add_inst(ctx, incoming);
+
+            ctx->pointers.push_back(ptr_phi_ref);
+            ctx->pointers.push_back(init_incoming_ref);
+            ctx->pointers.push_back(next_incoming_ref);
+
+            for (SIRInstRef ptr_user_ref : SIRModuleGetUses(module, user_ref)) {
+                SIRInstRef *operands[2];
+                uint32_t operand_count = SIRInstGetOperands(
+                    &module->insts[ptr_user_ref.id], operands);
+                for (uint32_t k = 0; k < operand_count; ++k) {
+                    if (operands[k]->id == user_ref.id) {
+                        *operands[k] = ptr_phi_ref;
+                    }
+                }
+            }
+            ctx->moved[user_ref.id] = true;
+            ctx->bases.push_back(user_ref);
+        }
+    }
+
+    if (ctx->bases.len == 0) return;
+
+    // New phis go first in the header, the replaced accesses go away
+    ctx->inst_refs.len = 0;
+    ctx->inst_refs.push_many(ctx->pointers.as_slice());
+    ctx->inst_refs.push_many(header->inst_refs.as_slice());
+    header->inst_refs.len = 0;
+    header->inst_refs.push_many(ctx->inst_refs.as_slice());
+    for (SIRInstRef inst_ref : ctx->pointers) {
+        ctx->inst_blocks[inst_ref.id] = loop.header;
+    }
+
+    for (uint32_t block : SIRAnalysisGetLoopBlocks(a, loop_index)) {
+        SIRBlock *loop_block = loop_get_block(ctx, block);
+        ctx->inst_refs.len = 0;
+        for (SIRInstRef inst_ref : loop_block->inst_refs) {
+            if (ctx->moved[inst_ref.id]) continue;
+            ctx->inst_refs.push_back(inst_ref);
+        }
+        loop_block->inst_refs.len = 0;
+        loop_block->inst_refs.push_many(ctx->inst_refs.as_slice());
+    }
+
+    // The new pointers are not in the use lists
+    SIRModuleInvalidateUses(module);
+    ctx->changed_count += ctx->bases.len;
+}
+
+static LoopContext loop_create_context(SIRModule *module)
+{
+    LoopContext ctx = {};
+    ctx.module = module;
+    ctx.inst_blocks = SIRArray<uint32_t>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.moved = SIRArray<bool>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.slot_stores = SIRArray<uint32_t>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.block_loops = SIRArray<uint32_t>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.preheaders = SIRArray<SIRInstRef>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.outside_preds = SIRArray<uint32_t>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.hoisted = SIRArray<SIRInstRef>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.pointers = SIRArray<SIRInstRef>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.bases = SIRArray<SIRInstRef>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.inst_refs = SIRArray<SIRInstRef>::create(&SIR_MALLOC_ALLOCATOR);
+    loop_grow_maps(&ctx);
+    return ctx;
+}
+
+static void loop_destroy_context(LoopContext *ctx)
+{
+    if (ctx->changed_count > 0) {
+        SIRModuleInvalidateUses(ctx->module);
+    }
+
+    ctx->inst_blocks.destroy();
+    ctx->moved.destroy();
+    ctx->slot_stores.destroy();
+    ctx->block_loops.destroy();
+    ctx->preheaders.destroy();
+    ctx->outside_preds.destroy();
+    ctx->hoisted.destroy();
+    ctx->pointers.destroy();
+    ctx->bases.destroy();
+    ctx->inst_refs.destroy();
+}
+
+size_t SIRModuleHoistLoopInvariants(SIRModule *module)
+{
+    ZoneScoped;
+
+    LoopContext ctx = loop_create_context(module);
+
+    for (SIRInstRef func_ref : module->functions) {
+        ctx.func_ref = func_ref;
+        ctx.func = module->insts[func_ref.id].func;
+        if (ctx.func->blocks.len == 0) continue;
+
+        loop_prepare_function(&ctx);
+
+        // Inner loops first, their preheaders are part of the outer loops
+        for (uint32_t i = (uint32_t)ctx.analysis->loops.len; i > 0; --i) {
+            loop_hoist(&ctx, i - 1);
+        }
+    }
+
+    size_t changed_count = ctx.changed_count;
+    loop_destroy_context(&ctx);
+    return changed_count;
+}
+
+size_t SIRModuleReduceStrength(SIRModule *module)
+{
+    ZoneScoped;
+
+    LoopContext ctx = loop_create_context(module);
+
+    for (SIRInstRef func_ref : module->functions) {
+        ctx.func_ref = func_ref;
+        ctx.func = module->insts[func_ref.id].func;
+        if (ctx.func->blocks.len == 0) continue;
+
+        loop_prepare_function(&ctx);
+
+        for (uint32_t i = (uint32_t)ctx.analysis->loops.len; i > 0; --i) {
+            loop_reduce(&ctx, i - 1);
+        }
+    }
+
+    size_t changed_count = ctx.changed_count;
+    loop_destroy_context(&ctx);
+    return changed_count;
+}
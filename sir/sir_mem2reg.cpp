@@ -0,0 +1,716 @@
+#include "sir_base.hpp"
+#include "sir_ir.hpp"
+
+// Promotes stack slots that are only loaded from and stored to as scalars
+// into SSA values. Phis are placed on the iterated dominance frontier of the
+// blocks storing to each slot, and loads are renamed to the reaching
+// definition by walking the dominator tree.
+
+static const uint32_t MEM2REG_NONE = UINT32_MAX;
+
+struct Mem2RegPhi {
+    SIRInstRef phi_ref;
+    uint32_t slot_index;
+    uint32_t use_count;
+    bool removed;
+    SIRArray<SIRInstRef> incoming_blocks;
+    SIRArray<SIRInstRef> incoming_values;
+};
+
+struct Mem2RegBlock {
+    SIRArray<uint32_t> phis; // Indices into Mem2RegContext::phis
+    uint32_t phi_slot;       // Last slot that got a phi in this block
+    uint32_t work_slot; // Last slot that added this block to the worklist
+    bool has_phis;      // New or pre-existing phis at the start of the block
+};
+
+struct Mem2RegSlot {
+    SIRInstRef slot_ref;
+    SIRType *type;
+    bool promotable;
+    SIRInstRef undef_ref;
+    SIRArray<uint32_t> def_blocks;
+    SIRArray<SIRInstRef> values; // Stack of reaching definitions
+};
+
+struct Mem2RegFrame {
+    uint32_t block_index;
+    uint32_t child_pos;
+    size_t undo_len;
+};
+
+struct Mem2RegContext {
+    SIRModule *module;
+    SIRAllocator *allocator;
+    SIRInstRef func_ref;
+    SIRFunction *func;
+    SIRFunctionAnalysis *analysis;
+
+    // Indexed by instruction id, shared by all functions of the module
+    SIRArray<uint32_t> slot_indices;
+    SIRArray<uint32_t> phi_indices;
+    SIRArray<SIRInstRef> replacements;
+    SIRArray<bool> removed;
+
+    SIRArray<Mem2RegBlock> blocks;
+    SIRArray<Mem2RegSlot> slots;
+    SIRArray<Mem2RegPhi> phis;
+    SIRArray<SIRInstRef> entry_insts; // Undefined values used by the function
+    SIRArray<uint32_t> undo_log;
+    SIRArray<Mem2RegFrame> frames;
+    SIRArray<SIRInstRef> inst_refs;
+};
+
+static void mem2reg_grow_maps(Mem2RegContext *ctx)
+{
+    size_t inst_count = ctx->module->insts.len;
+    while (ctx->removed.len < inst_count) {
+        ctx->slot_indices.push_back(MEM2REG_NONE);
+        ctx->phi_indices.push_back(MEM2REG_NONE);
+        ctx->replacements.push_back({0});
+        ctx->removed.push_back(false);
+    }
+}
+
+static SIRInstRef mem2reg_add_inst(Mem2RegContext *ctx, const SIRInst &inst)
+{
+    SIRInstRef inst_ref = SIRModuleAddInst(ctx->module, inst);
+    mem2reg_grow_maps(ctx);
+    return inst_ref;
+}
+
+SIR_INLINE
+static SIRInstRef mem2reg_resolve(Mem2RegContext *ctx, SIRInstRef inst_ref)
+{
+    while (ctx->replacements[inst_ref.id].id) {
+        inst_ref = ctx->replacements[inst_ref.id];
+    }
+    return inst_ref;
+}
+
+// Returns the slot index of a promotable stack slot, or MEM2REG_NONE
+SIR_INLINE
+static uint32_t mem2reg_get_slot(Mem2RegContext *ctx, SIRInstRef ptr_ref)
+{
+    if (ctx->module->insts[ptr_ref.id].kind != SIRInstKind_StackSlot) {
+        return MEM2REG_NONE;
+    }
+    uint32_t slot_index = ctx->slot_indices[ptr_ref.id];
+    if (slot_index == MEM2REG_NONE || !ctx->slots[slot_index].promotable) {
+        return MEM2REG_NONE;
+    }
+    return slot_index;
+}
+
+static Mem2RegBlock mem2reg_create_block(Mem2RegContext *ctx)
+{
+    Mem2RegBlock block = {};
+    block.phis = SIRArray<uint32_t>::create(ctx->allocator);
+    block.phi_slot = MEM2REG_NONE;
+    block.work_slot = MEM2REG_NONE;
+    return block;
+}
+
+
+SIR_INLINE
+static SIRBlock *mem2reg_get_block(Mem2RegContext *ctx, uint32_t block_index)
+{
+    return ctx->module->insts[ctx->func->blocks[block_index].id].block;
+}
+
+static size_t mem2reg_collect_slots(Mem2RegContext *ctx)
+{
+    ZoneScoped;
+
+    SIRModule *module = ctx->module;
+
+    ctx->slots.len = 0;
+    for (SIRInstRef slot_ref : ctx->func->stack_slots) {
+        ctx->slot_indices[slot_ref.id] = (uint32_t)ctx->slots.len;
+
+        Mem2RegSlot slot = {};
+        slot.slot_ref = slot_ref;
+        slot.type = module->insts[slot_ref.id].type->pointer.sub;
+        slot.def_blocks = SIRArray<uint32_t>::create(ctx->allocator);
+        slot.values = SIRArray<SIRInstRef>::create(ctx->allocator);
+
+        switch (slot.type->kind) {
+        case SIRTypeKind_Int:
+        case SIRTypeKind_Float:
+        case SIRTypeKind_Bool:
+        case SIRTypeKind_Pointer: slot.promotable = true; break;
+        default: slot.promotable = false; break;
+        }
+
+        ctx->slots.push_back(slot);
+    }
+
+    // Any use other than loading or storing a value of the slot's type makes
+    // the slot's address escape
+    for (uint32_t b = 0; b < ctx->func->blocks.len; ++b) {
+        bool reachable = SIRAnalysisIsReachable(ctx->analysis, b);
+
+        for (SIRInstRef inst_ref : mem2reg_get_block(ctx, b)->inst_refs) {
+            SIRInst inst = module->insts[inst_ref.id];
+
+            SIRInstRef *operands[2];
+            uint32_t operand_count = SIRInstGetOperands(&inst, operands);
+            for (uint32_t i = 0; i < operand_count; ++i) {
+                SIRInstRef operand_ref = *operands[i];
+                if (module->insts[operand_ref.id].kind !=
+                    SIRInstKind_StackSlot) {
+                    continue;
+                }
+
+                Mem2RegSlot *slot =
+                    &ctx->slots[ctx->slot_indices[operand_ref.id]];
+
+                if (inst.kind == SIRInstKind_Load) continue;
+                if (inst.kind == SIRInstKind_Store && i == 0 &&
+                    module->insts[inst.store.value_ref.id].type == slot->type) {
+                    if (reachable &&
+                        (slot->def_blocks.len == 0 ||
+                         slot->def_blocks[slot->def_blocks.len - 1] != b)) {
+                        slot->def_blocks.push_back(b);
+                    }
+                    continue;
+                }
+
+                slot->promotable = false;
+            }
+        }
+    }
+
+    size_t promotable_count = 0;
+    for (Mem2RegSlot &slot : ctx->slots) {
+        if (slot.promotable) promotable_count++;
+    }
+    return promotable_count;
+}
+
+static void mem2reg_place_phis(Mem2RegContext *ctx)
+{
+    ZoneScoped;
+
+    SIRArray<uint32_t> worklist = SIRArray<uint32_t>::create(ctx->allocator);
+
+    ctx->phis.len = 0;
+    for (uint32_t k = 0; k < ctx->slots.len; ++k) {
+        if (!ctx->slots[k].promotable) continue;
+
+        worklist.len = 0;
+        for (uint32_t b : ctx->slots[k].def_blocks) {
+            ctx->blocks[b].work_slot = k;
+            worklist.push_back(b);
+        }
+
+        while (worklist.len > 0) {
+            uint32_t b = worklist[worklist.len - 1];
+            worklist.pop();
+
+            for (uint32_t f : SIRAnalysisGetFrontier(ctx->analysis, b)) {
+                Mem2RegBlock *frontier_block = &ctx->blocks[f];
+                if (frontier_block->phi_slot != k) {
+                    frontier_block->phi_slot = k;
+
+                    SIRInst phi = {};
+                    phi.kind = SIRInstKind_Phi;
+                    phi.type = ctx->slots[k].type;
+
+                    Mem2RegPhi new_phi = {};
+                    new_phi.phi_ref = mem2reg_add_inst(ctx, phi);
+                    new_phi.slot_index = k;
+                    new_phi.incoming_blocks =
+                        SIRArray<SIRInstRef>::create(ctx->allocator);
+                    new_phi.incoming_values =
+                        SIRArray<SIRInstRef>::create(ctx->allocator);
+
+                    ctx->phi_indices[new_phi.phi_ref.id] =
+                        (uint32_t)ctx->phis.len;
+                    frontier_block->phis.push_back((uint32_t)ctx->phis.len);
+                    frontier_block->has_phis = true;
+                    ctx->phis.push_back(new_phi);
+                }
+                if (frontier_block->work_slot != k) {
+                    frontier_block->work_slot = k;
+                    worklist.push_back(f);
+                }
+            }
+        }
+    }
+}
+
+// Phi copies are emitted at the end of the predecessor, so an edge from a
+// block with several successors into a block with phis needs its own block.
+// Returns whether the CFG changed.
+static bool mem2reg_split_critical_edges(Mem2RegContext *ctx)
+{
+    ZoneScoped;
+
+    SIRModule *module = ctx->module;
+    SIRFunctionAnalysis *analysis = ctx->analysis;
+
+    bool changed = false;
+
+    size_t block_count = ctx->func->blocks.len;
+    for (uint32_t b = 0; b < block_count; ++b) {
+        SIRSlice<uint32_t> preds = SIRAnalysisGetPreds(analysis, b);
+        if (!ctx->blocks[b].has_phis || !SIRAnalysisIsReachable(analysis, b) ||
+            preds.len < 2) {
+            continue;
+        }
+
+        SIRInstRef block_ref = ctx->func->blocks[b];
+
+        for (uint32_t pred : preds) {
+            if (!SIRAnalysisIsReachable(analysis, pred) ||
+                SIRAnalysisGetSuccs(analysis, pred).len < 2) {
+                continue;
+            }
+
+            SIRInstRef pred_ref = ctx->func->blocks[pred];
+
+            SIRInstRef split_ref =
+                SIRModuleInsertBlockAtEnd(module, ctx->func_ref);
+            mem2reg_grow_maps(ctx);
+            ctx->blocks.push_back(mem2reg_create_block(ctx));
+
+            SIRInst jump = {};
+            jump.kind = SIRInstKind_Jump;
+            jump.op1 = block_ref;
+            SIRInstRef jump_ref = mem2reg_add_inst(ctx, jump);
+            module->insts[split_ref.id].block->inst_refs.push_back(jump_ref);
+
+            SIRInstRef term_ref = SIRBlockGetTerminator(module, pred_ref);
+            SIRInst *term = &module->insts[term_ref.id];
+            SIR_ASSERT(term->kind == SIRInstKind_Branch);
+            if (term->op1.id == block_ref.id) term->op1 = split_ref;
+            if (term->op2.id == block_ref.id) term->op2 = split_ref;
+
+            SIRBlock *block = module->insts[block_ref.id].block;
+            for (SIRInstRef inst_ref : block->inst_refs) {
+                SIRInst *inst = &module->insts[inst_ref.id];
+                if (inst->kind == SIRInstKind_Phi) continue;
+                if (inst->kind != SIRInstKind_PhiIncoming) break;
+                if (inst->phi_incoming.block_ref.id == pred_ref.id) {
+                    inst->phi_incoming.block_ref = split_ref;
+                }
+            }
+
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+static SIRInstRef mem2reg_get_undef(Mem2RegContext *ctx, uint32_t slot_index)
+{
+    Mem2RegSlot *slot = &ctx->slots[slot_index];
+    if (slot->undef_ref.id) return slot->undef_ref;
+
+    SIRModule *module = ctx->module;
+    SIRType *type = slot->type;
+
+    SIRInstRef undef_ref = {0};
+    switch (type->kind) {
+    case SIRTypeKind_Int: {
+        undef_ref = SIRModuleAddConstInt(module, type, 0);
+        break;
+    }
+    case SIRTypeKind_Float: {
+        undef_ref = SIRModuleAddConstFloat(module, type, 0.0);
+        break;
+    }
+    case SIRTypeKind_Bool: {
+        undef_ref = SIRModuleAddConstBool(module, false);
+        break;
+    }
+    case SIRTypeKind_Pointer: {
+        SIRInst cast = {};
+        cast.kind = SIRInstKind_BitCast;
+        cast.type = type;
+        cast.op1 = SIRModuleAddConstInt(module, module->u64_type, 0);
+        undef_ref = SIRModuleAddInst(module, cast);
+        ctx->entry_insts.push_back(undef_ref);
+        break;
+    }
+    default: SIR_ASSERT(0); break;
+    }
+    mem2reg_grow_maps(ctx);
+
+    slot->undef_ref = undef_ref;
+    return undef_ref;
+}
+
+SIR_INLINE
+static SIRInstRef
+mem2reg_get_current_value(Mem2RegContext *ctx, uint32_t slot_index)
+{
+    Mem2RegSlot *slot = &ctx->slots[slot_index];
+    if (slot->values.len > 0) {
+        return slot->values[slot->values.len - 1];
+    }
+    return mem2reg_get_undef(ctx, slot_index);
+}
+
+static void mem2reg_rename_block(Mem2RegContext *ctx, uint32_t block_index)
+{
+    ZoneScoped;
+
+    SIRModule *module = ctx->module;
+
+    for (uint32_t phi_index : ctx->blocks[block_index].phis) {
+        Mem2RegPhi *phi = &ctx->phis[phi_index];
+        ctx->slots[phi->slot_index].values.push_back(phi->phi_ref);
+        ctx->undo_log.push_back(phi->slot_index);
+    }
+
+    for (SIRInstRef inst_ref : mem2reg_get_block(ctx, block_index)->inst_refs) {
+        SIRInst inst = module->insts[inst_ref.id];
+        if (inst.kind == SIRInstKind_Load) {
+            uint32_t slot_index = mem2reg_get_slot(ctx, inst.load.ptr_ref);
+            if (slot_index == MEM2REG_NONE) continue;
+
+            ctx->replacements[inst_ref.id] =
+                mem2reg_get_current_value(ctx, slot_index);
+            ctx->removed[inst_ref.id] = true;
+        } else if (inst.kind == SIRInstKind_Store) {
+            uint32_t slot_index = mem2reg_get_slot(ctx, inst.store.ptr_ref);
+            if (slot_index == MEM2REG_NONE) continue;
+
+            ctx->slots[slot_index].values.push_back(
+                mem2reg_resolve(ctx, inst.store.value_ref));
+            ctx->undo_log.push_back(slot_index);
+            ctx->removed[inst_ref.id] = true;
+        }
+    }
+
+    SIRInstRef block_ref = ctx->func->blocks[block_index];
+    for (uint32_t succ : SIRAnalysisGetSuccs(ctx->analysis, block_index)) {
+        for (uint32_t phi_index : ctx->blocks[succ].phis) {
+            SIRInstRef value_ref =
+                mem2reg_get_current_value(ctx, ctx->phis[phi_index].slot_index);
+
+            Mem2RegPhi *phi = &ctx->phis[phi_index];
+            phi->incoming_blocks.push_back(block_ref);
+            phi->incoming_values.push_back(value_ref);
+        }
+    }
+}
+
+static void mem2reg_rename(Mem2RegContext *ctx)
+{
+    ZoneScoped;
+
+    SIRModule *module = ctx->module;
+    SIRFunctionAnalysis *analysis = ctx->analysis;
+
+    ctx->undo_log.len = 0;
+    ctx->frames.len = 0;
+    ctx->frames.push_back({0, 0, ctx->undo_log.len});
+    mem2reg_rename_block(ctx, 0);
+
+    while (ctx->frames.len > 0) {
+        Mem2RegFrame *frame = &ctx->frames[ctx->frames.len - 1];
+        SIRSlice<uint32_t> children =
+            SIRAnalysisGetDomChildren(analysis, frame->block_index);
+        if (frame->child_pos < children.len) {
+            uint32_t child = children[frame->child_pos++];
+            ctx->frames.push_back({child, 0, ctx->undo_log.len});
+            mem2reg_rename_block(ctx, child);
+        } else {
+            while (ctx->undo_log.len > frame->undo_len) {
+                uint32_t slot_index = ctx->undo_log[ctx->undo_log.len - 1];
+                ctx->slots[slot_index].values.pop();
+                ctx->undo_log.pop();
+            }
+            ctx->frames.pop();
+        }
+    }
+
+    // Unreachable blocks never see a definition
+    for (uint32_t b = 0; b < ctx->func->blocks.len; ++b) {
+        if (SIRAnalysisIsReachable(analysis, b)) continue;
+
+        for (SIRInstRef inst_ref : mem2reg_get_block(ctx, b)->inst_refs) {
+            SIRInst inst = module->insts[inst_ref.id];
+            if (inst.kind == SIRInstKind_Load) {
+                uint32_t slot_index = mem2reg_get_slot(ctx, inst.load.ptr_ref);
+                if (slot_index == MEM2REG_NONE) continue;
+
+                ctx->replacements[inst_ref.id] =
+                    mem2reg_get_undef(ctx, slot_index);
+                ctx->removed[inst_ref.id] = true;
+            } else if (inst.kind == SIRInstKind_Store) {
+                if (mem2reg_get_slot(ctx, inst.store.ptr_ref) == MEM2REG_NONE) {
+                    continue;
+                }
+                ctx->removed[inst_ref.id] = true;
+            }
+        }
+    }
+}
+
+static void mem2reg_remove_useless_phis(Mem2RegContext *ctx)
+{
+    ZoneScoped;
+
+    SIRModule *module = ctx->module;
+
+    // Phis whose incoming values are all the same value or the phi itself
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (uint32_t i = 0; i < ctx->phis.len; ++i) {
+            Mem2RegPhi *phi = &ctx->phis[i];
+            if (phi->removed) continue;
+
+            SIRInstRef same_ref = {0};
+            bool trivial = true;
+            for (SIRInstRef value_ref : phi->incoming_values) {
+                value_ref = mem2reg_resolve(ctx, value_ref);
+                if (value_ref.id == phi->phi_ref.id ||
+                    value_ref.id == same_ref.id) {
+                    continue;
+                }
+                if (same_ref.id) {
+                    trivial = false;
+                    break;
+                }
+                same_ref = value_ref;
+            }
+            if (!trivial) continue;
+
+            if (!same_ref.id) {
+                same_ref = mem2reg_get_undef(ctx, phi->slot_index);
+            }
+            ctx->replacements[phi->phi_ref.id] = same_ref;
+            phi->removed = true;
+            changed = true;
+        }
+    }
+
+    // Phis that are only used by other dead phis
+    for (Mem2RegPhi &phi : ctx->phis) {
+        phi.use_count = 0;
+    }
+
+    for (SIRInstRef block_ref : ctx->func->blocks) {
+        SIRBlock *block = module->insts[block_ref.id].block;
+        for (SIRInstRef inst_ref : block->inst_refs) {
+            if (ctx->removed[inst_ref.id]) continue;
+
+            SIRInst inst = module->insts[inst_ref.id];
+            SIRInstRef *operands[2];
+            uint32_t operand_count = SIRInstGetOperands(&inst, operands);
+            for (uint32_t i = 0; i < operand_count; ++i) {
+                SIRInstRef value_ref = mem2reg_resolve(ctx, *operands[i]);
+                uint32_t phi_index = ctx->phi_indices[value_ref.id];
+                if (phi_index != MEM2REG_NONE) {
+                    ctx->phis[phi_index].use_count++;
+                }
+            }
+        }
+    }
+
+    for (Mem2RegPhi &phi : ctx->phis) {
+        if (phi.removed) continue;
+        for (SIRInstRef value_ref : phi.incoming_values) {
+            value_ref = mem2reg_resolve(ctx, value_ref);
+            uint32_t phi_index = ctx->phi_indices[value_ref.id];
+            if (phi_index != MEM2REG_NONE && value_ref.id != phi.phi_ref.id) {
+                ctx->phis[phi_index].use_count++;
+            }
+        }
+    }
+
+    SIRArray<uint32_t> worklist = SIRArray<uint32_t>::create(ctx->allocator);
+    for (uint32_t i = 0; i < ctx->phis.len; ++i) {
+        if (!ctx->phis[i].removed && ctx->phis[i].use_count == 0) {
+            worklist.push_back(i);
+        }
+    }
+
+    while (worklist.len > 0) {
+        Mem2RegPhi *phi = &ctx->phis[worklist[worklist.len - 1]];
+        worklist.pop();
+        phi->removed = true;
+
+        for (SIRInstRef value_ref : phi->incoming_values) {
+            value_ref = mem2reg_resolve(ctx, value_ref);
+            uint32_t phi_index = ctx->phi_indices[value_ref.id];
+            if (phi_index == MEM2REG_NONE || value_ref.id == phi->phi_ref.id) {
+                continue;
+            }
+
+            Mem2RegPhi *used_phi = &ctx->phis[phi_index];
+            if (used_phi->removed) continue;
+            if (--used_phi->use_count == 0) {
+                worklist.push_back(phi_index);
+            }
+        }
+    }
+}
+
+static void mem2reg_rewrite_blocks(Mem2RegContext *ctx)
+{
+    ZoneScoped;
+
+    SIRModule *module = ctx->module;
+
+    for (uint32_t b = 0; b < ctx->func->blocks.len; ++b) {
+        SIRBlock *block = mem2reg_get_block(ctx, b);
+
+        ctx->inst_refs.len = 0;
+
+        size_t i = 0;
+        for (; i < block->inst_refs.len; ++i) {
+            SIRInstKind kind = module->insts[block->inst_refs[i].id].kind;
+            if (kind != SIRInstKind_Phi && kind != SIRInstKind_PhiIncoming) {
+                break;
+            }
+            ctx->inst_refs.push_back(block->inst_refs[i]);
+        }
+
+        for (uint32_t phi_index : ctx->blocks[b].phis) {
+            if (ctx->phis[phi_index].removed) continue;
+
+            ctx->inst_refs.push_back(ctx->phis[phi_index].phi_ref);
+            for (size_t j = 0; j < ctx->phis[phi_index].incoming_values.len;
+                 ++j) {
+                Mem2RegPhi *phi = &ctx->phis[phi_index];
+
+                SIRInst incoming = {};
+                incoming.kind = SIRInstKind_PhiIncoming;
+                incoming.phi_incoming.block_ref = phi->incoming_blocks[j];
+                incoming.phi_incoming.value_ref =
+                    mem2reg_resolve(ctx, phi->incoming_values[j]);
+                ctx->inst_refs.push_back(mem2reg_add_inst(ctx, incoming));
+            }
+        }
+
+        if (b == 0) {
+            for (SIRInstRef inst_ref : ctx->entry_insts) {
+                ctx->inst_refs.push_back(inst_ref);
+            }
+        }
+
+        for (; i < block->inst_refs.len; ++i) {
+            if (ctx->removed[block->inst_refs[i].id]) continue;
+            ctx->inst_refs.push_back(block->inst_refs[i]);
+        }
+
+        block->inst_refs.len = 0;
+        block->inst_refs.push_many(ctx->inst_refs.as_slice());
+    }
+
+    // No instructions are added from here on, so pointers stay valid
+    for (SIRInstRef block_ref : ctx->func->blocks) {
+        SIRBlock *block = module->insts[block_ref.id].block;
+        for (SIRInstRef inst_ref : block->inst_refs) {
+            SIRInstRef *operands[2];
+            uint32_t operand_count =
+                SIRInstGetOperands(&module->insts[inst_ref.id], operands);
+            for (uint32_t i = 0; i < operand_count; ++i) {
+                *operands[i] = mem2reg_resolve(ctx, *operands[i]);
+            }
+        }
+    }
+
+    size_t slot_count = 0;
+    for (Mem2RegSlot &slot : ctx->slots) {
+        if (slot.promotable) continue;
+        ctx->func->stack_slots[slot_count++] = slot.slot_ref;
+    }
+    ctx->func->stack_slots.len = slot_count;
+}
+
+static size_t mem2reg_function(Mem2RegContext *ctx, SIRInstRef func_ref)
+{
+    ZoneScoped;
+
+    SIRModule *module = ctx->module;
+
+    SIRFunction *func = module->insts[func_ref.id].func;
+    if (func->blocks.len == 0 || func->stack_slots.len == 0) return 0;
+
+    ctx->func_ref = func_ref;
+    ctx->func = func;
+    ctx->analysis =
+        SIRFunctionGetAnalysis(module, func_ref, SIRAnalysis_Dominators);
+    ctx->entry_insts.len = 0;
+
+    // Phis can't be placed in the entry block
+    if (SIRAnalysisGetPreds(ctx->analysis, 0).len > 0) return 0;
+
+    size_t promoted_count = mem2reg_collect_slots(ctx);
+    if (promoted_count == 0) return 0;
+
+    ctx->blocks.len = 0;
+    for (SIRInstRef block_ref : func->blocks) {
+        Mem2RegBlock block = mem2reg_create_block(ctx);
+        SIRBlock *sir_block = module->insts[block_ref.id].block;
+        block.has_phis =
+            sir_block->inst_refs.len > 0 &&
+            module->insts[sir_block->inst_refs[0].id].kind == SIRInstKind_Phi;
+        ctx->blocks.push_back(block);
+    }
+
+    mem2reg_place_phis(ctx);
+
+    // Split blocks only hold a jump, so the phis stay where they were placed
+    if (mem2reg_split_critical_edges(ctx)) {
+        SIRFunctionInvalidateAnalysis(module, func_ref, SIRAnalysis_CFG);
+        ctx->analysis =
+            SIRFunctionGetAnalysis(module, func_ref, SIRAnalysis_Dominators);
+    }
+
+    mem2reg_rename(ctx);
+    mem2reg_remove_useless_phis(ctx);
+    mem2reg_rewrite_blocks(ctx);
+
+    return promoted_count;
+}
+
+size_t SIRModulePromoteStackSlots(SIRModule *module)
+{
+    ZoneScoped;
+
+    SIRArenaAllocator *arena = SIRArenaAllocatorCreate(&SIR_MALLOC_ALLOCATOR);
+    SIRAllocator *allocator = (SIRAllocator *)arena;
+
+    Mem2RegContext ctx = {};
+    ctx.module = module;
+    ctx.allocator = allocator;
+    ctx.slot_indices = SIRArray<uint32_t>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.phi_indices = SIRArray<uint32_t>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.replacements = SIRArray<SIRInstRef>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.removed = SIRArray<bool>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.blocks = SIRArray<Mem2RegBlock>::create(allocator);
+    ctx.slots = SIRArray<Mem2RegSlot>::create(allocator);
+    ctx.phis = SIRArray<Mem2RegPhi>::create(allocator);
+    ctx.entry_insts = SIRArray<SIRInstRef>::create(allocator);
+    ctx.undo_log = SIRArray<uint32_t>::create(allocator);
+    ctx.frames = SIRArray<Mem2RegFrame>::create(allocator);
+    ctx.inst_refs = SIRArray<SIRInstRef>::create(allocator);
+
+    mem2reg_grow_maps(&ctx);
+
+    size_t promoted_count = 0;
+    for (size_t i = 0; i < module->functions.len; ++i) {
+        promoted_count += mem2reg_function(&ctx, module->functions[i]);
+    }
+
+    if (promoted_count > 0) {
+        SIRModuleInvalidateUses(module);
+    }
+
+    ctx.slot_indices.destroy();
+    ctx.phi_indices.destroy();
+    ctx.replacements.destroy();
+    ctx.removed.destroy();
+    SIRArenaAllocatorDestroy(arena);
+
+    return promoted_count;
+}
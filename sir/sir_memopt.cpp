@@ -0,0 +1,406 @@
+#include "sir_base.hpp"
+#include "sir_ir.hpp"
+
+// Store to load forwarding and dead store elimination for the memory
+// mem2reg can not promote. A load reading what an earlier store or load of
+// the same location left there is replaced by that value, first within a
+// block and then across blocks whose predecessors all agree on it. A store
+// is removed when a later store in the block overwrites it before anything
+// may read it, or when it writes a local stack slot the function never
+// loads from.
+
+// Bounds the quadratic work of killing and intersecting available values
+static const uint32_t MEMOPT_MAX_AVAILABLE = 64;
+
+struct MemOptAvailable {
+    SIRMemLoc loc;
+    SIRInstRef ptr_ref;
+    SIRType *type;
+    SIRInstRef value_ref;
+};
+
+struct MemOptContext {
+    SIRModule *module;
+    SIRInstRef func_ref;
+    SIRFunction *func;
+    SIRFunctionAnalysis *analysis;
+
+    // Indexed by instruction id, shared by all functions of the module
+    SIRArray<SIRInstRef> replacements;
+    SIRArray<bool> removed;
+    SIRArray<uint32_t> slot_loads; // Last function loading from the slot
+
+    // Values available at the end of every visited block, indexed by block
+    SIRArray<uint32_t> out_offsets;
+    SIRArray<uint32_t> out_lens; // SIR_NO_INDEX until the block is visited
+    SIRArray<MemOptAvailable> outs;
+
+    SIRArray<MemOptAvailable> available;
+    SIRArray<SIRMemLoc> stored; // Stores later in the block
+    SIRArray<SIRInstRef> inst_refs;
+    uint32_t func_index;
+    size_t changed_count;
+};
+
+static void memopt_grow_maps(MemOptContext *ctx)
+{
+    size_t inst_count = ctx->module->insts.len;
+    while (ctx->removed.len < inst_count) {
+        ctx->replacements.push_back({0});
+        ctx->removed.push_back(false);
+        ctx->slot_loads.push_back(0);
+    }
+}
+
+SIR_INLINE
+static SIRInstRef memopt_resolve(MemOptContext *ctx, SIRInstRef inst_ref)
+{
+    while (ctx->replacements[inst_ref.id].id) {
+        inst_ref = ctx->replacements[inst_ref.id];
+    }
+    return inst_ref;
+}
+
+// Aggregates live in memory anyway, forwarding them saves nothing
+SIR_INLINE
+static bool memopt_is_scalar(SIRType *type)
+{
+    switch (type->kind) {
+    case SIRTypeKind_Int:
+    case SIRTypeKind_Float:
+    case SIRTypeKind_Bool:
+    case SIRTypeKind_Pointer: return true;
+    default: return false;
+    }
+}
+
+// Whether both accesses are known to touch exactly the same bytes
+SIR_INLINE
+static bool memopt_same_loc(
+    const MemOptAvailable &a, const SIRMemLoc &loc, SIRInstRef ptr_ref)
+{
+    if (a.loc.size != loc.size) return false;
+    if (a.ptr_ref.id == ptr_ref.id) return true;
+    return a.loc.base.id == loc.base.id &&
+           a.loc.offset != SIR_UNKNOWN_OFFSET && a.loc.offset == loc.offset;
+}
+
+static void memopt_kill(MemOptContext *ctx, const SIRMemLoc &loc)
+{
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < ctx->available.len; ++i) {
+        if (SIRMemLocMayAlias(ctx->available[i].loc, loc)) continue;
+        ctx->available[kept++] = ctx->available[i];
+    }
+    ctx->available.len = kept;
+}
+
+static void memopt_kill_call_visible(MemOptContext *ctx)
+{
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < ctx->available.len; ++i) {
+        if (SIRMemLocIsCallVisible(ctx->available[i].loc)) continue;
+        ctx->available[kept++] = ctx->available[i];
+    }
+    ctx->available.len = kept;
+}
+
+static void memopt_make_available(
+    MemOptContext *ctx,
+    const SIRMemLoc &loc,
+    SIRInstRef ptr_ref,
+    SIRInstRef value_ref)
+{
+    SIRType *type = ctx->module->insts[value_ref.id].type;
+    if (!memopt_is_scalar(type)) return;
+
+    if (ctx->available.len >= MEMOPT_MAX_AVAILABLE) {
+        memmove(
+            &ctx->available[0],
+            &ctx->available[1],
+            (ctx->available.len - 1) * sizeof(MemOptAvailable));
+        ctx->available.len--;
+    }
+
+    MemOptAvailable entry = {};
+    entry.loc = loc;
+    entry.ptr_ref = ptr_ref;
+    entry.type = type;
+    entry.value_ref = value_ref;
+    ctx->available.push_back(entry);
+}
+
+// Values every predecessor leaves in memory. Predecessors not visited yet
+// are reached through a back edge, which could have changed anything.
+static void memopt_enter_block(MemOptContext *ctx, uint32_t block_index)
+{
+    ctx->available.len = 0;
+
+    SIRSlice<uint32_t> preds =
+        SIRAnalysisGetPreds(ctx->analysis, block_index);
+    if (preds.len == 0) return;
+    for (uint32_t pred : preds) {
+        if (ctx->out_lens[pred] == SIR_NO_INDEX) return;
+    }
+
+    uint32_t first = preds[0];
+    for (uint32_t i = 0; i < ctx->out_lens[first]; ++i) {
+        const MemOptAvailable &entry = ctx->outs[ctx->out_offsets[first] + i];
+
+        bool everywhere = true;
+        for (uint32_t p = 1; p < preds.len && everywhere; ++p) {
+            uint32_t pred = preds[p];
+            everywhere = false;
+            for (uint32_t j = 0; j < ctx->out_lens[pred]; ++j) {
+                const MemOptAvailable &other =
+                    ctx->outs[ctx->out_offsets[pred] + j];
+                if (other.value_ref.id == entry.value_ref.id &&
+                    other.type == entry.type &&
+                    memopt_same_loc(other, entry.loc, entry.ptr_ref)) {
+                    everywhere = true;
+                    break;
+                }
+            }
+        }
+        if (everywhere) ctx->available.push_back(entry);
+    }
+}
+
+static void memopt_forward_block(MemOptContext *ctx, uint32_t block_index)
+{
+    SIRModule *module = ctx->module;
+    SIRBlock *block = module->insts[ctx->func->blocks[block_index].id].block;
+
+    memopt_enter_block(ctx, block_index);
+
+    for (SIRInstRef inst_ref : block->inst_refs) {
+        SIRInst *inst = &module->insts[inst_ref.id];
+
+        SIRInstRef *operands[2];
+        uint32_t operand_count = SIRInstGetOperands(inst, operands);
+        for (uint32_t i = 0; i < operand_count; ++i) {
+            *operands[i] = memopt_resolve(ctx, *operands[i]);
+        }
+
+        if (SIRInstIsTerminator(inst->kind)) break;
+
+        switch (inst->kind) {
+        case SIRInstKind_Load: {
+            SIRInstRef ptr_ref = inst->op1;
+            SIRType *type = inst->type;
+            SIRMemLoc loc = SIRModuleGetMemLoc(
+                module, ptr_ref, SIRTypeSizeOf(module, type));
+
+            bool forwarded = false;
+            for (uint32_t i = ctx->available.len; i-- > 0;) {
+                const MemOptAvailable &entry = ctx->available[i];
+                if (entry.type != type) continue;
+                if (!memopt_same_loc(entry, loc, ptr_ref)) continue;
+
+                ctx->replacements[inst_ref.id] = entry.value_ref;
+                ctx->removed[inst_ref.id] = true;
+                ctx->changed_count++;
+                forwarded = true;
+                break;
+            }
+            if (!forwarded) {
+                memopt_make_available(ctx, loc, ptr_ref, inst_ref);
+            }
+            break;
+        }
+        case SIRInstKind_Store: {
+            SIRInstRef ptr_ref = inst->store.ptr_ref;
+            SIRInstRef value_ref = inst->store.value_ref;
+            SIRType *type = module->insts[value_ref.id].type;
+            SIRMemLoc loc = SIRModuleGetMemLoc(
+                module, ptr_ref, SIRTypeSizeOf(module, type));
+
+            memopt_kill(ctx, loc);
+            memopt_make_available(ctx, loc, ptr_ref, value_ref);
+            break;
+        }
+        case SIRInstKind_FuncCall: memopt_kill_call_visible(ctx); break;
+        default: break;
+        }
+    }
+
+    ctx->out_offsets[block_index] = (uint32_t)ctx->outs.len;
+    ctx->out_lens[block_index] = (uint32_t)ctx->available.len;
+    ctx->outs.push_many(ctx->available.as_slice());
+}
+
+// Walks the block backwards, tracking the locations stores overwrite before
+// anything may read them
+static void memopt_remove_dead_stores(MemOptContext *ctx, SIRBlock *block)
+{
+    SIRModule *module = ctx->module;
+
+    uint32_t end = 0;
+    while (end < block->inst_refs.len) {
+        SIRInstKind kind = module->insts[block->inst_refs[end].id].kind;
+        if (SIRInstIsTerminator(kind)) break;
+        end++;
+    }
+
+    ctx->stored.len = 0;
+    for (uint32_t i = end; i-- > 0;) {
+        SIRInstRef inst_ref = block->inst_refs[i];
+        SIRInst inst = module->insts[inst_ref.id];
+
+        switch (inst.kind) {
+        case SIRInstKind_Load: {
+            SIRMemLoc loc = SIRModuleGetMemLoc(
+                module, inst.op1, SIRTypeSizeOf(module, inst.type));
+            uint32_t kept = 0;
+            for (uint32_t j = 0; j < ctx->stored.len; ++j) {
+                if (SIRMemLocMayAlias(ctx->stored[j], loc)) continue;
+                ctx->stored[kept++] = ctx->stored[j];
+            }
+            ctx->stored.len = kept;
+            break;
+        }
+        case SIRInstKind_Store: {
+            SIRType *type = module->insts[inst.store.value_ref.id].type;
+            SIRMemLoc loc = SIRModuleGetMemLoc(
+                module, inst.store.ptr_ref, SIRTypeSizeOf(module, type));
+
+            bool dead = loc.local && loc.base_kind == SIRMemBase_StackSlot &&
+                        ctx->slot_loads[loc.base.id] != ctx->func_index;
+            for (uint32_t j = 0; j < ctx->stored.len && !dead; ++j) {
+                dead = SIRMemLocContains(ctx->stored[j], loc);
+            }
+            if (dead) {
+                ctx->removed[inst_ref.id] = true;
+                ctx->changed_count++;
+                break;
+            }
+
+            if (ctx->stored.len < MEMOPT_MAX_AVAILABLE) {
+                ctx->stored.push_back(loc);
+            }
+            break;
+        }
+        case SIRInstKind_FuncCall: {
+            uint32_t kept = 0;
+            for (uint32_t j = 0; j < ctx->stored.len; ++j) {
+                if (SIRMemLocIsCallVisible(ctx->stored[j])) continue;
+                ctx->stored[kept++] = ctx->stored[j];
+            }
+            ctx->stored.len = kept;
+            break;
+        }
+        default: break;
+        }
+    }
+}
+
+static void memopt_rebuild_blocks(MemOptContext *ctx)
+{
+    SIRModule *module = ctx->module;
+    for (SIRInstRef block_ref : ctx->func->blocks) {
+        SIRBlock *block = module->insts[block_ref.id].block;
+
+        ctx->inst_refs.len = 0;
+        for (SIRInstRef inst_ref : block->inst_refs) {
+            if (ctx->removed[inst_ref.id]) continue;
+            ctx->inst_refs.push_back(inst_ref);
+
+            SIRInstRef *operands[2];
+            uint32_t operand_count =
+                SIRInstGetOperands(&module->insts[inst_ref.id], operands);
+            for (uint32_t i = 0; i < operand_count; ++i) {
+                *operands[i] = memopt_resolve(ctx, *operands[i]);
+            }
+        }
+
+        block->inst_refs.len = 0;
+        block->inst_refs.push_many(ctx->inst_refs.as_slice());
+    }
+}
+
+static void memopt_function(MemOptContext *ctx, SIRInstRef func_ref)
+{
+    ZoneScoped;
+
+    SIRModule *module = ctx->module;
+    ctx->func_ref = func_ref;
+    ctx->func = module->insts[func_ref.id].func;
+    if (ctx->func->blocks.len == 0) return;
+
+    ctx->func_index++;
+    ctx->analysis = SIRFunctionGetAnalysis(module, func_ref, SIRAnalysis_CFG);
+
+    size_t block_count = ctx->func->blocks.len;
+    ctx->out_offsets.resize(block_count);
+    ctx->out_lens.resize(block_count);
+    for (size_t i = 0; i < block_count; ++i) {
+        ctx->out_lens[i] = SIR_NO_INDEX;
+    }
+    ctx->outs.len = 0;
+
+    size_t changed_before = ctx->changed_count;
+    for (uint32_t block_index : ctx->analysis->rpo) {
+        memopt_forward_block(ctx, block_index);
+    }
+    if (ctx->changed_count != changed_before) memopt_rebuild_blocks(ctx);
+
+    // Loads left after forwarding are the only readers of local slots
+    for (SIRInstRef block_ref : ctx->func->blocks) {
+        SIRBlock *block = module->insts[block_ref.id].block;
+        for (SIRInstRef inst_ref : block->inst_refs) {
+            SIRInst inst = module->insts[inst_ref.id];
+            if (inst.kind != SIRInstKind_Load) continue;
+
+            SIRMemLoc loc = SIRModuleGetMemLoc(module, inst.op1, 0);
+            if (loc.base_kind == SIRMemBase_StackSlot) {
+                ctx->slot_loads[loc.base.id] = ctx->func_index;
+            }
+        }
+    }
+
+    changed_before = ctx->changed_count;
+    for (SIRInstRef block_ref : ctx->func->blocks) {
+        memopt_remove_dead_stores(ctx, module->insts[block_ref.id].block);
+    }
+    if (ctx->changed_count != changed_before) memopt_rebuild_blocks(ctx);
+}
+
+size_t SIRModuleOptimizeMemory(SIRModule *module)
+{
+    ZoneScoped;
+
+    MemOptContext ctx = {};
+    ctx.module = module;
+    ctx.replacements = SIRArray<SIRInstRef>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.removed = SIRArray<bool>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.slot_loads = SIRArray<uint32_t>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.out_offsets = SIRArray<uint32_t>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.out_lens = SIRArray<uint32_t>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.outs = SIRArray<MemOptAvailable>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.available =
+        SIRArray<MemOptAvailable>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.stored = SIRArray<SIRMemLoc>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.inst_refs = SIRArray<SIRInstRef>::create(&SIR_MALLOC_ALLOCATOR);
+
+    memopt_grow_maps(&ctx);
+
+    for (size_t i = 0; i < module->functions.len; ++i) {
+        memopt_function(&ctx, module->functions[i]);
+    }
+
+    if (ctx.changed_count > 0) {
+        SIRModuleInvalidateUses(module);
+    }
+
+    ctx.replacements.destroy();
+    ctx.removed.destroy();
+    ctx.slot_loads.destroy();
+    ctx.out_offsets.destroy();
+    ctx.out_lens.destroy();
+    ctx.outs.destroy();
+    ctx.available.destroy();
+    ctx.stored.destroy();
+    ctx.inst_refs.destroy();
+
+    return ctx.changed_count;
+}
@@ -12,6 +12,33 @@ void SIRObjectBuilderOutputToFile(
     obj_builder->output_to_file(obj_builder, (SIRString){path, path_len});
 }
 
+size_t SIRObjectBuilderGetSectionCount(SIRObjectBuilder *obj_builder)
+{
+    return obj_builder->get_section_count(obj_builder);
+}
+
+SIRObjectSectionInfo SIRObjectBuilderGetSectionInfo(
+    SIRObjectBuilder *obj_builder, size_t section_index)
+{
+    return obj_builder->get_section_info(obj_builder, section_index);
+}
+
+size_t SIRObjectBuilderGetRelocationCount(SIRObjectBuilder *obj_builder)
+{
+    return obj_builder->get_relocation_count(obj_builder);
+}
+
+void SIRAsmBuilderSetOmitFramePointer(
+    SIRAsmBuilder *asm_builder, bool omit_frame_pointer)
+{
+    asm_builder->omit_frame_pointer = omit_frame_pointer;
+}
+
+void SIRAsmBuilderSetOptLevel(SIRAsmBuilder *asm_builder, SIROptLevel level)
+{
+    asm_builder->opt_level = level;
+}
+
 void SIRAsmBuilderGenerate(SIRAsmBuilder *asm_builder)
 {
     asm_builder->generate(asm_builder);
@@ -21,3 +48,10 @@ void SIRAsmBuilderDestroy(SIRAsmBuilder *asm_builder)
 {
     asm_builder->destroy(asm_builder);
 }
+
+const SIRFunctionStats *
+SIRAsmBuilderGetFunctionStats(SIRAsmBuilder *asm_builder, size_t *stats_len)
+{
+    *stats_len = asm_builder->function_stats.len;
+    return asm_builder->function_stats.ptr;
+}
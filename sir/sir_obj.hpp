@@ -35,6 +35,9 @@ struct SIRObjectBuilder {
         const uint8_t *data,
         size_t len);
     size_t (*get_section_size)(SIRObjectBuilder *builder, SIRSectionType type);
+    // Drops the data past size, and the relocations pointing into it
+    void (*truncate_section)(
+        SIRObjectBuilder *builder, SIRSectionType type, size_t size);
 
     void (*add_data_relocation)(
         SIRObjectBuilder *builder,
@@ -62,10 +65,25 @@ struct SIRObjectBuilder {
         size_t size);
 
     bool (*output_to_file)(SIRObjectBuilder *builder, SIRString path);
+    size_t (*get_section_count)(SIRObjectBuilder *builder);
+    SIRObjectSectionInfo (*get_section_info)(
+        SIRObjectBuilder *builder, size_t section_index);
+    size_t (*get_relocation_count)(SIRObjectBuilder *builder);
     void (*destroy)(SIRObjectBuilder *builder);
 };
 
 struct SIRAsmBuilder {
     void (*generate)(SIRAsmBuilder *asm_builder);
     void (*destroy)(SIRAsmBuilder *asm_builder);
+
+    // Address the frame through RSP and allocate RBP like any other callee
+    // saved register
+    bool omit_frame_pointer;
+
+    // Calls are only turned into jumps above -O0, so that unoptimized code
+    // keeps every frame for the debugger
+    SIROptLevel opt_level;
+
+    // Filled in by generate, one entry per function in the module
+    SIRArray<SIRFunctionStats> function_stats;
 };
@@ -0,0 +1,177 @@
+#include "sir_base.hpp"
+#include "sir_ir.hpp"
+
+// Pass pipelines run by SIRModuleOptimize. Every pass transforms the whole
+// module and is responsible for invalidating the analyses it breaks.
+
+struct SIRPass {
+    const char *name;
+    void (*run)(SIRModule *module);
+};
+
+static void pass_sroa(SIRModule *module)
+{
+    SIRModuleSplitStackSlots(module);
+}
+
+static void pass_mem2reg(SIRModule *module)
+{
+    SIRModulePromoteStackSlots(module);
+}
+
+static void pass_tailcall(SIRModule *module)
+{
+    SIRModuleEliminateTailCalls(module);
+}
+
+static void pass_inline_always(SIRModule *module)
+{
+    SIRModuleInlineCalls(module, 0);
+}
+
+// Small enough that a call costs about as much as the body
+static void pass_inline(SIRModule *module)
+{
+    SIRModuleInlineCalls(module, 24);
+}
+
+static void pass_fold(SIRModule *module)
+{
+    SIRModuleFoldConstants(module);
+}
+
+static void pass_gvn(SIRModule *module)
+{
+    SIRModuleNumberValues(module);
+}
+
+static void pass_memopt(SIRModule *module)
+{
+    SIRModuleOptimizeMemory(module);
+}
+
+static void pass_licm(SIRModule *module)
+{
+    SIRModuleHoistLoopInvariants(module);
+}
+
+static void pass_ivsr(SIRModule *module)
+{
+    SIRModuleReduceStrength(module);
+}
+
+static void pass_simplifycfg(SIRModule *module)
+{
+    SIRModuleSimplifyCFG(module);
+}
+
+static void pass_dce(SIRModule *module)
+{
+    SIRModuleRemoveDeadCode(module);
+}
+
+static const SIRPass O1_PASSES[] = {
+    {"sroa", pass_sroa},
+    {"mem2reg", pass_mem2reg},
+    {"tailcall", pass_tailcall},
+    {"inline", pass_inline_always},
+    {"fold", pass_fold},
+    {"simplifycfg", pass_simplifycfg},
+    {"dce", pass_dce},
+};
+
+static const SIRPass O2_PASSES[] = {
+    {"sroa", pass_sroa},
+    {"mem2reg", pass_mem2reg},
+    {"tailcall", pass_tailcall},
+    {"inline", pass_inline},
+    {"fold", pass_fold},
+    {"gvn", pass_gvn},
+    {"memopt", pass_memopt},
+    {"licm", pass_licm},
+    {"ivsr", pass_ivsr},
+    {"simplifycfg", pass_simplifycfg},
+    {"dce", pass_dce},
+};
+
+static void count_block_insts(
+    SIRModule *module, size_t *block_count, size_t *inst_count)
+{
+    *block_count = 0;
+    *inst_count = 0;
+    for (SIRInstRef func_ref : module->functions) {
+        SIRFunction *func = module->insts[func_ref.id].func;
+        *block_count += func->blocks.len;
+        for (SIRInstRef block_ref : func->blocks) {
+            *inst_count += module->insts[block_ref.id].block->inst_refs.len;
+        }
+    }
+}
+
+static void run_pass(SIRModule *module, const SIRPass *pass)
+{
+    ZoneScoped;
+
+    size_t blocks_before, insts_before;
+    count_block_insts(module, &blocks_before, &insts_before);
+
+    double start_time = SIRGetTimeSeconds();
+    pass->run(module);
+    double time = SIRGetTimeSeconds() - start_time;
+
+    size_t blocks_after, insts_after;
+    count_block_insts(module, &blocks_after, &insts_after);
+
+    SIRPassStats stats = {};
+    stats.name = pass->name;
+    stats.time = time;
+    stats.insts_removed =
+        (insts_after < insts_before) ? insts_before - insts_after : 0;
+    stats.blocks_merged =
+        (blocks_after < blocks_before) ? blocks_before - blocks_after : 0;
+    module->pass_stats.push_back(stats);
+
+#if !NDEBUG
+    if (!SIRModuleVerify(module)) {
+        fprintf(stderr, "SIR verifier failed after pass: %s\n", pass->name);
+        abort();
+    }
+#endif
+}
+
+const SIRPassStats *
+SIRModuleOptimize(SIRModule *module, SIROptLevel level, size_t *stats_len)
+{
+    ZoneScoped;
+
+    const SIRPass *passes = nullptr;
+    size_t pass_count = 0;
+    switch (level) {
+    case SIROptLevel_O0: break;
+    case SIROptLevel_O1: {
+        passes = O1_PASSES;
+        pass_count = SIR_CARRAY_LENGTH(O1_PASSES);
+        break;
+    }
+    case SIROptLevel_O2: {
+        passes = O2_PASSES;
+        pass_count = SIR_CARRAY_LENGTH(O2_PASSES);
+        break;
+    }
+    }
+
+#if !NDEBUG
+    if (pass_count > 0 && !SIRModuleVerify(module)) {
+        fprintf(stderr, "SIR verifier failed before optimization\n");
+        abort();
+    }
+#endif
+
+    module->pass_stats.len = 0;
+    for (size_t i = 0; i < pass_count; ++i) {
+        run_pass(module, &passes[i]);
+    }
+
+    *stats_len = module->pass_stats.len;
+    return module->pass_stats.ptr;
+}
@@ -0,0 +1,389 @@
+#include "sir_base.hpp"
+#include "sir_ir.hpp"
+
+// Simplifies the control flow graph of every function until nothing changes:
+// - unreachable blocks are removed
+// - branches on constants or to a single target become jumps
+// - a block is merged into its predecessor when that is its only predecessor
+//   and the predecessor jumps only to it
+// - jumps to a block holding nothing but another jump go to its target
+// Each round works on one snapshot of the CFG, blocks touched by a change are
+// left alone until the next round.
+
+struct SimplifyCFGContext {
+    SIRModule *module;
+    SIRInstRef func_ref;
+    SIRFunction *func;
+
+    // Indexed by instruction id, shared by all functions of the module
+    SIRArray<SIRInstRef> replacements;
+
+    // Indexed by block index, reset every round
+    SIRArray<bool> touched;
+    SIRArray<bool> removed;
+
+    SIRArray<SIRInstRef> inst_refs;
+    size_t removed_count;
+};
+
+SIR_INLINE
+static SIRInstRef scfg_resolve(SimplifyCFGContext *ctx, SIRInstRef inst_ref)
+{
+    while (ctx->replacements[inst_ref.id].id) {
+        inst_ref = ctx->replacements[inst_ref.id];
+    }
+    return inst_ref;
+}
+
+SIR_INLINE
+static SIRBlock *scfg_get_block(SimplifyCFGContext *ctx, uint32_t block_index)
+{
+    return ctx->module->insts[ctx->func->blocks[block_index].id].block;
+}
+
+static void scfg_begin_round(SimplifyCFGContext *ctx)
+{
+    size_t block_count = ctx->func->blocks.len;
+    ctx->touched.resize(block_count);
+    ctx->removed.resize(block_count);
+    for (size_t i = 0; i < block_count; ++i) {
+        ctx->touched[i] = false;
+        ctx->removed[i] = false;
+    }
+
+    while (ctx->replacements.len < ctx->module->insts.len) {
+        ctx->replacements.push_back({0});
+    }
+}
+
+// Drops the removed blocks from the function and invalidates its CFG
+static void scfg_end_round(SimplifyCFGContext *ctx, bool changed)
+{
+    if (!changed) return;
+
+    size_t block_count = 0;
+    for (size_t i = 0; i < ctx->func->blocks.len; ++i) {
+        if (ctx->removed[i]) {
+            ctx->removed_count++;
+            continue;
+        }
+        ctx->func->blocks[block_count++] = ctx->func->blocks[i];
+    }
+    ctx->func->blocks.len = block_count;
+
+    SIRFunctionInvalidateAnalysis(ctx->module, ctx->func_ref, SIRAnalysis_CFG);
+}
+
+static void scfg_retarget(SIRInst *term, SIRInstRef from_ref, SIRInstRef to_ref)
+{
+    if (term->kind == SIRInstKind_Jump) {
+        if (term->op1.id == from_ref.id) term->op1 = to_ref;
+    } else if (term->kind == SIRInstKind_Branch) {
+        if (term->op1.id == from_ref.id) term->op1 = to_ref;
+        if (term->op2.id == from_ref.id) term->op2 = to_ref;
+    }
+}
+
+// Rewrites the incoming values a block has for from_ref. A null to_ref
+// removes them.
+static void scfg_rewrite_incoming(
+    SimplifyCFGContext *ctx,
+    SIRInstRef block_ref,
+    SIRInstRef from_ref,
+    SIRInstRef to_ref)
+{
+    SIRModule *module = ctx->module;
+    SIRBlock *block = module->insts[block_ref.id].block;
+
+    size_t inst_count = 0;
+    for (size_t i = 0; i < block->inst_refs.len; ++i) {
+        SIRInstRef inst_ref = block->inst_refs[i];
+        SIRInst *inst = &module->insts[inst_ref.id];
+        if (inst->kind == SIRInstKind_PhiIncoming &&
+            inst->phi_incoming.block_ref.id == from_ref.id) {
+            if (!to_ref.id) continue;
+            inst->phi_incoming.block_ref = to_ref;
+        }
+        block->inst_refs[inst_count++] = inst_ref;
+    }
+    block->inst_refs.len = inst_count;
+}
+
+SIR_INLINE
+static bool scfg_has_phis(SIRModule *module, SIRBlock *block)
+{
+    return block->inst_refs.len > 0 &&
+           module->insts[block->inst_refs[0].id].kind == SIRInstKind_Phi;
+}
+
+static bool
+scfg_remove_unreachable(SimplifyCFGContext *ctx, SIRFunctionAnalysis *analysis)
+{
+    bool changed = false;
+    for (uint32_t b = 1; b < ctx->func->blocks.len; ++b) {
+        if (SIRAnalysisIsReachable(analysis, b)) continue;
+
+        ctx->removed[b] = true;
+        changed = true;
+
+        for (uint32_t succ : SIRAnalysisGetSuccs(analysis, b)) {
+            if (!SIRAnalysisIsReachable(analysis, succ)) continue;
+            scfg_rewrite_incoming(
+                ctx, ctx->func->blocks[succ], ctx->func->blocks[b], {0});
+        }
+    }
+    return changed;
+}
+
+static bool scfg_simplify_branches(SimplifyCFGContext *ctx)
+{
+    SIRModule *module = ctx->module;
+
+    bool changed = false;
+    for (uint32_t b = 0; b < ctx->func->blocks.len; ++b) {
+        SIRInstRef block_ref = ctx->func->blocks[b];
+        SIRBlock *block = scfg_get_block(ctx, b);
+
+        SIRInstRef term_ref = SIRBlockGetTerminator(module, block_ref);
+        SIRInst *term = &module->insts[term_ref.id];
+        if (term->kind != SIRInstKind_Branch) continue;
+
+        // The set_cond is right before the branch
+        size_t term_pos = 0;
+        while (block->inst_refs[term_pos].id != term_ref.id) term_pos++;
+        SIR_ASSERT(term_pos > 0);
+        SIRInstRef set_cond_ref = block->inst_refs[term_pos - 1];
+        SIRInst cond = module->insts[module->insts[set_cond_ref.id].op1.id];
+
+        SIRInstRef target_ref = {0};
+        if (term->op1.id == term->op2.id) {
+            target_ref = term->op1;
+        } else if (cond.kind == SIRInstKind_ConstBool) {
+            target_ref = cond.const_bool.value ? term->op1 : term->op2;
+            SIRInstRef untaken_ref =
+                cond.const_bool.value ? term->op2 : term->op1;
+            scfg_rewrite_incoming(ctx, untaken_ref, block_ref, {0});
+        } else {
+            continue;
+        }
+
+        term->kind = SIRInstKind_Jump;
+        term->op1 = target_ref;
+        term->op2 = {0};
+
+        for (size_t i = term_pos - 1; i + 1 < block->inst_refs.len; ++i) {
+            block->inst_refs[i] = block->inst_refs[i + 1];
+        }
+        block->inst_refs.len--;
+
+        changed = true;
+    }
+    return changed;
+}
+
+static bool
+scfg_merge_blocks(SimplifyCFGContext *ctx, SIRFunctionAnalysis *analysis)
+{
+    SIRModule *module = ctx->module;
+
+    bool changed = false;
+    for (uint32_t b = 1; b < ctx->func->blocks.len; ++b) {
+        SIRSlice<uint32_t> preds = SIRAnalysisGetPreds(analysis, b);
+        if (ctx->touched[b] || preds.len != 1) continue;
+
+        uint32_t p = preds[0];
+        if (p == b || ctx->touched[p] ||
+            SIRAnalysisGetSuccs(analysis, p).len != 1) {
+            continue;
+        }
+
+        SIRInstRef block_ref = ctx->func->blocks[b];
+        SIRInstRef pred_ref = ctx->func->blocks[p];
+        SIRBlock *block = scfg_get_block(ctx, b);
+        SIRBlock *pred = scfg_get_block(ctx, p);
+
+        SIRInstRef term_ref = SIRBlockGetTerminator(module, pred_ref);
+        if (module->insts[term_ref.id].kind != SIRInstKind_Jump) continue;
+
+        size_t term_pos = 0;
+        while (pred->inst_refs[term_pos].id != term_ref.id) term_pos++;
+        pred->inst_refs.len = term_pos;
+
+        // With a single predecessor every phi has one incoming value
+        SIRInstRef phi_ref = {0};
+        for (SIRInstRef inst_ref : block->inst_refs) {
+            SIRInst inst = module->insts[inst_ref.id];
+            if (inst.kind == SIRInstKind_Phi) {
+                phi_ref = inst_ref;
+            } else if (inst.kind == SIRInstKind_PhiIncoming) {
+                ctx->replacements[phi_ref.id] = inst.phi_incoming.value_ref;
+            } else {
+                pred->inst_refs.push_back(inst_ref);
+            }
+        }
+        block->inst_refs.len = 0;
+
+        for (uint32_t succ : SIRAnalysisGetSuccs(analysis, b)) {
+            scfg_rewrite_incoming(
+                ctx, ctx->func->blocks[succ], block_ref, pred_ref);
+        }
+
+        ctx->touched[b] = true;
+        ctx->touched[p] = true;
+        ctx->removed[b] = true;
+        changed = true;
+    }
+    return changed;
+}
+
+static bool
+scfg_thread_jumps(SimplifyCFGContext *ctx, SIRFunctionAnalysis *analysis)
+{
+    SIRModule *module = ctx->module;
+
+    bool changed = false;
+    for (uint32_t b = 1; b < ctx->func->blocks.len; ++b) {
+        SIRBlock *block = scfg_get_block(ctx, b);
+        if (ctx->touched[b] || block->inst_refs.len != 1) continue;
+
+        SIRInst jump = module->insts[block->inst_refs[0].id];
+        if (jump.kind != SIRInstKind_Jump) continue;
+
+        SIRInstRef block_ref = ctx->func->blocks[b];
+        SIRInstRef target_ref = jump.op1;
+        uint32_t target = module->insts[target_ref.id].block->index;
+        if (target == b || ctx->touched[target]) continue;
+
+        // A predecessor that already reaches the target would need two
+        // different incoming values in its phis
+        SIRBlock *target_block = module->insts[target_ref.id].block;
+        bool has_phis = scfg_has_phis(module, target_block);
+
+        SIRSlice<uint32_t> preds = SIRAnalysisGetPreds(analysis, b);
+        bool can_thread = preds.len > 0;
+        for (uint32_t p : preds) {
+            if (p == b || ctx->touched[p]) can_thread = false;
+            if (!has_phis) continue;
+            for (uint32_t target_pred : SIRAnalysisGetPreds(analysis, target)) {
+                if (target_pred == p) can_thread = false;
+            }
+        }
+        if (!can_thread) continue;
+
+        for (uint32_t p : preds) {
+            SIRInstRef pred_ref = ctx->func->blocks[p];
+            SIRInstRef term_ref = SIRBlockGetTerminator(module, pred_ref);
+            scfg_retarget(&module->insts[term_ref.id], block_ref, target_ref);
+            ctx->touched[p] = true;
+        }
+
+        // Every predecessor takes over the incoming values of the block
+        if (has_phis) {
+            ctx->inst_refs.len = 0;
+            for (SIRInstRef inst_ref : target_block->inst_refs) {
+                SIRInst inst = module->insts[inst_ref.id];
+                if (inst.kind != SIRInstKind_PhiIncoming ||
+                    inst.phi_incoming.block_ref.id != block_ref.id) {
+                    ctx->inst_refs.push_back(inst_ref);
+                    continue;
+                }
+
+                for (uint32_t p : preds) {
+                    SIRInst incoming = inst;
+                    incoming.phi_incoming.block_ref = ctx->func->blocks[p];
+                    ctx->inst_refs.push_back(
+                        SIRModuleAddInst(module, incoming));
+                }
+            }
+            target_block->inst_refs.len = 0;
+            target_block->inst_refs.push_many(ctx->inst_refs.as_slice());
+        }
+
+        ctx->touched[b] = true;
+        ctx->touched[target] = true;
+        ctx->removed[b] = true;
+        changed = true;
+    }
+    return changed;
+}
+
+static void scfg_function(SimplifyCFGContext *ctx, SIRInstRef func_ref)
+{
+    ZoneScoped;
+
+    SIRModule *module = ctx->module;
+    SIRFunction *func = module->insts[func_ref.id].func;
+    if (func->blocks.len == 0) return;
+
+    ctx->func_ref = func_ref;
+    ctx->func = func;
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+
+        SIRFunctionAnalysis *analysis;
+        bool round_changed;
+
+        scfg_begin_round(ctx);
+        analysis = SIRFunctionGetAnalysis(module, func_ref, SIRAnalysis_CFG);
+        round_changed = scfg_remove_unreachable(ctx, analysis);
+        scfg_end_round(ctx, round_changed);
+        changed |= round_changed;
+
+        scfg_begin_round(ctx);
+        round_changed = scfg_simplify_branches(ctx);
+        scfg_end_round(ctx, round_changed);
+        changed |= round_changed;
+
+        scfg_begin_round(ctx);
+        analysis = SIRFunctionGetAnalysis(module, func_ref, SIRAnalysis_CFG);
+        round_changed = scfg_merge_blocks(ctx, analysis);
+        scfg_end_round(ctx, round_changed);
+        changed |= round_changed;
+
+        scfg_begin_round(ctx);
+        analysis = SIRFunctionGetAnalysis(module, func_ref, SIRAnalysis_CFG);
+        round_changed = scfg_thread_jumps(ctx, analysis);
+        scfg_end_round(ctx, round_changed);
+        changed |= round_changed;
+    }
+
+    // Uses of the phis removed by merging
+    for (SIRInstRef block_ref : func->blocks) {
+        SIRBlock *block = module->insts[block_ref.id].block;
+        for (SIRInstRef inst_ref : block->inst_refs) {
+            SIRInstRef *operands[2];
+            uint32_t operand_count =
+                SIRInstGetOperands(&module->insts[inst_ref.id], operands);
+            for (uint32_t i = 0; i < operand_count; ++i) {
+                *operands[i] = scfg_resolve(ctx, *operands[i]);
+            }
+        }
+    }
+}
+
+size_t SIRModuleSimplifyCFG(SIRModule *module)
+{
+    ZoneScoped;
+
+    SimplifyCFGContext ctx = {};
+    ctx.module = module;
+    ctx.replacements = SIRArray<SIRInstRef>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.touched = SIRArray<bool>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.removed = SIRArray<bool>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.inst_refs = SIRArray<SIRInstRef>::create(&SIR_MALLOC_ALLOCATOR);
+
+    for (size_t i = 0; i < module->functions.len; ++i) {
+        scfg_function(&ctx, module->functions[i]);
+    }
+
+    SIRModuleInvalidateUses(module);
+
+    ctx.replacements.destroy();
+    ctx.touched.destroy();
+    ctx.removed.destroy();
+    ctx.inst_refs.destroy();
+
+    return ctx.removed_count;
+}
@@ -0,0 +1,510 @@
+#include "sir_base.hpp"
+#include "sir_ir.hpp"
+
+// Scalar replacement of aggregates. A struct or small array stack slot whose
+// address never escapes is split into one stack slot per field, so mem2reg
+// can promote the fields that are scalars. Field pointers are replaced by the
+// new slots, extracts from a loaded aggregate become loads of the field
+// slots, and aggregate copies in and out of the slot become per-field
+// copies. Fields that are aggregates themselves are split in turn.
+
+static const uint32_t SROA_NONE = UINT32_MAX;
+
+// Arrays are only split when indexed by constants, which long ones rarely are
+static const uint64_t SROA_MAX_ARRAY_LEN = 8;
+
+struct SROAUse {
+    SIRInstRef user_ref;
+    uint32_t next;
+};
+
+struct SROAInsert {
+    SIRInstRef inst_ref;
+    uint32_t next;
+};
+
+struct SROAContext {
+    SIRModule *module;
+    SIRInstRef func_ref;
+    SIRFunction *func;
+
+    // Indexed by instruction id, shared by all functions of the module
+    SIRArray<uint32_t> first_uses; // Into uses, valid for the current scan
+    SIRArray<uint32_t> use_scans;
+    SIRArray<uint32_t> inst_blocks;
+    SIRArray<uint32_t> inst_positions;
+    SIRArray<bool> removed;
+    SIRArray<uint32_t> insert_heads; // Into inserts, placed before the inst
+    SIRArray<uint32_t> insert_tails;
+
+    SIRArray<SROAUse> uses;
+    SIRArray<SROAInsert> inserts;
+    SIRArray<SIRInstRef> field_slots;
+    SIRArray<SIRInstRef> field_values;
+    SIRArray<SIRInstRef> inst_refs;
+    uint32_t scan;
+    size_t split_count;
+};
+
+static void sroa_grow_maps(SROAContext *ctx)
+{
+    size_t inst_count = ctx->module->insts.len;
+    while (ctx->removed.len < inst_count) {
+        ctx->first_uses.push_back(SROA_NONE);
+        ctx->use_scans.push_back(0);
+        ctx->inst_blocks.push_back(SROA_NONE);
+        ctx->inst_positions.push_back(0);
+        ctx->removed.push_back(false);
+        ctx->insert_heads.push_back(SROA_NONE);
+        ctx->insert_tails.push_back(SROA_NONE);
+    }
+}
+
+SIR_INLINE
+static uint32_t sroa_first_use(SROAContext *ctx, SIRInstRef inst_ref)
+{
+    if (ctx->use_scans[inst_ref.id] != ctx->scan) return SROA_NONE;
+    return ctx->first_uses[inst_ref.id];
+}
+
+// Builds the use lists and instruction positions of the current function
+static void sroa_scan(SROAContext *ctx)
+{
+    ZoneScoped;
+
+    SIRModule *module = ctx->module;
+
+    ctx->scan++;
+    ctx->uses.len = 0;
+
+    for (uint32_t b = 0; b < ctx->func->blocks.len; ++b) {
+        SIRBlock *block = module->insts[ctx->func->blocks[b].id].block;
+        for (uint32_t i = 0; i < block->inst_refs.len; ++i) {
+            SIRInstRef inst_ref = block->inst_refs[i];
+            ctx->inst_blocks[inst_ref.id] = b;
+            ctx->inst_positions[inst_ref.id] = i;
+
+            SIRInstRef *operands[2];
+            uint32_t operand_count =
+                SIRInstGetOperands(&module->insts[inst_ref.id], operands);
+            for (uint32_t j = 0; j < operand_count; ++j) {
+                uint32_t id = operands[j]->id;
+                SROAUse use = {inst_ref, sroa_first_use(ctx, {id})};
+                ctx->use_scans[id] = ctx->scan;
+                ctx->first_uses[id] = (uint32_t)ctx->uses.len;
+                ctx->uses.push_back(use);
+            }
+        }
+    }
+}
+
+SIR_INLINE
+static uint32_t sroa_field_count(SIRType *type)
+{
+    switch (type->kind) {
+    case SIRTypeKind_Struct: return type->struct_.fields_len;
+    case SIRTypeKind_Array: {
+        if (type->array.count > SROA_MAX_ARRAY_LEN) return 0;
+        return (uint32_t)type->array.count;
+    }
+    default: return 0;
+    }
+}
+
+SIR_INLINE
+static SIRType *sroa_field_type(SIRType *type, uint32_t field_index)
+{
+    if (type->kind == SIRTypeKind_Struct) {
+        return type->struct_.fields[field_index];
+    }
+    return type->array.sub;
+}
+
+// Returns the constant field index of an element access, or SROA_NONE
+SIR_INLINE
+static uint32_t
+sroa_field_index(SROAContext *ctx, SIRInstRef index_ref, uint32_t field_count)
+{
+    SIRInst index = ctx->module->insts[index_ref.id];
+    if (index.kind != SIRInstKind_ConstInt) return SROA_NONE;
+    if (index.const_int.u64 >= field_count) return SROA_NONE;
+    return (uint32_t)index.const_int.u64;
+}
+
+// Whether the aggregate loaded by load_ref is stored unchanged by store_ref,
+// so the copy can be done field by field at the store
+static bool
+sroa_is_copy(SROAContext *ctx, SIRInstRef load_ref, SIRInstRef store_ref)
+{
+    SIRModule *module = ctx->module;
+
+    SIRInst store = module->insts[store_ref.id];
+    if (store.kind != SIRInstKind_Store) return false;
+    if (store.store.value_ref.id != load_ref.id) return false;
+
+    uint32_t block_index = ctx->inst_blocks[load_ref.id];
+    if (ctx->inst_blocks[store_ref.id] != block_index) return false;
+
+    SIRBlock *block = module->insts[ctx->func->blocks[block_index].id].block;
+    for (uint32_t i = ctx->inst_positions[load_ref.id] + 1;
+         i < ctx->inst_positions[store_ref.id];
+         ++i) {
+        SIRInstKind kind = module->insts[block->inst_refs[i].id].kind;
+        if (kind == SIRInstKind_Store || kind == SIRInstKind_FuncCall) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool sroa_can_split(SROAContext *ctx, SIRInstRef slot_ref)
+{
+    SIRModule *module = ctx->module;
+    SIRType *type = module->insts[slot_ref.id].type->pointer.sub;
+    uint32_t field_count = sroa_field_count(type);
+    if (field_count == 0) return false;
+
+    for (uint32_t u = sroa_first_use(ctx, slot_ref); u != SROA_NONE;
+         u = ctx->uses[u].next) {
+        SIRInstRef user_ref = ctx->uses[u].user_ref;
+        SIRInst user = module->insts[user_ref.id];
+
+        switch (user.kind) {
+        case SIRInstKind_ArrayElemPtr:
+        case SIRInstKind_StructElemPtr: {
+            if (sroa_field_index(ctx, user.op2, field_count) == SROA_NONE) {
+                return false;
+            }
+
+            // The field pointer must not escape either
+            for (uint32_t v = sroa_first_use(ctx, user_ref); v != SROA_NONE;
+                 v = ctx->uses[v].next) {
+                SIRInst field_user = module->insts[ctx->uses[v].user_ref.id];
+                switch (field_user.kind) {
+                case SIRInstKind_Load: break;
+                case SIRInstKind_Store: {
+                    if (field_user.store.value_ref.id == user_ref.id) {
+                        return false;
+                    }
+                    break;
+                }
+                case SIRInstKind_ArrayElemPtr:
+                case SIRInstKind_StructElemPtr: {
+                    if (field_user.op2.id == user_ref.id) return false;
+                    break;
+                }
+                default: return false;
+                }
+            }
+            break;
+        }
+        case SIRInstKind_Load: {
+            for (uint32_t v = sroa_first_use(ctx, user_ref); v != SROA_NONE;
+                 v = ctx->uses[v].next) {
+                SIRInstRef value_user_ref = ctx->uses[v].user_ref;
+                SIRInst value_user = module->insts[value_user_ref.id];
+                switch (value_user.kind) {
+                case SIRInstKind_ExtractArrayElem:
+                case SIRInstKind_ExtractStructElem: {
+                    if (sroa_field_index(ctx, value_user.op2, field_count) ==
+                        SROA_NONE) {
+                        return false;
+                    }
+                    break;
+                }
+                default: {
+                    if (!sroa_is_copy(ctx, user_ref, value_user_ref)) {
+                        return false;
+                    }
+                    break;
+                }
+                }
+            }
+            break;
+        }
+        case SIRInstKind_Store: {
+            if (user.store.value_ref.id == slot_ref.id) return false;
+            SIRInstRef value_ref = user.store.value_ref;
+            if (module->insts[value_ref.id].kind != SIRInstKind_Load ||
+                !sroa_is_copy(ctx, value_ref, user_ref)) {
+                return false;
+            }
+            break;
+        }
+        default: return false;
+        }
+    }
+
+    return true;
+}
+
+static SIRInstRef
+sroa_insert(SROAContext *ctx, SIRInstRef anchor_ref, const SIRInst &inst)
+{
+    SIRInstRef inst_ref = SIRModuleAddInst(ctx->module, inst);
+    sroa_grow_maps(ctx);
+
+    uint32_t insert_index = (uint32_t)ctx->inserts.len;
+    ctx->inserts.push_back({inst_ref, SROA_NONE});
+    if (ctx->insert_heads[anchor_ref.id] == SROA_NONE) {
+        ctx->insert_heads[anchor_ref.id] = insert_index;
+    } else {
+        ctx->inserts[ctx->insert_tails[anchor_ref.id]].next = insert_index;
+    }
+    ctx->insert_tails[anchor_ref.id] = insert_index;
+
+    return inst_ref;
+}
+
+static void
+sroa_replace_uses(SROAContext *ctx, SIRInstRef old_ref, SIRInstRef new_ref)
+{
+    for (uint32_t u = sroa_first_use(ctx, old_ref); u != SROA_NONE;
+         u = ctx->uses[u].next) {
+        SIRInstRef *operands[2];
+        uint32_t operand_count = SIRInstGetOperands(
+            &ctx->module->insts[ctx->uses[u].user_ref.id], operands);
+        for (uint32_t i = 0; i < operand_count; ++i) {
+            if (operands[i]->id == old_ref.id) *operands[i] = new_ref;
+        }
+    }
+}
+
+// Pointer to a field of an aggregate, the split slot itself maps straight to
+// its field slots
+static SIRInstRef sroa_field_ptr(
+    SROAContext *ctx,
+    SIRInstRef anchor_ref,
+    SIRInstRef slot_ref,
+    SIRInstRef ptr_ref,
+    SIRType *type,
+    uint32_t field_index)
+{
+    if (ptr_ref.id == slot_ref.id) return ctx->field_slots[field_index];
+
+    SIRModule *module = ctx->module;
+    SIRInst inst = {};
+    inst.type =
+        SIRModuleCreatePointerType(module, sroa_field_type(type, field_index));
+    if (type->kind == SIRTypeKind_Struct) {
+        inst.kind = SIRInstKind_StructElemPtr;
+        inst.struct_elem_ptr.accessed_ref = ptr_ref;
+        inst.struct_elem_ptr.field_index_ref =
+            SIRModuleAddConstInt(module, module->u32_type, field_index);
+    } else {
+        inst.kind = SIRInstKind_ArrayElemPtr;
+        inst.array_elem_ptr.accessed_ref = ptr_ref;
+        inst.array_elem_ptr.index_ref =
+            SIRModuleAddConstInt(module, module->u32_type, field_index);
+    }
+    return sroa_insert(ctx, anchor_ref, inst);
+}
+
+// Replaces the aggregate copy done by store_ref with one copy per field
+static void sroa_copy_fields(
+    SROAContext *ctx,
+    SIRInstRef store_ref,
+    SIRInstRef slot_ref,
+    SIRInstRef src_ref,
+    SIRInstRef dst_ref,
+    SIRType *type)
+{
+    uint32_t field_count = sroa_field_count(type);
+    for (uint32_t i = 0; i < field_count; ++i) {
+        SIRInst load = {};
+        load.kind = SIRInstKind_Load;
+        load.type = sroa_field_type(type, i);
+        load.load.ptr_ref =
+            sroa_field_ptr(ctx, store_ref, slot_ref, src_ref, type, i);
+        SIRInstRef value_ref = sroa_insert(ctx, store_ref, load);
+
+        SIRInst store = {};
+        store.kind = SIRInstKind_Store;
+        store.store.ptr_ref =
+            sroa_field_ptr(ctx, store_ref, slot_ref, dst_ref, type, i);
+        store.store.value_ref = value_ref;
+        sroa_insert(ctx, store_ref, store);
+    }
+    ctx->removed[store_ref.id] = true;
+}
+
+static void sroa_split(SROAContext *ctx, SIRInstRef slot_ref)
+{
+    ZoneScoped;
+
+    SIRModule *module = ctx->module;
+    SIRFunction *func = ctx->func;
+    SIRType *type = module->insts[slot_ref.id].type->pointer.sub;
+    uint32_t field_count = sroa_field_count(type);
+
+    ctx->field_slots.len = 0;
+    for (uint32_t i = 0; i < field_count; ++i) {
+        ctx->field_slots.push_back(SIRModuleAddStackSlot(
+            module, ctx->func_ref, sroa_field_type(type, i)));
+    }
+    sroa_grow_maps(ctx);
+
+    size_t slot_count = 0;
+    for (SIRInstRef other_ref : func->stack_slots) {
+        if (other_ref.id == slot_ref.id) continue;
+        func->stack_slots[slot_count++] = other_ref;
+    }
+    func->stack_slots.len = slot_count;
+
+    for (uint32_t u = sroa_first_use(ctx, slot_ref); u != SROA_NONE;
+         u = ctx->uses[u].next) {
+        SIRInstRef user_ref = ctx->uses[u].user_ref;
+        if (ctx->removed[user_ref.id]) continue;
+        SIRInst user = module->insts[user_ref.id];
+
+        switch (user.kind) {
+        case SIRInstKind_ArrayElemPtr:
+        case SIRInstKind_StructElemPtr: {
+            uint32_t field_index =
+                sroa_field_index(ctx, user.op2, field_count);
+            sroa_replace_uses(ctx, user_ref, ctx->field_slots[field_index]);
+            ctx->removed[user_ref.id] = true;
+            break;
+        }
+        case SIRInstKind_Load: {
+            ctx->field_values.len = 0;
+            for (uint32_t i = 0; i < field_count; ++i) {
+                ctx->field_values.push_back({0});
+            }
+
+            for (uint32_t v = sroa_first_use(ctx, user_ref); v != SROA_NONE;
+                 v = ctx->uses[v].next) {
+                SIRInstRef value_user_ref = ctx->uses[v].user_ref;
+                if (ctx->removed[value_user_ref.id]) continue;
+                SIRInst value_user = module->insts[value_user_ref.id];
+
+                if (value_user.kind == SIRInstKind_Store) {
+                    sroa_copy_fields(
+                        ctx,
+                        value_user_ref,
+                        slot_ref,
+                        slot_ref,
+                        value_user.store.ptr_ref,
+                        type);
+                    continue;
+                }
+
+                uint32_t field_index =
+                    sroa_field_index(ctx, value_user.op2, field_count);
+                if (!ctx->field_values[field_index].id) {
+                    SIRInst load = {};
+                    load.kind = SIRInstKind_Load;
+                    load.type = sroa_field_type(type, field_index);
+                    load.load.ptr_ref = ctx->field_slots[field_index];
+                    ctx->field_values[field_index] =
+                        sroa_insert(ctx, user_ref, load);
+                }
+                sroa_replace_uses(
+                    ctx, value_user_ref, ctx->field_values[field_index]);
+                ctx->removed[value_user_ref.id] = true;
+            }
+
+            ctx->removed[user_ref.id] = true;
+            break;
+        }
+        case SIRInstKind_Store: {
+            SIRInstRef src_ref = module->insts[user.store.value_ref.id].op1;
+            sroa_copy_fields(ctx, user_ref, slot_ref, src_ref, slot_ref, type);
+            break;
+        }
+        default: SIR_ASSERT(0); break;
+        }
+    }
+
+    // Rebuild the blocks with the new instructions in place
+    for (SIRInstRef block_ref : func->blocks) {
+        SIRBlock *block = module->insts[block_ref.id].block;
+
+        ctx->inst_refs.len = 0;
+        for (SIRInstRef inst_ref : block->inst_refs) {
+            for (uint32_t i = ctx->insert_heads[inst_ref.id]; i != SROA_NONE;
+                 i = ctx->inserts[i].next) {
+                ctx->inst_refs.push_back(ctx->inserts[i].inst_ref);
+            }
+            ctx->insert_heads[inst_ref.id] = SROA_NONE;
+
+            if (!ctx->removed[inst_ref.id]) ctx->inst_refs.push_back(inst_ref);
+        }
+
+        block->inst_refs.len = 0;
+        block->inst_refs.push_many(ctx->inst_refs.as_slice());
+    }
+    ctx->inserts.len = 0;
+
+    ctx->split_count++;
+}
+
+static void sroa_function(SROAContext *ctx, SIRInstRef func_ref)
+{
+    ZoneScoped;
+
+    SIRModule *module = ctx->module;
+    ctx->func_ref = func_ref;
+    ctx->func = module->insts[func_ref.id].func;
+    if (ctx->func->blocks.len == 0) return;
+
+    // Splitting changes the uses of other slots, so start over after each
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        sroa_scan(ctx);
+
+        for (SIRInstRef slot_ref : ctx->func->stack_slots) {
+            if (sroa_can_split(ctx, slot_ref)) {
+                sroa_split(ctx, slot_ref);
+                changed = true;
+                break;
+            }
+        }
+    }
+}
+
+size_t SIRModuleSplitStackSlots(SIRModule *module)
+{
+    ZoneScoped;
+
+    SROAContext ctx = {};
+    ctx.module = module;
+    ctx.first_uses = SIRArray<uint32_t>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.use_scans = SIRArray<uint32_t>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.inst_blocks = SIRArray<uint32_t>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.inst_positions = SIRArray<uint32_t>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.removed = SIRArray<bool>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.insert_heads = SIRArray<uint32_t>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.insert_tails = SIRArray<uint32_t>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.uses = SIRArray<SROAUse>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.inserts = SIRArray<SROAInsert>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.field_slots = SIRArray<SIRInstRef>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.field_values = SIRArray<SIRInstRef>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.inst_refs = SIRArray<SIRInstRef>::create(&SIR_MALLOC_ALLOCATOR);
+
+    sroa_grow_maps(&ctx);
+
+    for (size_t i = 0; i < module->functions.len; ++i) {
+        sroa_function(&ctx, module->functions[i]);
+    }
+
+    if (ctx.split_count > 0) {
+        SIRModuleInvalidateUses(module);
+    }
+
+    ctx.first_uses.destroy();
+    ctx.use_scans.destroy();
+    ctx.inst_blocks.destroy();
+    ctx.inst_positions.destroy();
+    ctx.removed.destroy();
+    ctx.insert_heads.destroy();
+    ctx.insert_tails.destroy();
+    ctx.uses.destroy();
+    ctx.inserts.destroy();
+    ctx.field_slots.destroy();
+    ctx.field_values.destroy();
+    ctx.inst_refs.destroy();
+
+    return ctx.split_count;
+}
@@ -0,0 +1,233 @@
+#include "sir_base.hpp"
+#include "sir_ir.hpp"
+
+// Turns calls of a function to itself in tail position into loops. A new
+// entry block is placed in front of the old one, which becomes the loop
+// header: every parameter is replaced by a phi merging the incoming argument
+// with the arguments pushed by each tail call, and each tail call and its
+// return are replaced by a jump back to the header.
+
+struct TailCallContext {
+    SIRModule *module;
+
+    // Indexed by instruction id
+    SIRArray<SIRInstRef> param_phis; // Parameters to the phis replacing them
+
+    SIRArray<SIRInstRef> call_blocks;
+    SIRArray<uint32_t> call_positions;
+    SIRArray<SIRInstRef> preds;
+    SIRArray<SIRInstRef> inst_refs;
+    size_t converted_count;
+};
+
+static SIRInstRef tail_add_inst(TailCallContext *ctx, const SIRInst &inst)
+{
+    SIRInstRef inst_ref = SIRModuleAddInst(ctx->module, inst);
+    while (ctx->param_phis.len < ctx->module->insts.len) {
+        ctx->param_phis.push_back({0});
+    }
+    return inst_ref;
+}
+
+// Aggregates are passed through memory, so only scalar parameters become
+// phis
+SIR_INLINE
+static bool tail_is_scalar(SIRType *type)
+{
+    switch (type->kind) {
+    case SIRTypeKind_Int:
+    case SIRTypeKind_Float:
+    case SIRTypeKind_Bool:
+    case SIRTypeKind_Pointer: return true;
+    default: return false;
+    }
+}
+
+static bool tail_is_self_call(
+    TailCallContext *ctx,
+    SIRInstRef func_ref,
+    SIRInstRef block_ref,
+    uint32_t call_pos)
+{
+    SIRModule *module = ctx->module;
+    SIRFunction *func = module->insts[func_ref.id].func;
+    SIRBlock *block = module->insts[block_ref.id].block;
+
+    SIRInst call = module->insts[block->inst_refs[call_pos].id];
+    if (call.kind != SIRInstKind_FuncCall || call.op1.id != func_ref.id) {
+        return false;
+    }
+    if (!SIRFunctionIsTailCall(module, func_ref, block_ref, call_pos)) {
+        return false;
+    }
+
+    // The arguments are pushed right before the call
+    if (call_pos < func->param_types_len) return false;
+    for (size_t i = call_pos - func->param_types_len; i < call_pos; ++i) {
+        if (module->insts[block->inst_refs[i].id].kind !=
+            SIRInstKind_PushFunctionParameter) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void tail_function(TailCallContext *ctx, SIRInstRef func_ref)
+{
+    ZoneScoped;
+
+    SIRModule *module = ctx->module;
+    SIRFunction *func = module->insts[func_ref.id].func;
+    if (func->blocks.len == 0 || func->variadic) return;
+    for (size_t i = 0; i < func->param_types_len; ++i) {
+        if (!tail_is_scalar(func->param_types[i])) return;
+    }
+
+    SIRInstRef header_ref = func->blocks[0];
+    SIRBlock *header = module->insts[header_ref.id].block;
+    if (header->inst_refs.len > 0 &&
+        module->insts[header->inst_refs[0].id].kind == SIRInstKind_Phi) {
+        return;
+    }
+
+    ctx->call_blocks.len = 0;
+    ctx->call_positions.len = 0;
+    for (SIRInstRef block_ref : func->blocks) {
+        SIRBlock *block = module->insts[block_ref.id].block;
+        for (uint32_t i = 0; i < block->inst_refs.len; ++i) {
+            if (tail_is_self_call(ctx, func_ref, block_ref, i)) {
+                ctx->call_blocks.push_back(block_ref);
+                ctx->call_positions.push_back(i);
+                break;
+            }
+        }
+    }
+    if (ctx->call_blocks.len == 0) return;
+
+    // Blocks already jumping back to the entry block keep the parameters
+    SIRFunctionAnalysis *analysis =
+        SIRFunctionGetAnalysis(module, func_ref, SIRAnalysis_CFG);
+    ctx->preds.len = 0;
+    for (uint32_t pred : SIRAnalysisGetPreds(analysis, 0)) {
+        ctx->preds.push_back(func->blocks[pred]);
+    }
+
+    SIRInstRef entry_ref = SIRModuleInsertBlockAtEnd(module, func_ref);
+    for (size_t i = func->blocks.len - 1; i > 0; --i) {
+        func->blocks[i] = func->blocks[i - 1];
+    }
+    func->blocks[0] = entry_ref;
+    for (uint32_t b = 0; b < func->blocks.len; ++b) {
+        module->insts[func->blocks[b].id].block->index = b;
+    }
+
+    SIRInst jump = {};
+    jump.kind = SIRInstKind_Jump;
+    jump.op1 = header_ref;
+    SIRInstRef jump_ref = tail_add_inst(ctx, jump);
+    module->insts[entry_ref.id].block->inst_refs.push_back(jump_ref);
+
+    for (SIRInstRef param_ref : func->param_insts) {
+        SIRInst phi = {};
+        phi.kind = SIRInstKind_Phi;
+        phi.type = module->insts[param_ref.id].type;
+        ctx->param_phis[param_ref.id] = tail_add_inst(ctx, phi);
+    }
+
+    for (SIRInstRef block_ref : func->blocks) {
+        SIRBlock *block = module->insts[block_ref.id].block;
+        for (SIRInstRef inst_ref : block->inst_refs) {
+            SIRInstRef *operands[2];
+            uint32_t operand_count =
+                SIRInstGetOperands(&module->insts[inst_ref.id], operands);
+            for (uint32_t j = 0; j < operand_count; ++j) {
+                SIRInstRef phi_ref = ctx->param_phis[operands[j]->id];
+                if (phi_ref.id) *operands[j] = phi_ref;
+            }
+        }
+    }
+
+    // Incoming values of each phi: the parameter, itself from the blocks
+    // that already looped back and the arguments of every tail call
+    ctx->inst_refs.len = 0;
+    for (size_t p = 0; p < func->param_insts.len; ++p) {
+        SIRInstRef param_ref = func->param_insts[p];
+        SIRInstRef phi_ref = ctx->param_phis[param_ref.id];
+        ctx->inst_refs.push_back(phi_ref);
+
+        SIRInst incoming = {};
+        incoming.kind = SIRInstKind_PhiIncoming;
+        incoming.phi_incoming.block_ref = entry_ref;
+        incoming.phi_incoming.value_ref = param_ref;
+        ctx->inst_refs.push_back(tail_add_inst(ctx, incoming));
+
+        for (SIRInstRef pred_ref : ctx->preds) {
+            incoming.phi_incoming.block_ref = pred_ref;
+            incoming.phi_incoming.value_ref = phi_ref;
+            ctx->inst_refs.push_back(tail_add_inst(ctx, incoming));
+        }
+
+        for (size_t i = 0; i < ctx->call_blocks.len; ++i) {
+            SIRBlock *block = module->insts[ctx->call_blocks[i].id].block;
+            size_t push_pos =
+                ctx->call_positions[i] - func->param_types_len + p;
+            incoming.phi_incoming.block_ref = ctx->call_blocks[i];
+            incoming.phi_incoming.value_ref =
+                module->insts[block->inst_refs[push_pos].id].op1;
+            ctx->inst_refs.push_back(tail_add_inst(ctx, incoming));
+        }
+    }
+
+    for (size_t i = 0; i < ctx->call_blocks.len; ++i) {
+        SIRBlock *block = module->insts[ctx->call_blocks[i].id].block;
+        block->inst_refs.len = ctx->call_positions[i] - func->param_types_len;
+        block->inst_refs.push_back(tail_add_inst(ctx, jump));
+        ctx->converted_count++;
+    }
+
+    for (SIRInstRef inst_ref : header->inst_refs) {
+        ctx->inst_refs.push_back(inst_ref);
+    }
+    header->inst_refs.len = 0;
+    header->inst_refs.push_many(ctx->inst_refs.as_slice());
+
+    for (SIRInstRef param_ref : func->param_insts) {
+        ctx->param_phis[param_ref.id] = {0};
+    }
+
+    SIRFunctionInvalidateAnalysis(module, func_ref, SIRAnalysis_All);
+}
+
+size_t SIRModuleEliminateTailCalls(SIRModule *module)
+{
+    ZoneScoped;
+
+    TailCallContext ctx = {};
+    ctx.module = module;
+    ctx.param_phis = SIRArray<SIRInstRef>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.call_blocks = SIRArray<SIRInstRef>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.call_positions = SIRArray<uint32_t>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.preds = SIRArray<SIRInstRef>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.inst_refs = SIRArray<SIRInstRef>::create(&SIR_MALLOC_ALLOCATOR);
+
+    ctx.param_phis.resize(module->insts.len);
+    for (size_t i = 0; i < module->insts.len; ++i) {
+        ctx.param_phis[i] = {0};
+    }
+
+    for (size_t i = 0; i < module->functions.len; ++i) {
+        tail_function(&ctx, module->functions[i]);
+    }
+
+    if (ctx.converted_count > 0) {
+        SIRModuleInvalidateUses(module);
+    }
+
+    ctx.param_phis.destroy();
+    ctx.call_blocks.destroy();
+    ctx.call_positions.destroy();
+    ctx.preds.destroy();
+    ctx.inst_refs.destroy();
+
+    return ctx.converted_count;
+}
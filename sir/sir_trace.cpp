@@ -0,0 +1,209 @@
+#include "sir_trace.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+// The tracer must not use ZoneScoped or the SIR allocators, since both are
+// instrumented themselves.
+
+struct SIRTraceEvent {
+    const SIRTraceLocation *location;
+    uint64_t start_ns;
+    uint64_t end_ns;
+};
+
+struct SIRTraceBuffer {
+    SIRTraceBuffer *next;
+    uint64_t tid;
+    SIRTraceEvent *events;
+    uint64_t capacity;
+    uint64_t count; // Total events recorded, the ring keeps the last capacity
+};
+
+SIRTraceConfig SIR_TRACE_CONFIG = {};
+
+static const char *SIR_TRACE_PATH = NULL;
+static uint64_t SIR_TRACE_BUFFER_CAPACITY = 1 << 20;
+static uint64_t SIR_TRACE_START_NS = 0;
+static SIRTraceBuffer *SIR_TRACE_BUFFERS = NULL;
+static uint32_t SIR_TRACE_LOCK = 0;
+static thread_local SIRTraceBuffer *SIR_TRACE_THREAD_BUFFER = NULL;
+
+static void SIRTraceLock()
+{
+    while (__atomic_exchange_n(&SIR_TRACE_LOCK, 1, __ATOMIC_ACQUIRE)) {
+    }
+}
+
+static void SIRTraceUnlock()
+{
+    __atomic_store_n(&SIR_TRACE_LOCK, 0, __ATOMIC_RELEASE);
+}
+
+static uint64_t SIRTraceGetEnvInt(const char *name, uint64_t default_value)
+{
+    const char *value = getenv(name);
+    if (!value || value[0] == '\0') return default_value;
+    return strtoull(value, NULL, 10);
+}
+
+static void SIRTraceWriteString(FILE *f, const char *str)
+{
+    fputc('"', f);
+    for (const char *c = str; *c; ++c) {
+        switch (*c) {
+        case '"': fputs("\\\"", f); break;
+        case '\\': fputs("\\\\", f); break;
+        default: fputc(*c, f); break;
+        }
+    }
+    fputc('"', f);
+}
+
+static void SIRTraceWriteEvent(
+    FILE *f, bool *first, uint64_t tid, const SIRTraceEvent *event)
+{
+    // Timestamps are in microseconds
+    double ts = (double)(event->start_ns - SIR_TRACE_START_NS) / 1000.0;
+    double dur = (double)(event->end_ns - event->start_ns) / 1000.0;
+
+    fputs(*first ? "\n" : ",\n", f);
+    *first = false;
+
+    fputs("{\"name\":", f);
+    SIRTraceWriteString(f, event->location->function);
+    fprintf(
+        f,
+        ",\"cat\":\"zone\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+        "\"pid\":%d,\"tid\":%lu,\"args\":{\"file\":",
+        ts,
+        dur,
+        (int)getpid(),
+        (unsigned long)tid);
+    SIRTraceWriteString(f, event->location->file);
+    fprintf(f, ",\"line\":%u}}", event->location->line);
+}
+
+static void SIRTraceDump()
+{
+    SIRTraceLock();
+
+    FILE *f = fopen(SIR_TRACE_PATH, "wb");
+    if (!f) {
+        fprintf(stderr, "Failed to open trace file: '%s'\n", SIR_TRACE_PATH);
+        SIRTraceUnlock();
+        return;
+    }
+
+    uint64_t dropped_count = 0;
+    bool first = true;
+
+    fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", f);
+    for (SIRTraceBuffer *buffer = SIR_TRACE_BUFFERS; buffer;
+         buffer = buffer->next) {
+        uint64_t first_index = 0;
+        if (buffer->count > buffer->capacity) {
+            first_index = buffer->count - buffer->capacity;
+            dropped_count += first_index;
+        }
+
+        for (uint64_t i = first_index; i < buffer->count; ++i) {
+            SIRTraceWriteEvent(
+                f,
+                &first,
+                buffer->tid,
+                &buffer->events[i % buffer->capacity]);
+        }
+    }
+    fputs("\n]}\n", f);
+
+    fclose(f);
+
+    if (dropped_count > 0) {
+        fprintf(
+            stderr,
+            "Trace ring buffers overflowed, %lu oldest events were dropped\n",
+            (unsigned long)dropped_count);
+    }
+
+    SIRTraceUnlock();
+}
+
+void SIRTraceInit()
+{
+    SIRTraceLock();
+
+    if (SIR_TRACE_CONFIG.state == SIRTraceState_Uninitialized) {
+        const char *path = getenv("SIR_TRACE_FILE");
+        if (!path) path = "trace.json";
+
+        if (path[0] == '\0') {
+            SIR_TRACE_CONFIG.state = SIRTraceState_Disabled;
+        } else {
+            SIR_TRACE_PATH = strdup(path);
+            SIR_TRACE_CONFIG.min_duration_ns =
+                SIRTraceGetEnvInt("SIR_TRACE_MIN_NS", 0);
+            SIR_TRACE_CONFIG.sample_rate =
+                (uint32_t)SIRTraceGetEnvInt("SIR_TRACE_SAMPLE", 1);
+            SIR_TRACE_CONFIG.sample_after =
+                (uint32_t)SIRTraceGetEnvInt("SIR_TRACE_SAMPLE_AFTER", 1024);
+            SIR_TRACE_BUFFER_CAPACITY =
+                SIRTraceGetEnvInt("SIR_TRACE_BUFFER_EVENTS", 1 << 20);
+
+            if (SIR_TRACE_CONFIG.sample_rate == 0) {
+                SIR_TRACE_CONFIG.sample_rate = 1;
+            }
+            if (SIR_TRACE_BUFFER_CAPACITY == 0) {
+                SIR_TRACE_BUFFER_CAPACITY = 1;
+            }
+
+            SIR_TRACE_START_NS = SIRTraceNow();
+            atexit(SIRTraceDump);
+
+            __atomic_store_n(
+                &SIR_TRACE_CONFIG.state,
+                SIRTraceState_Enabled,
+                __ATOMIC_RELEASE);
+        }
+    }
+
+    SIRTraceUnlock();
+}
+
+static SIRTraceBuffer *SIRTraceCreateThreadBuffer()
+{
+    SIRTraceBuffer *buffer = (SIRTraceBuffer *)calloc(1, sizeof(*buffer));
+    buffer->tid = (uint64_t)syscall(SYS_gettid);
+    buffer->capacity = SIR_TRACE_BUFFER_CAPACITY;
+    buffer->events =
+        (SIRTraceEvent *)malloc(sizeof(SIRTraceEvent) * buffer->capacity);
+
+    // Buffers outlive their threads so they can be dumped at exit
+    SIRTraceLock();
+    buffer->next = SIR_TRACE_BUFFERS;
+    SIR_TRACE_BUFFERS = buffer;
+    SIRTraceUnlock();
+
+    return buffer;
+}
+
+void SIRTraceRecord(
+    const SIRTraceLocation *location, uint64_t start_ns, uint64_t end_ns)
+{
+    if (end_ns - start_ns < SIR_TRACE_CONFIG.min_duration_ns) return;
+
+    SIRTraceBuffer *buffer = SIR_TRACE_THREAD_BUFFER;
+    if (!buffer) {
+        buffer = SIRTraceCreateThreadBuffer();
+        SIR_TRACE_THREAD_BUFFER = buffer;
+    }
+
+    SIRTraceEvent *event = &buffer->events[buffer->count % buffer->capacity];
+    event->location = location;
+    event->start_ns = start_ns;
+    event->end_ns = end_ns;
+    buffer->count++;
+}
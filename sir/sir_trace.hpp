@@ -0,0 +1,106 @@
+#pragma once
+
+// Built-in Chrome trace-event tracer used by ZoneScoped when Tracy is
+// disabled. Every zone becomes a complete ("X") event stored in a per-thread
+// ring buffer, and all buffers are written as trace_event JSON at exit.
+//
+// Runtime controls (environment variables):
+//   SIR_TRACE_FILE           output path, empty disables tracing
+//                            (default: trace.json)
+//   SIR_TRACE_MIN_NS         drop zones shorter than this (default: 0)
+//   SIR_TRACE_SAMPLE         record 1 in N hits of a hot zone (default: 1)
+//   SIR_TRACE_SAMPLE_AFTER   hits before a zone is considered hot
+//                            (default: 1024)
+//   SIR_TRACE_BUFFER_EVENTS  ring buffer capacity per thread
+//                            (default: 1048576)
+
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__clang__) || defined(__GNUC__)
+#define SIR_TRACE_INLINE __attribute__((always_inline)) inline
+#else
+#define SIR_TRACE_INLINE inline
+#endif
+
+enum SIRTraceState : uint32_t {
+    SIRTraceState_Uninitialized = 0,
+    SIRTraceState_Disabled,
+    SIRTraceState_Enabled,
+};
+
+struct SIRTraceConfig {
+    SIRTraceState state;
+    uint64_t min_duration_ns;
+    uint32_t sample_rate;
+    uint32_t sample_after;
+};
+
+struct SIRTraceLocation {
+    const char *function;
+    const char *file;
+    uint32_t line;
+    uint32_t hit_count;
+};
+
+extern SIRTraceConfig SIR_TRACE_CONFIG;
+
+void SIRTraceInit();
+void SIRTraceRecord(
+    const SIRTraceLocation *location, uint64_t start_ns, uint64_t end_ns);
+
+SIR_TRACE_INLINE static uint64_t SIRTraceNow()
+{
+    timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000ull + (uint64_t)time.tv_nsec;
+}
+
+SIR_TRACE_INLINE static bool SIRTraceShouldRecord(SIRTraceLocation *location)
+{
+    if (SIR_TRACE_CONFIG.state != SIRTraceState_Enabled) {
+        if (SIR_TRACE_CONFIG.state == SIRTraceState_Uninitialized) {
+            SIRTraceInit();
+        }
+        if (SIR_TRACE_CONFIG.state != SIRTraceState_Enabled) return false;
+    }
+
+    uint32_t hits =
+        __atomic_fetch_add(&location->hit_count, 1, __ATOMIC_RELAXED);
+    if (hits >= SIR_TRACE_CONFIG.sample_after &&
+        (hits % SIR_TRACE_CONFIG.sample_rate) != 0) {
+        return false;
+    }
+
+    return true;
+}
+
+struct SIRTraceZone {
+    SIRTraceLocation *location;
+    uint64_t start_ns;
+
+    SIR_TRACE_INLINE SIRTraceZone(SIRTraceLocation *location)
+    {
+        this->location = nullptr;
+        this->start_ns = 0;
+        if (!SIRTraceShouldRecord(location)) return;
+        this->location = location;
+        this->start_ns = SIRTraceNow();
+    }
+
+    SIR_TRACE_INLINE ~SIRTraceZone()
+    {
+        if (this->location) {
+            SIRTraceRecord(this->location, this->start_ns, SIRTraceNow());
+        }
+    }
+};
+
+#define SIR_TRACE_CONCAT_INNER(a, b) a##b
+#define SIR_TRACE_CONCAT(a, b) SIR_TRACE_CONCAT_INNER(a, b)
+
+#define ZoneScoped                                                             \
+    static SIRTraceLocation SIR_TRACE_CONCAT(sir_trace_loc_, __LINE__) = {     \
+        __func__, __FILE__, __LINE__, 0};                                      \
+    SIRTraceZone SIR_TRACE_CONCAT(sir_trace_zone_, __LINE__)(                  \
+        &SIR_TRACE_CONCAT(sir_trace_loc_, __LINE__))
@@ -0,0 +1,449 @@
+#include "sir_base.hpp"
+#include "sir_ir.hpp"
+#include <stdarg.h>
+
+// Checks the invariants that passes and the backend rely on: every block of
+// a function ends in a terminator, phis are grouped at the start of their
+// block with one incoming per predecessor, and every operand is defined in a
+// block that dominates its use.
+
+struct VerifyContext {
+    SIRModule *module;
+    SIRInstRef func_ref;
+    SIRFunction *func;
+    SIRFunctionAnalysis *analysis;
+    SIRArray<uint32_t> inst_funcs; // Function holding each inst, or NONE
+    SIRArray<uint32_t> inst_blocks;
+    SIRArray<uint32_t> inst_positions;
+    size_t error_count;
+};
+
+SIR_PRINTF_FORMATTING(4, 5)
+static void verify_error(
+    VerifyContext *ctx,
+    SIRInstRef block_ref,
+    SIRInstRef inst_ref,
+    const char *fmt,
+    ...)
+{
+    fprintf(
+        stderr,
+        "SIR verifier: function \"%.*s\", block %%b%u, inst %%r%u: ",
+        (int)ctx->func->name.len,
+        ctx->func->name.ptr,
+        block_ref.id,
+        inst_ref.id);
+
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+
+    fprintf(stderr, "\n");
+    ctx->error_count++;
+}
+
+SIR_INLINE
+static bool verify_is_placed_in_block(SIRInstKind kind)
+{
+    switch (kind) {
+    case SIRInstKind_ConstInt:
+    case SIRInstKind_ConstFloat:
+    case SIRInstKind_ConstBool:
+    case SIRInstKind_Global:
+    case SIRInstKind_StackSlot:
+    case SIRInstKind_FunctionParameter: return false;
+    default: return true;
+    }
+}
+
+static bool verify_is_pred(VerifyContext *ctx, uint32_t block, uint32_t pred)
+{
+    for (uint32_t p : SIRAnalysisGetPreds(ctx->analysis, block)) {
+        if (p == pred) return true;
+    }
+    return false;
+}
+
+// A CFG cached before a pass retargeted a terminator without invalidating
+static void verify_cached_cfg(VerifyContext *ctx, uint32_t func_index)
+{
+    SIRModule *module = ctx->module;
+    SIRFunction *func = ctx->func;
+    SIRFunctionAnalysis *analysis = &func->analysis;
+
+    if (!(analysis->valid & SIRAnalysis_CFG)) return;
+
+    if (analysis->succ_offsets.len != func->blocks.len + 1) {
+        verify_error(
+            ctx, {0}, {0}, "cached CFG has a different number of blocks");
+        return;
+    }
+
+    for (uint32_t b = 0; b < func->blocks.len; ++b) {
+        SIRInstRef block_ref = func->blocks[b];
+        SIRInstRef term_ref = SIRBlockGetTerminator(module, block_ref);
+        if (!term_ref.id) continue;
+
+        SIRInst term = module->insts[term_ref.id];
+        SIRInstRef targets[2] = {};
+        uint32_t target_count = 0;
+        if (term.kind == SIRInstKind_Jump) {
+            targets[target_count++] = term.op1;
+        } else if (term.kind == SIRInstKind_Branch) {
+            targets[target_count++] = term.op1;
+            if (term.op2.id != term.op1.id) targets[target_count++] = term.op2;
+        }
+
+        SIRSlice<uint32_t> succs = SIRAnalysisGetSuccs(analysis, b);
+        bool matches = succs.len == target_count;
+        for (uint32_t i = 0; matches && i < target_count; ++i) {
+            uint32_t target_func = ctx->inst_funcs[targets[i].id];
+            uint32_t target = ctx->inst_blocks[targets[i].id];
+            matches = false;
+            for (uint32_t succ : succs) {
+                if (target_func == func_index && succ == target) {
+                    matches = true;
+                }
+            }
+        }
+
+        if (!matches) {
+            verify_error(
+                ctx,
+                block_ref,
+                term_ref,
+                "cached CFG does not match the terminator, the pass that "
+                "changed it did not invalidate the analysis");
+        }
+    }
+}
+
+static void verify_operand(
+    VerifyContext *ctx,
+    uint32_t func_index,
+    uint32_t block_index,
+    SIRInstRef inst_ref,
+    uint32_t inst_pos,
+    SIRInstRef operand_ref)
+{
+    SIRModule *module = ctx->module;
+    SIRInstRef block_ref = ctx->func->blocks[block_index];
+
+    if (operand_ref.id == 0 || operand_ref.id >= module->insts.len) {
+        verify_error(
+            ctx, block_ref, inst_ref, "invalid operand %%r%u", operand_ref.id);
+        return;
+    }
+
+    SIRInst operand = module->insts[operand_ref.id];
+    switch (operand.kind) {
+    case SIRInstKind_Unknown:
+    case SIRInstKind_Block:
+    case SIRInstKind_Function: {
+        verify_error(
+            ctx,
+            block_ref,
+            inst_ref,
+            "operand %%r%u is not a value",
+            operand_ref.id);
+        return;
+    }
+    default: break;
+    }
+
+    uint32_t def_func = ctx->inst_funcs[operand_ref.id];
+    if (def_func == SIR_NO_INDEX) {
+        if (verify_is_placed_in_block(operand.kind)) {
+            verify_error(
+                ctx,
+                block_ref,
+                inst_ref,
+                "operand %%r%u is not in any block",
+                operand_ref.id);
+        }
+        return;
+    }
+
+    if (def_func != func_index) {
+        verify_error(
+            ctx,
+            block_ref,
+            inst_ref,
+            "operand %%r%u is defined in another function",
+            operand_ref.id);
+        return;
+    }
+
+    uint32_t def_block = ctx->inst_blocks[operand_ref.id];
+    uint32_t def_pos = ctx->inst_positions[operand_ref.id];
+
+    // Incoming values are used at the end of the incoming block
+    SIRInst inst = module->insts[inst_ref.id];
+    uint32_t use_block = block_index;
+    if (inst.kind == SIRInstKind_PhiIncoming) {
+        SIRInstRef from_ref = inst.phi_incoming.block_ref;
+        if (from_ref.id >= module->insts.len ||
+            ctx->inst_funcs[from_ref.id] != func_index) {
+            return; // Reported by verify_phis
+        }
+        use_block = ctx->inst_blocks[from_ref.id];
+        inst_pos = UINT32_MAX;
+    }
+
+    // Nothing dominates code that never runs, such as the edges left behind
+    // by folding a branch, but its operands still have to be defined
+    if (!SIRAnalysisIsReachable(ctx->analysis, use_block)) return;
+
+    bool dominates;
+    if (def_block == use_block) {
+        dominates = def_pos < inst_pos;
+    } else {
+        dominates = SIRAnalysisIsReachable(ctx->analysis, def_block) &&
+                    SIRAnalysisDominates(ctx->analysis, def_block, use_block);
+    }
+
+    if (!dominates) {
+        verify_error(
+            ctx,
+            block_ref,
+            inst_ref,
+            "operand %%r%u does not dominate its use",
+            operand_ref.id);
+    }
+}
+
+static void verify_block_target(
+    VerifyContext *ctx,
+    uint32_t func_index,
+    SIRInstRef block_ref,
+    SIRInstRef inst_ref,
+    SIRInstRef target_ref)
+{
+    if (target_ref.id == 0 || target_ref.id >= ctx->module->insts.len ||
+        ctx->module->insts[target_ref.id].kind != SIRInstKind_Block ||
+        ctx->inst_funcs[target_ref.id] != func_index) {
+        verify_error(
+            ctx,
+            block_ref,
+            inst_ref,
+            "%%r%u is not a block of this function",
+            target_ref.id);
+    }
+}
+
+static void verify_phis(VerifyContext *ctx, uint32_t block_index)
+{
+    SIRModule *module = ctx->module;
+    SIRInstRef block_ref = ctx->func->blocks[block_index];
+    SIRBlock *block = module->insts[block_ref.id].block;
+
+    bool reachable = SIRAnalysisIsReachable(ctx->analysis, block_index);
+    size_t pred_count = SIRAnalysisGetPreds(ctx->analysis, block_index).len;
+
+    SIRInstRef phi_ref = {0};
+    size_t incoming_count = 0;
+    bool in_phis = true;
+
+    for (size_t i = 0; i <= block->inst_refs.len; ++i) {
+        SIRInstRef inst_ref = {0};
+        SIRInstKind kind = SIRInstKind_Unknown;
+        if (i < block->inst_refs.len) {
+            inst_ref = block->inst_refs[i];
+            kind = module->insts[inst_ref.id].kind;
+        }
+
+        if (phi_ref.id && kind != SIRInstKind_PhiIncoming) {
+            if (reachable && incoming_count != pred_count) {
+                verify_error(
+                    ctx,
+                    block_ref,
+                    phi_ref,
+                    "phi has %zu incoming values for %zu predecessors",
+                    incoming_count,
+                    pred_count);
+            }
+            phi_ref = {0};
+        }
+
+        if (kind == SIRInstKind_Phi) {
+            if (!in_phis) {
+                verify_error(
+                    ctx,
+                    block_ref,
+                    inst_ref,
+                    "phi is not at the start of the block");
+            }
+            phi_ref = inst_ref;
+            incoming_count = 0;
+        } else if (kind == SIRInstKind_PhiIncoming) {
+            SIRInst incoming = module->insts[inst_ref.id];
+            if (!phi_ref.id) {
+                verify_error(
+                    ctx, block_ref, inst_ref, "incoming value without a phi");
+                continue;
+            }
+            incoming_count++;
+
+            SIRInstRef from_ref = incoming.phi_incoming.block_ref;
+            bool is_pred =
+                from_ref.id < module->insts.len &&
+                module->insts[from_ref.id].kind == SIRInstKind_Block &&
+                (!reachable ||
+                 verify_is_pred(
+                     ctx, block_index, ctx->inst_blocks[from_ref.id]));
+            if (!is_pred) {
+                verify_error(
+                    ctx,
+                    block_ref,
+                    inst_ref,
+                    "incoming block %%b%u is not a predecessor",
+                    from_ref.id);
+            }
+
+            // The frontend mixes bool and u8 values in phis
+            SIRInstRef value_ref = incoming.phi_incoming.value_ref;
+            SIRType *value_type = (value_ref.id < module->insts.len)
+                                      ? module->insts[value_ref.id].type
+                                      : nullptr;
+            SIRType *phi_type = module->insts[phi_ref.id].type;
+            if (!value_type ||
+                SIRTypeSizeOf(module, value_type) !=
+                    SIRTypeSizeOf(module, phi_type)) {
+                verify_error(
+                    ctx,
+                    block_ref,
+                    inst_ref,
+                    "incoming value size does not match the phi");
+            }
+        } else {
+            in_phis = false;
+        }
+    }
+}
+
+static void verify_function(VerifyContext *ctx, uint32_t func_index)
+{
+    SIRModule *module = ctx->module;
+    SIRFunction *func = ctx->func;
+
+    size_t error_count = ctx->error_count;
+    verify_cached_cfg(ctx, func_index);
+    if (ctx->error_count > error_count) return;
+
+    ctx->analysis =
+        SIRFunctionGetAnalysis(module, ctx->func_ref, SIRAnalysis_Dominators);
+
+    for (uint32_t b = 0; b < func->blocks.len; ++b) {
+        SIRInstRef block_ref = func->blocks[b];
+        SIRBlock *block = module->insts[block_ref.id].block;
+
+        SIRInstRef term_ref = SIRBlockGetTerminator(module, block_ref);
+        if (!term_ref.id) {
+            verify_error(ctx, block_ref, {0}, "block has no terminator");
+            continue;
+        }
+
+        verify_phis(ctx, b);
+
+        // Instructions after the terminator are never executed
+        for (uint32_t i = 0; i < block->inst_refs.len; ++i) {
+            SIRInstRef inst_ref = block->inst_refs[i];
+            SIRInst *inst = &module->insts[inst_ref.id];
+
+            SIRInstRef *operands[2];
+            uint32_t operand_count = SIRInstGetOperands(inst, operands);
+            for (uint32_t j = 0; j < operand_count; ++j) {
+                verify_operand(ctx, func_index, b, inst_ref, i, *operands[j]);
+            }
+
+            if (inst->kind == SIRInstKind_Jump) {
+                verify_block_target(
+                    ctx, func_index, block_ref, inst_ref, inst->op1);
+            } else if (inst->kind == SIRInstKind_Branch) {
+                verify_block_target(
+                    ctx, func_index, block_ref, inst_ref, inst->op1);
+                verify_block_target(
+                    ctx, func_index, block_ref, inst_ref, inst->op2);
+                if (i == 0 || module->insts[block->inst_refs[i - 1].id].kind !=
+                                  SIRInstKind_SetCond) {
+                    verify_error(
+                        ctx,
+                        block_ref,
+                        inst_ref,
+                        "branch is not preceded by a set_cond");
+                }
+            }
+
+            if (inst_ref.id == term_ref.id) break;
+        }
+    }
+}
+
+bool SIRModuleVerify(SIRModule *module)
+{
+    ZoneScoped;
+
+    VerifyContext ctx = {};
+    ctx.module = module;
+    ctx.inst_funcs = SIRArray<uint32_t>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.inst_blocks = SIRArray<uint32_t>::create(&SIR_MALLOC_ALLOCATOR);
+    ctx.inst_positions = SIRArray<uint32_t>::create(&SIR_MALLOC_ALLOCATOR);
+
+    ctx.inst_funcs.resize(module->insts.len);
+    ctx.inst_blocks.resize(module->insts.len);
+    ctx.inst_positions.resize(module->insts.len);
+    for (size_t i = 0; i < module->insts.len; ++i) {
+        ctx.inst_funcs[i] = SIR_NO_INDEX;
+    }
+
+    // Placement of every instruction, so uses across functions are caught
+    for (uint32_t f = 0; f < module->functions.len; ++f) {
+        ctx.func_ref = module->functions[f];
+        ctx.func = module->insts[ctx.func_ref.id].func;
+
+        for (uint32_t b = 0; b < ctx.func->blocks.len; ++b) {
+            SIRInstRef block_ref = ctx.func->blocks[b];
+            if (module->insts[block_ref.id].kind != SIRInstKind_Block ||
+                ctx.inst_funcs[block_ref.id] != SIR_NO_INDEX) {
+                verify_error(
+                    &ctx, block_ref, {0}, "block is listed more than once");
+                continue;
+            }
+            ctx.inst_funcs[block_ref.id] = f;
+            ctx.inst_blocks[block_ref.id] = b;
+
+            SIRBlock *block = module->insts[block_ref.id].block;
+            for (uint32_t i = 0; i < block->inst_refs.len; ++i) {
+                SIRInstRef inst_ref = block->inst_refs[i];
+                if (ctx.inst_funcs[inst_ref.id] != SIR_NO_INDEX) {
+                    verify_error(
+                        &ctx,
+                        block_ref,
+                        inst_ref,
+                        "instruction is in more than one block");
+                    continue;
+                }
+                ctx.inst_funcs[inst_ref.id] = f;
+                ctx.inst_blocks[inst_ref.id] = b;
+                ctx.inst_positions[inst_ref.id] = i;
+            }
+        }
+    }
+
+    if (ctx.error_count == 0) {
+        for (uint32_t f = 0; f < module->functions.len; ++f) {
+            ctx.func_ref = module->functions[f];
+            ctx.func = module->insts[ctx.func_ref.id].func;
+            if (ctx.func->blocks.len == 0) continue;
+
+            verify_function(&ctx, f);
+        }
+    }
+
+    ctx.inst_funcs.destroy();
+    ctx.inst_blocks.destroy();
+    ctx.inst_positions.destroy();
+
+    return ctx.error_count == 0;
+}
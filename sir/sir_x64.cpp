@@ -89,10 +89,12 @@ typedef enum {
     Mnem_MUL,
     Mnem_DIV,
     Mnem_IDIV,
+    Mnem_IMUL,
     Mnem_C_SEP,
     Mnem_AND,
     Mnem_OR,
     Mnem_XOR,
+    Mnem_CMP,
     Mnem_SHL,
     Mnem_SHR,
     Mnem_SAR,
@@ -103,7 +105,7 @@ typedef enum {
     Mnem_SSE_UCOMIS,
     Mnem_SSE_CVTS,
     Mnem_SSE_CVTSI2S,
-    Mnem_SSE_CVTS2SI,
+    Mnem_SSE_CVTTS2SI,
     Mnem_COUNT,
 } MnemOptions;
 
@@ -211,6 +213,19 @@ static RegisterIndex SYSV_CALLEE_SAVED[] = {
     RegisterIndex_R15,
 };
 
+// RBP is allocatable when the frame pointer is omitted
+static RegisterIndex SYSV_CALLEE_SAVED_NO_FRAME_POINTER[] = {
+    RegisterIndex_RBX,
+    RegisterIndex_RBP,
+    RegisterIndex_R12,
+    RegisterIndex_R13,
+    RegisterIndex_R14,
+    RegisterIndex_R15,
+};
+
+// Bytes below RSP that signal handlers leave alone
+static const uint32_t SYSV_RED_ZONE_SIZE = 128;
+
 static RegisterIndex SYSV_CALLER_SAVED[] = {
     RegisterIndex_RAX,
     RegisterIndex_RCX,
@@ -256,11 +271,18 @@ typedef struct MetaValue {
 typedef struct FuncJumpPatch {
     int64_t instruction;
     size_t instruction_offset;
+    size_t length;
     SIRInstRef destination_block;
+    size_t destination_offset; // Used when there is no destination block
 } FuncJumpPatch;
 
 struct MetaFunction {
     uint32_t stack_size;
+    // Frame slots are addressed from frame_register, their offsets are
+    // relative to where RBP points in a function with a frame pointer
+    RegisterIndex frame_register;
+    int32_t frame_offset;
+    bool frameless; // Leaf whose slots fit in the red zone
     SIRArray<FuncJumpPatch> jump_patches;
     SIRArray<RegisterIndex> free_int_registers;
     SIRArray<RegisterIndex> free_float_registers;
@@ -277,9 +299,55 @@ typedef struct Interval {
     RegisterIndex reg;
     uint32_t start;
     uint32_t end;
-    uint32_t stack_offset;
+    uint32_t frame_slot; // One past the index of the slot, 0 for none
+    RegisterIndex hint;  // Argument register the value is passed in, if any
+    uint32_t position;   // Of the instruction itself
+    // Kept in a caller saved register, and saved to the frame slot around
+    // the calls the interval crosses
+    bool split_at_calls;
 } Interval;
 
+// Stack space shared by values whose intervals don't overlap
+typedef struct FrameSlot {
+    uint32_t size;
+    uint32_t align;
+    uint32_t end; // Last position of the values in the slot
+    uint32_t offset;
+} FrameSlot;
+
+typedef uint8_t RegisterClass;
+typedef enum {
+    RegisterClass_None = 0,
+    RegisterClass_Int,
+    RegisterClass_Float,
+} RegisterClassOptions;
+
+static const uint32_t VALUE_INDEX_NONE = UINT32_MAX;
+static const uint32_t VALUE_INDEX_EXCLUDED = UINT32_MAX - 1;
+
+// Condition codes of a comparison: setcc of the result, jcc jumping when it
+// is true and jcc jumping when it is false
+typedef struct Condition {
+    int64_t set;
+    int64_t jump;
+    int64_t inverse_jump;
+} Condition;
+
+typedef struct PhiCopy {
+    SIRInstRef dest_ref;
+    SIRInstRef source_ref; // Zero once the source was saved to a register
+    MetaValue dest;
+    MetaValue source;
+    size_t size;
+} PhiCopy;
+
+// Move into or out of the registers arguments are passed in
+typedef struct ArgMove {
+    MetaValue dest;
+    MetaValue source;
+    size_t size;
+} ArgMove;
+
 struct X64AsmBuilder {
     SIRAsmBuilder vt;
     SIRModule *module;
@@ -290,6 +358,36 @@ struct X64AsmBuilder {
     SIRArray<SIRInstRef> current_func_params;
     SIRInstRef current_cond;
     SIRInstRef current_func;
+    SIRArray<PhiCopy> phi_copies;
+    SIRArray<ArgMove> arg_moves;
+    size_t encoded_inst_count;
+    // Last instruction added by encode, for the relocations of its operands
+    uint64_t last_mnem;
+    FeOp last_ops[4];
+    size_t last_inst_len;
+    SIRInstRef next_block; // Block placed after the current one, if any
+    // Instruction whose encoding computes the value instead, the folded
+    // instruction gets no storage. Indexed by instruction id.
+    SIRArray<SIRInstRef> folded_into;
+    // Calls that jump to the callee after releasing the frame, indexed by
+    // instruction id
+    SIRArray<bool> tail_calls;
+    SIRArray<bool> short_jumps; // Indexed by jump patch
+    SIRArray<uint32_t> jump_shrinks;
+    SIRArray<SIRInstRef> block_layout;
+
+    // Register allocation state of the current function
+    SIRArray<uint32_t> value_indices; // Indexed by instruction id
+    SIRArray<SIRInstRef> values;
+    SIRArray<uint32_t> block_starts;
+    SIRArray<uint32_t> block_ends;
+    SIRArray<uint64_t> live_sets; // Live in, live out, use, def and phi use
+    SIRArray<uint32_t> call_counts; // Calls before each position
+    SIRArray<uint32_t> start_offsets;
+    SIRArray<SIRInstRef> sorted_values;
+    SIRArray<SIRInstRef> active_values;
+    SIRArray<SIRInstRef> split_values;
+    SIRArray<FrameSlot> frame_slots;
 };
 
 SIR_INLINE
@@ -328,23 +426,55 @@ SIR_INLINE
 static void value_add_relocation(
     X64AsmBuilder *builder,
     const MetaValue *value,
-    Mnem mnem,
-    OperandKind other_operand_kind = OperandKind_None,
-    SizeClass other_operand_size_class = SizeClass_None)
+    Mnem mnem)
 {
     (void)mnem;
 
     if (value->kind == MetaValueKind_Global ||
         value->kind == MetaValueKind_GlobalPtr) {
-        size_t relocation_offset = builder_get_code_offset(builder) - 4;
-        if (other_operand_kind == OperandKind_Imm) {
-            relocation_offset -= SIZE_CLASS_SIZES[other_operand_size_class];
+        // RIP points past the immediate that can follow the displacement.
+        // The encoder picks the size of the immediate, so the last
+        // instruction is encoded again with another displacement to find
+        // where the displacement ends.
+        FeOp rip_operand = value_into_operand(value);
+        FeOp moved_ops[4];
+        for (size_t i = 0; i < 4; ++i) {
+            moved_ops[i] = builder->last_ops[i];
+            if (moved_ops[i] == rip_operand) {
+                moved_ops[i] = FE_MEM(FE_IP, 0, 0, -1);
+            }
+        }
+
+        uint8_t inst[16] = {};
+        uint8_t moved_inst[16] = {};
+        uint8_t *ptr = &inst[0];
+        uint8_t *moved_ptr = &moved_inst[0];
+        int failed = fe_enc64(
+            &ptr,
+            builder->last_mnem,
+            builder->last_ops[0],
+            builder->last_ops[1],
+            builder->last_ops[2],
+            builder->last_ops[3]);
+        failed |= fe_enc64(
+            &moved_ptr,
+            builder->last_mnem,
+            moved_ops[0],
+            moved_ops[1],
+            moved_ops[2],
+            moved_ops[3]);
+        SIR_ASSERT(!failed);
+        SIR_ASSERT((size_t)(ptr - inst) == builder->last_inst_len);
+
+        size_t disp_end = builder->last_inst_len;
+        while (disp_end > 0 && inst[disp_end - 1] == moved_inst[disp_end - 1]) {
+            disp_end--;
         }
+        size_t imm_size = builder->last_inst_len - disp_end;
 
-        int64_t data_offset = value->global.offset;
-        /* if (mnem == Mnem_MOV) { */
-        /*     data_offset -= 4; */
-        /* } */
+        size_t relocation_offset =
+            builder_get_code_offset(builder) - imm_size - 4;
+        int64_t data_offset = value->global.offset - (int64_t)imm_size;
 
         builder->obj_builder->add_data_relocation(
             builder->obj_builder,
@@ -411,7 +541,8 @@ static MetaValue create_int_register_memory_value(
 }
 
 SIR_INLINE
-static MetaValue create_stack_value(size_t byte_size, int32_t offset)
+static MetaValue create_stack_value(
+    const MetaFunction *meta_func, size_t byte_size, int32_t offset)
 {
     ZoneScoped;
 
@@ -424,13 +555,14 @@ static MetaValue create_stack_value(size_t byte_size, int32_t offset)
     case 8: value.size_class = SIZE_CLASSES[byte_size]; break;
     default: value.size_class = SizeClass_None; break;
     }
-    value.regmem.base = RegisterIndex_RBP;
-    value.regmem.offset = offset;
+    value.regmem.base = meta_func->frame_register;
+    value.regmem.offset = offset + meta_func->frame_offset;
     return value;
 }
 
 SIR_INLINE
-static MetaValue create_stack_ptr_value(size_t byte_size, int32_t offset)
+static MetaValue create_stack_ptr_value(
+    const MetaFunction *meta_func, size_t byte_size, int32_t offset)
 {
     ZoneScoped;
 
@@ -443,8 +575,8 @@ static MetaValue create_stack_ptr_value(size_t byte_size, int32_t offset)
     case 8: value.size_class = SIZE_CLASSES[byte_size]; break;
     default: value.size_class = SizeClass_None; break;
     }
-    value.regmem.base = RegisterIndex_RBP;
-    value.regmem.offset = offset;
+    value.regmem.base = meta_func->frame_register;
+    value.regmem.offset = offset + meta_func->frame_offset;
     return value;
 }
 
@@ -525,6 +657,7 @@ encode_raw(X64AsmBuilder *builder, const uint8_t *bytes, size_t len)
 
     builder->obj_builder->add_to_section(
         builder->obj_builder, SIRSectionType_Text, (uint8_t *)bytes, len);
+    builder->encoded_inst_count++;
     return len;
 }
 
@@ -548,6 +681,13 @@ static size_t encode(
     size_t inst_len = (size_t)(ptr - temp);
     builder->obj_builder->add_to_section(
         builder->obj_builder, SIRSectionType_Text, &temp[0], inst_len);
+    builder->encoded_inst_count++;
+    builder->last_mnem = mnem;
+    builder->last_ops[0] = op0;
+    builder->last_ops[1] = op1;
+    builder->last_ops[2] = op2;
+    builder->last_ops[3] = op3;
+    builder->last_inst_len = inst_len;
     return inst_len;
 }
 
@@ -576,11 +716,14 @@ static size_t encode_at(
 }
 
 SIR_INLINE
-static size_t encode_direct_call(X64AsmBuilder *builder, SIRInstRef func_ref)
+static size_t encode_direct_call(
+    X64AsmBuilder *builder, SIRInstRef func_ref, bool tail = false)
 {
     ZoneScoped;
 
+    // A tail call is a jmp rel32, which takes the same relocation
     uint8_t inst_bytes[5] = {0xe8, 0x00, 0x00, 0x00, 0x00};
+    if (tail) inst_bytes[0] = 0xe9;
     size_t inst_len =
         encode_raw(builder, inst_bytes, SIR_CARRAY_LENGTH(inst_bytes));
 
@@ -611,7 +754,7 @@ encode_mnem1(X64AsmBuilder *builder, Mnem mnem, const MetaValue *op1)
 
     int64_t encoding = ENCODING_ENTRIES1[mnem][op1_opkind][op1->size_class];
     encode(builder, encoding, value_into_operand(op1), 0, 0, 0);
-    value_add_relocation(builder, op1, mnem, op1_opkind, op1->size_class);
+    value_add_relocation(builder, op1, mnem);
 }
 
 static void encode_mnem2(
@@ -622,18 +765,51 @@ static void encode_mnem2(
 {
     ZoneScoped;
 
+    // xor is shorter than a mov of zero, flags are never live across a mov
+    if (mnem == Mnem_MOV && dest->kind == MetaValueKind_IRegister &&
+        dest->reg.bytes >= 4 && source->kind == MetaValueKind_ImmInt &&
+        source->imm_int.u64 == 0) {
+        FeOp reg = REGISTERS[dest->reg.index];
+        encode(builder, FE_XOR32rr, reg, reg, 0, 0);
+        return;
+    }
+
     OperandKind source_opkind = OPERAND_KINDS[source->kind];
     OperandKind dest_opkind = OPERAND_KINDS[dest->kind];
 
-    if ((source_opkind == OperandKind_Memory ||
-         source_opkind == OperandKind_MemoryPtr) &&
-        dest_opkind == OperandKind_Memory) {
+    // Memory to memory operations, and operations that can only write a
+    // register, go through RAX
+    bool source_is_memory = source_opkind == OperandKind_Memory ||
+                            source_opkind == OperandKind_MemoryPtr;
+    if (dest_opkind == OperandKind_Memory &&
+        (source_is_memory ||
+         !ENCODING_ENTRIES2[mnem][dest_opkind][dest->size_class]
+                           [source_opkind][source->size_class])) {
         int64_t encoding1 =
             ENCODING_ENTRIES2[mnem][OperandKind_Reg][dest->size_class]
                              [source_opkind][source->size_class];
         int64_t encoding2 =
             ENCODING_ENTRIES2[Mnem_MOV][dest_opkind][dest->size_class]
                              [OperandKind_Reg][dest->size_class];
+
+        switch (mnem) {
+        case Mnem_ADD:
+        case Mnem_SUB:
+        case Mnem_MUL:
+        case Mnem_AND:
+        case Mnem_OR:
+        case Mnem_XOR: {
+            // These read the destination, so it has to be in the register
+            int64_t encoding0 =
+                ENCODING_ENTRIES2[Mnem_MOV][OperandKind_Reg][dest->size_class]
+                                 [dest_opkind][dest->size_class];
+            encode(builder, encoding0, FE_AX, value_into_operand(dest), 0, 0);
+            value_add_relocation(builder, dest, Mnem_MOV);
+            break;
+        }
+        default: break;
+        }
+
         encode(builder, encoding1, FE_AX, value_into_operand(source), 0, 0);
         value_add_relocation(builder, source, mnem);
         encode(builder, encoding2, value_into_operand(dest), FE_AX, 0, 0);
@@ -649,10 +825,8 @@ static void encode_mnem2(
             value_into_operand(source),
             0,
             0);
-        value_add_relocation(
-            builder, source, mnem, dest_opkind, dest->size_class);
-        value_add_relocation(
-            builder, dest, mnem, source_opkind, source->size_class);
+        value_add_relocation(builder, source, mnem);
+        value_add_relocation(builder, dest, mnem);
     }
 }
 
@@ -679,12 +853,14 @@ static void encode_mnem3(
         value_into_operand(op2),
         value_into_operand(op3),
         0);
-    value_add_relocation(builder, op1, mnem, op1_opkind, op1->size_class);
-    value_add_relocation(builder, op2, mnem, op2_opkind, op2->size_class);
-    value_add_relocation(builder, op3, mnem, op3_opkind, op3->size_class);
+    value_add_relocation(builder, op1, mnem);
+    value_add_relocation(builder, op2, mnem);
+    value_add_relocation(builder, op3, mnem);
 }
 
-static void encode_function_ending(X64AsmBuilder *builder, SIRInstRef func_ref)
+// Restores the callee saved registers and releases the frame, leaving RSP
+// at the return address
+static void encode_frame_release(X64AsmBuilder *builder, SIRInstRef func_ref)
 {
     ZoneScoped;
 
@@ -699,43 +875,85 @@ static void encode_function_ending(X64AsmBuilder *builder, SIRInstRef func_ref)
                 FE_MOV64rm,
                 REGISTERS[reg_index],
                 FE_MEM(
-                    FE_BP,
+                    REGISTERS[meta_func->frame_register],
                     0,
                     0,
-                    meta_func->saved_register_stack_offset[reg_index]),
+                    meta_func->saved_register_stack_offset[reg_index] +
+                        meta_func->frame_offset),
                 0,
                 0);
         }
     }
 
     // End stack frame
-    encode(builder, FE_LEAVE, FE_BP, 0, 0, 0);
+    if (meta_func->frame_register == RegisterIndex_RBP) {
+        encode(builder, FE_LEAVE, FE_BP, 0, 0, 0);
+    } else if (!meta_func->frameless) {
+        encode(builder, FE_ADD64ri, FE_SP, meta_func->frame_offset + 8, 0, 0);
+    }
+}
+
+static void encode_function_ending(X64AsmBuilder *builder, SIRInstRef func_ref)
+{
+    encode_frame_release(builder, func_ref);
     encode(builder, FE_RET, 0, 0, 0, 0);
 }
 
-static RegisterIndex alloc_int_register(MetaFunction *func)
+static bool is_callee_saved(MetaFunction *func, RegisterIndex reg)
+{
+    for (size_t i = 0; i < func->callee_saved_registers_len; ++i) {
+        if (func->callee_saved_registers[i] == reg) return true;
+    }
+    return false;
+}
+
+// Takes the hinted register if it is free, otherwise the most recently freed
+// register of the pool. Values living across calls can only use callee saved
+// registers.
+static RegisterIndex alloc_register(
+    MetaFunction *func,
+    SIRArray<RegisterIndex> *pool,
+    bool callee_saved,
+    RegisterIndex hint)
 {
-    if (func->free_int_registers.len == 0) return RegisterIndex_None;
-    RegisterIndex reg =
-        func->free_int_registers[func->free_int_registers.len - 1];
-    func->free_int_registers.pop();
+    size_t index = SIR_NO_INDEX;
+    for (size_t i = pool->len; i-- > 0;) {
+        RegisterIndex reg = (*pool)[i];
+        if (callee_saved && !is_callee_saved(func, reg)) continue;
+        if (index == SIR_NO_INDEX || reg == hint) index = i;
+        if (reg == hint) break;
+    }
+    if (index == SIR_NO_INDEX) return RegisterIndex_None;
+
+    RegisterIndex reg = (*pool)[index];
+    for (size_t j = index + 1; j < pool->len; ++j) {
+        (*pool)[j - 1] = (*pool)[j];
+    }
+    pool->pop();
     func->registers_used[reg] = true;
     return reg;
 }
 
+static RegisterIndex alloc_int_register(
+    MetaFunction *func,
+    bool callee_saved = false,
+    RegisterIndex hint = RegisterIndex_None)
+{
+    return alloc_register(func, &func->free_int_registers, callee_saved, hint);
+}
+
 static void free_int_register(MetaFunction *func, RegisterIndex reg)
 {
     func->free_int_registers.push_back(reg);
 }
 
-static RegisterIndex alloc_float_register(MetaFunction *func)
+static RegisterIndex alloc_float_register(
+    MetaFunction *func,
+    bool callee_saved = false,
+    RegisterIndex hint = RegisterIndex_None)
 {
-    if (func->free_float_registers.len == 0) return RegisterIndex_None;
-    RegisterIndex reg =
-        func->free_float_registers[func->free_float_registers.len - 1];
-    func->free_float_registers.pop();
-    func->registers_used[reg] = true;
-    return reg;
+    return alloc_register(
+        func, &func->free_float_registers, callee_saved, hint);
 }
 
 static void free_float_register(MetaFunction *func, RegisterIndex reg)
@@ -877,11 +1095,51 @@ static bool sysv_param_should_use_regs(
     return use_regs;
 }
 
+// Register the next argument of the type is passed in, arguments passed on
+// the stack or in two registers get none
+static RegisterIndex sysv_next_param_register(
+    X64AsmBuilder *builder,
+    SIRType *param_type,
+    uint32_t *used_int_regs,
+    uint32_t *used_float_regs)
+{
+    SysVParamClass class1 = SysVParamClass_SSE;
+    SysVParamClass class2 = SysVParamClass_SSE;
+    if (!sysv_param_should_use_regs(
+            builder,
+            param_type,
+            &class1,
+            &class2,
+            *used_int_regs,
+            *used_float_regs)) {
+        return RegisterIndex_None;
+    }
+
+    RegisterIndex reg = RegisterIndex_None;
+    switch (class1) {
+    case SysVParamClass_Int:
+        reg = SYSV_INT_PARAM_REGS[(*used_int_regs)++];
+        break;
+    case SysVParamClass_SSE:
+        reg = SYSV_FLOAT_PARAM_REGS[(*used_float_regs)++];
+        break;
+    }
+
+    if (SIRTypeSizeOf(builder->module, param_type) <= 8) return reg;
+    switch (class2) {
+    case SysVParamClass_Int: (*used_int_regs)++; break;
+    case SysVParamClass_SSE: (*used_float_regs)++; break;
+    }
+    return RegisterIndex_None;
+}
+
+// Odd sized memory is assembled in a register with the help of tmp_index
 static void encode_memcpy(
     X64AsmBuilder *builder,
     size_t value_size,
     MetaValue source_value,
-    MetaValue dest_value)
+    MetaValue dest_value,
+    RegisterIndex tmp_index = RegisterIndex_RCX)
 {
     ZoneScoped;
 
@@ -929,8 +1187,7 @@ static void encode_memcpy(
             if (dest_value.kind == MetaValueKind_IRegister &&
                 source_value.kind == MetaValueKind_IRegisterMemory) {
 
-                MetaValue tmp_reg =
-                    create_int_register_value(4, RegisterIndex_RCX);
+                MetaValue tmp_reg = create_int_register_value(4, tmp_index);
                 MetaValue source_mem = source_value;
                 int64_t index_in_dest_reg = 0;
                 int64_t index_in_tmp_reg = 0;
@@ -1032,187 +1289,1376 @@ static void encode_memcpy(
     }
 }
 
-static void generate_const(X64AsmBuilder *builder, SIRInstRef inst_ref)
+SIR_INLINE
+static bool is_register_value(const MetaValue &value)
 {
-    ZoneScoped;
-
-    SIRInst inst = SIRModuleGetInst(builder->module, inst_ref);
+    return value.kind == MetaValueKind_IRegister ||
+           value.kind == MetaValueKind_FRegister;
+}
 
-    switch (inst.kind) {
-    case SIRInstKind_Unknown:
-    case SIRInstKind_Alias:
-    case SIRInstKind_Global:
-    case SIRInstKind_StackSlot:
-    case SIRInstKind_Block:
-    case SIRInstKind_Function:
-    case SIRInstKind_FunctionParameter:
-    case SIRInstKind_SetCond:
-    case SIRInstKind_PushFunctionParameter:
-    case SIRInstKind_ReturnVoid:
-    case SIRInstKind_ReturnValue:
-    case SIRInstKind_Load:
-    case SIRInstKind_Store:
-    case SIRInstKind_Jump:
-    case SIRInstKind_Branch:
-    case SIRInstKind_PhiIncoming:
-    case SIRInstKind_Phi:
-    case SIRInstKind_FuncCall:
-    case SIRInstKind_BitCast:
-    case SIRInstKind_ZExt:
-    case SIRInstKind_SExt:
-    case SIRInstKind_Trunc:
-    case SIRInstKind_FPTrunc:
-    case SIRInstKind_FPExt:
-    case SIRInstKind_SIToFP:
-    case SIRInstKind_UIToFP:
-    case SIRInstKind_FPToSI:
-    case SIRInstKind_FPToUI:
-    case SIRInstKind_FNeg:
-    case SIRInstKind_ArrayElemPtr:
-    case SIRInstKind_StructElemPtr:
-    case SIRInstKind_ExtractArrayElem:
-    case SIRInstKind_ExtractStructElem:
-    case SIRInstKind_Binop: SIR_ASSERT(0); break;
+static void add_arg_move(
+    X64AsmBuilder *builder,
+    size_t size,
+    MetaValue source_value,
+    MetaValue dest_value)
+{
+    ArgMove move = {};
+    move.dest = dest_value;
+    move.source = source_value;
+    move.size = size;
+    builder->arg_moves.push_back(move);
+}
 
-    case SIRInstKind_ConstBool: {
-        builder->meta_insts[inst_ref.id] =
-            create_imm_int_value(1, inst.const_bool.value ? 1 : 0);
-        break;
-    }
+// Performs the moves of arg_moves as if they happened at once. Memory is
+// written first while every register still holds its source, then registers
+// are written once no other move reads them. A cycle of register moves is
+// broken by saving one of the registers to RAX, which is free until the
+// variadic float count is written. The remaining sources are in memory, whose
+// address never depends on an argument register, or are constants.
+static void encode_arg_moves(X64AsmBuilder *builder)
+{
+    ZoneScoped;
 
-    case SIRInstKind_ConstInt: {
-        uint8_t data[8];
+    SIRArray<ArgMove> *moves = &builder->arg_moves;
 
-        size_t byte_size = inst.type->int_.bits >> 3;
-        if (byte_size == 8 && inst.const_int.u64 > UINT32_MAX) {
-            *((uint64_t *)data) = inst.const_int.u64;
-            builder->meta_insts[inst_ref.id] = create_global_value(
-                builder,
-                SIRGlobalFlags_Initialized | SIRGlobalFlags_ReadOnly,
-                &data[0],
-                byte_size);
-        } else {
-            builder->meta_insts[inst_ref.id] =
-                create_imm_int_value(byte_size, inst.const_int.u64);
+    size_t len = 0;
+    for (size_t i = 0; i < moves->len; ++i) {
+        ArgMove move = (*moves)[i];
+        if (!is_register_value(move.dest)) {
+            encode_memcpy(
+                builder, move.size, move.source, move.dest, RegisterIndex_RAX);
+        } else if (
+            !is_register_value(move.source) ||
+            move.source.reg.index != move.dest.reg.index) {
+            (*moves)[len++] = move;
         }
-
-        break;
     }
+    moves->len = len;
+
+    for (;;) {
+        size_t first = SIR_NO_INDEX;
+        size_t ready = SIR_NO_INDEX;
+        for (size_t i = 0; i < moves->len && ready == SIR_NO_INDEX; ++i) {
+            ArgMove move = (*moves)[i];
+            if (!is_register_value(move.source)) continue;
+            if (first == SIR_NO_INDEX) first = i;
+
+            ready = i;
+            for (size_t j = 0; j < moves->len; ++j) {
+                MetaValue source = (*moves)[j].source;
+                if (j != i && is_register_value(source) &&
+                    source.reg.index == move.dest.reg.index) {
+                    ready = SIR_NO_INDEX;
+                    break;
+                }
+            }
+        }
+        if (first == SIR_NO_INDEX) break;
 
-    case SIRInstKind_ConstFloat: {
-        uint8_t data[8];
-        size_t byte_size = inst.type->float_.bits >> 3;
-
-        switch (byte_size) {
-        case 4: *((float *)data) = (float)inst.const_float.f64; break;
-        case 8: *((double *)data) = (double)inst.const_float.f64; break;
+        if (ready != SIR_NO_INDEX) {
+            ArgMove move = (*moves)[ready];
+            encode_memcpy(
+                builder, move.size, move.source, move.dest, RegisterIndex_RAX);
+            for (size_t i = ready + 1; i < moves->len; ++i) {
+                (*moves)[i - 1] = (*moves)[i];
+            }
+            moves->pop();
+            continue;
         }
 
-        builder->meta_insts[inst_ref.id] = create_global_value(
-            builder,
-            SIRGlobalFlags_Initialized | SIRGlobalFlags_ReadOnly,
-            &data[0],
-            byte_size);
+        RegisterIndex reg = (*moves)[first].dest.reg.index;
+        MetaValue saved_value = create_int_register_value(8, reg);
+        if (reg >= RegisterIndex_XMM0) {
+            saved_value = create_float_register_value(8, reg);
+        }
+        MetaValue tmp_value = create_int_register_value(8, RegisterIndex_RAX);
+        encode_mnem2(builder, Mnem_MOV, &tmp_value, &saved_value);
+
+        for (size_t i = 0; i < moves->len; ++i) {
+            MetaValue *source = &(*moves)[i].source;
+            if (is_register_value(*source) && source->reg.index == reg) {
+                *source = create_int_register_value(
+                    source->reg.bytes, RegisterIndex_RAX);
+            }
+        }
+    }
 
-        break;
+    for (ArgMove move : *moves) {
+        encode_memcpy(
+            builder, move.size, move.source, move.dest, RegisterIndex_RAX);
     }
+    moves->len = 0;
+}
+
+// Aliases and bitcasts share the storage of their operand
+static SIRInstRef get_storage_inst(SIRModule *module, SIRInstRef inst_ref)
+{
+    SIRInst inst = SIRModuleGetInst(module, inst_ref);
+    while (inst.kind == SIRInstKind_Alias || inst.kind == SIRInstKind_BitCast) {
+        inst_ref = inst.op1;
+        inst = SIRModuleGetInst(module, inst_ref);
     }
+    return inst_ref;
 }
 
-static void
-generate_inst(X64AsmBuilder *builder, SIRInstRef func_ref, SIRInstRef inst_ref)
+// Jumps are encoded with the rel32 form unless relax_jumps found that the
+// rel8 form reaches the destination. The displacement is patched once the
+// whole function is encoded.
+static size_t encode_jump(
+    X64AsmBuilder *builder,
+    MetaFunction *meta_func,
+    int64_t mnem,
+    SIRInstRef destination_block)
 {
-    ZoneScoped;
+    size_t patch_index = meta_func->jump_patches.len;
+    if (patch_index >= builder->short_jumps.len ||
+        !builder->short_jumps[patch_index]) {
+        mnem |= FE_JMPL;
+    }
 
-    MetaFunction *meta_func = builder->meta_insts[func_ref.id].func;
+    FuncJumpPatch patch = {};
+    patch.instruction = mnem;
+    patch.instruction_offset = builder_get_code_offset(builder);
+    patch.destination_block = destination_block;
+    patch.length = encode(builder, mnem, 0, 0, 0, 0);
+    meta_func->jump_patches.push_back(patch);
 
-    SIRInst inst = SIRModuleGetInst(builder->module, inst_ref);
+    return patch_index;
+}
 
-    switch (inst.kind) {
-    case SIRInstKind_Unknown:
-    case SIRInstKind_Function:
-    case SIRInstKind_Block:
-    case SIRInstKind_FunctionParameter:
-    case SIRInstKind_Global:
-    case SIRInstKind_StackSlot:
-    case SIRInstKind_ConstBool:
-    case SIRInstKind_ConstInt:
-    case SIRInstKind_ConstFloat: SIR_ASSERT(0); break;
+SIR_INLINE
+static bool block_has_phis(X64AsmBuilder *builder, SIRInstRef block_ref)
+{
+    SIRBlock *block = SIRModuleGetInst(builder->module, block_ref).block;
+    if (block->inst_refs.len == 0) return false;
+    SIRInstRef first_ref = block->inst_refs[0];
+    return SIRModuleGetInst(builder->module, first_ref).kind ==
+           SIRInstKind_Phi;
+}
 
-    case SIRInstKind_PhiIncoming: {
-        break;
-    }
+// Copies the incoming values of every phi in the destination block into the
+// phis' storage. The copies happen in parallel, so a phi used as the source of
+// another phi's copy is only overwritten once it has been read.
+static void encode_phi_copies(X64AsmBuilder *builder, SIRInstRef dest_block_ref)
+{
+    ZoneScoped;
 
-    case SIRInstKind_SetCond: {
-        builder->current_cond = inst.op1;
-        break;
-    }
+    SIRInst dest_block = SIRModuleGetInst(builder->module, dest_block_ref);
 
-    case SIRInstKind_PushFunctionParameter: {
-        builder->current_func_params.push_back(inst.op1);
-        break;
-    }
+    builder->phi_copies.len = 0;
 
-    case SIRInstKind_Alias: {
-        builder->meta_insts[inst_ref.id] = builder->meta_insts[inst.op1.id];
-        break;
+    SIRInstRef phi_ref = {0};
+    bool phi_found = false;
+    for (SIRInstRef next_inst_ref : dest_block.block->inst_refs) {
+        SIRInst next_inst = SIRModuleGetInst(builder->module, next_inst_ref);
+        if (next_inst.kind == SIRInstKind_Phi) {
+            phi_ref = next_inst_ref;
+            phi_found = false;
+            continue;
+        }
+        if (next_inst.kind != SIRInstKind_PhiIncoming) break;
+
+        if (!phi_found && next_inst.phi_incoming.block_ref.id ==
+                              builder->current_block.id) {
+            SIRInstRef value_ref = next_inst.phi_incoming.value_ref;
+
+            PhiCopy copy = {};
+            copy.dest_ref = phi_ref;
+            copy.source_ref = get_storage_inst(builder->module, value_ref);
+            copy.dest = builder->meta_insts[phi_ref.id];
+            copy.source = builder->meta_insts[value_ref.id];
+            copy.size = SIRTypeSizeOf(
+                builder->module,
+                SIRModuleGetInstType(builder->module, phi_ref));
+            builder->phi_copies.push_back(copy);
+
+            phi_found = true;
+        }
     }
 
-    case SIRInstKind_BitCast: {
-        builder->meta_insts[inst_ref.id] = builder->meta_insts[inst.op1.id];
-        break;
-    }
+    SIRArray<PhiCopy> *copies = &builder->phi_copies;
+    while (copies->len > 0) {
+        bool progress = false;
 
-    case SIRInstKind_ZExt: {
-        MetaValue dest_value = builder->meta_insts[inst_ref.id];
-        MetaValue source_value = builder->meta_insts[inst.op1.id];
-        Mnem mnem = Mnem_MOVZX;
+        for (size_t i = 0; i < copies->len; ++i) {
+            PhiCopy copy = (*copies)[i];
 
-        if (source_value.kind == MetaValueKind_ImmInt) {
-            source_value.size_class = dest_value.size_class;
-            mnem = Mnem_MOV;
-        }
+            bool blocked = false;
+            for (size_t j = 0; j < copies->len; ++j) {
+                if (j != i && (*copies)[j].source_ref.id == copy.dest_ref.id) {
+                    blocked = true;
+                    break;
+                }
+            }
+            if (blocked) continue;
 
-        encode_mnem2(builder, mnem, &dest_value, &source_value);
+            if (copy.source_ref.id != copy.dest_ref.id) {
+                encode_memcpy(builder, copy.size, copy.source, copy.dest);
+            }
 
-        break;
-    }
+            (*copies)[i] = (*copies)[copies->len - 1];
+            copies->pop();
+            progress = true;
+            break;
+        }
 
-    case SIRInstKind_SExt: {
-        MetaValue dest_value = builder->meta_insts[inst_ref.id];
-        MetaValue source_value = builder->meta_insts[inst.op1.id];
-        Mnem mnem = Mnem_MOVSX;
+        if (progress) continue;
 
-        if (source_value.kind == MetaValueKind_ImmInt) {
-            source_value.size_class = dest_value.size_class;
-            mnem = Mnem_MOV;
-        }
+        // Every remaining copy is part of a cycle, so one of the destinations
+        // is saved to a register to break it
+        PhiCopy copy = (*copies)[0];
+        SIR_ASSERT(copy.size <= 8);
 
-        encode_mnem2(builder, mnem, &dest_value, &source_value);
+        MetaValue tmp_value =
+            create_int_register_value(copy.size, RegisterIndex_RCX);
+        if (copy.dest.kind == MetaValueKind_FRegister) {
+            tmp_value =
+                create_float_register_value(copy.size, RegisterIndex_XMM0);
+        }
+        encode_memcpy(builder, copy.size, copy.dest, tmp_value);
 
-        break;
+        for (size_t j = 0; j < copies->len; ++j) {
+            if ((*copies)[j].source_ref.id == copy.dest_ref.id) {
+                (*copies)[j].source_ref = {0};
+                (*copies)[j].source = tmp_value;
+            }
+        }
     }
+}
 
-    case SIRInstKind_Trunc: {
-        MetaValue dest_value = builder->meta_insts[inst_ref.id];
-        MetaValue source_value = builder->meta_insts[inst.op1.id];
+SIR_INLINE
+static bool is_comparison(SIRBinaryOperation binop)
+{
+    return binop >= SIRBinaryOperation_IEQ && binop <= SIRBinaryOperation_FLE;
+}
 
-        SIRType *source_type = SIRModuleGetInst(builder->module, inst.op1).type;
-        SIRType *dest_type = inst.type;
+SIR_INLINE
+static bool is_folded(X64AsmBuilder *builder, SIRInstRef inst_ref)
+{
+    return builder->folded_into[inst_ref.id].id != 0;
+}
 
-        uint32_t source_size = SIRTypeSizeOf(builder->module, source_type);
-        uint32_t dest_size = SIRTypeSizeOf(builder->module, dest_type);
-        SIR_ASSERT(source_size >= dest_size);
+SIR_INLINE
+static const FrameSlot *
+get_frame_slot(X64AsmBuilder *builder, SIRInstRef inst_ref)
+{
+    uint32_t frame_slot = builder->intervals[inst_ref.id].frame_slot;
+    if (frame_slot == 0) return NULL;
+    return &builder->frame_slots[frame_slot - 1];
+}
 
-        source_value.size_class = dest_value.size_class;
-        encode_mnem2(builder, Mnem_MOV, &dest_value, &source_value);
+SIR_INLINE
+static bool is_elem_ptr(SIRInstKind kind)
+{
+    return kind == SIRInstKind_ArrayElemPtr ||
+           kind == SIRInstKind_StructElemPtr;
+}
 
-        break;
-    }
+// base + index * stride + offset, built from a chain of element pointers
+typedef struct Address {
+    SIRInstRef base_ref;
+    SIRInstRef index_ref; // {0} when all indices are constant
+    uint32_t stride;
+    int64_t offset;
+} Address;
 
-    case SIRInstKind_FPExt:
-    case SIRInstKind_FPTrunc: {
-        MetaValue dest_value = builder->meta_insts[inst_ref.id];
+static void
+add_elem_ptr_to_address(SIRModule *module, SIRInst elem_ptr, Address *address)
+{
+    SIRInst index = SIRModuleGetInst(module, elem_ptr.op2);
+    if (elem_ptr.kind == SIRInstKind_StructElemPtr) {
+        SIRType *struct_type =
+            SIRModuleGetInstType(module, elem_ptr.op1)->pointer.sub;
+        address->offset += SIRTypeStructOffsetOf(
+            module, struct_type, (uint32_t)index.const_int.u64);
+    } else {
+        uint32_t stride = SIRTypeSizeOf(module, elem_ptr.type->pointer.sub);
+        if (index.kind == SIRInstKind_ConstInt) {
+            address->offset += (int64_t)index.const_int.u64 * stride;
+        } else {
+            SIR_ASSERT(address->index_ref.id == 0);
+            address->index_ref = elem_ptr.op2;
+            address->stride = stride;
+        }
+    }
+    address->base_ref = elem_ptr.op1;
+}
+
+// Address of the value pointed to, element pointers folded into the pointer's
+// user are added to it
+static Address get_address(X64AsmBuilder *builder, SIRInstRef ptr_ref)
+{
+    Address address = {};
+    address.base_ref = ptr_ref;
+    while (is_folded(builder, address.base_ref)) {
+        SIRInst inst = SIRModuleGetInst(builder->module, address.base_ref);
+        SIR_ASSERT(is_elem_ptr(inst.kind));
+        add_elem_ptr_to_address(builder->module, inst, &address);
+    }
+    return address;
+}
+
+// Memory operand for an address. A base pointer that was spilled is loaded
+// into RCX, and an index that is not in a register or has a stride that can
+// not be a scale is computed in RDX.
+static MetaValue
+encode_address(X64AsmBuilder *builder, const Address *address, size_t size)
+{
+    ZoneScoped;
+
+    MetaValue base = builder->meta_insts[address->base_ref.id];
+    RegisterIndex base_reg = RegisterIndex_None;
+    int64_t offset = address->offset;
+    switch ((MetaValueKindOptions)base.kind) {
+    case MetaValueKind_IRegisterMemoryPtr: {
+        base_reg = base.regmem.base;
+        offset += base.regmem.offset;
+        break;
+    }
+    case MetaValueKind_GlobalPtr: {
+        if (address->index_ref.id == 0) {
+            base.kind = MetaValueKind_Global;
+            base.global.offset += offset;
+            switch (size) {
+            case 1:
+            case 2:
+            case 4:
+            case 8: base.size_class = SIZE_CLASSES[size]; break;
+            default: base.size_class = SizeClass_None; break;
+            }
+            return base;
+        }
+    }
+    // fallthrough
+    case MetaValueKind_IRegisterMemory: {
+        MetaValue ptr_value = create_int_register_value(8, RegisterIndex_RCX);
+        encode_mnem2(builder, Mnem_MOV, &ptr_value, &base);
+        base_reg = RegisterIndex_RCX;
+        break;
+    }
+    case MetaValueKind_IRegister: base_reg = base.reg.index; break;
+    default: SIR_ASSERT(0); break;
+    }
+
+    RegisterIndex index_reg = RegisterIndex_None;
+    int32_t scale = 0;
+    if (address->index_ref.id) {
+        MetaValue index = builder->meta_insts[address->index_ref.id];
+        switch (address->stride) {
+        case 1:
+        case 2:
+        case 4:
+        case 8: scale = address->stride; break;
+        default: scale = 1; break;
+        }
+
+        if (index.kind == MetaValueKind_IRegister &&
+            scale == (int32_t)address->stride) {
+            index_reg = index.reg.index;
+        } else {
+            MetaValue dx_value = create_int_register_value(
+                SIZE_CLASS_SIZES[index.size_class], RegisterIndex_RDX);
+            encode_mnem2(builder, Mnem_MOV, &dx_value, &index);
+            if (scale != (int32_t)address->stride) {
+                dx_value = create_int_register_value(8, RegisterIndex_RDX);
+                MetaValue stride_value =
+                    create_imm_int_value(8, address->stride);
+                encode_mnem3(
+                    builder, Mnem_MUL, &dx_value, &dx_value, &stride_value);
+            }
+            index_reg = RegisterIndex_RDX;
+        }
+    }
+
+    SIR_ASSERT(offset == (int32_t)offset);
+    return create_int_register_memory_value(
+        size, base_reg, scale, index_reg, (int32_t)offset);
+}
+
+// Value of an operand, a folded load becomes a memory operand of its user
+static MetaValue get_operand_value(X64AsmBuilder *builder, SIRInstRef inst_ref)
+{
+    SIRInst load = SIRModuleGetInst(builder->module, inst_ref);
+    if (!is_folded(builder, inst_ref) || load.kind != SIRInstKind_Load) {
+        return builder->meta_insts[inst_ref.id];
+    }
+
+    size_t value_size = SIRTypeSizeOf(builder->module, load.type);
+    Address address = get_address(builder, load.load.ptr_ref);
+    return encode_address(builder, &address, value_size);
+}
+
+SIR_INLINE
+static bool is_register_value(const MetaValue *value)
+{
+    return value->kind == MetaValueKind_IRegister ||
+           value->kind == MetaValueKind_FRegister;
+}
+
+// dest = left op right with an instruction that reads and writes its first
+// operand. A destination in memory is computed in the scratch register.
+static void encode_binop2(
+    X64AsmBuilder *builder,
+    Mnem mnem,
+    const MetaValue *dest,
+    const MetaValue *left,
+    const MetaValue *right,
+    const MetaValue *scratch)
+{
+    const MetaValue *target = is_register_value(dest) ? dest : scratch;
+    if (!is_register_value(left) || left->reg.index != target->reg.index) {
+        encode_mnem2(builder, Mnem_MOV, target, left);
+    }
+    encode_mnem2(builder, mnem, target, right);
+    if (target != dest) encode_mnem2(builder, Mnem_MOV, dest, target);
+}
+
+// Compares the operands of a comparison binop and returns the condition codes
+// that test its result in the flags
+static Condition encode_comparison(X64AsmBuilder *builder, SIRInst inst)
+{
+    ZoneScoped;
+
+    size_t operand_size = SIRTypeSizeOf(
+        builder->module, SIRModuleGetInst(builder->module, inst.op1).type);
+
+    MetaValue left_val = get_operand_value(builder, inst.op1);
+    MetaValue right_val = get_operand_value(builder, inst.op2);
+
+    if (inst.binop < SIRBinaryOperation_FEQ) {
+        // The right operand can be a register, memory or an immediate
+        if (!is_register_value(&left_val)) {
+            MetaValue ax_value =
+                create_int_register_value(operand_size, RegisterIndex_RAX);
+            encode_mnem2(builder, Mnem_MOV, &ax_value, &left_val);
+            left_val = ax_value;
+        }
+        encode_mnem2(builder, Mnem_CMP, &left_val, &right_val);
+    } else {
+        // Less than is greater than with the operands swapped
+        if (inst.binop == SIRBinaryOperation_FLT ||
+            inst.binop == SIRBinaryOperation_FLE) {
+            MetaValue tmp = left_val;
+            left_val = right_val;
+            right_val = tmp;
+        }
+
+        if (!is_register_value(&left_val)) {
+            MetaValue xmm0_value =
+                create_float_register_value(operand_size, RegisterIndex_XMM0);
+            encode_mnem2(builder, Mnem_MOV, &xmm0_value, &left_val);
+            left_val = xmm0_value;
+        }
+        encode_mnem2(builder, Mnem_SSE_UCOMIS, &left_val, &right_val);
+    }
+
+    Condition cond = {};
+    switch (inst.binop) {
+    default: SIR_ASSERT(0); break;
+    case SIRBinaryOperation_IEQ:
+    case SIRBinaryOperation_FEQ: cond = {FE_SETZ8r, FE_JZ, FE_JNZ}; break;
+    case SIRBinaryOperation_INE:
+    case SIRBinaryOperation_FNE: cond = {FE_SETNZ8r, FE_JNZ, FE_JZ}; break;
+    case SIRBinaryOperation_UGT:
+    case SIRBinaryOperation_FGT:
+    case SIRBinaryOperation_FLT: cond = {FE_SETA8r, FE_JA, FE_JBE}; break;
+    case SIRBinaryOperation_UGE:
+    case SIRBinaryOperation_FGE:
+    case SIRBinaryOperation_FLE: cond = {FE_SETNC8r, FE_JNC, FE_JC}; break;
+    case SIRBinaryOperation_ULT: cond = {FE_SETC8r, FE_JC, FE_JNC}; break;
+    case SIRBinaryOperation_ULE: cond = {FE_SETBE8r, FE_JBE, FE_JA}; break;
+    case SIRBinaryOperation_SGT: cond = {FE_SETG8r, FE_JG, FE_JLE}; break;
+    case SIRBinaryOperation_SGE: cond = {FE_SETGE8r, FE_JGE, FE_JL}; break;
+    case SIRBinaryOperation_SLT: cond = {FE_SETL8r, FE_JL, FE_JGE}; break;
+    case SIRBinaryOperation_SLE: cond = {FE_SETLE8r, FE_JLE, FE_JG}; break;
+    }
+    return cond;
+}
+
+// Scale of a shift or multiplication by a constant that lea can encode as a
+// scaled index, or 0
+static uint32_t get_index_scale(SIRModule *module, SIRInst inst)
+{
+    if (inst.kind != SIRInstKind_Binop) return 0;
+
+    SIRInst amount = SIRModuleGetInst(module, inst.op2);
+    if (amount.kind != SIRInstKind_ConstInt) return 0;
+
+    switch (inst.binop) {
+    case SIRBinaryOperation_Shl: {
+        if (amount.const_int.u64 >= 1 && amount.const_int.u64 <= 3) {
+            return 1u << amount.const_int.u64;
+        }
+        return 0;
+    }
+    case SIRBinaryOperation_IMul: {
+        switch (amount.const_int.u64) {
+        case 2:
+        case 4:
+        case 8: return (uint32_t)amount.const_int.u64;
+        default: return 0;
+        }
+    }
+    default: return 0;
+    }
+}
+
+// Whether a load can become a memory operand of the binop using it
+static bool can_fold_load_into(SIRModule *module, SIRInst user)
+{
+    if (user.kind != SIRInstKind_Binop) return false;
+
+    SIRType *type = SIRModuleGetInstType(module, user.op1);
+    uint32_t size = SIRTypeSizeOf(module, type);
+    if (type->kind == SIRTypeKind_Float) {
+        switch (user.binop) {
+        case SIRBinaryOperation_FAdd:
+        case SIRBinaryOperation_FSub:
+        case SIRBinaryOperation_FMul:
+        case SIRBinaryOperation_FDiv: return true;
+        default: return is_comparison(user.binop);
+        }
+    }
+
+    if (type->kind != SIRTypeKind_Int) return false;
+    switch (user.binop) {
+    case SIRBinaryOperation_IAdd:
+    case SIRBinaryOperation_ISub:
+    case SIRBinaryOperation_And:
+    case SIRBinaryOperation_Or:
+    case SIRBinaryOperation_Xor: return true;
+    case SIRBinaryOperation_IMul: return size >= 2;
+    default: return is_comparison(user.binop);
+    }
+}
+
+SIR_INLINE
+static bool is_commutative(SIRBinaryOperation binop)
+{
+    switch (binop) {
+    case SIRBinaryOperation_IAdd:
+    case SIRBinaryOperation_IMul:
+    case SIRBinaryOperation_And:
+    case SIRBinaryOperation_Or:
+    case SIRBinaryOperation_Xor:
+    case SIRBinaryOperation_FAdd:
+    case SIRBinaryOperation_FMul: return true;
+    default: return false;
+    }
+}
+
+// Whether an element pointer can be added to the address its single user
+// computes. The user must be in the same block and the whole chain can have
+// only one index that is not constant.
+static bool
+can_fold_elem_ptr(X64AsmBuilder *builder, SIRBlock *block, SIRInstRef inst_ref)
+{
+    SIRModule *module = builder->module;
+    SIRInst inst = SIRModuleGetInst(module, inst_ref);
+
+    SIRSlice<SIRInstRef> uses = SIRModuleGetUses(module, inst_ref);
+    if (uses.len != 1) return false;
+
+    SIRInstRef user_ref = uses[0];
+    SIRInst user = SIRModuleGetInst(module, user_ref);
+    SIRType *value_type = NULL;
+    switch (user.kind) {
+    case SIRInstKind_Load: value_type = user.type; break;
+    case SIRInstKind_Store: {
+        if (user.store.ptr_ref.id != inst_ref.id ||
+            user.store.value_ref.id == inst_ref.id) {
+            return false;
+        }
+        value_type = SIRModuleGetInstType(module, user.store.value_ref);
+        break;
+    }
+    case SIRInstKind_ArrayElemPtr:
+    case SIRInstKind_StructElemPtr: {
+        if (!is_folded(builder, user_ref) || user.op1.id != inst_ref.id) {
+            return false;
+        }
+        break;
+    }
+    default: return false;
+    }
+
+    // Parts of odd sized values are moved through RCX
+    if (value_type) {
+        uint32_t size = SIRTypeSizeOf(module, value_type);
+        if (size <= 8 && (size & (size - 1)) != 0) return false;
+    }
+
+    bool found = false;
+    for (SIRInstRef other_ref : block->inst_refs) {
+        if (other_ref.id == user_ref.id) found = true;
+    }
+    if (!found) return false;
+
+    if (inst.kind == SIRInstKind_StructElemPtr) return true;
+
+    SIRInst index = SIRModuleGetInst(module, inst.array_elem_ptr.index_ref);
+    uint32_t stride = SIRTypeSizeOf(module, inst.type->pointer.sub);
+    if (index.kind == SIRInstKind_ConstInt) {
+        int64_t offset = (int64_t)index.const_int.u64 * stride;
+        return offset >= -(1 << 24) && offset <= (1 << 24);
+    }
+
+    uint32_t index_size = SIRTypeSizeOf(module, index.type);
+    if (index_size != 4 && index_size != 8) return false;
+
+    while (is_elem_ptr(user.kind)) {
+        if (user.kind == SIRInstKind_ArrayElemPtr &&
+            SIRModuleGetInst(module, user.op2).kind != SIRInstKind_ConstInt) {
+            return false;
+        }
+        user_ref = builder->folded_into[user_ref.id];
+        user = SIRModuleGetInst(module, user_ref);
+    }
+    return true;
+}
+
+// Picks the instructions that are computed as part of a later instruction of
+// their block instead of getting storage of their own:
+// - element pointers only used to address a load, a store or another folded
+//   element pointer, which become part of the memory operand
+// - comparisons only used by the branch, which jumps on the flags
+// - shifts and multiplications by 2, 4 or 8 only used by an add, which
+//   becomes a lea with a scaled index
+// - loads only used as an operand of arithmetic, which reads memory directly
+static void select_folded_insts(X64AsmBuilder *builder, SIRFunction *func)
+{
+    ZoneScoped;
+
+    SIRModule *module = builder->module;
+    for (SIRInstRef block_ref : func->blocks) {
+        SIRBlock *block = SIRModuleGetInst(module, block_ref).block;
+        for (SIRInstRef inst_ref : block->inst_refs) {
+            builder->folded_into[inst_ref.id] = {0};
+        }
+
+        // Users come first so whole chains fold into the final access
+        for (size_t i = block->inst_refs.len; i-- > 0;) {
+            SIRInstRef inst_ref = block->inst_refs[i];
+            SIRInst inst = SIRModuleGetInst(module, inst_ref);
+            if (is_elem_ptr(inst.kind) &&
+                can_fold_elem_ptr(builder, block, inst_ref)) {
+                builder->folded_into[inst_ref.id] =
+                    SIRModuleGetUses(module, inst_ref)[0];
+            }
+        }
+
+        SIRInstRef cond_ref = {0};
+        for (SIRInstRef inst_ref : block->inst_refs) {
+            SIRInst inst = SIRModuleGetInst(module, inst_ref);
+            if (inst.kind == SIRInstKind_SetCond) cond_ref = inst.op1;
+
+            if (inst.kind == SIRInstKind_Branch && cond_ref.id) {
+                // Aliases of the result are fine as long as nothing else
+                // reads them either
+                SIRInst cond = SIRModuleGetInst(module, cond_ref);
+                while ((cond.kind == SIRInstKind_Alias ||
+                        cond.kind == SIRInstKind_BitCast) &&
+                       SIRModuleGetUses(module, cond_ref).len == 1) {
+                    cond_ref = cond.op1;
+                    cond = SIRModuleGetInst(module, cond_ref);
+                }
+                if (cond.kind == SIRInstKind_Binop &&
+                    is_comparison(cond.binop) &&
+                    SIRModuleGetUses(module, cond_ref).len == 1) {
+                    for (SIRInstRef other_ref : block->inst_refs) {
+                        if (other_ref.id == cond_ref.id) {
+                            builder->folded_into[cond_ref.id] = inst_ref;
+                        }
+                    }
+                }
+            }
+
+            if (inst.kind != SIRInstKind_Binop ||
+                inst.binop != SIRBinaryOperation_IAdd) {
+                continue;
+            }
+
+            uint32_t size =
+                SIRTypeSizeOf(module, SIRModuleGetInstType(module, inst_ref));
+            if (size != 4 && size != 8) continue;
+
+            SIRInstRef operands[2] = {inst.op1, inst.op2};
+            for (SIRInstRef operand_ref : operands) {
+                if (operand_ref.id == inst.op1.id &&
+                    operand_ref.id == inst.op2.id) {
+                    break;
+                }
+                SIRInst operand = SIRModuleGetInst(module, operand_ref);
+                if (!get_index_scale(module, operand)) continue;
+                if (SIRModuleGetUses(module, operand_ref).len != 1) continue;
+
+                for (SIRInstRef other_ref : block->inst_refs) {
+                    if (other_ref.id == inst_ref.id) break;
+                    if (other_ref.id == operand_ref.id) {
+                        builder->folded_into[operand_ref.id] = inst_ref;
+                        break;
+                    }
+                }
+                if (is_folded(builder, operand_ref)) break;
+            }
+        }
+
+        // Loads, memory must not change between the load and the
+        // instruction that ends up reading it
+        for (size_t i = 0; i < block->inst_refs.len; ++i) {
+            SIRInstRef load_ref = block->inst_refs[i];
+            SIRInst load = SIRModuleGetInst(module, load_ref);
+            if (load.kind != SIRInstKind_Load) continue;
+
+            SIRSlice<SIRInstRef> uses = SIRModuleGetUses(module, load_ref);
+            if (uses.len != 1) continue;
+
+            SIRInstRef user_ref = uses[0];
+            SIRInst user = SIRModuleGetInst(module, user_ref);
+            if (is_folded(builder, user_ref) &&
+                user.kind == SIRInstKind_Binop &&
+                !is_comparison(user.binop)) {
+                continue;
+            }
+            if (!can_fold_load_into(module, user)) continue;
+            if (user.op1.id == user.op2.id) continue;
+            if (user.op2.id != load_ref.id) {
+                SIRInst other = SIRModuleGetInst(module, user.op2);
+                if (!is_commutative(user.binop) ||
+                    other.kind == SIRInstKind_Load) {
+                    continue;
+                }
+            }
+
+            SIRInstRef reader_ref = user_ref;
+            if (is_folded(builder, user_ref)) {
+                reader_ref = builder->folded_into[user_ref.id];
+            }
+
+            bool clobbered = false;
+            bool found = false;
+            for (size_t j = i + 1; j < block->inst_refs.len; ++j) {
+                SIRInstRef other_ref = block->inst_refs[j];
+                if (other_ref.id == reader_ref.id) {
+                    found = true;
+                    break;
+                }
+                SIRInstKind kind = SIRModuleGetInst(module, other_ref).kind;
+                if (kind == SIRInstKind_Store ||
+                    kind == SIRInstKind_FuncCall) {
+                    clobbered = true;
+                    break;
+                }
+            }
+            if (clobbered || !found) continue;
+
+            if (user.op2.id != load_ref.id) {
+                SIRInst *user_inst = &module->insts[user_ref.id];
+                user_inst->op1 = user_inst->op2;
+                user_inst->op2 = load_ref;
+            }
+            builder->folded_into[load_ref.id] = user_ref;
+        }
+    }
+}
+
+// Additions with both operands in registers, an immediate or a folded scaled
+// index become a lea, which does not have to copy the left operand first
+static void encode_add(
+    X64AsmBuilder *builder,
+    SIRInst inst,
+    const MetaValue *dest,
+    MetaValue left,
+    MetaValue right)
+{
+    ZoneScoped;
+
+    SIRModule *module = builder->module;
+    uint32_t size = SIRTypeSizeOf(module, inst.type);
+    MetaValue ax_value = create_int_register_value(size, RegisterIndex_RAX);
+
+    // Keep any scaled index on the right
+    SIRInst op1 = SIRModuleGetInst(module, inst.op1);
+    SIRInst op2 = SIRModuleGetInst(module, inst.op2);
+    bool op1_index =
+        is_folded(builder, inst.op1) && op1.kind == SIRInstKind_Binop;
+    bool op2_index =
+        is_folded(builder, inst.op2) && op2.kind == SIRInstKind_Binop;
+    if (op1_index ||
+        (!op2_index && !is_register_value(&left) &&
+         is_register_value(&right))) {
+        MetaValue tmp = left;
+        left = right;
+        right = tmp;
+        SIRInst tmp_inst = op1;
+        op1 = op2;
+        op2 = tmp_inst;
+        op2_index = op1_index;
+    }
+
+    uint32_t scale = 1;
+    if (op2_index) {
+        scale = get_index_scale(module, op2);
+        right = builder->meta_insts[op2.op1.id];
+    } else if (
+        size < 4 || !is_register_value(dest) || !is_register_value(&left) ||
+        !(is_register_value(&right) || right.kind == MetaValueKind_ImmInt)) {
+        encode_binop2(builder, Mnem_ADD, dest, &left, &right, &ax_value);
+        return;
+    }
+
+    RegisterIndex base = RegisterIndex_None;
+    int64_t offset = 0;
+    if (is_register_value(&left)) {
+        base = left.reg.index;
+    } else if (left.kind == MetaValueKind_ImmInt) {
+        offset = (int64_t)left.imm_int.u64;
+    } else {
+        encode_mnem2(builder, Mnem_MOV, &ax_value, &left);
+        base = RegisterIndex_RAX;
+    }
+
+    RegisterIndex index = RegisterIndex_None;
+    if (is_register_value(&right)) {
+        index = right.reg.index;
+    } else if (
+        right.kind == MetaValueKind_ImmInt &&
+        offset + (int64_t)right.imm_int.u64 * scale == (int32_t)(
+            offset + (int64_t)right.imm_int.u64 * scale)) {
+        offset += (int64_t)right.imm_int.u64 * scale;
+        scale = 0;
+    } else {
+        MetaValue dx_value = create_int_register_value(
+            SIZE_CLASS_SIZES[right.size_class], RegisterIndex_RDX);
+        encode_mnem2(builder, Mnem_MOV, &dx_value, &right);
+        index = RegisterIndex_RDX;
+    }
+    if (index == RegisterIndex_None) scale = 0;
+
+    MetaValue address = create_int_register_memory_value(
+        size, base, scale, index, (int32_t)offset);
+    if (is_register_value(dest)) {
+        encode_mnem2(builder, Mnem_LEA, dest, &address);
+    } else {
+        encode_mnem2(builder, Mnem_LEA, &ax_value, &address);
+        encode_mnem2(builder, Mnem_MOV, dest, &ax_value);
+    }
+}
+
+// 32 and 64 bit multiplication. Constant factors of 0, 1, powers of two, 3, 5
+// and 9 become moves, shifts or a lea, other constants are the immediate of
+// the three operand imul.
+static void encode_mul(
+    X64AsmBuilder *builder,
+    const MetaValue *dest,
+    const MetaValue *left,
+    const MetaValue *right)
+{
+    ZoneScoped;
+
+    size_t size = SIZE_CLASS_SIZES[dest->size_class];
+    MetaValue ax_value = create_int_register_value(size, RegisterIndex_RAX);
+    if (right->kind != MetaValueKind_ImmInt) {
+        encode_binop2(builder, Mnem_MUL, dest, left, right, &ax_value);
+        return;
+    }
+
+    uint64_t mask = size == 8 ? ~0ULL : (1ULL << (size * 8)) - 1;
+    uint64_t factor = right->imm_int.u64 & mask;
+    const MetaValue *target = is_register_value(dest) ? dest : &ax_value;
+
+    if (factor == 0 || factor == 1) {
+        MetaValue zero_value = create_imm_int_value(size, 0);
+        encode_mnem2(
+            builder, Mnem_MOV, dest, factor == 0 ? &zero_value : left);
+        return;
+    }
+
+    if ((factor & (factor - 1)) == 0) {
+        MetaValue shift_value =
+            create_imm_int_value(1, (uint64_t)__builtin_ctzll(factor));
+        encode_binop2(
+            builder, Mnem_SHL, dest, left, &shift_value, &ax_value);
+        return;
+    }
+
+    if (factor == 3 || factor == 5 || factor == 9) {
+        const MetaValue *base = left;
+        if (!is_register_value(left)) {
+            encode_mnem2(builder, Mnem_MOV, target, left);
+            base = target;
+        }
+        MetaValue address = create_int_register_memory_value(
+            size, base->reg.index, (int32_t)factor - 1, base->reg.index, 0);
+        encode_mnem2(builder, Mnem_LEA, target, &address);
+    } else {
+        encode_mnem3(builder, Mnem_MUL, target, left, right);
+    }
+    if (target != dest) encode_mnem2(builder, Mnem_MOV, dest, target);
+}
+
+typedef struct DivisionMagic {
+    uint64_t multiplier;
+    uint32_t shift;
+    bool add; // The multiplier has one bit more than the operands
+} DivisionMagic;
+
+// Multiplier and shift for unsigned division by a constant of the given bit
+// width, Hacker's Delight 10-8. The divisor must not be 0 or 1.
+static DivisionMagic get_unsigned_magic(uint64_t divisor, uint32_t bits)
+{
+    uint64_t mask = bits == 64 ? ~0ULL : (1ULL << bits) - 1;
+    uint64_t min_signed = 1ULL << (bits - 1);
+    uint64_t max_signed = min_signed - 1;
+
+    DivisionMagic magic = {};
+    uint64_t nc = mask - ((0 - divisor) & mask) % divisor;
+    uint32_t p = bits - 1;
+    uint64_t q1 = min_signed / nc;
+    uint64_t r1 = min_signed - q1 * nc;
+    uint64_t q2 = max_signed / divisor;
+    uint64_t r2 = max_signed - q2 * divisor;
+    uint64_t delta = 0;
+    do {
+        p++;
+        if (r1 >= nc - r1) {
+            q1 = (2 * q1 + 1) & mask;
+            r1 = (2 * r1 - nc) & mask;
+        } else {
+            q1 = (2 * q1) & mask;
+            r1 = (2 * r1) & mask;
+        }
+        if (r2 + 1 >= divisor - r2) {
+            if (q2 >= max_signed) magic.add = true;
+            q2 = (2 * q2 + 1) & mask;
+            r2 = (2 * r2 + 1 - divisor) & mask;
+        } else {
+            if (q2 >= min_signed) magic.add = true;
+            q2 = (2 * q2) & mask;
+            r2 = (2 * r2 + 1) & mask;
+        }
+        delta = divisor - 1 - r2;
+    } while (p < 2 * bits && (q1 < delta || (q1 == delta && r1 == 0)));
+
+    magic.multiplier = (q2 + 1) & mask;
+    magic.shift = p - bits;
+    return magic;
+}
+
+// Multiplier and shift for signed division by a constant of the given bit
+// width, Hacker's Delight 10-1. The divisor must have an absolute value of at
+// least 2 and not be the minimum value.
+static DivisionMagic get_signed_magic(int64_t divisor, uint32_t bits)
+{
+    uint64_t mask = bits == 64 ? ~0ULL : (1ULL << bits) - 1;
+    uint64_t min_signed = 1ULL << (bits - 1);
+
+    DivisionMagic magic = {};
+    uint64_t ad = divisor < 0 ? (0 - (uint64_t)divisor) : (uint64_t)divisor;
+    uint64_t t = min_signed + (divisor < 0 ? 1 : 0);
+    uint64_t anc = t - 1 - t % ad;
+    uint32_t p = bits - 1;
+    uint64_t q1 = min_signed / anc;
+    uint64_t r1 = min_signed - q1 * anc;
+    uint64_t q2 = min_signed / ad;
+    uint64_t r2 = min_signed - q2 * ad;
+    uint64_t delta = 0;
+    do {
+        p++;
+        q1 = (2 * q1) & mask;
+        r1 = (2 * r1) & mask;
+        if (r1 >= anc) {
+            q1++;
+            r1 -= anc;
+        }
+        q2 = (2 * q2) & mask;
+        r2 = (2 * r2) & mask;
+        if (r2 >= ad) {
+            q2++;
+            r2 -= ad;
+        }
+        delta = ad - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+
+    magic.multiplier = (q2 + 1) & mask;
+    if (divisor < 0) magic.multiplier = (0 - magic.multiplier) & mask;
+    magic.shift = p - bits;
+    return magic;
+}
+
+// 32 and 64 bit division and remainder by a constant without div: shifts for
+// powers of two, otherwise a multiplication by the reciprocal that keeps the
+// high half of the product. The dividend must not be in RAX or RDX. Returns
+// false for divisors that still need div.
+static bool encode_div_by_constant(
+    X64AsmBuilder *builder,
+    SIRBinaryOperation binop,
+    size_t size,
+    const MetaValue *dest,
+    const MetaValue *left,
+    uint64_t divisor)
+{
+    ZoneScoped;
+
+    if (size != 4 && size != 8) return false;
+
+    bool is_signed =
+        binop == SIRBinaryOperation_SDiv || binop == SIRBinaryOperation_SRem;
+    bool is_rem =
+        binop == SIRBinaryOperation_SRem || binop == SIRBinaryOperation_URem;
+
+    uint32_t bits = (uint32_t)size * 8;
+    uint64_t mask = bits == 64 ? ~0ULL : (1ULL << bits) - 1;
+    uint64_t min_signed = 1ULL << (bits - 1);
+    divisor &= mask;
+    int64_t signed_divisor = (int64_t)(divisor << (64 - bits)) >> (64 - bits);
+
+    if (divisor == 0) return false;
+    if (is_signed && (signed_divisor == -1 || divisor == min_signed)) {
+        return false;
+    }
+
+    MetaValue ax_value = create_int_register_value(size, RegisterIndex_RAX);
+    MetaValue dx_value = create_int_register_value(size, RegisterIndex_RDX);
+
+    if (divisor == 1) {
+        MetaValue zero_value = create_imm_int_value(size, 0);
+        encode_mnem2(builder, Mnem_MOV, dest, is_rem ? &zero_value : left);
+        return true;
+    }
+
+    bool is_pow2 = (divisor & (divisor - 1)) == 0;
+    uint32_t log2 = (uint32_t)__builtin_ctzll(divisor);
+    MetaValue log2_value = create_imm_int_value(1, log2);
+
+    if (is_pow2 && !is_signed) {
+        if (!is_rem) {
+            encode_binop2(
+                builder, Mnem_SHR, dest, left, &log2_value, &ax_value);
+            return true;
+        }
+        if (divisor - 1 <= 0x7fffffff) {
+            MetaValue mask_value = create_imm_int_value(size, divisor - 1);
+            encode_binop2(
+                builder, Mnem_AND, dest, left, &mask_value, &ax_value);
+            return true;
+        }
+    }
+
+    if (is_pow2 && is_signed) {
+        // Negative dividends are biased by divisor - 1 to round towards zero
+        MetaValue sign_value = create_imm_int_value(1, bits - 1);
+        MetaValue bias_value = create_imm_int_value(1, bits - log2);
+        encode_mnem2(builder, Mnem_MOV, &ax_value, left);
+        encode_mnem2(builder, Mnem_MOV, &dx_value, &ax_value);
+        if (log2 > 1) encode_mnem2(builder, Mnem_SAR, &dx_value, &sign_value);
+        encode_mnem2(builder, Mnem_SHR, &dx_value, &bias_value);
+        encode_mnem2(builder, Mnem_ADD, &ax_value, &dx_value);
+        encode_mnem2(builder, Mnem_SAR, &ax_value, &log2_value);
+        if (is_rem) {
+            encode_mnem2(builder, Mnem_SHL, &ax_value, &log2_value);
+            encode_mnem2(builder, Mnem_MOV, &dx_value, left);
+            encode_mnem2(builder, Mnem_SUB, &dx_value, &ax_value);
+            encode_mnem2(builder, Mnem_MOV, dest, &dx_value);
+        } else {
+            encode_mnem2(builder, Mnem_MOV, dest, &ax_value);
+        }
+        return true;
+    }
+
+    // The quotient ends up in RDX
+    if (is_signed) {
+        DivisionMagic magic = get_signed_magic(signed_divisor, bits);
+        MetaValue magic_value = create_imm_int_value(size, magic.multiplier);
+        encode_mnem2(builder, Mnem_MOV, &ax_value, &magic_value);
+        encode_mnem1(builder, Mnem_IMUL, left);
+
+        bool negative_magic = (magic.multiplier & min_signed) != 0;
+        if (signed_divisor > 0 && negative_magic) {
+            encode_mnem2(builder, Mnem_ADD, &dx_value, left);
+        } else if (signed_divisor < 0 && !negative_magic) {
+            encode_mnem2(builder, Mnem_SUB, &dx_value, left);
+        }
+        if (magic.shift > 0) {
+            MetaValue shift_value = create_imm_int_value(1, magic.shift);
+            encode_mnem2(builder, Mnem_SAR, &dx_value, &shift_value);
+        }
+
+        // Negative quotients are rounded towards zero
+        MetaValue sign_value = create_imm_int_value(1, bits - 1);
+        encode_mnem2(builder, Mnem_MOV, &ax_value, &dx_value);
+        encode_mnem2(builder, Mnem_SHR, &ax_value, &sign_value);
+        encode_mnem2(builder, Mnem_ADD, &dx_value, &ax_value);
+    } else {
+        DivisionMagic magic = get_unsigned_magic(divisor, bits);
+        MetaValue magic_value = create_imm_int_value(size, magic.multiplier);
+        encode_mnem2(builder, Mnem_MOV, &ax_value, &magic_value);
+        encode_mnem1(builder, Mnem_MUL, left);
+
+        if (magic.add) {
+            // The product is missing the dividend, which is added back
+            // without overflowing
+            MetaValue one_value = create_imm_int_value(1, 1);
+            encode_mnem2(builder, Mnem_MOV, &ax_value, left);
+            encode_mnem2(builder, Mnem_SUB, &ax_value, &dx_value);
+            encode_mnem2(builder, Mnem_SHR, &ax_value, &one_value);
+            encode_mnem2(builder, Mnem_ADD, &dx_value, &ax_value);
+            if (magic.shift > 1) {
+                MetaValue shift_value =
+                    create_imm_int_value(1, magic.shift - 1);
+                encode_mnem2(builder, Mnem_SHR, &dx_value, &shift_value);
+            }
+        } else if (magic.shift > 0) {
+            MetaValue shift_value = create_imm_int_value(1, magic.shift);
+            encode_mnem2(builder, Mnem_SHR, &dx_value, &shift_value);
+        }
+    }
+
+    if (!is_rem) {
+        encode_mnem2(builder, Mnem_MOV, dest, &dx_value);
+        return true;
+    }
+
+    // remainder = dividend - quotient * divisor
+    MetaValue divisor_value = create_imm_int_value(size, divisor);
+    if ((int64_t)divisor == (int32_t)divisor || size == 4) {
+        encode_mnem3(builder, Mnem_MUL, &dx_value, &dx_value, &divisor_value);
+    } else {
+        encode_mnem2(builder, Mnem_MOV, &ax_value, &divisor_value);
+        encode_mnem2(builder, Mnem_MUL, &dx_value, &ax_value);
+    }
+    encode_mnem2(builder, Mnem_MOV, &ax_value, left);
+    encode_mnem2(builder, Mnem_SUB, &ax_value, &dx_value);
+    encode_mnem2(builder, Mnem_MOV, dest, &ax_value);
+    return true;
+}
+
+// Position of the instruction that encodes the value of a folded one
+SIR_INLINE
+static uint32_t
+get_folded_use_position(X64AsmBuilder *builder, SIRInstRef inst_ref)
+{
+    while (is_folded(builder, inst_ref)) {
+        inst_ref = builder->folded_into[inst_ref.id];
+    }
+    return builder->intervals[inst_ref.id].start;
+}
+
+static void generate_const(X64AsmBuilder *builder, SIRInstRef inst_ref)
+{
+    ZoneScoped;
+
+    SIRInst inst = SIRModuleGetInst(builder->module, inst_ref);
+
+    switch (inst.kind) {
+    case SIRInstKind_Unknown:
+    case SIRInstKind_Alias:
+    case SIRInstKind_Global:
+    case SIRInstKind_StackSlot:
+    case SIRInstKind_Block:
+    case SIRInstKind_Function:
+    case SIRInstKind_FunctionParameter:
+    case SIRInstKind_SetCond:
+    case SIRInstKind_PushFunctionParameter:
+    case SIRInstKind_ReturnVoid:
+    case SIRInstKind_ReturnValue:
+    case SIRInstKind_Load:
+    case SIRInstKind_Store:
+    case SIRInstKind_Jump:
+    case SIRInstKind_Branch:
+    case SIRInstKind_PhiIncoming:
+    case SIRInstKind_Phi:
+    case SIRInstKind_FuncCall:
+    case SIRInstKind_BitCast:
+    case SIRInstKind_ZExt:
+    case SIRInstKind_SExt:
+    case SIRInstKind_Trunc:
+    case SIRInstKind_FPTrunc:
+    case SIRInstKind_FPExt:
+    case SIRInstKind_SIToFP:
+    case SIRInstKind_UIToFP:
+    case SIRInstKind_FPToSI:
+    case SIRInstKind_FPToUI:
+    case SIRInstKind_FNeg:
+    case SIRInstKind_ArrayElemPtr:
+    case SIRInstKind_StructElemPtr:
+    case SIRInstKind_ExtractArrayElem:
+    case SIRInstKind_ExtractStructElem:
+    case SIRInstKind_Binop: SIR_ASSERT(0); break;
+
+    case SIRInstKind_ConstBool: {
+        builder->meta_insts[inst_ref.id] =
+            create_imm_int_value(1, inst.const_bool.value ? 1 : 0);
+        break;
+    }
+
+    case SIRInstKind_ConstInt: {
+        uint8_t data[8];
+
+        size_t byte_size = inst.type->int_.bits >> 3;
+        // 64 bit immediates are sign extended from 32 bits
+        int64_t value = (int64_t)inst.const_int.u64;
+        if (byte_size == 8 && value != (int64_t)(int32_t)value) {
+            *((uint64_t *)data) = inst.const_int.u64;
+            builder->meta_insts[inst_ref.id] = create_global_value(
+                builder,
+                SIRGlobalFlags_Initialized | SIRGlobalFlags_ReadOnly,
+                &data[0],
+                byte_size);
+        } else {
+            builder->meta_insts[inst_ref.id] =
+                create_imm_int_value(byte_size, inst.const_int.u64);
+        }
+
+        break;
+    }
+
+    case SIRInstKind_ConstFloat: {
+        uint8_t data[8];
+        size_t byte_size = inst.type->float_.bits >> 3;
+
+        switch (byte_size) {
+        case 4: *((float *)data) = (float)inst.const_float.f64; break;
+        case 8: *((double *)data) = (double)inst.const_float.f64; break;
+        }
+
+        builder->meta_insts[inst_ref.id] = create_global_value(
+            builder,
+            SIRGlobalFlags_Initialized | SIRGlobalFlags_ReadOnly,
+            &data[0],
+            byte_size);
+
+        break;
+    }
+    }
+}
+
+// Saves the values split at calls that are live across the call to their
+// frame slot, or reloads them after it. A value defined by the call itself
+// is the only one whose interval can start at the call.
+static void encode_split_values(
+    X64AsmBuilder *builder,
+    SIRInstRef func_ref,
+    SIRInstRef call_ref,
+    bool reload)
+{
+    MetaFunction *meta_func = builder->meta_insts[func_ref.id].func;
+    uint32_t position = builder->intervals[call_ref.id].position;
+    for (SIRInstRef value_ref : builder->split_values) {
+        Interval *interval = &builder->intervals[value_ref.id];
+        if (value_ref.id == call_ref.id || interval->start > position ||
+            interval->end <= position) {
+            continue;
+        }
+
+        const FrameSlot *slot = get_frame_slot(builder, value_ref);
+        uint32_t size = SIRTypeSizeOf(
+            builder->module, SIRModuleGetInstType(builder->module, value_ref));
+        MetaValue reg_value = builder->meta_insts[value_ref.id];
+        MetaValue slot_value =
+            create_stack_value(meta_func, size, -((int32_t)slot->offset));
+        if (reload) {
+            encode_memcpy(builder, size, slot_value, reg_value);
+        } else {
+            encode_memcpy(builder, size, reg_value, slot_value);
+        }
+    }
+}
+
+static void
+generate_inst(X64AsmBuilder *builder, SIRInstRef func_ref, SIRInstRef inst_ref)
+{
+    ZoneScoped;
+
+    MetaFunction *meta_func = builder->meta_insts[func_ref.id].func;
+
+    SIRInst inst = SIRModuleGetInst(builder->module, inst_ref);
+
+    switch (inst.kind) {
+    case SIRInstKind_Unknown:
+    case SIRInstKind_Function:
+    case SIRInstKind_Block:
+    case SIRInstKind_FunctionParameter:
+    case SIRInstKind_Global:
+    case SIRInstKind_StackSlot:
+    case SIRInstKind_ConstBool:
+    case SIRInstKind_ConstInt:
+    case SIRInstKind_ConstFloat: SIR_ASSERT(0); break;
+
+    case SIRInstKind_PhiIncoming: {
+        break;
+    }
+
+    case SIRInstKind_SetCond: {
+        builder->current_cond = inst.op1;
+        break;
+    }
+
+    case SIRInstKind_PushFunctionParameter: {
+        builder->current_func_params.push_back(inst.op1);
+        break;
+    }
+
+    case SIRInstKind_Alias: {
+        builder->meta_insts[inst_ref.id] = builder->meta_insts[inst.op1.id];
+        break;
+    }
+
+    case SIRInstKind_BitCast: {
+        builder->meta_insts[inst_ref.id] = builder->meta_insts[inst.op1.id];
+        break;
+    }
+
+    case SIRInstKind_ZExt: {
+        MetaValue dest_value = builder->meta_insts[inst_ref.id];
+        MetaValue source_value = builder->meta_insts[inst.op1.id];
+        Mnem mnem = Mnem_MOVZX;
+
+        if (source_value.kind == MetaValueKind_ImmInt) {
+            source_value.size_class = dest_value.size_class;
+            mnem = Mnem_MOV;
+        }
+
+        encode_mnem2(builder, mnem, &dest_value, &source_value);
+
+        break;
+    }
+
+    case SIRInstKind_SExt: {
+        MetaValue dest_value = builder->meta_insts[inst_ref.id];
+        MetaValue source_value = builder->meta_insts[inst.op1.id];
+        Mnem mnem = Mnem_MOVSX;
+
+        if (source_value.kind == MetaValueKind_ImmInt) {
+            source_value.size_class = dest_value.size_class;
+            mnem = Mnem_MOV;
+        }
+
+        encode_mnem2(builder, mnem, &dest_value, &source_value);
+
+        break;
+    }
+
+    case SIRInstKind_Trunc: {
+        MetaValue dest_value = builder->meta_insts[inst_ref.id];
+        MetaValue source_value = builder->meta_insts[inst.op1.id];
+
+        SIRType *source_type = SIRModuleGetInst(builder->module, inst.op1).type;
+        SIRType *dest_type = inst.type;
+
+        uint32_t source_size = SIRTypeSizeOf(builder->module, source_type);
+        uint32_t dest_size = SIRTypeSizeOf(builder->module, dest_type);
+        SIR_ASSERT(source_size >= dest_size);
+
+        source_value.size_class = dest_value.size_class;
+        encode_mnem2(builder, Mnem_MOV, &dest_value, &source_value);
+
+        break;
+    }
+
+    case SIRInstKind_FPExt:
+    case SIRInstKind_FPTrunc: {
+        MetaValue dest_value = builder->meta_insts[inst_ref.id];
         MetaValue source_value = builder->meta_insts[inst.op1.id];
 
         SIRType *source_type = SIRModuleGetInst(builder->module, inst.op1).type;
@@ -1335,7 +2781,8 @@ generate_inst(X64AsmBuilder *builder, SIRInstRef func_ref, SIRInstRef inst_ref)
         MetaValue dest_reg_value =
             create_int_register_value(SIR_MAX(dest_size, 4), RegisterIndex_RAX);
 
-        encode_mnem2(builder, Mnem_SSE_CVTS2SI, &dest_reg_value, &source_value);
+        encode_mnem2(
+            builder, Mnem_SSE_CVTTS2SI, &dest_reg_value, &source_value);
 
         dest_reg_value =
             create_int_register_value(dest_size, RegisterIndex_RAX);
@@ -1372,31 +2819,54 @@ generate_inst(X64AsmBuilder *builder, SIRInstRef func_ref, SIRInstRef inst_ref)
     }
 
     case SIRInstKind_Binop: {
+        // Encoded by the instruction it is folded into
+        if (is_folded(builder, inst_ref)) break;
+
         MetaValue dest_value = builder->meta_insts[inst_ref.id];
 
         size_t operand_size = SIRTypeSizeOf(
             builder->module, SIRModuleGetInst(builder->module, inst.op1).type);
 
-        MetaValue left_val = builder->meta_insts[inst.op1.id];
-        MetaValue right_val = builder->meta_insts[inst.op2.id];
+        MetaValue left_val = get_operand_value(builder, inst.op1);
+        MetaValue right_val = get_operand_value(builder, inst.op2);
+
+        MetaValue ax_scratch =
+            create_int_register_value(operand_size, RegisterIndex_RAX);
+        MetaValue xmm0_scratch =
+            create_float_register_value(operand_size, RegisterIndex_XMM0);
 
         switch (inst.binop) {
         case SIRBinaryOperation_Unknown:
         case SIRBinaryOperation_MAX: SIR_ASSERT(0); break;
 
         case SIRBinaryOperation_IAdd: {
-            encode_mnem2(builder, Mnem_MOV, &dest_value, &left_val);
-            encode_mnem2(builder, Mnem_ADD, &dest_value, &right_val);
+            encode_add(builder, inst, &dest_value, left_val, right_val);
             break;
         }
 
         case SIRBinaryOperation_ISub: {
-            encode_mnem2(builder, Mnem_MOV, &dest_value, &left_val);
-            encode_mnem2(builder, Mnem_SUB, &dest_value, &right_val);
+            encode_binop2(
+                builder,
+                Mnem_SUB,
+                &dest_value,
+                &left_val,
+                &right_val,
+                &ax_scratch);
             break;
         }
 
         case SIRBinaryOperation_IMul: {
+            if (left_val.kind == MetaValueKind_ImmInt &&
+                right_val.kind != MetaValueKind_ImmInt) {
+                MetaValue tmp_val = left_val;
+                left_val = right_val;
+                right_val = tmp_val;
+            }
+            if (operand_size >= 4 && left_val.kind != MetaValueKind_ImmInt) {
+                encode_mul(builder, &dest_value, &left_val, &right_val);
+                break;
+            }
+
             MetaValue ax_value =
                 create_int_register_value(operand_size, RegisterIndex_RAX);
             MetaValue dx_value =
@@ -1454,6 +2924,27 @@ generate_inst(X64AsmBuilder *builder, SIRInstRef func_ref, SIRInstRef inst_ref)
                 create_int_register_value(operand_size, RegisterIndex_RAX);
             MetaValue divisor_value = right_val;
 
+            SIRInst divisor_inst = SIRModuleGetInst(builder->module, inst.op2);
+            if (divisor_inst.kind == SIRInstKind_ConstInt &&
+                operand_size >= 4) {
+                // The dividend is read after RAX and RDX are clobbered
+                MetaValue cx_value =
+                    create_int_register_value(operand_size, RegisterIndex_RCX);
+                if (left_val.kind != MetaValueKind_IRegister) {
+                    encode_mnem2(builder, Mnem_MOV, &cx_value, &left_val);
+                    left_val = cx_value;
+                }
+                if (encode_div_by_constant(
+                        builder,
+                        inst.binop,
+                        operand_size,
+                        &dest_value,
+                        &left_val,
+                        divisor_inst.const_int.u64)) {
+                    break;
+                }
+            }
+
             bool is_signed = inst.binop == SIRBinaryOperation_SDiv ||
                              inst.binop == SIRBinaryOperation_SRem;
             bool is_rem = inst.binop == SIRBinaryOperation_SRem ||
@@ -1532,38 +3023,46 @@ generate_inst(X64AsmBuilder *builder, SIRInstRef func_ref, SIRInstRef inst_ref)
         }
 
         case SIRBinaryOperation_FAdd: {
-            MetaValue xmm0_value =
-                create_float_register_value(operand_size, RegisterIndex_XMM0);
-            encode_mnem2(builder, Mnem_MOV, &xmm0_value, &left_val);
-            encode_mnem2(builder, Mnem_SSE_ADD, &xmm0_value, &right_val);
-            encode_mnem2(builder, Mnem_MOV, &dest_value, &xmm0_value);
+            encode_binop2(
+                builder,
+                Mnem_SSE_ADD,
+                &dest_value,
+                &left_val,
+                &right_val,
+                &xmm0_scratch);
             break;
         }
 
         case SIRBinaryOperation_FSub: {
-            MetaValue xmm0_value =
-                create_float_register_value(operand_size, RegisterIndex_XMM0);
-            encode_mnem2(builder, Mnem_MOV, &xmm0_value, &left_val);
-            encode_mnem2(builder, Mnem_SSE_SUB, &xmm0_value, &right_val);
-            encode_mnem2(builder, Mnem_MOV, &dest_value, &xmm0_value);
+            encode_binop2(
+                builder,
+                Mnem_SSE_SUB,
+                &dest_value,
+                &left_val,
+                &right_val,
+                &xmm0_scratch);
             break;
         }
 
         case SIRBinaryOperation_FMul: {
-            MetaValue xmm0_value =
-                create_float_register_value(operand_size, RegisterIndex_XMM0);
-            encode_mnem2(builder, Mnem_MOV, &xmm0_value, &left_val);
-            encode_mnem2(builder, Mnem_SSE_MUL, &xmm0_value, &right_val);
-            encode_mnem2(builder, Mnem_MOV, &dest_value, &xmm0_value);
+            encode_binop2(
+                builder,
+                Mnem_SSE_MUL,
+                &dest_value,
+                &left_val,
+                &right_val,
+                &xmm0_scratch);
             break;
         }
 
         case SIRBinaryOperation_FDiv: {
-            MetaValue xmm0_value =
-                create_float_register_value(operand_size, RegisterIndex_XMM0);
-            encode_mnem2(builder, Mnem_MOV, &xmm0_value, &left_val);
-            encode_mnem2(builder, Mnem_SSE_DIV, &xmm0_value, &right_val);
-            encode_mnem2(builder, Mnem_MOV, &dest_value, &xmm0_value);
+            encode_binop2(
+                builder,
+                Mnem_SSE_DIV,
+                &dest_value,
+                &left_val,
+                &right_val,
+                &xmm0_scratch);
             break;
         }
 
@@ -1576,105 +3075,15 @@ generate_inst(X64AsmBuilder *builder, SIRInstRef func_ref, SIRInstRef inst_ref)
         case SIRBinaryOperation_SGT:
         case SIRBinaryOperation_SGE:
         case SIRBinaryOperation_SLT:
-        case SIRBinaryOperation_SLE: {
-            // TODO: comparison encoding could be better
-
-            MetaValue ax_value =
-                create_int_register_value(operand_size, RegisterIndex_RAX);
-            MetaValue dx_value =
-                create_int_register_value(operand_size, RegisterIndex_RDX);
-
-            encode_mnem2(
-                builder,
-                Mnem_MOV,
-                &ax_value,
-                &builder->meta_insts[inst.op1.id]);
-            encode_mnem2(
-                builder,
-                Mnem_MOV,
-                &dx_value,
-                &builder->meta_insts[inst.op2.id]);
-
-            int64_t x86_inst = 0;
-            switch (operand_size) {
-            case 1: x86_inst = FE_CMP8rr; break;
-            case 2: x86_inst = FE_CMP16rr; break;
-            case 4: x86_inst = FE_CMP32rr; break;
-            case 8: x86_inst = FE_CMP64rr; break;
-            default: SIR_ASSERT(0); break;
-            }
-
-            encode(builder, x86_inst, FE_AX, FE_DX, 0, 0);
-
-            int64_t opcode = 0;
-            switch (inst.binop) {
-            default: SIR_ASSERT(0); break;
-            case SIRBinaryOperation_IEQ: opcode = FE_SETZ8r; break;  // sete
-            case SIRBinaryOperation_INE: opcode = FE_SETNZ8r; break; // setne
-            case SIRBinaryOperation_UGT: opcode = FE_SETA8r; break;  // seta
-            case SIRBinaryOperation_UGE: opcode = FE_SETNC8r; break; // setae
-            case SIRBinaryOperation_ULT: opcode = FE_SETC8r; break;  // setb
-            case SIRBinaryOperation_ULE: opcode = FE_SETBE8r; break; // setbe
-            case SIRBinaryOperation_SGT: opcode = FE_SETG8r; break;  // setg
-            case SIRBinaryOperation_SGE: opcode = FE_SETGE8r; break; // setge
-            case SIRBinaryOperation_SLT: opcode = FE_SETL8r; break;  // setl
-            case SIRBinaryOperation_SLE: opcode = FE_SETLE8r; break; // setle
-            }
-
-            encode(builder, opcode, FE_AX, 0, 0, 0);
-
-            MetaValue al_value =
-                create_int_register_value(1, RegisterIndex_RAX);
-            encode(builder, FE_AND8ri, FE_AX, 1, 0, 0);
-            encode_mnem2(builder, Mnem_MOV, &dest_value, &al_value);
-            break;
-        }
-
+        case SIRBinaryOperation_SLE:
         case SIRBinaryOperation_FEQ:
         case SIRBinaryOperation_FNE:
         case SIRBinaryOperation_FGT:
         case SIRBinaryOperation_FGE:
         case SIRBinaryOperation_FLT:
         case SIRBinaryOperation_FLE: {
-            MetaValue xmm0_value =
-                create_float_register_value(operand_size, RegisterIndex_XMM0);
-            MetaValue xmm1_value =
-                create_float_register_value(operand_size, RegisterIndex_XMM1);
-
-            encode_mnem2(builder, Mnem_MOV, &xmm0_value, &left_val);
-            encode_mnem2(builder, Mnem_MOV, &xmm1_value, &right_val);
-
-            switch (inst.binop) {
-            default: SIR_ASSERT(0); break;
-            case SIRBinaryOperation_FEQ:
-            case SIRBinaryOperation_FNE:
-                encode_mnem2(
-                    builder, Mnem_SSE_UCOMIS, &xmm0_value, &xmm1_value);
-                break;
-            case SIRBinaryOperation_FGE:
-            case SIRBinaryOperation_FGT:
-                encode_mnem2(
-                    builder, Mnem_SSE_UCOMIS, &xmm0_value, &xmm1_value);
-                break;
-            case SIRBinaryOperation_FLT:
-            case SIRBinaryOperation_FLE:
-                encode_mnem2(
-                    builder, Mnem_SSE_UCOMIS, &xmm1_value, &xmm0_value);
-                break;
-            }
-
-            int64_t opcode = 0;
-            switch (inst.binop) {
-            default: SIR_ASSERT(0); break;
-            case SIRBinaryOperation_FEQ: opcode = FE_SETZ8r; break;  // sete
-            case SIRBinaryOperation_FNE: opcode = FE_SETNZ8r; break; // setne
-            case SIRBinaryOperation_FLT:
-            case SIRBinaryOperation_FGT: opcode = FE_SETA8r; break; // seta
-            case SIRBinaryOperation_FLE:
-            case SIRBinaryOperation_FGE: opcode = FE_SETNC8r; break; // setae
-            }
-
-            encode(builder, opcode, FE_AX, 0, 0, 0); // setae
+            Condition cond = encode_comparison(builder, inst);
+            encode(builder, cond.set, FE_AX, 0, 0, 0);
 
             MetaValue al_value =
                 create_int_register_value(1, RegisterIndex_RAX);
@@ -1694,8 +3103,8 @@ generate_inst(X64AsmBuilder *builder, SIRInstRef func_ref, SIRInstRef inst_ref)
             default: SIR_ASSERT(0); break;
             }
 
-            encode_mnem2(builder, Mnem_MOV, &dest_value, &left_val);
-            encode_mnem2(builder, mnem, &dest_value, &right_val);
+            encode_binop2(
+                builder, mnem, &dest_value, &left_val, &right_val, &ax_scratch);
             break;
         }
 
@@ -1734,54 +3143,19 @@ generate_inst(X64AsmBuilder *builder, SIRInstRef func_ref, SIRInstRef inst_ref)
     }
 
     case SIRInstKind_ArrayElemPtr: {
-        size_t index_size = SIRTypeSizeOf(
-            builder->module,
-            SIRModuleGetInst(builder->module, inst.array_elem_ptr.index_ref)
-                .type);
-
-        MetaValue index_value =
-            create_int_register_value(index_size, RegisterIndex_RCX);
-        encode_mnem2(
-            builder,
-            Mnem_MOV,
-            &index_value,
-            &builder->meta_insts[inst.array_elem_ptr.index_ref.id]);
+        if (is_folded(builder, inst_ref)) break;
 
-        MetaValue base_ptr_value =
-            create_int_register_value(8, RegisterIndex_RAX);
+        Address address = {};
+        add_elem_ptr_to_address(builder->module, inst, &address);
+        MetaValue value_addr = encode_address(builder, &address, 8);
         encode_mnem2(
-            builder,
-            Mnem_MOV,
-            &base_ptr_value,
-            &builder->meta_insts[inst.array_elem_ptr.accessed_ref.id]);
-
-        int32_t scale = SIRTypeSizeOf(builder->module, inst.type->pointer.sub);
-        switch (scale) {
-        case 1:
-        case 2:
-        case 4:
-        case 8: {
-            MetaValue value_addr = create_int_register_memory_value(
-                8, RegisterIndex_RAX, scale, RegisterIndex_RCX, 0);
-
-            encode_mnem2(
-                builder,
-                Mnem_LEA,
-                &builder->meta_insts[inst_ref.id],
-                &value_addr);
-            break;
-        }
-        default: {
-            // TODO: scale can only be 1, 2, 4, or 8
-            SIR_ASSERT(!"array access unimplemented for odd value sizes");
-            break;
-        }
-        }
-
+            builder, Mnem_LEA, &builder->meta_insts[inst_ref.id], &value_addr);
         break;
     }
 
     case SIRInstKind_StructElemPtr: {
+        if (is_folded(builder, inst_ref)) break;
+
         SIRInstRef field_index_ref = inst.struct_elem_ptr.field_index_ref;
         uint32_t field_index =
             SIRModuleGetInst(builder->module, field_index_ref).const_int.u64;
@@ -1910,46 +3284,14 @@ generate_inst(X64AsmBuilder *builder, SIRInstRef func_ref, SIRInstRef inst_ref)
     }
 
     case SIRInstKind_Store: {
-        size_t value_size = SIRTypeSizeOf(
-            builder->module,
-            SIRModuleGetInst(builder->module, inst.store.value_ref).type);
-
-        MetaValue stored_value = builder->meta_insts[inst.store.value_ref.id];
-
-        MetaValue dest_value = builder->meta_insts[inst.store.ptr_ref.id];
-        switch ((MetaValueKindOptions)dest_value.kind) {
-        case MetaValueKind_IRegisterMemoryPtr: {
-            dest_value.kind = MetaValueKind_IRegisterMemory;
-            break;
-        }
-        case MetaValueKind_GlobalPtr: {
-            /* dest_value.kind = MetaValueKind_Global; */
-            MetaValue new_ptr_value =
-                create_int_register_value(8, RegisterIndex_RCX);
-            encode_mnem2(builder, Mnem_MOV, &new_ptr_value, &dest_value);
-            dest_value = create_int_register_memory_value(
-                value_size, new_ptr_value.reg.index, 0, RegisterIndex_None, 0);
-            break;
-        }
-        case MetaValueKind_IRegister: {
-            MetaValue new_ptr_value = create_int_register_memory_value(
-                value_size, dest_value.reg.index, 0, RegisterIndex_None, 0);
-            dest_value = new_ptr_value;
-            break;
-        }
-        case MetaValueKind_IRegisterMemory: {
-            MetaValue new_ptr_value =
-                create_int_register_value(8, RegisterIndex_RCX);
-            encode_mnem2(builder, Mnem_MOV, &new_ptr_value, &dest_value);
-            dest_value = create_int_register_memory_value(
-                value_size, new_ptr_value.reg.index, 0, RegisterIndex_None, 0);
-            break;
-        }
-        default: {
-            SIR_ASSERT(0);
-            break;
-        }
-        }
+        size_t value_size = SIRTypeSizeOf(
+            builder->module,
+            SIRModuleGetInst(builder->module, inst.store.value_ref).type);
+
+        MetaValue stored_value = builder->meta_insts[inst.store.value_ref.id];
+
+        Address address = get_address(builder, inst.store.ptr_ref);
+        MetaValue dest_value = encode_address(builder, &address, value_size);
 
         encode_memcpy(builder, value_size, stored_value, dest_value);
 
@@ -1957,37 +3299,13 @@ generate_inst(X64AsmBuilder *builder, SIRInstRef func_ref, SIRInstRef inst_ref)
     }
 
     case SIRInstKind_Load: {
+        if (is_folded(builder, inst_ref)) break;
+
         size_t value_size = SIRTypeSizeOf(builder->module, inst.type);
 
-        MetaValue source_value = builder->meta_insts[inst.load.ptr_ref.id];
-        switch ((MetaValueKindOptions)source_value.kind) {
-        case MetaValueKind_IRegisterMemoryPtr: {
-            source_value.kind = MetaValueKind_IRegisterMemory;
-            break;
-        }
-        case MetaValueKind_GlobalPtr: {
-            source_value.kind = MetaValueKind_Global;
-            break;
-        }
-        case MetaValueKind_IRegister: {
-            MetaValue new_ptr_value = create_int_register_memory_value(
-                value_size, source_value.reg.index, 0, RegisterIndex_None, 0);
-            source_value = new_ptr_value;
-            break;
-        }
-        case MetaValueKind_IRegisterMemory: {
-            MetaValue new_ptr_value =
-                create_int_register_value(8, RegisterIndex_RCX);
-            encode_mnem2(builder, Mnem_MOV, &new_ptr_value, &source_value);
-            source_value = create_int_register_memory_value(
-                value_size, new_ptr_value.reg.index, 0, RegisterIndex_None, 0);
-            break;
-        }
-        default: {
-            SIR_ASSERT(0);
-            break;
-        }
-        }
+        Address address = get_address(builder, inst.load.ptr_ref);
+        MetaValue source_value =
+            encode_address(builder, &address, value_size);
 
         encode_memcpy(
             builder,
@@ -2003,11 +3321,22 @@ generate_inst(X64AsmBuilder *builder, SIRInstRef func_ref, SIRInstRef inst_ref)
         SIRFunction *called_func =
             SIRModuleGetInst(builder->module, called_func_ref).func;
 
-        // TODO: save and restore caller-saved registers
-
         SIR_ASSERT(
             called_func->param_types_len <= builder->current_func_params.len);
 
+        // A tail call passes its stack arguments where the function received
+        // its own, above the return address
+        bool tail = builder->tail_calls[inst_ref.id];
+        MetaFunction *meta_func = builder->meta_insts[func_ref.id].func;
+        RegisterIndex stack_args_register = RegisterIndex_RSP;
+        int32_t stack_args_offset = 0;
+        if (tail) {
+            stack_args_register = meta_func->frame_register;
+            stack_args_offset = meta_func->frame_offset + 16;
+        } else {
+            encode_split_values(builder, func_ref, inst_ref, false);
+        }
+
         switch (called_func->calling_convention) {
         case SIRCallingConvention_SystemV: {
             uint32_t used_int_regs = 0;
@@ -2015,7 +3344,8 @@ generate_inst(X64AsmBuilder *builder, SIRInstRef func_ref, SIRInstRef inst_ref)
 
             size_t param_stack_offset = 0;
 
-            // Write parameters to ABI locations
+            // Write parameters to ABI locations, the moves are resolved at
+            // once so that arguments can be computed in any register
             for (size_t i = 0; i < builder->current_func_params.len; ++i) {
                 SIRInstRef param_inst_ref = builder->current_func_params[i];
                 SIR_ASSERT(param_inst_ref.id > 0);
@@ -2069,7 +3399,7 @@ generate_inst(X64AsmBuilder *builder, SIRInstRef func_ref, SIRInstRef inst_ref)
                             break;
                         }
 
-                        encode_memcpy(
+                        add_arg_move(
                             builder,
                             param_size1,
                             param_meta_inst1,
@@ -2098,7 +3428,7 @@ generate_inst(X64AsmBuilder *builder, SIRInstRef func_ref, SIRInstRef inst_ref)
                             break;
                         }
 
-                        encode_memcpy(
+                        add_arg_move(
                             builder,
                             param_size2,
                             param_meta_inst2,
@@ -2112,14 +3442,14 @@ generate_inst(X64AsmBuilder *builder, SIRInstRef func_ref, SIRInstRef inst_ref)
                     MetaValue dest_param_value =
                         create_int_register_memory_value(
                             param_size,
-                            RegisterIndex_RSP,
+                            stack_args_register,
                             0,
                             RegisterIndex_None,
-                            param_stack_offset);
+                            stack_args_offset + (int32_t)param_stack_offset);
                     param_stack_offset +=
                         param_size; // TODO: not sure if builder should have
                                     // alignment added to it
-                    encode_memcpy(
+                    add_arg_move(
                         builder,
                         param_size,
                         source_param_value,
@@ -2127,6 +3457,8 @@ generate_inst(X64AsmBuilder *builder, SIRInstRef func_ref, SIRInstRef inst_ref)
                 }
             }
 
+            encode_arg_moves(builder);
+
             if (called_func->variadic) {
                 // Write the amount of vector registers to %AL
                 MetaValue float_count_imm =
@@ -2144,6 +3476,12 @@ generate_inst(X64AsmBuilder *builder, SIRInstRef func_ref, SIRInstRef inst_ref)
         // Reset parameter list
         builder->current_func_params.len = 0;
 
+        if (tail) {
+            encode_frame_release(builder, func_ref);
+            encode_direct_call(builder, called_func_ref, true);
+            break;
+        }
+
         encode_direct_call(builder, called_func_ref);
 
         // Move returned values to result location
@@ -2219,6 +3557,7 @@ generate_inst(X64AsmBuilder *builder, SIRInstRef func_ref, SIRInstRef inst_ref)
         }
         }
 
+        encode_split_values(builder, func_ref, inst_ref, true);
         break;
     }
 
@@ -2310,158 +3649,73 @@ generate_inst(X64AsmBuilder *builder, SIRInstRef func_ref, SIRInstRef inst_ref)
     }
 
     case SIRInstKind_Jump: {
-        SIRInst dest_block = SIRModuleGetInst(builder->module, inst.op1);
-
-        SIRInstRef phi_ref = {0};
-        for (size_t i = 0; i < dest_block.block->inst_refs.len; ++i) {
-            SIRInstRef next_inst_ref = dest_block.block->inst_refs[i];
-            SIRInst next_inst =
-                SIRModuleGetInst(builder->module, next_inst_ref);
-            if (i == 0) {
-                if (next_inst.kind != SIRInstKind_Phi) break;
-
-                phi_ref = next_inst_ref;
-            } else {
-                if (next_inst.kind != SIRInstKind_PhiIncoming) break;
-
-                if (next_inst.phi_incoming.block_ref.id ==
-                    builder->current_block.id) {
-                    encode_memcpy(
-                        builder,
-                        SIRTypeSizeOf(
-                            builder->module,
-                            SIRModuleGetInstType(builder->module, phi_ref)),
-                        builder
-                            ->meta_insts[next_inst.phi_incoming.value_ref.id],
-                        builder->meta_insts[phi_ref.id]);
-                    break;
-                }
-            }
+        encode_phi_copies(builder, inst.op1);
+        if (inst.op1.id != builder->next_block.id) {
+            encode_jump(builder, meta_func, FE_JMP, inst.op1);
         }
-
-        FuncJumpPatch patch = {
-            .instruction = FE_JMP | FE_JMPL,
-            .instruction_offset = builder_get_code_offset(builder),
-            .destination_block = inst.op1,
-        };
-        meta_func->jump_patches.push_back(patch);
-
-        encode(builder, FE_JMP | FE_JMPL, -patch.instruction_offset, 0, 0, 0);
-
         break;
     }
     case SIRInstKind_Branch: {
-        MetaValue al_value = create_int_register_value(1, RegisterIndex_RAX);
-
         SIRInstRef true_block = inst.op1;
         SIRInstRef false_block = inst.op2;
 
-        SIRInstRef true_phi = {0};
-        SIRInstRef true_phi_value = {0};
-        SIRInstRef false_phi = {0};
-        SIRInstRef false_phi_value = {0};
-
-        SIRInst dest_block;
+        Condition cond = {FE_SETNZ8r, FE_JNZ, FE_JZ};
+        SIRInstRef cond_ref =
+            get_storage_inst(builder->module, builder->current_cond);
+        if (is_folded(builder, cond_ref)) {
+            cond = encode_comparison(
+                builder, SIRModuleGetInst(builder->module, cond_ref));
+        } else {
+            MetaValue al_value =
+                create_int_register_value(1, RegisterIndex_RAX);
+            encode_mnem2(
+                builder,
+                Mnem_MOV,
+                &al_value,
+                &builder->meta_insts[builder->current_cond.id]);
+            encode(builder, FE_TEST8rr, FE_AX, FE_AX, 0, 0);
+        }
 
-        // Get true phi
-        dest_block = SIRModuleGetInst(builder->module, true_block);
-        for (size_t i = 0; i < dest_block.block->inst_refs.len; ++i) {
-            SIRInstRef next_inst_ref = dest_block.block->inst_refs[i];
-            SIRInst next_inst =
-                SIRModuleGetInst(builder->module, next_inst_ref);
-            if (i == 0) {
-                if (next_inst.kind != SIRInstKind_Phi) break;
+        // Phi copies of one edge must not run on the other, so the edge with
+        // copies gets its own path out of the block
+        bool true_copies = block_has_phis(builder, true_block);
+        bool false_copies = block_has_phis(builder, false_block);
 
-                true_phi = next_inst_ref;
-            } else {
-                if (next_inst.kind != SIRInstKind_PhiIncoming) break;
+        if (!true_copies) {
+            if (true_block.id == builder->next_block.id && !false_copies) {
+                encode_jump(
+                    builder, meta_func, cond.inverse_jump, false_block);
+                break;
+            }
 
-                if (next_inst.phi_incoming.block_ref.id ==
-                    builder->current_block.id) {
-                    true_phi_value = next_inst.phi_incoming.value_ref;
-                    break;
-                }
+            encode_jump(builder, meta_func, cond.jump, true_block);
+            encode_phi_copies(builder, false_block);
+            if (false_block.id != builder->next_block.id) {
+                encode_jump(builder, meta_func, FE_JMP, false_block);
             }
+            break;
         }
 
-        // Get false phi
-        dest_block = SIRModuleGetInst(builder->module, false_block);
-        for (size_t i = 0; i < dest_block.block->inst_refs.len; ++i) {
-            SIRInstRef next_inst_ref = dest_block.block->inst_refs[i];
-            SIRInst next_inst =
-                SIRModuleGetInst(builder->module, next_inst_ref);
-            if (i == 0) {
-                if (next_inst.kind != SIRInstKind_Phi) break;
-
-                false_phi = next_inst_ref;
-            } else {
-                if (next_inst.kind != SIRInstKind_PhiIncoming) break;
-
-                if (next_inst.phi_incoming.block_ref.id ==
-                    builder->current_block.id) {
-                    false_phi_value = next_inst.phi_incoming.value_ref;
-                    break;
-                }
+        if (!false_copies) {
+            encode_jump(builder, meta_func, cond.inverse_jump, false_block);
+            encode_phi_copies(builder, true_block);
+            if (true_block.id != builder->next_block.id) {
+                encode_jump(builder, meta_func, FE_JMP, true_block);
             }
+            break;
         }
 
-        encode_mnem2(
-            builder,
-            Mnem_MOV,
-            &al_value,
-            &builder->meta_insts[builder->current_cond.id]);
-
-        encode(
-            builder,
-            FE_TEST8rr,
-            REGISTERS[al_value.reg.index],
-            REGISTERS[al_value.reg.index],
-            0,
-            0);
-
-        if (true_phi.id) {
-            encode_memcpy(
-                builder,
-                SIRTypeSizeOf(
-                    builder->module,
-                    SIRModuleGetInstType(builder->module, true_phi)),
-                builder->meta_insts[true_phi_value.id],
-                builder->meta_insts[true_phi.id]);
-        }
-
-        FuncJumpPatch true_patch = {
-            .instruction = FE_JNZ | FE_JMPL,
-            .instruction_offset = builder_get_code_offset(builder),
-            .destination_block = true_block,
-        };
-        meta_func->jump_patches.push_back(true_patch);
-        encode(
-            builder, FE_JNZ | FE_JMPL, -true_patch.instruction_offset, 0, 0, 0);
-
-        if (false_phi.id) {
-            encode_memcpy(
-                builder,
-                SIRTypeSizeOf(
-                    builder->module,
-                    SIRModuleGetInstType(builder->module, false_phi)),
-                builder->meta_insts[false_phi_value.id],
-                builder->meta_insts[false_phi.id]);
-        }
-
-        FuncJumpPatch false_patch = {
-            .instruction = FE_JMP | FE_JMPL,
-            .instruction_offset = builder_get_code_offset(builder),
-            .destination_block = false_block,
-        };
-        meta_func->jump_patches.push_back(false_patch);
-        encode(
-            builder,
-            FE_JMP | FE_JMPL,
-            -false_patch.instruction_offset,
-            0,
-            0,
-            0);
+        size_t false_path =
+            encode_jump(builder, meta_func, cond.inverse_jump, SIRInstRef{0});
+        encode_phi_copies(builder, true_block);
+        encode_jump(builder, meta_func, FE_JMP, true_block);
 
+        meta_func->jump_patches[false_path].destination_offset =
+            builder_get_code_offset(builder);
+        encode_phi_copies(builder, false_block);
+        if (false_block.id != builder->next_block.id) {
+            encode_jump(builder, meta_func, FE_JMP, false_block);
+        }
         break;
     }
     case SIRInstKind_Phi: {
@@ -2483,8 +3737,10 @@ SIR_INLINE void generate_global(X64AsmBuilder *builder, SIRInstRef global_ref)
         global.global->data_len);
 }
 
-SIR_INLINE void
-move_func_params_to_stack(X64AsmBuilder *builder, SIRFunction *func)
+// Moves the parameters from where the calling convention passes them to the
+// registers or frame slots they were given
+SIR_INLINE void move_func_params(
+    X64AsmBuilder *builder, SIRFunction *func, const MetaFunction *meta_func)
 {
     ZoneScoped;
 
@@ -2533,7 +3789,7 @@ move_func_params_to_stack(X64AsmBuilder *builder, SIRFunction *func)
                         break;
                     }
 
-                    encode_memcpy(
+                    add_arg_move(
                         builder, param_size1, param_value1, param_meta_inst1);
                 }
 
@@ -2558,46 +3814,47 @@ move_func_params_to_stack(X64AsmBuilder *builder, SIRFunction *func)
                         break;
                     }
 
-                    encode_memcpy(
+                    add_arg_move(
                         builder, param_size2, param_value2, param_meta_inst2);
                 }
             } else {
                 MetaValue param_value = create_int_register_memory_value(
                     param_size,
-                    RegisterIndex_RBP,
+                    meta_func->frame_register,
                     0,
                     RegisterIndex_None,
-                    stack_param_offset);
+                    stack_param_offset + meta_func->frame_offset);
                 stack_param_offset += param_size;
 
-                encode_memcpy(
-                    builder, param_size, param_value, param_meta_inst);
+                add_arg_move(builder, param_size, param_value, param_meta_inst);
             }
         }
 
+        encode_arg_moves(builder);
         break;
     }
     }
 }
 
-SIR_INLINE size_t get_func_call_stack_parameters_size(
-    X64AsmBuilder *builder, SIRInstRef func_call_ref)
+// Stack space for passing the given values as arguments to a function of the
+// calling convention
+SIR_INLINE size_t get_stack_parameters_size(
+    X64AsmBuilder *builder,
+    SIRCallingConvention calling_convention,
+    SIRSlice<SIRInstRef> param_refs)
 {
     ZoneScoped;
 
     size_t stack_parameters_size = 0;
 
-    SIRInst func_call = SIRModuleGetInst(builder->module, func_call_ref);
-    SIRFunction *called_func =
-        SIRModuleGetInst(builder->module, func_call.op1).func;
-
-    switch (called_func->calling_convention) {
+    switch (calling_convention) {
     case SIRCallingConvention_SystemV: {
         uint32_t used_int_regs = 0;
         uint32_t used_float_regs = 0;
 
-        for (uint32_t i = 0; i < called_func->param_types_len; ++i) {
-            SIRType *param_type = called_func->param_types[i];
+        for (SIRInstRef param_ref : param_refs) {
+            SIRType *param_type =
+                SIRModuleGetInstType(builder->module, param_ref);
 
             uint32_t param_align = SIRTypeAlignOf(builder->module, param_type);
             stack_parameters_size =
@@ -2671,6 +3928,58 @@ SIR_INLINE size_t get_func_call_stack_parameters_size(
     return stack_parameters_size;
 }
 
+// Stack space for the arguments in current_func_params, which includes the
+// variadic ones
+SIR_INLINE size_t get_func_call_stack_parameters_size(
+    X64AsmBuilder *builder, SIRInstRef func_call_ref)
+{
+    SIRInst func_call = SIRModuleGetInst(builder->module, func_call_ref);
+    SIRFunction *called_func =
+        SIRModuleGetInst(builder->module, func_call.op1).func;
+    return get_stack_parameters_size(
+        builder,
+        called_func->calling_convention,
+        builder->current_func_params.as_slice());
+}
+
+// Marks the calls in tail position whose stack arguments fit in the space
+// the function received its own in, and whose result comes back in
+// registers. Like the tailcall pass, this only happens above -O0.
+static void select_tail_calls(
+    X64AsmBuilder *builder, SIRInstRef func_ref, SIRFunction *func)
+{
+    ZoneScoped;
+
+    if (builder->vt.opt_level == SIROptLevel_O0) return;
+
+    SIRModule *module = builder->module;
+    size_t own_stack_parameters_size = get_stack_parameters_size(
+        builder, func->calling_convention, func->param_insts.as_slice());
+
+    builder->current_func_params.len = 0;
+    for (SIRInstRef block_ref : func->blocks) {
+        SIRBlock *block = SIRModuleGetInst(module, block_ref).block;
+        for (size_t i = 0; i < block->inst_refs.len; ++i) {
+            SIRInstRef inst_ref = block->inst_refs[i];
+            SIRInst inst = SIRModuleGetInst(module, inst_ref);
+            if (inst.kind == SIRInstKind_PushFunctionParameter) {
+                builder->current_func_params.push_back(inst.op1);
+                continue;
+            }
+            if (inst.kind != SIRInstKind_FuncCall) continue;
+
+            SIRFunction *called_func = SIRModuleGetInst(module, inst.op1).func;
+            builder->tail_calls[inst_ref.id] =
+                called_func->calling_convention == func->calling_convention &&
+                SIRTypeSizeOf(module, called_func->return_type) <= 16 &&
+                get_func_call_stack_parameters_size(builder, inst_ref) <=
+                    own_stack_parameters_size &&
+                SIRFunctionIsTailCall(module, func_ref, block_ref, i);
+            builder->current_func_params.len = 0;
+        }
+    }
+}
+
 static bool is_inst_reg_allocatable(SIRInstKind kind)
 {
     switch (kind) {
@@ -2690,12 +3999,12 @@ static bool is_inst_reg_allocatable(SIRInstKind kind)
     case SIRInstKind_Branch:
     case SIRInstKind_PhiIncoming:
     case SIRInstKind_Global:
-    case SIRInstKind_StackSlot: return false;
+    case SIRInstKind_StackSlot:
     case SIRInstKind_Alias:
+    case SIRInstKind_BitCast: return false;
     case SIRInstKind_Load:
     case SIRInstKind_Phi:
     case SIRInstKind_FuncCall:
-    case SIRInstKind_BitCast:
     case SIRInstKind_ZExt:
     case SIRInstKind_SExt:
     case SIRInstKind_Trunc:
@@ -2716,105 +4025,531 @@ static bool is_inst_reg_allocatable(SIRInstKind kind)
     return false;
 }
 
-static bool inst_has_operands(SIRInstKind kind)
+static RegisterClass get_type_register_class(SIRModule *module, SIRType *type)
 {
-    switch (kind) {
-    case SIRInstKind_Unknown:
-    case SIRInstKind_ConstInt:
-    case SIRInstKind_ConstFloat:
-    case SIRInstKind_ConstBool:
-    case SIRInstKind_Block:
-    case SIRInstKind_Function:
-    case SIRInstKind_FunctionParameter:
-    case SIRInstKind_ReturnVoid:
-    case SIRInstKind_Jump:
-    case SIRInstKind_Branch:
-    case SIRInstKind_Global:
-    case SIRInstKind_StackSlot: return false;
-    case SIRInstKind_PushFunctionParameter:
-    case SIRInstKind_SetCond:
-    case SIRInstKind_PhiIncoming:
-    case SIRInstKind_ReturnValue:
-    case SIRInstKind_Store:
-    case SIRInstKind_Alias:
-    case SIRInstKind_Load:
-    case SIRInstKind_Phi:
-    case SIRInstKind_FuncCall:
-    case SIRInstKind_BitCast:
-    case SIRInstKind_ZExt:
-    case SIRInstKind_SExt:
-    case SIRInstKind_Trunc:
-    case SIRInstKind_FPTrunc:
-    case SIRInstKind_FPExt:
-    case SIRInstKind_SIToFP:
-    case SIRInstKind_UIToFP:
-    case SIRInstKind_FPToSI:
-    case SIRInstKind_FPToUI:
-    case SIRInstKind_FNeg:
-    case SIRInstKind_ArrayElemPtr:
-    case SIRInstKind_StructElemPtr:
-    case SIRInstKind_ExtractArrayElem:
-    case SIRInstKind_ExtractStructElem:
-    case SIRInstKind_Binop: return true;
+    if (!type) return RegisterClass_None;
+
+    switch (type->kind) {
+    case SIRTypeKind_Int:
+    case SIRTypeKind_Bool:
+    case SIRTypeKind_Pointer: {
+        switch (SIRTypeSizeOf(module, type)) {
+        case 1:
+        case 2:
+        case 4:
+        case 8: return RegisterClass_Int;
+        default: return RegisterClass_None;
+        }
     }
+    case SIRTypeKind_Float: return RegisterClass_Float;
+    default: return RegisterClass_None;
+    }
+}
 
-    return false;
+// Struct field pointers into a stack slot are folded into the address of the
+// slot by generate_inst, so they never need storage
+static bool is_stack_address(SIRModule *module, SIRInstRef inst_ref)
+{
+    for (;;) {
+        inst_ref = get_storage_inst(module, inst_ref);
+        SIRInst inst = SIRModuleGetInst(module, inst_ref);
+        switch (inst.kind) {
+        case SIRInstKind_StackSlot: return true;
+        case SIRInstKind_StructElemPtr: inst_ref = inst.op1; break;
+        default: return false;
+        }
+    }
+}
+
+SIR_INLINE
+static uint64_t *
+get_live_set(X64AsmBuilder *builder, size_t set, size_t block, size_t words)
+{
+    return builder->live_sets.ptr + (block * 5 + set) * words;
+}
+
+// Liveness of every value whose type fits in a register, turned into one
+// interval per value that spans all positions the value is live at.
+// Positions are instruction indices in the order blocks are emitted.
+static void compute_intervals(X64AsmBuilder *builder, SIRFunction *func)
+{
+    ZoneScoped;
+
+    SIRModule *module = builder->module;
+    enum { LiveIn, LiveOut, Use, Def, PhiUse };
+
+    // Values a bitcast reinterprets as the other register class have to stay
+    // in memory
+    builder->values.len = 0;
+    for (SIRInstRef block_ref : func->blocks) {
+        SIRBlock *block = SIRModuleGetInst(module, block_ref).block;
+        for (SIRInstRef inst_ref : block->inst_refs) {
+            SIRInst inst = SIRModuleGetInst(module, inst_ref);
+            if (inst.kind != SIRInstKind_Alias &&
+                inst.kind != SIRInstKind_BitCast) {
+                continue;
+            }
+
+            SIRInstRef storage_ref = get_storage_inst(module, inst_ref);
+            if (get_type_register_class(module, inst.type) !=
+                get_type_register_class(
+                    module, SIRModuleGetInstType(module, storage_ref))) {
+                builder->value_indices[storage_ref.id] = VALUE_INDEX_EXCLUDED;
+            }
+        }
+    }
+
+    // Parameters are live from before the first instruction and are wanted in
+    // the registers they arrive in
+    uint32_t used_int_regs = 0;
+    uint32_t used_float_regs = 0;
+    for (SIRInstRef param_ref : func->param_insts) {
+        SIRType *type = SIRModuleGetInstType(module, param_ref);
+        Interval *interval = &builder->intervals[param_ref.id];
+        *interval = {};
+        interval->hint = sysv_next_param_register(
+            builder, type, &used_int_regs, &used_float_regs);
+
+        if (builder->value_indices[param_ref.id] == VALUE_INDEX_NONE &&
+            get_type_register_class(module, type) != RegisterClass_None) {
+            builder->value_indices[param_ref.id] =
+                (uint32_t)builder->values.len;
+            builder->values.push_back(param_ref);
+        }
+    }
+    used_int_regs = 0;
+    used_float_regs = 0;
+
+    uint32_t position = 0;
+    builder->block_starts.resize(func->blocks.len);
+    builder->block_ends.resize(func->blocks.len);
+    builder->call_counts.len = 0;
+    uint32_t call_count = 0;
+    for (size_t b = 0; b < func->blocks.len; ++b) {
+        SIRBlock *block = SIRModuleGetInst(module, func->blocks[b]).block;
+        block->index = (uint32_t)b;
+        builder->block_starts[b] = position;
+        for (SIRInstRef inst_ref : block->inst_refs) {
+            SIRInst inst = SIRModuleGetInst(module, inst_ref);
+
+            // Nothing is live after a tail call, the function can still
+            // be a leaf
+            builder->call_counts.push_back(call_count);
+            if (inst.kind == SIRInstKind_FuncCall &&
+                !builder->tail_calls[inst_ref.id]) {
+                call_count++;
+            }
+
+            Interval *interval = &builder->intervals[inst_ref.id];
+            *interval = {};
+            interval->start = position;
+            interval->end = position;
+            interval->position = position;
+
+            // Arguments are wanted in the register they are passed in
+            if (inst.kind == SIRInstKind_PushFunctionParameter) {
+                SIRInstRef value_ref = get_storage_inst(module, inst.op1);
+                RegisterIndex reg = sysv_next_param_register(
+                    builder,
+                    SIRModuleGetInstType(module, inst.op1),
+                    &used_int_regs,
+                    &used_float_regs);
+                if (!builder->intervals[value_ref.id].hint) {
+                    builder->intervals[value_ref.id].hint = reg;
+                }
+            } else if (inst.kind == SIRInstKind_FuncCall) {
+                used_int_regs = 0;
+                used_float_regs = 0;
+            }
+
+            if (builder->value_indices[inst_ref.id] == VALUE_INDEX_NONE &&
+                is_inst_reg_allocatable(inst.kind) &&
+                !is_folded(builder, inst_ref) &&
+                get_type_register_class(module, inst.type) !=
+                    RegisterClass_None &&
+                !(inst.kind == SIRInstKind_StructElemPtr &&
+                  is_stack_address(module, inst_ref))) {
+                builder->value_indices[inst_ref.id] =
+                    (uint32_t)builder->values.len;
+                builder->values.push_back(inst_ref);
+            }
+            position++;
+        }
+        builder->block_ends[b] = (position > builder->block_starts[b])
+                                     ? position - 1
+                                     : position;
+    }
+    builder->call_counts.push_back(call_count);
+
+    size_t words = (builder->values.len + 63) / 64;
+    builder->live_sets.resize(func->blocks.len * 5 * words);
+    for (size_t i = 0; i < builder->live_sets.len; ++i) {
+        builder->live_sets[i] = 0;
+    }
+
+    // Arguments are read by the call and branch conditions by the branch,
+    // phi incoming values at the end of the predecessor
+    for (size_t b = 0; b < func->blocks.len; ++b) {
+        SIRBlock *block = SIRModuleGetInst(module, func->blocks[b]).block;
+        uint64_t *uses = get_live_set(builder, Use, b, words);
+        uint64_t *defs = get_live_set(builder, Def, b, words);
+
+        uint32_t next_call = builder->block_ends[b];
+        for (size_t i = block->inst_refs.len; i-- > 0;) {
+            SIRInstRef inst_ref = block->inst_refs[i];
+            SIRInst inst = SIRModuleGetInst(module, inst_ref);
+            uint32_t inst_position = builder->block_starts[b] + (uint32_t)i;
+            if (inst.kind == SIRInstKind_FuncCall) next_call = inst_position;
+            if (inst.kind != SIRInstKind_PushFunctionParameter) continue;
+            builder->intervals[inst_ref.id].end = next_call;
+        }
+
+        SIRInstRef phi_ref = {0};
+        for (size_t i = 0; i < block->inst_refs.len; ++i) {
+            SIRInstRef inst_ref = block->inst_refs[i];
+            SIRInst *inst = &module->insts[inst_ref.id];
+            uint32_t inst_position = builder->block_starts[b] + (uint32_t)i;
+
+            // Operands of a folded instruction are read by the instruction
+            // that encodes it
+            uint32_t use_position = inst_position;
+            if (is_folded(builder, inst_ref)) {
+                use_position = get_folded_use_position(builder, inst_ref);
+            }
+            uint64_t *use_set = uses;
+            switch (inst->kind) {
+            case SIRInstKind_PushFunctionParameter: {
+                use_position = builder->intervals[inst_ref.id].end;
+                break;
+            }
+            case SIRInstKind_SetCond: {
+                use_position = builder->block_ends[b];
+                break;
+            }
+            case SIRInstKind_Phi: {
+                phi_ref = inst_ref;
+                break;
+            }
+            case SIRInstKind_PhiIncoming: {
+                SIRInstRef pred_ref = inst->phi_incoming.block_ref;
+                uint32_t pred = SIRModuleGetInst(module, pred_ref).block->index;
+                use_position = builder->block_ends[pred];
+                use_set = get_live_set(builder, PhiUse, pred, words);
+
+                // The phi is written by the copies at the end of the
+                // predecessor
+                Interval *phi = &builder->intervals[phi_ref.id];
+                phi->start = SIR_MIN(phi->start, use_position);
+                phi->end = SIR_MAX(phi->end, use_position);
+                break;
+            }
+            default: break;
+            }
+
+            SIRInstRef *operands[2];
+            uint32_t operand_count = SIRInstGetOperands(inst, operands);
+            for (uint32_t j = 0; j < operand_count; ++j) {
+                SIRInstRef value_ref = get_storage_inst(module, *operands[j]);
+                uint32_t value = builder->value_indices[value_ref.id];
+                if (value >= VALUE_INDEX_EXCLUDED) continue;
+
+                Interval *interval = &builder->intervals[value_ref.id];
+                interval->end = SIR_MAX(interval->end, use_position);
+                uint64_t bit = 1ULL << (value % 64);
+                if (use_set != uses || !(defs[value / 64] & bit)) {
+                    use_set[value / 64] |= bit;
+                }
+            }
+
+            uint32_t value = builder->value_indices[inst_ref.id];
+            if (value < VALUE_INDEX_EXCLUDED) {
+                defs[value / 64] |= 1ULL << (value % 64);
+            }
+        }
+    }
+
+    // Backwards dataflow until nothing changes, visiting blocks in reverse
+    // emission order converges quickly for the usual forward layouts
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t b = func->blocks.len; b-- > 0;) {
+            uint64_t *live_in = get_live_set(builder, LiveIn, b, words);
+            uint64_t *live_out = get_live_set(builder, LiveOut, b, words);
+            uint64_t *uses = get_live_set(builder, Use, b, words);
+            uint64_t *defs = get_live_set(builder, Def, b, words);
+            uint64_t *phi_uses = get_live_set(builder, PhiUse, b, words);
+
+            SIRInstRef term_ref =
+                SIRBlockGetTerminator(module, func->blocks[b]);
+            SIRInstRef succs[2] = {};
+            if (term_ref.id) {
+                SIRInst term = SIRModuleGetInst(module, term_ref);
+                switch (term.kind) {
+                case SIRInstKind_Jump: succs[0] = term.op1; break;
+                case SIRInstKind_Branch: {
+                    succs[0] = term.op1;
+                    succs[1] = term.op2;
+                    break;
+                }
+                default: break;
+                }
+            }
+
+            for (size_t w = 0; w < words; ++w) {
+                uint64_t out = phi_uses[w];
+                for (SIRInstRef succ_ref : succs) {
+                    if (!succ_ref.id) continue;
+                    uint32_t succ =
+                        SIRModuleGetInst(module, succ_ref).block->index;
+                    out |= get_live_set(builder, LiveIn, succ, words)[w];
+                }
+                uint64_t in = uses[w] | (out & ~defs[w]);
+                if (out != live_out[w] || in != live_in[w]) changed = true;
+                live_out[w] = out;
+                live_in[w] = in;
+            }
+        }
+    }
+
+    for (size_t b = 0; b < func->blocks.len; ++b) {
+        uint64_t *live_in = get_live_set(builder, LiveIn, b, words);
+        uint64_t *live_out = get_live_set(builder, LiveOut, b, words);
+        for (size_t value = 0; value < builder->values.len; ++value) {
+            uint64_t bit = 1ULL << (value % 64);
+            Interval *interval = &builder->intervals[builder->values[value].id];
+            if (live_in[value / 64] & bit) {
+                interval->start =
+                    SIR_MIN(interval->start, builder->block_starts[b]);
+            }
+            if (live_out[value / 64] & bit) {
+                interval->end = SIR_MAX(interval->end, builder->block_ends[b]);
+            }
+        }
+    }
 }
 
-static void
-reg_alloc(X64AsmBuilder *builder, SIRFunction *func, MetaFunction *meta_func)
-{
-    (void)meta_func;
+// Linear scan over the intervals in order of their start. When no register
+// is free, the interval that ends last is spilled to the stack. Values live
+// across a call prefer callee saved registers. Otherwise they are split at
+// the calls: they keep a caller saved or XMM register between the calls and
+// are saved to a frame slot and reloaded around each of them. Parameters and
+// arguments take the register they are passed in when it is free.
+static void
+reg_alloc(X64AsmBuilder *builder, SIRFunction *func, MetaFunction *meta_func)
+{
+    ZoneScoped;
+
+    SIRModule *module = builder->module;
+
+    compute_intervals(builder, func);
+
+    // Counting sort by start position
+    size_t position_count = builder->call_counts.len;
+    builder->start_offsets.resize(position_count + 1);
+    for (size_t i = 0; i < builder->start_offsets.len; ++i) {
+        builder->start_offsets[i] = 0;
+    }
+    for (SIRInstRef value_ref : builder->values) {
+        builder->start_offsets[builder->intervals[value_ref.id].start + 1]++;
+    }
+    for (size_t i = 1; i < builder->start_offsets.len; ++i) {
+        builder->start_offsets[i] += builder->start_offsets[i - 1];
+    }
+    builder->sorted_values.resize(builder->values.len);
+    for (SIRInstRef value_ref : builder->values) {
+        uint32_t start = builder->intervals[value_ref.id].start;
+        builder->sorted_values[builder->start_offsets[start]++] = value_ref;
+    }
+
+    SIRArray<SIRInstRef> *active = &builder->active_values;
+    active->len = 0;
+    for (SIRInstRef value_ref : builder->sorted_values) {
+        Interval *interval = &builder->intervals[value_ref.id];
+        RegisterClass reg_class = get_type_register_class(
+            module, SIRModuleGetInstType(module, value_ref));
+
+        for (size_t i = 0; i < active->len;) {
+            Interval *other = &builder->intervals[(*active)[i].id];
+            if (other->end >= interval->start) {
+                ++i;
+                continue;
+            }
+
+            if (other->reg >= RegisterIndex_XMM0) {
+                free_float_register(meta_func, other->reg);
+            } else {
+                free_int_register(meta_func, other->reg);
+            }
+            (*active)[i] = (*active)[active->len - 1];
+            active->pop();
+        }
+
+        // Parameters are defined before the instruction at their start
+        uint32_t def_end = interval->start + 1;
+        if (SIRModuleGetInst(module, value_ref).kind ==
+            SIRInstKind_FunctionParameter) {
+            def_end = interval->start;
+        }
+        bool crosses_call =
+            builder->call_counts[interval->end] > builder->call_counts[def_end];
+
+        RegisterIndex reg = RegisterIndex_None;
+        switch (reg_class) {
+        case RegisterClass_Int: {
+            reg = alloc_int_register(meta_func, crosses_call, interval->hint);
+            if (reg == RegisterIndex_None && crosses_call) {
+                reg = alloc_int_register(meta_func, false, interval->hint);
+            }
+            break;
+        }
+        case RegisterClass_Float: {
+            reg = alloc_float_register(meta_func, false, interval->hint);
+            break;
+        }
+        default: SIR_ASSERT(0); break;
+        }
+
+        if (reg != RegisterIndex_None) {
+            interval->reg = reg;
+            interval->split_at_calls =
+                crosses_call && !is_callee_saved(meta_func, reg);
+            active->push_back(value_ref);
+            continue;
+        }
 
-    size_t inst_index = 0;
-    for (SIRInstRef block_ref : func->blocks) {
-        SIRInst block = SIRModuleGetInst(builder->module, block_ref);
-        for (size_t i = 0; i < block.block->inst_refs.len; ++i, ++inst_index) {
-            SIRInstRef inst_ref = block.block->inst_refs.ptr[i];
-            SIRInst inst = SIRModuleGetInst(builder->module, inst_ref);
-            SIRType *type = SIRModuleGetInstType(builder->module, inst_ref);
+        // Take the register of the active interval that ends last
+        size_t victim = SIR_NO_INDEX;
+        uint32_t victim_end = interval->end;
+        for (size_t i = 0; i < active->len; ++i) {
+            Interval *other = &builder->intervals[(*active)[i].id];
+            bool other_is_float = other->reg >= RegisterIndex_XMM0;
+            if (other_is_float != (reg_class == RegisterClass_Float)) continue;
+            if (other->end > victim_end) {
+                victim = i;
+                victim_end = other->end;
+            }
+        }
+        if (victim == SIR_NO_INDEX) continue;
+
+        Interval *other = &builder->intervals[(*active)[victim].id];
+        interval->reg = other->reg;
+        interval->split_at_calls =
+            crosses_call && !is_callee_saved(meta_func, other->reg);
+        other->reg = RegisterIndex_None;
+        other->split_at_calls = false;
+        (*active)[victim] = value_ref;
+    }
 
-            Interval *interval = &builder->intervals[inst_ref.id];
+    builder->split_values.len = 0;
+    for (SIRInstRef value_ref : builder->values) {
+        builder->value_indices[value_ref.id] = VALUE_INDEX_NONE;
 
-            if (inst_has_operands(inst.kind)) {
-                if (inst.op1.id) {
-                    SIRInstKind op1_kind =
-                        SIRModuleGetInstKind(builder->module, inst.op1);
-                    if (is_inst_reg_allocatable(op1_kind)) {
-                        builder->intervals[inst.op1.id].end = inst_index;
-                    }
-                }
-                if (inst.op2.id) {
-                    SIRInstKind op2_kind =
-                        SIRModuleGetInstKind(builder->module, inst.op2);
-                    if (is_inst_reg_allocatable(op2_kind)) {
-                        builder->intervals[inst.op2.id].end = inst_index;
-                    }
-                }
-            }
+        Interval interval = builder->intervals[value_ref.id];
+        if (interval.reg == RegisterIndex_None) continue;
+        if (interval.split_at_calls) builder->split_values.push_back(value_ref);
 
-            if (!type) continue;
+        SIRType *type = SIRModuleGetInstType(module, value_ref);
+        uint8_t size = (uint8_t)SIRTypeSizeOf(module, type);
+        if (interval.reg >= RegisterIndex_XMM0) {
+            builder->meta_insts[value_ref.id] =
+                create_float_register_value(size, interval.reg);
+        } else {
+            builder->meta_insts[value_ref.id] =
+                create_int_register_value(size, interval.reg);
+        }
+    }
+}
 
-            size_t type_size = SIRTypeSizeOf(builder->module, type);
-            if (type_size == 0) continue;
+static void add_frame_slot(
+    X64AsmBuilder *builder, SIRInstRef inst_ref, SIRType *type, uint32_t end)
+{
+    FrameSlot slot = {};
+    slot.size = SIRTypeSizeOf(builder->module, type);
+    slot.align = SIRTypeAlignOf(builder->module, type);
+    slot.end = end;
+    builder->frame_slots.push_back(slot);
+    builder->intervals[inst_ref.id].frame_slot =
+        (uint32_t)builder->frame_slots.len;
+}
 
-            interval->start = inst_index;
+// Puts a spilled value into the smallest slot that is free at the start of
+// its interval, or into a new slot
+static void color_frame_slot(X64AsmBuilder *builder, SIRInstRef value_ref)
+{
+    Interval *interval = &builder->intervals[value_ref.id];
+    SIRType *type = SIRModuleGetInstType(builder->module, value_ref);
+    uint32_t size = SIRTypeSizeOf(builder->module, type);
+    uint32_t align = SIRTypeAlignOf(builder->module, type);
+
+    size_t best = SIR_NO_INDEX;
+    for (size_t i = 0; i < builder->frame_slots.len; ++i) {
+        FrameSlot *slot = &builder->frame_slots[i];
+        if (slot->end >= interval->start || slot->size < size ||
+            slot->align < align) {
+            continue;
         }
+        if (best == SIR_NO_INDEX ||
+            slot->size < builder->frame_slots[best].size) {
+            best = i;
+        }
+    }
+
+    if (best == SIR_NO_INDEX) {
+        add_frame_slot(builder, value_ref, type, interval->end);
+        return;
     }
+
+    builder->frame_slots[best].end = interval->end;
+    interval->frame_slot = (uint32_t)best + 1;
 }
 
+// Stack slots, parameters and every value that lives in memory get a frame
+// slot. Spilled values share slots when their intervals don't overlap. The
+// slots are laid out from the largest alignment down so that only the first
+// slot of each alignment can need padding.
 static void reg_stack_alloc(
     X64AsmBuilder *builder, SIRFunction *func, MetaFunction *meta_func)
 {
     ZoneScoped;
 
+    SIRModule *module = builder->module;
+    builder->frame_slots.len = 0;
+
+    for (SIRInstRef stack_slot_ref : func->stack_slots) {
+        SIRInst stack_slot = SIRModuleGetInst(module, stack_slot_ref);
+        SIR_ASSERT(stack_slot.type->kind == SIRTypeKind_Pointer);
+        add_frame_slot(
+            builder, stack_slot_ref, stack_slot.type->pointer.sub, UINT32_MAX);
+    }
+
+    // In order of the interval starts
+    for (SIRInstRef value_ref : builder->sorted_values) {
+        Interval *interval = &builder->intervals[value_ref.id];
+        if (interval->reg == RegisterIndex_None || interval->split_at_calls) {
+            color_frame_slot(builder, value_ref);
+        }
+    }
+
+    // Parameters that never got an interval keep their slot for the whole
+    // function
+    for (SIRInstRef param_inst_ref : func->param_insts) {
+        Interval interval = builder->intervals[param_inst_ref.id];
+        if (interval.reg != RegisterIndex_None || interval.frame_slot != 0) {
+            continue;
+        }
+
+        SIRInst param_inst = SIRModuleGetInst(module, param_inst_ref);
+        add_frame_slot(builder, param_inst_ref, param_inst.type, UINT32_MAX);
+    }
+
     size_t stack_params_size = 0;
 
-    // Spill all elegible insts to stack
+    // Values without an interval keep their slot for the whole function
     for (SIRInstRef block_ref : func->blocks) {
-        SIRInst block = SIRModuleGetInst(builder->module, block_ref);
+        SIRInst block = SIRModuleGetInst(module, block_ref);
         for (SIRInstRef inst_ref : block.block->inst_refs) {
-            SIRInst inst = SIRModuleGetInst(builder->module, inst_ref);
+            SIRInst inst = SIRModuleGetInst(module, inst_ref);
 
             switch (inst.kind) {
             // Invalid for this stage of generation:
@@ -2832,8 +4567,12 @@ static void reg_stack_alloc(
             case SIRInstKind_Branch:
             case SIRInstKind_ReturnVoid:
             case SIRInstKind_ReturnValue:
-            case SIRInstKind_SetCond:
-            case SIRInstKind_PushFunctionParameter: break;
+            case SIRInstKind_SetCond: break;
+
+            case SIRInstKind_PushFunctionParameter: {
+                builder->current_func_params.push_back(inst.op1);
+                break;
+            }
 
             // Data already stored somewhere else:
             case SIRInstKind_Alias:
@@ -2861,35 +4600,99 @@ static void reg_stack_alloc(
             case SIRInstKind_ExtractStructElem:
             case SIRInstKind_Load:
             case SIRInstKind_FuncCall: {
-                uint32_t inst_size = SIRTypeSizeOf(builder->module, inst.type);
-                uint32_t inst_align =
-                    SIRTypeAlignOf(builder->module, inst.type);
-
-                meta_func->stack_size =
-                    SIR_ROUND_UP(inst_align, meta_func->stack_size);
-                meta_func->stack_size += inst_size;
-
-                builder->meta_insts[inst_ref.id] = create_stack_value(
-                    inst_size, -((int32_t)meta_func->stack_size));
-
+                // Tail calls pass their stack arguments in the space of
+                // the incoming ones
                 if (inst.kind == SIRInstKind_FuncCall) {
                     size_t func_stack_params_size =
                         get_func_call_stack_parameters_size(builder, inst_ref);
-                    if (stack_params_size < func_stack_params_size) {
+                    if (!builder->tail_calls[inst_ref.id] &&
+                        stack_params_size < func_stack_params_size) {
                         stack_params_size = func_stack_params_size;
                     }
+                    builder->current_func_params.len = 0;
+                }
+
+                // Already lives in a register or a shared slot, or is never
+                // materialized
+                Interval *interval = &builder->intervals[inst_ref.id];
+                if (interval->reg != RegisterIndex_None ||
+                    interval->frame_slot != 0 || is_folded(builder, inst_ref)) {
+                    break;
                 }
 
+                add_frame_slot(builder, inst_ref, inst.type, UINT32_MAX);
                 break;
             }
             }
         }
     }
 
+    uint32_t max_align = 1;
+    for (const FrameSlot &slot : builder->frame_slots) {
+        max_align = SIR_MAX(max_align, slot.align);
+    }
+    for (uint32_t align = max_align; align > 0; align /= 2) {
+        for (FrameSlot &slot : builder->frame_slots) {
+            if (slot.align != align) continue;
+            meta_func->stack_size = SIR_ROUND_UP(align, meta_func->stack_size);
+            meta_func->stack_size += slot.size;
+            slot.offset = meta_func->stack_size;
+        }
+    }
+
     // Reserve stack space for function call parameters
-    meta_func->stack_size += stack_params_size;
+    meta_func->stack_size += (uint32_t)stack_params_size;
+
+    // A leaf leaves RSP where it is and keeps its slots in the red zone,
+    // below the 8 bytes RBP would have been pushed to. Without a frame
+    // pointer the slots are addressed from RSP with the same layout.
+    bool is_leaf = builder->call_counts[builder->call_counts.len - 1] == 0;
+    meta_func->frameless =
+        is_leaf && meta_func->stack_size + 8 <= SYSV_RED_ZONE_SIZE;
+    meta_func->stack_size = SIR_ROUND_UP(0x10, meta_func->stack_size);
+    meta_func->frame_register = RegisterIndex_RBP;
+    meta_func->frame_offset = 0;
+    if (meta_func->frameless) {
+        meta_func->frame_register = RegisterIndex_RSP;
+        meta_func->frame_offset = -8;
+    } else if (builder->vt.omit_frame_pointer) {
+        meta_func->frame_register = RegisterIndex_RSP;
+        meta_func->frame_offset = (int32_t)meta_func->stack_size;
+    }
+
+    for (SIRInstRef stack_slot_ref : func->stack_slots) {
+        const FrameSlot *slot = get_frame_slot(builder, stack_slot_ref);
+        builder->meta_insts[stack_slot_ref.id] = create_stack_ptr_value(
+            meta_func, slot->size, -((int32_t)slot->offset));
+    }
+
+    // Values split at calls stay in their register outside the calls
+    for (SIRInstRef param_inst_ref : func->param_insts) {
+        const FrameSlot *slot = get_frame_slot(builder, param_inst_ref);
+        if (!slot) continue;
+        if (builder->intervals[param_inst_ref.id].reg != RegisterIndex_None) {
+            continue;
+        }
+
+        builder->meta_insts[param_inst_ref.id] = create_stack_value(
+            meta_func, slot->size, -((int32_t)slot->offset));
+    }
+
+    for (SIRInstRef block_ref : func->blocks) {
+        SIRInst block = SIRModuleGetInst(module, block_ref);
+        for (SIRInstRef inst_ref : block.block->inst_refs) {
+            const FrameSlot *slot = get_frame_slot(builder, inst_ref);
+            if (!slot) continue;
+            if (builder->intervals[inst_ref.id].reg != RegisterIndex_None) {
+                continue;
+            }
 
-    // TODO: Reserve saved register space
+            uint32_t inst_size = SIRTypeSizeOf(
+                module, SIRModuleGetInstType(module, inst_ref));
+            builder->meta_insts[inst_ref.id] = create_stack_value(
+                meta_func, inst_size, -((int32_t)slot->offset));
+        }
+    }
 }
 
 static void inst_aliasing_pass(X64AsmBuilder *builder, SIRFunction *func)
@@ -2957,6 +4760,231 @@ static void inst_aliasing_pass(X64AsmBuilder *builder, SIRFunction *func)
     }
 }
 
+// Orders the blocks into chains that fall through into a successor that is
+// not placed yet, so most jumps to the next block can be left out. The entry
+// block stays first.
+//
+// Chains start in reverse postorder, which places every block after the
+// blocks dominating it: the aliases and stack addresses are only resolved
+// when their instruction is generated, and passes merging or appending
+// blocks do not keep definitions ahead of their uses in the block list.
+// Unreachable blocks come last.
+static void
+layout_blocks(X64AsmBuilder *builder, SIRInstRef func_ref, SIRFunction *func)
+{
+    ZoneScoped;
+
+    SIRModule *module = builder->module;
+    SIRFunctionAnalysis *analysis =
+        SIRFunctionGetAnalysis(module, func_ref, SIRAnalysis_CFG);
+
+    builder->block_layout.len = 0;
+    for (uint32_t b : analysis->rpo) {
+        builder->block_layout.push_back(func->blocks[b]);
+    }
+    for (uint32_t b = 0; b < func->blocks.len; ++b) {
+        if (!SIRAnalysisIsReachable(analysis, b)) {
+            builder->block_layout.push_back(func->blocks[b]);
+        }
+    }
+    for (size_t i = 0; i < func->blocks.len; ++i) {
+        func->blocks[i] = builder->block_layout[i];
+    }
+    SIRFunctionInvalidateAnalysis(module, func_ref, SIRAnalysis_CFG);
+
+    for (SIRInstRef block_ref : func->blocks) {
+        SIRModuleGetInst(module, block_ref).block->index = SIR_NO_INDEX;
+    }
+
+    builder->block_layout.len = 0;
+    for (SIRInstRef chain_ref : func->blocks) {
+        SIRInstRef block_ref = chain_ref;
+        while (block_ref.id) {
+            SIRBlock *block = SIRModuleGetInst(module, block_ref).block;
+            if (block->index != SIR_NO_INDEX) break;
+
+            block->index = (uint32_t)builder->block_layout.len;
+            builder->block_layout.push_back(block_ref);
+
+            SIRInstRef term_ref = SIRBlockGetTerminator(module, block_ref);
+            SIRInstRef succs[2] = {};
+            if (term_ref.id) {
+                SIRInst term = SIRModuleGetInst(module, term_ref);
+                switch (term.kind) {
+                case SIRInstKind_Jump: succs[0] = term.op1; break;
+                case SIRInstKind_Branch: {
+                    succs[0] = term.op1;
+                    succs[1] = term.op2;
+                    break;
+                }
+                default: break;
+                }
+            }
+
+            block_ref = {0};
+            for (SIRInstRef succ_ref : succs) {
+                if (!succ_ref.id) continue;
+                SIRBlock *succ = SIRModuleGetInst(module, succ_ref).block;
+                if (succ->index == SIR_NO_INDEX) {
+                    block_ref = succ_ref;
+                    break;
+                }
+            }
+        }
+    }
+
+    SIR_ASSERT(builder->block_layout.len == func->blocks.len);
+    for (size_t i = 0; i < func->blocks.len; ++i) {
+        func->blocks[i] = builder->block_layout[i];
+    }
+}
+
+SIR_INLINE
+static size_t jump_destination_offset(
+    X64AsmBuilder *builder, const FuncJumpPatch *jump_patch)
+{
+    if (!jump_patch->destination_block.id) {
+        return jump_patch->destination_offset;
+    }
+    return builder->meta_insts[jump_patch->destination_block.id].block.offset;
+}
+
+// Offset of code after the jumps marked short have been shrunk
+static size_t
+relaxed_offset(X64AsmBuilder *builder, MetaFunction *meta_func, size_t offset)
+{
+    size_t lo = 0;
+    size_t hi = meta_func->jump_patches.len;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (meta_func->jump_patches[mid].instruction_offset < offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return offset - (lo > 0 ? builder->jump_shrinks[lo - 1] : 0);
+}
+
+// Marks the jumps that reach their destination with a rel8 displacement.
+// Shrinking a jump only brings others closer to their destination, so this
+// repeats until no more jumps fit. Returns whether any jump got shorter.
+static bool relax_jumps(X64AsmBuilder *builder, MetaFunction *meta_func)
+{
+    ZoneScoped;
+
+    SIRArray<FuncJumpPatch> *patches = &meta_func->jump_patches;
+    builder->short_jumps.resize(patches->len);
+    builder->jump_shrinks.resize(patches->len);
+    for (size_t i = 0; i < patches->len; ++i) {
+        builder->short_jumps[i] = false;
+    }
+
+    bool any_short = false;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+
+        uint32_t shrink = 0;
+        for (size_t i = 0; i < patches->len; ++i) {
+            if (builder->short_jumps[i]) {
+                shrink += (uint32_t)(*patches)[i].length - 2;
+            }
+            builder->jump_shrinks[i] = shrink;
+        }
+
+        for (size_t i = 0; i < patches->len; ++i) {
+            if (builder->short_jumps[i]) continue;
+
+            const FuncJumpPatch *patch = &(*patches)[i];
+            int64_t source = (int64_t)relaxed_offset(
+                builder, meta_func, patch->instruction_offset);
+            int64_t destination = (int64_t)relaxed_offset(
+                builder,
+                meta_func,
+                jump_destination_offset(builder, patch));
+
+            int64_t displacement = destination - (source + 2);
+            if (displacement >= INT8_MIN && displacement <= INT8_MAX) {
+                builder->short_jumps[i] = true;
+                any_short = true;
+                changed = true;
+            }
+        }
+    }
+
+    return any_short;
+}
+
+static void encode_function_body(
+    X64AsmBuilder *builder, SIRInstRef func_ref, MetaFunction *meta_func)
+{
+    ZoneScoped;
+
+    SIRFunction *func = SIRModuleGetInst(builder->module, func_ref).func;
+
+    // Begin stack frame, without a frame pointer the return address is
+    // padded to keep RSP aligned
+    if (meta_func->frame_register == RegisterIndex_RBP) {
+        encode(builder, FE_PUSHr, FE_BP, 0, 0, 0);
+        encode(builder, FE_MOV64rr, FE_BP, FE_SP, 0, 0);
+        if (meta_func->stack_size > 0) {
+            encode(builder, FE_SUB64ri, FE_SP, meta_func->stack_size, 0, 0);
+        }
+    } else if (!meta_func->frameless) {
+        encode(builder, FE_SUB64ri, FE_SP, meta_func->stack_size + 8, 0, 0);
+    }
+
+    // Save callee saved registers
+    for (size_t i = 0; i < meta_func->callee_saved_registers_len; ++i) {
+        RegisterIndex reg_index = meta_func->callee_saved_registers[i];
+        if (meta_func->registers_used[reg_index]) {
+            encode(
+                builder,
+                FE_MOV64mr,
+                FE_MEM(
+                    REGISTERS[meta_func->frame_register],
+                    0,
+                    0,
+                    meta_func->saved_register_stack_offset[reg_index] +
+                        meta_func->frame_offset),
+                REGISTERS[reg_index],
+                0,
+                0);
+        }
+    }
+
+    // Parameters can be given callee saved registers, so they are moved
+    // once those are saved
+    move_func_params(builder, func, meta_func);
+
+    builder->current_func = func_ref;
+
+    // Generate blocks
+    for (size_t i = 0; i < func->blocks.len; ++i) {
+        SIRInstRef block_ref = func->blocks[i];
+        SIRInst block = SIRModuleGetInst(builder->module, block_ref);
+        MetaValue *meta_block = &builder->meta_insts[block_ref.id];
+        *meta_block = {};
+
+        meta_block->kind = MetaValueKind_Block;
+        meta_block->block.offset = builder_get_code_offset(builder);
+
+        builder->current_block = block_ref;
+        builder->next_block = {0};
+        if (i + 1 < func->blocks.len) builder->next_block = func->blocks[i + 1];
+
+        // The return after a tail call is never reached
+        for (SIRInstRef inst_ref : block.block->inst_refs) {
+            generate_inst(builder, func_ref, inst_ref);
+            // encode(builder, FE_NOP, 0, 0, 0, 0);
+            if (builder->tail_calls[inst_ref.id]) break;
+        }
+    }
+
+    builder->current_func = {0};
+}
+
 static void generate_function(X64AsmBuilder *builder, SIRInstRef func_ref)
 {
     ZoneScoped;
@@ -2976,22 +5004,29 @@ static void generate_function(X64AsmBuilder *builder, SIRInstRef func_ref)
         SIRArray<RegisterIndex>::create((SIRAllocator *)builder->module->arena);
     meta_func->free_int_registers.reserve(16);
 
+    // RAX, RCX and RDX are scratch registers of the instruction encoding, so
+    // they are not handed out. The other argument registers only hold values
+    // that don't live across a call. The pool is taken from the back.
+    if (builder->vt.omit_frame_pointer) {
+        meta_func->free_int_registers.push_back(RegisterIndex_RBP);
+    }
     meta_func->free_int_registers.push_back(RegisterIndex_RBX);
-    meta_func->free_int_registers.push_back(RegisterIndex_R8);
-    meta_func->free_int_registers.push_back(RegisterIndex_R9);
-    meta_func->free_int_registers.push_back(RegisterIndex_R10);
-    meta_func->free_int_registers.push_back(RegisterIndex_R11);
     meta_func->free_int_registers.push_back(RegisterIndex_R12);
     meta_func->free_int_registers.push_back(RegisterIndex_R13);
     meta_func->free_int_registers.push_back(RegisterIndex_R14);
     meta_func->free_int_registers.push_back(RegisterIndex_R15);
+    meta_func->free_int_registers.push_back(RegisterIndex_RDI);
+    meta_func->free_int_registers.push_back(RegisterIndex_RSI);
+    meta_func->free_int_registers.push_back(RegisterIndex_R8);
+    meta_func->free_int_registers.push_back(RegisterIndex_R9);
+    meta_func->free_int_registers.push_back(RegisterIndex_R10);
+    meta_func->free_int_registers.push_back(RegisterIndex_R11);
 
     meta_func->free_float_registers =
         SIRArray<RegisterIndex>::create((SIRAllocator *)builder->module->arena);
     meta_func->free_float_registers.reserve(16);
 
-    meta_func->free_float_registers.push_back(RegisterIndex_XMM0);
-    meta_func->free_float_registers.push_back(RegisterIndex_XMM1);
+    // XMM0 and XMM1 are scratch registers
     meta_func->free_float_registers.push_back(RegisterIndex_XMM2);
     meta_func->free_float_registers.push_back(RegisterIndex_XMM3);
     meta_func->free_float_registers.push_back(RegisterIndex_XMM4);
@@ -3012,6 +5047,12 @@ static void generate_function(X64AsmBuilder *builder, SIRInstRef func_ref)
         meta_func->callee_saved_registers_len =
             SIR_CARRAY_LENGTH(SYSV_CALLEE_SAVED);
         meta_func->callee_saved_registers = &SYSV_CALLEE_SAVED[0];
+        if (builder->vt.omit_frame_pointer) {
+            meta_func->callee_saved_registers_len =
+                SIR_CARRAY_LENGTH(SYSV_CALLEE_SAVED_NO_FRAME_POINTER);
+            meta_func->callee_saved_registers =
+                &SYSV_CALLEE_SAVED_NO_FRAME_POINTER[0];
+        }
 
         meta_func->caller_saved_registers_len =
             SIR_CARRAY_LENGTH(SYSV_CALLER_SAVED);
@@ -3053,40 +5094,18 @@ static void generate_function(X64AsmBuilder *builder, SIRInstRef func_ref)
     // Aliasing pass
     inst_aliasing_pass(builder, func);
 
-    for (SIRInstRef stack_slot_ref : func->stack_slots) {
-        SIRInst stack_slot = SIRModuleGetInst(builder->module, stack_slot_ref);
-        SIR_ASSERT(stack_slot.type->kind == SIRTypeKind_Pointer);
-        uint32_t slot_size =
-            SIRTypeSizeOf(builder->module, stack_slot.type->pointer.sub);
-        uint32_t slot_align =
-            SIRTypeAlignOf(builder->module, stack_slot.type->pointer.sub);
-        meta_func->stack_size = SIR_ROUND_UP(slot_align, meta_func->stack_size);
-        meta_func->stack_size += slot_size;
-
-        builder->meta_insts[stack_slot_ref.id] = create_stack_ptr_value(
-            slot_size, -((int32_t)meta_func->stack_size));
-    }
-
-    // Create stack space for function parameters
-    for (SIRInstRef param_inst_ref : func->param_insts) {
-        SIRInst param_inst = SIRModuleGetInst(builder->module, param_inst_ref);
-
-        uint32_t inst_size = SIRTypeSizeOf(builder->module, param_inst.type);
-        uint32_t inst_align = SIRTypeAlignOf(builder->module, param_inst.type);
-
-        meta_func->stack_size = SIR_ROUND_UP(inst_align, meta_func->stack_size);
-        meta_func->stack_size += inst_size;
-
-        builder->meta_insts[param_inst_ref.id] =
-            create_stack_value(inst_size, -((int32_t)meta_func->stack_size));
-    }
+    layout_blocks(builder, func_ref, func);
+    select_folded_insts(builder, func);
+    select_tail_calls(builder, func_ref, func);
 
     // Register allocation / variable spilling
     reg_alloc(builder, func, meta_func);
-    reg_stack_alloc(builder, func, meta_func);
 
+    // Space for the callee saved registers the function clobbers, above the
+    // outgoing stack arguments
     for (uint32_t i = 0; i < RegisterIndex_COUNT; ++i) {
-        if (meta_func->registers_used[i]) {
+        if (meta_func->registers_used[i] &&
+            is_callee_saved(meta_func, (RegisterIndex)i)) {
             meta_func->stack_size = SIR_ROUND_UP(8, meta_func->stack_size);
             meta_func->stack_size += 8;
 
@@ -3095,69 +5114,37 @@ static void generate_function(X64AsmBuilder *builder, SIRInstRef func_ref)
         }
     }
 
+    reg_stack_alloc(builder, func, meta_func);
+
     size_t function_start_offset = builder->obj_builder->get_section_size(
         builder->obj_builder, SIRSectionType_Text);
 
-    // Begin stack frame
-    meta_func->stack_size = SIR_ROUND_UP(0x10, meta_func->stack_size);
-    encode(builder, FE_PUSHr, FE_BP, 0, 0, 0);
-    encode(builder, FE_MOV64rr, FE_BP, FE_SP, 0, 0);
-    encode(builder, FE_SUB64ri, FE_SP, meta_func->stack_size, 0, 0);
-
-    // Move parameters to stack
-    move_func_params_to_stack(builder, func);
-
-    // Save callee saved registers
-    for (size_t i = 0; i < meta_func->callee_saved_registers_len; ++i) {
-        RegisterIndex reg_index = meta_func->callee_saved_registers[i];
-        if (meta_func->registers_used[reg_index]) {
-            encode(
-                builder,
-                FE_MOV64mr,
-                FE_MEM(
-                    FE_BP,
-                    0,
-                    0,
-                    meta_func->saved_register_stack_offset[reg_index]),
-                REGISTERS[reg_index],
-                0,
-                0);
-        }
-    }
-
-    builder->current_func = func_ref;
-
-    // Generate blocks
-    for (SIRInstRef block_ref : func->blocks) {
-        SIRInst block = SIRModuleGetInst(builder->module, block_ref);
-        MetaValue *meta_block = &builder->meta_insts[block_ref.id];
-        *meta_block = {};
-
-        meta_block->kind = MetaValueKind_Block;
-        meta_block->block.offset = builder_get_code_offset(builder);
-
-        builder->current_block = block_ref;
-
-        for (SIRInstRef inst_ref : block.block->inst_refs) {
-            generate_inst(builder, func_ref, inst_ref);
-            // encode(builder, FE_NOP, 0, 0, 0, 0);
-        }
+    // Encode once with long jumps, then again with the jumps that fit in
+    // the short form
+    size_t start_inst_count = builder->encoded_inst_count;
+    builder->short_jumps.len = 0;
+    encode_function_body(builder, func_ref, meta_func);
+    if (relax_jumps(builder, meta_func)) {
+        builder->obj_builder->truncate_section(
+            builder->obj_builder, SIRSectionType_Text, function_start_offset);
+        builder->encoded_inst_count = start_inst_count;
+        meta_func->jump_patches.len = 0;
+        encode_function_body(builder, func_ref, meta_func);
     }
 
-    builder->current_func = {0};
-
     // Patch jumps
     for (const FuncJumpPatch &jump_patch : meta_func->jump_patches) {
-        MetaValue *meta_block =
-            &builder->meta_insts[jump_patch.destination_block.id];
-        encode_at(
+        size_t length = encode_at(
             builder,
             jump_patch.instruction_offset,
             jump_patch.instruction,
-            meta_block->block.offset - jump_patch.instruction_offset,
+            jump_destination_offset(builder, &jump_patch) -
+                jump_patch.instruction_offset,
             0,
             0,
             0);
+        SIR_ASSERT(length == jump_patch.length);
+        (void)length;
     }
 
     size_t function_end_offset = builder->obj_builder->get_section_size(
@@ -3249,6 +5236,23 @@ static void generate(SIRAsmBuilder *asm_builder)
     ZoneScoped;
     X64AsmBuilder *builder = (X64AsmBuilder *)asm_builder;
 
+    // Passes may have added instructions after the builder was created
+    size_t old_inst_count = builder->meta_insts.len;
+    builder->meta_insts.resize(builder->module->insts.len);
+    builder->intervals.resize(builder->module->insts.len);
+    builder->value_indices.resize(builder->module->insts.len);
+    builder->folded_into.resize(builder->module->insts.len);
+    builder->tail_calls.resize(builder->module->insts.len);
+    for (size_t i = 0; i < builder->value_indices.len; ++i) {
+        builder->value_indices[i] = VALUE_INDEX_NONE;
+        builder->folded_into[i] = {0};
+        builder->tail_calls[i] = false;
+    }
+    for (size_t i = old_inst_count; i < builder->meta_insts.len; ++i) {
+        builder->meta_insts[i] = {};
+        builder->intervals[i] = {};
+    }
+
     // Generate constants
     for (SIRInstRef const_ref : builder->module->consts) {
         generate_const(builder, const_ref);
@@ -3260,8 +5264,23 @@ static void generate(SIRAsmBuilder *asm_builder)
     }
 
     // Generate functions
+    builder->vt.function_stats.reserve(builder->module->functions.len);
     for (SIRInstRef func_ref : builder->module->functions) {
+        SIRFunctionStats stats = {};
+        stats.func_ref = func_ref;
+
+        double start_time = SIRGetTimeSeconds();
+        size_t start_alloc_count = SIR_ALLOC_COUNT;
+        size_t start_inst_count = builder->encoded_inst_count;
+        size_t start_code_size = builder_get_code_offset(builder);
+
         generate_function(builder, func_ref);
+
+        stats.time = SIRGetTimeSeconds() - start_time;
+        stats.alloc_count = SIR_ALLOC_COUNT - start_alloc_count;
+        stats.inst_count = builder->encoded_inst_count - start_inst_count;
+        stats.code_size = builder_get_code_offset(builder) - start_code_size;
+        builder->vt.function_stats.push_back(stats);
     }
 
 #if !NDEBUG
@@ -3294,9 +5313,28 @@ static void generate(SIRAsmBuilder *asm_builder)
 static void destroy(SIRAsmBuilder *asm_builder)
 {
     X64AsmBuilder *builder = (X64AsmBuilder *)asm_builder;
+    builder->vt.function_stats.destroy();
     builder->current_func_params.destroy();
+    builder->phi_copies.destroy();
+    builder->arg_moves.destroy();
     builder->intervals.destroy();
     builder->meta_insts.destroy();
+    builder->value_indices.destroy();
+    builder->values.destroy();
+    builder->block_starts.destroy();
+    builder->block_ends.destroy();
+    builder->live_sets.destroy();
+    builder->call_counts.destroy();
+    builder->start_offsets.destroy();
+    builder->sorted_values.destroy();
+    builder->active_values.destroy();
+    builder->split_values.destroy();
+    builder->frame_slots.destroy();
+    builder->folded_into.destroy();
+    builder->tail_calls.destroy();
+    builder->short_jumps.destroy();
+    builder->jump_shrinks.destroy();
+    builder->block_layout.destroy();
 }
 
 SIRAsmBuilder *
@@ -3308,12 +5346,16 @@ SIRCreateX64Builder(SIRModule *module, SIRObjectBuilder *obj_builder)
 
     asm_builder->vt.generate = generate;
     asm_builder->vt.destroy = destroy;
+    asm_builder->vt.function_stats =
+        SIRArray<SIRFunctionStats>::create(&SIR_MALLOC_ALLOCATOR);
 
     asm_builder->module = module;
     asm_builder->obj_builder = obj_builder;
 
     asm_builder->current_func_params =
         SIRArray<SIRInstRef>::create(&SIR_MALLOC_ALLOCATOR);
+    asm_builder->phi_copies = SIRArray<PhiCopy>::create(&SIR_MALLOC_ALLOCATOR);
+    asm_builder->arg_moves = SIRArray<ArgMove>::create(&SIR_MALLOC_ALLOCATOR);
 
     asm_builder->meta_insts =
         SIRArray<MetaValue>::create(&SIR_MALLOC_ALLOCATOR);
@@ -3330,6 +5372,34 @@ SIRCreateX64Builder(SIRModule *module, SIRObjectBuilder *obj_builder)
         asm_builder->intervals[i] = {};
     }
 
+    asm_builder->value_indices =
+        SIRArray<uint32_t>::create(&SIR_MALLOC_ALLOCATOR);
+    asm_builder->values = SIRArray<SIRInstRef>::create(&SIR_MALLOC_ALLOCATOR);
+    asm_builder->block_starts =
+        SIRArray<uint32_t>::create(&SIR_MALLOC_ALLOCATOR);
+    asm_builder->block_ends = SIRArray<uint32_t>::create(&SIR_MALLOC_ALLOCATOR);
+    asm_builder->live_sets = SIRArray<uint64_t>::create(&SIR_MALLOC_ALLOCATOR);
+    asm_builder->call_counts =
+        SIRArray<uint32_t>::create(&SIR_MALLOC_ALLOCATOR);
+    asm_builder->start_offsets =
+        SIRArray<uint32_t>::create(&SIR_MALLOC_ALLOCATOR);
+    asm_builder->sorted_values =
+        SIRArray<SIRInstRef>::create(&SIR_MALLOC_ALLOCATOR);
+    asm_builder->active_values =
+        SIRArray<SIRInstRef>::create(&SIR_MALLOC_ALLOCATOR);
+    asm_builder->split_values =
+        SIRArray<SIRInstRef>::create(&SIR_MALLOC_ALLOCATOR);
+    asm_builder->frame_slots =
+        SIRArray<FrameSlot>::create(&SIR_MALLOC_ALLOCATOR);
+    asm_builder->folded_into =
+        SIRArray<SIRInstRef>::create(&SIR_MALLOC_ALLOCATOR);
+    asm_builder->tail_calls = SIRArray<bool>::create(&SIR_MALLOC_ALLOCATOR);
+    asm_builder->short_jumps = SIRArray<bool>::create(&SIR_MALLOC_ALLOCATOR);
+    asm_builder->jump_shrinks =
+        SIRArray<uint32_t>::create(&SIR_MALLOC_ALLOCATOR);
+    asm_builder->block_layout =
+        SIRArray<SIRInstRef>::create(&SIR_MALLOC_ALLOCATOR);
+
     SIZE_CLASSES[1] = SizeClass_1;
     SIZE_CLASSES[2] = SizeClass_2;
     SIZE_CLASSES[4] = SizeClass_4;
@@ -3361,6 +5431,18 @@ SIRCreateX64Builder(SIRModule *module, SIRObjectBuilder *obj_builder)
     ENCODING_ENTRIES1[Mnem_DIV][OperandKind_Memory][SizeClass_4] = FE_DIV32m;
     ENCODING_ENTRIES1[Mnem_DIV][OperandKind_Memory][SizeClass_8] = FE_DIV64m;
 
+    // One operand multiplication, the high half of the product goes to RDX
+
+    ENCODING_ENTRIES1[Mnem_MUL][OperandKind_Reg][SizeClass_4] = FE_MUL32r;
+    ENCODING_ENTRIES1[Mnem_MUL][OperandKind_Reg][SizeClass_8] = FE_MUL64r;
+    ENCODING_ENTRIES1[Mnem_MUL][OperandKind_Memory][SizeClass_4] = FE_MUL32m;
+    ENCODING_ENTRIES1[Mnem_MUL][OperandKind_Memory][SizeClass_8] = FE_MUL64m;
+
+    ENCODING_ENTRIES1[Mnem_IMUL][OperandKind_Reg][SizeClass_4] = FE_IMUL32r;
+    ENCODING_ENTRIES1[Mnem_IMUL][OperandKind_Reg][SizeClass_8] = FE_IMUL64r;
+    ENCODING_ENTRIES1[Mnem_IMUL][OperandKind_Memory][SizeClass_4] = FE_IMUL32m;
+    ENCODING_ENTRIES1[Mnem_IMUL][OperandKind_Memory][SizeClass_8] = FE_IMUL64m;
+
     // MOV
 
     ENCODING_ENTRIES2[Mnem_MOV][OperandKind_Reg][SizeClass_8][OperandKind_Reg]
@@ -3548,6 +5630,17 @@ SIRCreateX64Builder(SIRModule *module, SIRObjectBuilder *obj_builder)
     ENCODING_ENTRIES2[Mnem_MOV][OperandKind_Memory][SizeClass_8]
                      [OperandKind_FReg][SizeClass_8] = FE_SSE_MOVSDmr;
 
+    // MOVD / MOVQ
+
+    ENCODING_ENTRIES2[Mnem_MOV][OperandKind_Reg][SizeClass_4][OperandKind_FReg]
+                     [SizeClass_4] = FE_SSE_MOVDrr;
+    ENCODING_ENTRIES2[Mnem_MOV][OperandKind_Reg][SizeClass_8][OperandKind_FReg]
+                     [SizeClass_8] = FE_SSE_MOVQrr;
+    ENCODING_ENTRIES2[Mnem_MOV][OperandKind_FReg][SizeClass_4][OperandKind_Reg]
+                     [SizeClass_4] = FE_SSE_MOVDrr;
+    ENCODING_ENTRIES2[Mnem_MOV][OperandKind_FReg][SizeClass_8][OperandKind_Reg]
+                     [SizeClass_8] = FE_SSE_MOVQrr;
+
     // LEA
 
     ENCODING_ENTRIES2[Mnem_LEA][OperandKind_Reg][SizeClass_8]
@@ -3572,6 +5665,17 @@ SIRCreateX64Builder(SIRModule *module, SIRObjectBuilder *obj_builder)
     ENCODING_ENTRIES2[Mnem_LEA][OperandKind_Memory][SizeClass_8]
                      [OperandKind_Memory][SizeClass_None] = FE_LEA64rm;
 
+    ENCODING_ENTRIES2[Mnem_LEA][OperandKind_Reg][SizeClass_4]
+                     [OperandKind_Memory][SizeClass_1] = FE_LEA32rm;
+    ENCODING_ENTRIES2[Mnem_LEA][OperandKind_Reg][SizeClass_4]
+                     [OperandKind_Memory][SizeClass_2] = FE_LEA32rm;
+    ENCODING_ENTRIES2[Mnem_LEA][OperandKind_Reg][SizeClass_4]
+                     [OperandKind_Memory][SizeClass_4] = FE_LEA32rm;
+    ENCODING_ENTRIES2[Mnem_LEA][OperandKind_Reg][SizeClass_4]
+                     [OperandKind_Memory][SizeClass_8] = FE_LEA32rm;
+    ENCODING_ENTRIES2[Mnem_LEA][OperandKind_Reg][SizeClass_4]
+                     [OperandKind_Memory][SizeClass_None] = FE_LEA32rm;
+
     // ADD
 
     ENCODING_ENTRIES2[Mnem_ADD][OperandKind_Memory][SizeClass_8]
@@ -3672,6 +5776,34 @@ SIRCreateX64Builder(SIRModule *module, SIRObjectBuilder *obj_builder)
                      [SizeClass_8] = FE_IMUL64rr;
     ENCODING_ENTRIES2[Mnem_MUL][OperandKind_Reg][SizeClass_4][OperandKind_Reg]
                      [SizeClass_4] = FE_IMUL32rr;
+    ENCODING_ENTRIES2[Mnem_MUL][OperandKind_Reg][SizeClass_2][OperandKind_Reg]
+                     [SizeClass_2] = FE_IMUL16rr;
+
+    ENCODING_ENTRIES2[Mnem_MUL][OperandKind_Reg][SizeClass_8]
+                     [OperandKind_Memory][SizeClass_8] = FE_IMUL64rm;
+    ENCODING_ENTRIES2[Mnem_MUL][OperandKind_Reg][SizeClass_4]
+                     [OperandKind_Memory][SizeClass_4] = FE_IMUL32rm;
+    ENCODING_ENTRIES2[Mnem_MUL][OperandKind_Reg][SizeClass_2]
+                     [OperandKind_Memory][SizeClass_2] = FE_IMUL16rm;
+
+    ENCODING_ENTRIES3[Mnem_MUL][OperandKind_Reg][SizeClass_8]
+                     [OperandKind_Reg][SizeClass_8][OperandKind_Imm]
+                     [SizeClass_8] = FE_IMUL64rri;
+    ENCODING_ENTRIES3[Mnem_MUL][OperandKind_Reg][SizeClass_8]
+                     [OperandKind_Memory][SizeClass_8][OperandKind_Imm]
+                     [SizeClass_8] = FE_IMUL64rmi;
+    ENCODING_ENTRIES3[Mnem_MUL][OperandKind_Reg][SizeClass_4]
+                     [OperandKind_Reg][SizeClass_4][OperandKind_Imm]
+                     [SizeClass_4] = FE_IMUL32rri;
+    ENCODING_ENTRIES3[Mnem_MUL][OperandKind_Reg][SizeClass_4]
+                     [OperandKind_Memory][SizeClass_4][OperandKind_Imm]
+                     [SizeClass_4] = FE_IMUL32rmi;
+    ENCODING_ENTRIES3[Mnem_MUL][OperandKind_Reg][SizeClass_2]
+                     [OperandKind_Reg][SizeClass_2][OperandKind_Imm]
+                     [SizeClass_2] = FE_IMUL16rri;
+    ENCODING_ENTRIES3[Mnem_MUL][OperandKind_Reg][SizeClass_2]
+                     [OperandKind_Memory][SizeClass_2][OperandKind_Imm]
+                     [SizeClass_2] = FE_IMUL16rmi;
 
     // AND
 
@@ -3814,6 +5946,53 @@ SIRCreateX64Builder(SIRModule *module, SIRObjectBuilder *obj_builder)
     ENCODING_ENTRIES2[Mnem_XOR][OperandKind_Memory][SizeClass_8]
                      [OperandKind_Imm][SizeClass_8] = FE_XOR64mi;
 
+    // CMP
+
+    ENCODING_ENTRIES2[Mnem_CMP][OperandKind_Reg][SizeClass_1][OperandKind_Reg]
+                     [SizeClass_1] = FE_CMP8rr;
+    ENCODING_ENTRIES2[Mnem_CMP][OperandKind_Reg][SizeClass_2][OperandKind_Reg]
+                     [SizeClass_2] = FE_CMP16rr;
+    ENCODING_ENTRIES2[Mnem_CMP][OperandKind_Reg][SizeClass_4][OperandKind_Reg]
+                     [SizeClass_4] = FE_CMP32rr;
+    ENCODING_ENTRIES2[Mnem_CMP][OperandKind_Reg][SizeClass_8][OperandKind_Reg]
+                     [SizeClass_8] = FE_CMP64rr;
+
+    ENCODING_ENTRIES2[Mnem_CMP][OperandKind_Reg][SizeClass_1][OperandKind_Imm]
+                     [SizeClass_1] = FE_CMP8ri;
+    ENCODING_ENTRIES2[Mnem_CMP][OperandKind_Reg][SizeClass_2][OperandKind_Imm]
+                     [SizeClass_2] = FE_CMP16ri;
+    ENCODING_ENTRIES2[Mnem_CMP][OperandKind_Reg][SizeClass_4][OperandKind_Imm]
+                     [SizeClass_4] = FE_CMP32ri;
+    ENCODING_ENTRIES2[Mnem_CMP][OperandKind_Reg][SizeClass_8][OperandKind_Imm]
+                     [SizeClass_8] = FE_CMP64ri;
+
+    ENCODING_ENTRIES2[Mnem_CMP][OperandKind_Reg][SizeClass_1]
+                     [OperandKind_Memory][SizeClass_1] = FE_CMP8rm;
+    ENCODING_ENTRIES2[Mnem_CMP][OperandKind_Reg][SizeClass_2]
+                     [OperandKind_Memory][SizeClass_2] = FE_CMP16rm;
+    ENCODING_ENTRIES2[Mnem_CMP][OperandKind_Reg][SizeClass_4]
+                     [OperandKind_Memory][SizeClass_4] = FE_CMP32rm;
+    ENCODING_ENTRIES2[Mnem_CMP][OperandKind_Reg][SizeClass_8]
+                     [OperandKind_Memory][SizeClass_8] = FE_CMP64rm;
+
+    ENCODING_ENTRIES2[Mnem_CMP][OperandKind_Memory][SizeClass_1]
+                     [OperandKind_Reg][SizeClass_1] = FE_CMP8mr;
+    ENCODING_ENTRIES2[Mnem_CMP][OperandKind_Memory][SizeClass_2]
+                     [OperandKind_Reg][SizeClass_2] = FE_CMP16mr;
+    ENCODING_ENTRIES2[Mnem_CMP][OperandKind_Memory][SizeClass_4]
+                     [OperandKind_Reg][SizeClass_4] = FE_CMP32mr;
+    ENCODING_ENTRIES2[Mnem_CMP][OperandKind_Memory][SizeClass_8]
+                     [OperandKind_Reg][SizeClass_8] = FE_CMP64mr;
+
+    ENCODING_ENTRIES2[Mnem_CMP][OperandKind_Memory][SizeClass_1]
+                     [OperandKind_Imm][SizeClass_1] = FE_CMP8mi;
+    ENCODING_ENTRIES2[Mnem_CMP][OperandKind_Memory][SizeClass_2]
+                     [OperandKind_Imm][SizeClass_2] = FE_CMP16mi;
+    ENCODING_ENTRIES2[Mnem_CMP][OperandKind_Memory][SizeClass_4]
+                     [OperandKind_Imm][SizeClass_4] = FE_CMP32mi;
+    ENCODING_ENTRIES2[Mnem_CMP][OperandKind_Memory][SizeClass_8]
+                     [OperandKind_Imm][SizeClass_8] = FE_CMP64mi;
+
     // SHL
 
     ENCODING_ENTRIES2[Mnem_SHL][OperandKind_Reg][SizeClass_1][OperandKind_Reg]
@@ -4022,27 +6201,27 @@ SIRCreateX64Builder(SIRModule *module, SIRObjectBuilder *obj_builder)
     ENCODING_ENTRIES2[Mnem_SSE_CVTSI2S][OperandKind_FReg][SizeClass_8]
                      [OperandKind_Memory][SizeClass_8] = FE_SSE_CVTSI2SD64rm;
 
-    // SSE CVTS2SI
+    // SSE CVTTS2SI, truncating like a C cast
 
-    ENCODING_ENTRIES2[Mnem_SSE_CVTS2SI][OperandKind_Reg][SizeClass_4]
-                     [OperandKind_FReg][SizeClass_4] = FE_SSE_CVTSS2SI32rr;
-    ENCODING_ENTRIES2[Mnem_SSE_CVTS2SI][OperandKind_Reg][SizeClass_4]
-                     [OperandKind_Memory][SizeClass_4] = FE_SSE_CVTSS2SI32rm;
+    ENCODING_ENTRIES2[Mnem_SSE_CVTTS2SI][OperandKind_Reg][SizeClass_4]
+                     [OperandKind_FReg][SizeClass_4] = FE_SSE_CVTTSS2SI32rr;
+    ENCODING_ENTRIES2[Mnem_SSE_CVTTS2SI][OperandKind_Reg][SizeClass_4]
+                     [OperandKind_Memory][SizeClass_4] = FE_SSE_CVTTSS2SI32rm;
 
-    ENCODING_ENTRIES2[Mnem_SSE_CVTS2SI][OperandKind_Reg][SizeClass_8]
-                     [OperandKind_FReg][SizeClass_4] = FE_SSE_CVTSS2SI64rr;
-    ENCODING_ENTRIES2[Mnem_SSE_CVTS2SI][OperandKind_Reg][SizeClass_8]
-                     [OperandKind_Memory][SizeClass_4] = FE_SSE_CVTSS2SI64rm;
+    ENCODING_ENTRIES2[Mnem_SSE_CVTTS2SI][OperandKind_Reg][SizeClass_8]
+                     [OperandKind_FReg][SizeClass_4] = FE_SSE_CVTTSS2SI64rr;
+    ENCODING_ENTRIES2[Mnem_SSE_CVTTS2SI][OperandKind_Reg][SizeClass_8]
+                     [OperandKind_Memory][SizeClass_4] = FE_SSE_CVTTSS2SI64rm;
 
-    ENCODING_ENTRIES2[Mnem_SSE_CVTS2SI][OperandKind_Reg][SizeClass_4]
-                     [OperandKind_FReg][SizeClass_8] = FE_SSE_CVTSD2SI32rr;
-    ENCODING_ENTRIES2[Mnem_SSE_CVTS2SI][OperandKind_Reg][SizeClass_4]
-                     [OperandKind_Memory][SizeClass_8] = FE_SSE_CVTSD2SI32rm;
+    ENCODING_ENTRIES2[Mnem_SSE_CVTTS2SI][OperandKind_Reg][SizeClass_4]
+                     [OperandKind_FReg][SizeClass_8] = FE_SSE_CVTTSD2SI32rr;
+    ENCODING_ENTRIES2[Mnem_SSE_CVTTS2SI][OperandKind_Reg][SizeClass_4]
+                     [OperandKind_Memory][SizeClass_8] = FE_SSE_CVTTSD2SI32rm;
 
-    ENCODING_ENTRIES2[Mnem_SSE_CVTS2SI][OperandKind_Reg][SizeClass_8]
-                     [OperandKind_FReg][SizeClass_8] = FE_SSE_CVTSD2SI64rr;
-    ENCODING_ENTRIES2[Mnem_SSE_CVTS2SI][OperandKind_Reg][SizeClass_8]
-                     [OperandKind_Memory][SizeClass_8] = FE_SSE_CVTSD2SI64rm;
+    ENCODING_ENTRIES2[Mnem_SSE_CVTTS2SI][OperandKind_Reg][SizeClass_8]
+                     [OperandKind_FReg][SizeClass_8] = FE_SSE_CVTTSD2SI64rr;
+    ENCODING_ENTRIES2[Mnem_SSE_CVTTS2SI][OperandKind_Reg][SizeClass_8]
+                     [OperandKind_Memory][SizeClass_8] = FE_SSE_CVTTSD2SI64rm;
 
     return &asm_builder->vt;
 }
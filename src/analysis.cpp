@@ -533,10 +533,11 @@ static void analyze_expr(
             TypeRef dest_type_ref = compiler->expr_as_types[param0];
             TypeRef source_type_ref = compiler->expr_types[param1];
 
-            Type dest_type = dest_type_ref.get(compiler);
-            Type source_type = source_type_ref.get(compiler);
+            Type *dest_type = &compiler->types[dest_type_ref.id];
+            Type *source_type = &compiler->types[source_type_ref.id];
 
-            if (dest_type.size_of(compiler) != source_type.size_of(compiler)) {
+            if (dest_type->size_of(compiler) !=
+                source_type->size_of(compiler)) {
                 compiler->add_error(
                     compiler->expr_locs[expr_ref],
                     "@bitcast types have different sizes");
@@ -1340,6 +1341,9 @@ analyze_decl(Compiler *compiler, AnalyzerState *state, DeclRef decl_ref)
     Decl decl = compiler->decls[decl_ref.id];
     String decl_name = compiler->decl_names[decl_ref.id];
 
+    bool profiled = compiler->should_profile_decl(decl_ref);
+    if (profiled) compiler->begin_decl_profile(ProfilePhase_Analysis);
+
     switch (decl.kind) {
     case DeclKind_Unknown: {
         LANG_ASSERT(0);
@@ -1593,6 +1597,8 @@ analyze_decl(Compiler *compiler, AnalyzerState *state, DeclRef decl_ref)
     }
 
     compiler->decls[decl_ref.id] = decl;
+
+    if (profiled) compiler->end_decl_profile(decl_ref);
 }
 
 void analyze_file(Compiler *compiler, FileRef file_ref)
@@ -66,6 +66,7 @@ void *ArenaAllocator::alloc_bytes(size_t size)
     header->size = size;
 
     chunk->offset = new_offset;
+    this->alloc_count++;
 
     return (void *)ptr;
 }
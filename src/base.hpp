@@ -8,8 +8,14 @@
 #include <new>
 #include "stb_sprintf.h"
 
-#ifdef TRACY_ENABLE
+#ifdef __linux__
+#include <time.h>
+#endif
+
+#if defined(TRACY_ENABLE)
 #include <Tracy.hpp>
+#elif defined(SIR_TRACE_ENABLE)
+#include <sir_trace.hpp>
 #else
 #define ZoneScoped
 #endif
@@ -48,6 +54,38 @@
         }                                                                      \
     } while (0)
 
+struct Clock {
+    int64_t start_seconds = 0;
+    int64_t start_nanoseconds = 0;
+
+    void start()
+    {
+#ifdef __linux__
+        timespec start_time;
+        clock_gettime(CLOCK_MONOTONIC, &start_time);
+        this->start_seconds = start_time.tv_sec;
+        this->start_nanoseconds = start_time.tv_nsec;
+#else
+#error Unsupported OS
+#endif
+    }
+
+    double elapsed()
+    {
+#ifdef __linux__
+        timespec end_time;
+        clock_gettime(CLOCK_MONOTONIC, &end_time);
+        int64_t ns_diff =
+            ((int64_t)end_time.tv_sec - (int64_t)this->start_seconds) *
+                (int64_t)1000000000 +
+            ((int64_t)end_time.tv_nsec - (int64_t)this->start_nanoseconds);
+        return (double)ns_diff / 1000000000.0;
+#else
+#error Unsupported OS
+#endif
+    }
+};
+
 template <typename T> struct Slice {
     T *ptr = nullptr;
     size_t len = 0;
@@ -130,6 +168,8 @@ struct String {
 };
 
 struct Allocator {
+    size_t alloc_count = 0;
+
     virtual void *alloc_bytes(size_t size) = 0;
     virtual void *realloc_bytes(void *ptr, size_t size) = 0;
     virtual void free_bytes(void *ptr) = 0;
@@ -278,12 +318,14 @@ struct MallocAllocator : Allocator {
     virtual void *alloc_bytes(size_t size) override
     {
         ZoneScoped;
+        this->alloc_count++;
         return ::malloc(size);
     }
 
     virtual void *realloc_bytes(void *ptr, size_t size) override
     {
         ZoneScoped;
+        this->alloc_count++;
         return ::realloc(ptr, size);
     }
 
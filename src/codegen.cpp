@@ -501,9 +501,9 @@ codegen_expr(Compiler *compiler, CodegenContext *ctx, ExprRef expr_ref)
         case BuiltinFunction_Unknown: LANG_ASSERT(0); break;
         case BuiltinFunction_Sizeof: {
             ExprRef param0_ref = expr.builtin_call.param_refs[0];
-            uint64_t size =
-                compiler->expr_as_types[param0_ref].get(compiler).size_of(
-                    compiler);
+            Type *param0_type =
+                &compiler->types[compiler->expr_as_types[param0_ref].id];
+            uint64_t size = param0_type->size_of(compiler);
 
             value = {
                 false,
@@ -514,9 +514,9 @@ codegen_expr(Compiler *compiler, CodegenContext *ctx, ExprRef expr_ref)
         }
         case BuiltinFunction_Alignof: {
             ExprRef param0_ref = expr.builtin_call.param_refs[0];
-            uint64_t align =
-                compiler->expr_as_types[param0_ref].get(compiler).align_of(
-                    compiler);
+            Type *param0_type =
+                &compiler->types[compiler->expr_as_types[param0_ref].id];
+            uint64_t align = param0_type->align_of(compiler);
 
             value = {
                 false,
@@ -948,8 +948,6 @@ codegen_expr(Compiler *compiler, CodegenContext *ctx, ExprRef expr_ref)
         case BinaryOp_And: {
             SIRInstRef current_func =
                 SIRBuilderGetCurrentFunction(ctx->builder);
-            SIRInstRef incoming_block = SIRBuilderGetCurrentBlock(ctx->builder);
-
             SIRInstRef true_block =
                 SIRModuleInsertBlockAtEnd(ctx->module, current_func);
 
@@ -965,6 +963,8 @@ codegen_expr(Compiler *compiler, CodegenContext *ctx, ExprRef expr_ref)
                 compiler->expr_types[expr.binary.left_ref].get(compiler),
                 left_value);
 
+            // The left side may have ended in another block
+            SIRInstRef incoming_block = SIRBuilderGetCurrentBlock(ctx->builder);
             SIRBuilderInsertBranch(
                 ctx->builder, left_value, true_block, merge_block);
 
@@ -974,6 +974,8 @@ codegen_expr(Compiler *compiler, CodegenContext *ctx, ExprRef expr_ref)
             SIRInstRef right_value = load_lvalue(
                 ctx, codegen_expr(compiler, ctx, expr.binary.right_ref));
 
+            // So may the right side
+            SIRInstRef right_block = SIRBuilderGetCurrentBlock(ctx->builder);
             SIRBuilderInsertJump(ctx->builder, merge_block);
 
             // In merge block
@@ -986,15 +988,13 @@ codegen_expr(Compiler *compiler, CodegenContext *ctx, ExprRef expr_ref)
             };
 
             SIRPhiAddIncoming(ctx->builder, incoming_block, left_value);
-            SIRPhiAddIncoming(ctx->builder, true_block, right_value);
+            SIRPhiAddIncoming(ctx->builder, right_block, right_value);
 
             break;
         }
         case BinaryOp_Or: {
             SIRInstRef current_func =
                 SIRBuilderGetCurrentFunction(ctx->builder);
-            SIRInstRef incoming_block = SIRBuilderGetCurrentBlock(ctx->builder);
-
             SIRInstRef false_block =
                 SIRModuleInsertBlockAtEnd(ctx->module, current_func);
 
@@ -1010,6 +1010,8 @@ codegen_expr(Compiler *compiler, CodegenContext *ctx, ExprRef expr_ref)
                 compiler->expr_types[expr.binary.left_ref].get(compiler),
                 left_value);
 
+            // The left side may have ended in another block
+            SIRInstRef incoming_block = SIRBuilderGetCurrentBlock(ctx->builder);
             SIRBuilderInsertBranch(
                 ctx->builder, left_value, merge_block, false_block);
 
@@ -1019,6 +1021,8 @@ codegen_expr(Compiler *compiler, CodegenContext *ctx, ExprRef expr_ref)
             SIRInstRef right_value = load_lvalue(
                 ctx, codegen_expr(compiler, ctx, expr.binary.right_ref));
 
+            // So may the right side
+            SIRInstRef right_block = SIRBuilderGetCurrentBlock(ctx->builder);
             SIRBuilderInsertJump(ctx->builder, merge_block);
 
             // In merge block
@@ -1031,7 +1035,7 @@ codegen_expr(Compiler *compiler, CodegenContext *ctx, ExprRef expr_ref)
             };
 
             SIRPhiAddIncoming(ctx->builder, incoming_block, left_value);
-            SIRPhiAddIncoming(ctx->builder, false_block, right_value);
+            SIRPhiAddIncoming(ctx->builder, right_block, right_value);
 
             break;
         }
@@ -1198,6 +1202,9 @@ codegen_decl(Compiler *compiler, CodegenContext *ctx, DeclRef decl_ref)
         return;
     }
 
+    bool profiled = compiler->should_profile_decl(decl_ref);
+    if (profiled) compiler->begin_decl_profile(ProfilePhase_SIRBuild);
+
     SIRModule *module = ctx->module;
     Decl decl = decl_ref.get(compiler);
     CodegenValue value = {};
@@ -1262,6 +1269,11 @@ codegen_decl(Compiler *compiler, CodegenContext *ctx, DeclRef decl_ref)
                 param_types.len,
                 return_type)};
 
+        if (decl.func->flags & FunctionFlags_Inline) {
+            SIRModuleSetFunctionFlags(
+                module, value.inst_ref, SIRFunctionFlags_AlwaysInline);
+        }
+
         ctx->decl_values[decl_ref.id] = value;
 
         ctx->function_stack.push_back(value.inst_ref);
@@ -1375,6 +1387,8 @@ codegen_decl(Compiler *compiler, CodegenContext *ctx, DeclRef decl_ref)
         break;
     }
     }
+
+    if (profiled) compiler->end_decl_profile(decl_ref);
 }
 
 CodegenContext *CodegenContextCreate()
@@ -1480,9 +1494,9 @@ void *codegen_interp_expr(
     SIRInstRef func_ref =
         codegen_isolated_expr_into_func(compiler, ctx, expr_ref);
     TypeRef expr_type_ref = compiler->expr_types[expr_ref];
-    Type expr_type = expr_type_ref.get(compiler);
+    Type *expr_type = &compiler->types[expr_type_ref.id];
 
-    *out_size = expr_type.size_of(compiler);
+    *out_size = expr_type->size_of(compiler);
     // TODO: ensure alignment
     void *result = compiler->arena->alloc_bytes(*out_size);
 
@@ -1490,6 +1504,43 @@ void *codegen_interp_expr(
     return result;
 }
 
+static void record_function_stats(
+    Compiler *compiler, CodegenContext *ctx, SIRAsmBuilder *asm_builder)
+{
+    // Map SIR functions back to the declarations that generated them
+    Array<DeclRef> func_decls =
+        Array<DeclRef>::create(MallocAllocator::get_instance());
+    func_decls.resize(SIRModuleGetInstCount(ctx->module));
+    for (size_t i = 0; i < func_decls.len; ++i) {
+        func_decls[i] = {0};
+    }
+
+    for (size_t i = 1; i < compiler->decls.len; ++i) {
+        if (compiler->decls[i].kind != DeclKind_Function) continue;
+
+        SIRInstRef func_ref = ctx->decl_values[i].inst_ref;
+        if (func_ref.id > 0) {
+            func_decls[func_ref.id] = {(uint32_t)i};
+        }
+    }
+
+    size_t stats_len = 0;
+    const SIRFunctionStats *stats =
+        SIRAsmBuilderGetFunctionStats(asm_builder, &stats_len);
+    for (size_t i = 0; i < stats_len; ++i) {
+        DeclRef decl_ref = func_decls[stats[i].func_ref.id];
+        if (decl_ref.id == 0) continue;
+
+        DeclProfile *profile = compiler->get_decl_profile(decl_ref);
+        profile->time[ProfilePhase_X64] += stats[i].time;
+        profile->alloc_count[ProfilePhase_X64] += stats[i].alloc_count;
+        profile->inst_count[ProfilePhase_X64] += stats[i].inst_count;
+        profile->code_size += stats[i].code_size;
+    }
+
+    func_decls.destroy();
+}
+
 void codegen_file(Compiler *compiler, CodegenContext *ctx, FileRef file_ref)
 {
     ZoneScoped;
@@ -1514,14 +1565,29 @@ void codegen_file(Compiler *compiler, CodegenContext *ctx, FileRef file_ref)
         ctx->expr_values[i] = {};
     }
 
+    compiler->begin_phase(ProfilePhase_SIRBuild);
+    compiler->profile_module = ctx->module;
     for (DeclRef decl_ref : file.top_level_decls) {
         codegen_decl(compiler, ctx, decl_ref);
     }
+    compiler->profile_module = nullptr;
+    compiler->end_phase(ProfilePhase_SIRBuild);
+
+    compiler->stats.sir_inst_count = SIRModuleGetInstCount(ctx->module);
 
     if (compiler->errors.len > 0) {
         compiler->halt_compilation();
     }
 
+    compiler->begin_phase(ProfilePhase_Optimize);
+    size_t pass_count = 0;
+    const SIRPassStats *passes = SIRModuleOptimize(
+        ctx->module, compiler->options.opt_level, &pass_count);
+    for (size_t i = 0; i < pass_count; ++i) {
+        compiler->stats.passes.push_back(passes[i]);
+    }
+    compiler->end_phase(ProfilePhase_Optimize);
+
 #if !NDEBUG
     {
         size_t str_len = 0;
@@ -1533,11 +1599,36 @@ void codegen_file(Compiler *compiler, CodegenContext *ctx, FileRef file_ref)
 
     SIRObjectBuilder *obj_builder = SIRCreateELF64Builder(ctx->module);
     SIRAsmBuilder *asm_builder = SIRCreateX64Builder(ctx->module, obj_builder);
+    SIRAsmBuilderSetOmitFramePointer(
+        asm_builder, compiler->options.omit_frame_pointer);
+    SIRAsmBuilderSetOptLevel(asm_builder, compiler->options.opt_level);
 
+    compiler->begin_phase(ProfilePhase_X64);
     SIRAsmBuilderGenerate(asm_builder);
+    compiler->end_phase(ProfilePhase_X64);
 
+    if (compiler->options.time_functions > 0) {
+        record_function_stats(compiler, ctx, asm_builder);
+    }
+
+    compiler->begin_phase(ProfilePhase_Object);
     const char *path = "./main.o";
     SIRObjectBuilderOutputToFile(obj_builder, path, strlen(path));
+    compiler->end_phase(ProfilePhase_Object);
+
+    size_t section_count = SIRObjectBuilderGetSectionCount(obj_builder);
+    for (size_t i = 0; i < section_count; ++i) {
+        SIRObjectSectionInfo info =
+            SIRObjectBuilderGetSectionInfo(obj_builder, i);
+        if (strlen(info.name) == 0) continue; // Null section
+
+        ObjectSectionStats section = {};
+        section.name = compiler->arena->clone(String(info.name));
+        section.size = info.size;
+        compiler->stats.sections.push_back(section);
+    }
+    compiler->stats.relocation_count =
+        SIRObjectBuilderGetRelocationCount(obj_builder);
 
     SIRAsmBuilderDestroy(asm_builder);
     SIRObjectBuilderDestroy(obj_builder);
@@ -1,40 +1,38 @@
 #include "compiler.hpp"
 
+#include <errno.h>
 #include <stdio.h>
 #ifdef __linux__
-#include <time.h>
+#include <linux/perf_event.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 #endif
 
-struct Clock {
-    int64_t start_seconds = 0;
-    int64_t start_nanoseconds = 0;
+static const char *PHASE_NAMES[ProfilePhase_COUNT] = {
+    "Parser",
+    "Analysis",
+    "SIR build",
+    "Optimize",
+    "X64",
+    "Object",
+};
 
-    void start()
-    {
-#ifdef __linux__
-        timespec start_time;
-        clock_gettime(CLOCK_MONOTONIC, &start_time);
-        this->start_seconds = start_time.tv_sec;
-        this->start_nanoseconds = start_time.tv_nsec;
-#else
-#error Unsupported OS
-#endif
-    }
+static const char *PHASE_REPORT_KEYS[ProfilePhase_COUNT] = {
+    "parse",
+    "analysis",
+    "sir_build",
+    "optimize",
+    "x64",
+    "object",
+};
 
-    double elapsed()
-    {
-#ifdef __linux__
-        timespec end_time;
-        clock_gettime(CLOCK_MONOTONIC, &end_time);
-        int64_t ns_diff =
-            ((int64_t)end_time.tv_sec - (int64_t)this->start_seconds) *
-                (int64_t)1000000000 +
-            ((int64_t)end_time.tv_nsec - (int64_t)this->start_nanoseconds);
-        return (double)ns_diff / 1000000000.0;
-#else
-#error Unsupported OS
-#endif
-    }
+static const char *PERF_COUNTER_REPORT_KEYS[PerfCounter_COUNT] = {
+    "cycles",
+    "instructions",
+    "l1d_read_misses",
+    "llc_misses",
+    "branch_misses",
 };
 
 bool ExprRef::is_lvalue(Compiler *compiler)
@@ -105,7 +103,7 @@ DeclRef Scope::lookup(const String &name)
     return {0};
 }
 
-Compiler Compiler::create()
+Compiler Compiler::create(const CompilerOptions &options)
 {
     init_parser_tables();
 
@@ -234,6 +232,7 @@ Compiler Compiler::create()
     builtin_function_map.set("defined", BuiltinFunction_Defined);
 
     Compiler compiler = {
+        .options = options,
         .arena = arena,
         .keyword_map = keyword_map,
         .builtin_function_map = builtin_function_map,
@@ -281,8 +280,27 @@ Compiler Compiler::create()
         .f64_type = {0},
         .usize_type = {0},
         .isize_type = {0},
+
+        .stats = {},
+        .decl_profiles =
+            Array<DeclProfile>::create(MallocAllocator::get_instance()),
+        .profile_frames =
+            Array<DeclProfileFrame>::create(MallocAllocator::get_instance()),
+        .profile_module = nullptr,
     };
 
+    compiler.stats.sections =
+        Array<ObjectSectionStats>::create(MallocAllocator::get_instance());
+    compiler.stats.passes =
+        Array<SIRPassStats>::create(MallocAllocator::get_instance());
+
+    for (size_t i = 0; i < PerfCounter_COUNT; ++i) {
+        compiler.stats.perf_fds[i] = -1;
+    }
+    if (options.perf_counters) {
+        compiler.open_perf_counters();
+    }
+
     {
         Type type = {};
         type.kind = TypeKind_Unknown;
@@ -422,6 +440,11 @@ Compiler Compiler::create()
 
 void Compiler::destroy()
 {
+    this->close_perf_counters();
+    this->stats.sections.destroy();
+    this->stats.passes.destroy();
+    this->profile_frames.destroy();
+    this->decl_profiles.destroy();
     this->exprs.destroy();
     this->stmts.destroy();
     this->decls.destroy();
@@ -505,9 +528,540 @@ void Compiler::print_errors()
     }
 }
 
+static uint64_t profile_alloc_count(Compiler *compiler)
+{
+    return compiler->arena->alloc_count +
+           MallocAllocator::get_instance()->alloc_count + SIRGetAllocCount();
+}
+
+static uint64_t profile_inst_count(Compiler *compiler)
+{
+    if (!compiler->profile_module) return 0;
+    return SIRModuleGetInstCount(compiler->profile_module);
+}
+
+static uint64_t profile_ast_node_count(Compiler *compiler)
+{
+    return compiler->exprs.len + compiler->stmts.len + compiler->decls.len;
+}
+
+static void profile_frame_resume(Compiler *compiler, DeclProfileFrame *frame)
+{
+    frame->alloc_count = profile_alloc_count(compiler);
+    frame->inst_count = profile_inst_count(compiler);
+    frame->ast_node_count = profile_ast_node_count(compiler);
+    frame->clock.start();
+}
+
+static void profile_frame_pause(Compiler *compiler, DeclProfileFrame *frame)
+{
+    DeclProfile *acc = &frame->accumulated;
+    acc->time[frame->phase] += frame->clock.elapsed();
+    acc->alloc_count[frame->phase] +=
+        profile_alloc_count(compiler) - frame->alloc_count;
+    acc->inst_count[frame->phase] +=
+        profile_inst_count(compiler) - frame->inst_count;
+    acc->ast_node_count +=
+        profile_ast_node_count(compiler) - frame->ast_node_count;
+}
+
+bool Compiler::should_profile_decl(DeclRef decl_ref)
+{
+    if (this->options.time_functions == 0) return false;
+
+    switch (this->decls[decl_ref.id].kind) {
+    case DeclKind_FunctionParameter:
+    case DeclKind_LocalVarDecl:
+    case DeclKind_ImmutableLocalVarDecl: return false;
+    default: return true;
+    }
+}
+
+void Compiler::begin_decl_profile(ProfilePhase phase)
+{
+    if (this->profile_frames.len > 0) {
+        profile_frame_pause(this, this->profile_frames.last());
+    }
+
+    DeclProfileFrame frame = {};
+    frame.phase = phase;
+    this->profile_frames.push_back(frame);
+    profile_frame_resume(this, this->profile_frames.last());
+}
+
+void Compiler::end_decl_profile(DeclRef decl_ref)
+{
+    LANG_ASSERT(this->profile_frames.len > 0);
+
+    DeclProfileFrame *frame = this->profile_frames.last();
+    profile_frame_pause(this, frame);
+
+    DeclProfile *profile = this->get_decl_profile(decl_ref);
+    for (size_t i = 0; i < ProfilePhase_COUNT; ++i) {
+        profile->time[i] += frame->accumulated.time[i];
+        profile->alloc_count[i] += frame->accumulated.alloc_count[i];
+        profile->inst_count[i] += frame->accumulated.inst_count[i];
+    }
+    profile->ast_node_count += frame->accumulated.ast_node_count;
+
+    this->profile_frames.pop();
+
+    if (this->profile_frames.len > 0) {
+        profile_frame_resume(this, this->profile_frames.last());
+    }
+}
+
+DeclProfile *Compiler::get_decl_profile(DeclRef decl_ref)
+{
+    while (this->decl_profiles.len < this->decls.len) {
+        this->decl_profiles.push_back({});
+    }
+    return &this->decl_profiles[decl_ref.id];
+}
+
+struct DeclProfileEntry {
+    DeclRef decl_ref;
+    double total_time;
+};
+
+static int compare_decl_profile_entries(const void *a, const void *b)
+{
+    const DeclProfileEntry *entry_a = (const DeclProfileEntry *)a;
+    const DeclProfileEntry *entry_b = (const DeclProfileEntry *)b;
+    if (entry_a->total_time < entry_b->total_time) return 1;
+    if (entry_a->total_time > entry_b->total_time) return -1;
+    return 0;
+}
+
+void Compiler::print_decl_profiles()
+{
+    Array<DeclProfileEntry> entries =
+        Array<DeclProfileEntry>::create(MallocAllocator::get_instance());
+
+    for (size_t i = 1; i < this->decl_profiles.len; ++i) {
+        DeclProfile *profile = &this->decl_profiles[i];
+
+        double total_time = 0.0;
+        for (size_t j = 0; j < ProfilePhase_COUNT; ++j) {
+            total_time += profile->time[j];
+        }
+
+        if (total_time > 0.0) {
+            entries.push_back({DeclRef{(uint32_t)i}, total_time});
+        }
+    }
+
+    qsort(
+        entries.ptr,
+        entries.len,
+        sizeof(DeclProfileEntry),
+        compare_decl_profile_entries);
+
+    size_t count = entries.len;
+    if (count > this->options.time_functions) {
+        count = this->options.time_functions;
+    }
+
+    fprintf(
+        stderr,
+        "Function profile: top %zu of %zu declarations by total time\n",
+        count,
+        entries.len);
+    fprintf(
+        stderr,
+        "%10s %10s %10s %10s %10s %10s %10s %10s %10s %10s  %s\n",
+        "total ms",
+        "parse ms",
+        "anal. ms",
+        "sir ms",
+        "x64 ms",
+        "allocs",
+        "ast nodes",
+        "sir insts",
+        "x64 insts",
+        "code bytes",
+        "name");
+
+    for (size_t i = 0; i < count; ++i) {
+        DeclRef decl_ref = entries[i].decl_ref;
+        DeclProfile *profile = &this->decl_profiles[decl_ref.id];
+
+        uint64_t alloc_count = 0;
+        for (size_t j = 0; j < ProfilePhase_COUNT; ++j) {
+            alloc_count += profile->alloc_count[j];
+        }
+
+        String name = this->decl_names[decl_ref.id];
+        if (name.len == 0) {
+            name = this->arena->sprintf(
+                "<#if at line %u>", this->decl_locs[decl_ref.id].line);
+        }
+
+        fprintf(
+            stderr,
+            "%10.3lf %10.3lf %10.3lf %10.3lf %10.3lf %10lu %10lu %10lu %10lu "
+            "%10lu  %.*s\n",
+            entries[i].total_time * 1000.0,
+            profile->time[ProfilePhase_Parse] * 1000.0,
+            profile->time[ProfilePhase_Analysis] * 1000.0,
+            profile->time[ProfilePhase_SIRBuild] * 1000.0,
+            profile->time[ProfilePhase_X64] * 1000.0,
+            alloc_count,
+            profile->ast_node_count,
+            profile->inst_count[ProfilePhase_SIRBuild],
+            profile->inst_count[ProfilePhase_X64],
+            profile->code_size,
+            (int)name.len,
+            name.ptr);
+    }
+
+    entries.destroy();
+}
+
+static double get_process_cpu_time()
+{
+#ifdef __linux__
+    timespec time;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec / 1000000000.0;
+#else
+#error Unsupported OS
+#endif
+}
+
+static size_t get_peak_rss_bytes()
+{
+#ifdef __linux__
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+    return (size_t)usage.ru_maxrss * 1024; // ru_maxrss is in kilobytes
+#else
+#error Unsupported OS
+#endif
+}
+
+#ifdef __linux__
+static int open_perf_counter(uint32_t type, uint64_t config)
+{
+    perf_event_attr attr = {};
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format =
+        PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+void Compiler::open_perf_counters()
+{
+#ifdef __linux__
+    static const uint64_t L1D_READ_MISS =
+        PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+
+    int *fds = this->stats.perf_fds;
+    fds[PerfCounter_Cycles] =
+        open_perf_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    fds[PerfCounter_Instructions] =
+        open_perf_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    fds[PerfCounter_L1DMisses] =
+        open_perf_counter(PERF_TYPE_HW_CACHE, L1D_READ_MISS);
+    fds[PerfCounter_LLCMisses] =
+        open_perf_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    fds[PerfCounter_BranchMisses] =
+        open_perf_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+
+    for (size_t i = 0; i < PerfCounter_COUNT; ++i) {
+        if (fds[i] >= 0) this->stats.has_perf_counters = true;
+    }
+
+    if (!this->stats.has_perf_counters) {
+        fprintf(
+            stderr,
+            "warning: hardware performance counters are unavailable: %s\n",
+            strerror(errno));
+    }
+#else
+    fprintf(
+        stderr,
+        "warning: hardware performance counters are unsupported on this "
+        "platform\n");
+#endif
+}
+
+void Compiler::close_perf_counters()
+{
+#ifdef __linux__
+    for (size_t i = 0; i < PerfCounter_COUNT; ++i) {
+        if (this->stats.perf_fds[i] >= 0) close(this->stats.perf_fds[i]);
+        this->stats.perf_fds[i] = -1;
+    }
+#endif
+    this->stats.has_perf_counters = false;
+}
+
+static uint64_t read_perf_counter(int fd)
+{
+#ifdef __linux__
+    uint64_t values[3] = {}; // value, time enabled, time running
+    if (fd < 0 || read(fd, values, sizeof(values)) != sizeof(values)) {
+        return 0;
+    }
+
+    // Scale the count when the kernel had to multiplex the counters
+    if (values[2] > 0 && values[2] < values[1]) {
+        return (uint64_t)((double)values[0] * (double)values[1] /
+                          (double)values[2]);
+    }
+    return values[0];
+#else
+    return 0;
+#endif
+}
+
+void Compiler::begin_phase(ProfilePhase phase)
+{
+    PhaseStats *stats = &this->stats.phases[phase];
+    stats->cpu_start = get_process_cpu_time();
+    if (this->stats.has_perf_counters) {
+        for (size_t i = 0; i < PerfCounter_COUNT; ++i) {
+            stats->counter_start[i] =
+                read_perf_counter(this->stats.perf_fds[i]);
+        }
+    }
+    stats->clock.start();
+}
+
+void Compiler::end_phase(ProfilePhase phase)
+{
+    PhaseStats *stats = &this->stats.phases[phase];
+    stats->wall_time += stats->clock.elapsed();
+    if (this->stats.has_perf_counters) {
+        for (size_t i = 0; i < PerfCounter_COUNT; ++i) {
+            stats->counters[i] += read_perf_counter(this->stats.perf_fds[i]) -
+                                  stats->counter_start[i];
+        }
+    }
+    stats->cpu_time += get_process_cpu_time() - stats->cpu_start;
+}
+
 static void print_time_taken(const char *task_name, double time)
 {
-    printf("%s time: %.3lf seconds\n", task_name, time);
+    fprintf(stderr, "%s time: %.3lf seconds\n", task_name, time);
+}
+
+void Compiler::print_time_summary(FileRef file_ref)
+{
+    File *file = &this->files[file_ref.id];
+
+    for (size_t i = 0; i < ProfilePhase_COUNT; ++i) {
+        print_time_taken(PHASE_NAMES[i], this->stats.phases[i].wall_time);
+    }
+
+    double time = this->stats.total_wall_time;
+    double total_line_count = (double)file->line_count;
+
+    fprintf(stderr, "Compilation time: %.3lf seconds\n", time);
+    fprintf(stderr, "Line count: %zu lines\n", file->line_count);
+    fprintf(
+        stderr, "Lines per second: %.3lf lines/s\n", total_line_count / time);
+
+    if (this->stats.passes.len > 0) {
+        this->print_pass_stats();
+    }
+
+    if (this->stats.has_perf_counters) {
+        this->print_perf_counters();
+    }
+}
+
+void Compiler::print_pass_stats()
+{
+    fprintf(
+        stderr,
+        "%-16s %10s %14s %14s\n",
+        "Pass",
+        "Time ms",
+        "Insts removed",
+        "Blocks merged");
+
+    for (SIRPassStats &pass : this->stats.passes) {
+        fprintf(
+            stderr,
+            "%-16s %10.3lf %14zu %14zu\n",
+            pass.name,
+            pass.time * 1000.0,
+            pass.insts_removed,
+            pass.blocks_merged);
+    }
+}
+
+static void print_perf_counter(int fd, uint64_t value)
+{
+    if (fd < 0) {
+        fprintf(stderr, " %14s", "n/a");
+    } else {
+        fprintf(stderr, " %14lu", (unsigned long)value);
+    }
+}
+
+void Compiler::print_perf_counters()
+{
+    int *fds = this->stats.perf_fds;
+
+    fprintf(
+        stderr,
+        "%-10s %14s %14s %6s %14s %14s %14s\n",
+        "Phase",
+        "Cycles",
+        "Instructions",
+        "IPC",
+        "L1d misses",
+        "LLC misses",
+        "Branch misses");
+
+    for (size_t i = 0; i < ProfilePhase_COUNT; ++i) {
+        uint64_t *counters = this->stats.phases[i].counters;
+        uint64_t cycles = counters[PerfCounter_Cycles];
+        uint64_t instructions = counters[PerfCounter_Instructions];
+
+        fprintf(stderr, "%-10s", PHASE_NAMES[i]);
+        print_perf_counter(fds[PerfCounter_Cycles], cycles);
+        print_perf_counter(fds[PerfCounter_Instructions], instructions);
+        if (fds[PerfCounter_Cycles] >= 0 &&
+            fds[PerfCounter_Instructions] >= 0 && cycles > 0) {
+            fprintf(stderr, " %6.2lf", (double)instructions / (double)cycles);
+        } else {
+            fprintf(stderr, " %6s", "n/a");
+        }
+        print_perf_counter(
+            fds[PerfCounter_L1DMisses], counters[PerfCounter_L1DMisses]);
+        print_perf_counter(
+            fds[PerfCounter_LLCMisses], counters[PerfCounter_LLCMisses]);
+        print_perf_counter(
+            fds[PerfCounter_BranchMisses], counters[PerfCounter_BranchMisses]);
+        fprintf(stderr, "\n");
+    }
+}
+
+static void write_json_string(FILE *f, const String &str)
+{
+    fputc('"', f);
+    for (char c : str) {
+        switch (c) {
+        case '"': fputs("\\\"", f); break;
+        case '\\': fputs("\\\\", f); break;
+        case '\n': fputs("\\n", f); break;
+        case '\t': fputs("\\t", f); break;
+        default: {
+            if ((unsigned char)c < 0x20) {
+                fprintf(f, "\\u%04x", (unsigned)c);
+            } else {
+                fputc(c, f);
+            }
+            break;
+        }
+        }
+    }
+    fputc('"', f);
+}
+
+void Compiler::write_time_report(FileRef file_ref)
+{
+    File *file = &this->files[file_ref.id];
+
+    FILE *f = fopen(this->options.time_report_path, "wb");
+    if (!f) {
+        fprintf(
+            stderr,
+            "error: could not open time report file: '%s'\n",
+            this->options.time_report_path);
+        return;
+    }
+
+    fprintf(f, "{\n");
+
+    fprintf(f, "  \"file\": ");
+    write_json_string(f, file->path);
+    fprintf(f, ",\n");
+    fprintf(f, "  \"file_bytes\": %zu,\n", file->text.len);
+    fprintf(f, "  \"line_count\": %zu,\n", file->line_count);
+    fprintf(f, "  \"token_count\": %zu,\n", file->token_count);
+    fprintf(f, "  \"expr_count\": %zu,\n", this->exprs.len - 1);
+    fprintf(f, "  \"stmt_count\": %zu,\n", this->stmts.len - 1);
+    fprintf(f, "  \"decl_count\": %zu,\n", this->decls.len - 1);
+    fprintf(f, "  \"type_count\": %zu,\n", this->types.len - 1);
+    fprintf(f, "  \"sir_inst_count\": %zu,\n", this->stats.sir_inst_count);
+
+    fprintf(f, "  \"phases\": {\n");
+    for (size_t i = 0; i < ProfilePhase_COUNT; ++i) {
+        PhaseStats *phase = &this->stats.phases[i];
+        fprintf(
+            f,
+            "    \"%s\": {\"wall_seconds\": %.9lf, \"cpu_seconds\": %.9lf",
+            PHASE_REPORT_KEYS[i],
+            phase->wall_time,
+            phase->cpu_time);
+
+        // Unavailable counters are reported as null
+        if (this->stats.has_perf_counters) {
+            for (size_t j = 0; j < PerfCounter_COUNT; ++j) {
+                fprintf(f, ", \"%s\": ", PERF_COUNTER_REPORT_KEYS[j]);
+                if (this->stats.perf_fds[j] >= 0) {
+                    fprintf(f, "%lu", (unsigned long)phase->counters[j]);
+                } else {
+                    fprintf(f, "null");
+                }
+            }
+        }
+
+        fprintf(f, "}%s\n", (i + 1 < ProfilePhase_COUNT) ? "," : "");
+    }
+    fprintf(f, "  },\n");
+    fprintf(
+        f,
+        "  \"total\": {\"wall_seconds\": %.9lf, \"cpu_seconds\": %.9lf},\n",
+        this->stats.total_wall_time,
+        this->stats.total_cpu_time);
+
+    fprintf(f, "  \"passes\": [\n");
+    for (size_t i = 0; i < this->stats.passes.len; ++i) {
+        SIRPassStats *pass = &this->stats.passes[i];
+        fprintf(
+            f,
+            "    {\"name\": \"%s\", \"wall_seconds\": %.9lf, "
+            "\"insts_removed\": %zu, \"blocks_merged\": %zu}%s\n",
+            pass->name,
+            pass->time,
+            pass->insts_removed,
+            pass->blocks_merged,
+            (i + 1 < this->stats.passes.len) ? "," : "");
+    }
+    fprintf(f, "  ],\n");
+
+    fprintf(f, "  \"object_sections\": {\n");
+    for (size_t i = 0; i < this->stats.sections.len; ++i) {
+        ObjectSectionStats *section = &this->stats.sections[i];
+        fprintf(f, "    ");
+        write_json_string(f, section->name);
+        fprintf(
+            f,
+            ": %zu%s\n",
+            section->size,
+            (i + 1 < this->stats.sections.len) ? "," : "");
+    }
+    fprintf(f, "  },\n");
+    fprintf(
+        f, "  \"relocation_count\": %zu,\n", this->stats.relocation_count);
+    fprintf(f, "  \"peak_rss_bytes\": %zu\n", get_peak_rss_bytes());
+
+    fprintf(f, "}\n");
+
+    fclose(f);
 }
 
 void Compiler::compile(String path)
@@ -546,39 +1100,39 @@ void Compiler::compile(String path)
             .path = path,
             .text = String{file_content.ptr, file_content.len},
             .line_count = 0,
+            .token_count = 0,
             .scope = Scope::create(this, file_ref),
             .top_level_decls = Array<DeclRef>::create(this->arena),
         };
 
         Clock total_clock = {};
-        Clock phase_clock = {};
-
         total_clock.start();
+        double total_cpu_start = get_process_cpu_time();
 
-        phase_clock.start();
+        this->begin_phase(ProfilePhase_Parse);
         parse_file(this, file_ref);
-        print_time_taken("Parser", phase_clock.elapsed());
+        this->end_phase(ProfilePhase_Parse);
 
-        phase_clock.start();
+        this->begin_phase(ProfilePhase_Analysis);
         analyze_file(this, file_ref);
-        print_time_taken("Analysis", phase_clock.elapsed());
+        this->end_phase(ProfilePhase_Analysis);
 
-        phase_clock.start();
+        // Records the SIR build, X64 and object phases
         CodegenContext *codegen_ctx = CodegenContextCreate();
         codegen_file(this, codegen_ctx, file_ref);
-        print_time_taken("Codegen", phase_clock.elapsed());
         CodegenContextDestroy(codegen_ctx);
 
-        {
-            File *file = &this->files[file_ref.id];
+        this->stats.total_wall_time = total_clock.elapsed();
+        this->stats.total_cpu_time = get_process_cpu_time() - total_cpu_start;
+
+        this->print_time_summary(file_ref);
 
-            double time = total_clock.elapsed();
-            double total_line_count = (double)file->line_count;
+        if (this->options.time_functions > 0) {
+            this->print_decl_profiles();
+        }
 
-            printf("Compilation time: %.3lf seconds\n", time);
-            printf("Line count: %zu seconds\n", file->line_count);
-            printf(
-                "Lines per second: %.3lf lines/s\n", total_line_count / time);
+        if (this->options.time_report_path) {
+            this->write_time_report(file_ref);
         }
     } catch (...) {
         if (this->errors.len == 0) {
@@ -636,6 +1190,9 @@ TypeRef Compiler::create_distinct_type(const String &name)
 void Compiler::set_distinct_type_alias(TypeRef distinct_type, TypeRef sub)
 {
     Type *type = &this->types[distinct_type.id];
+    // Layouts are frozen once computed, and types containing this one may
+    // have cached it already, so the body has to be set before any use
+    LANG_ASSERT(!type->has_layout);
     type->distinct.sub_type = sub;
 }
 
@@ -689,6 +1246,8 @@ void Compiler::set_named_struct_body(
     for (size_t i = 0; i < field_names.len; ++i) {
         type->struct_->field_map.set(field_names[i], i);
     }
+    // Same as set_distinct_type_alias: the layout must not be computed yet
+    LANG_ASSERT(!type->has_layout);
 }
 
 TypeRef Compiler::create_tuple_type(Slice<TypeRef> fields)
@@ -1059,88 +1618,34 @@ String Type::to_pretty_string(Compiler *compiler)
     return "";
 }
 
-uint32_t Type::size_of(Compiler *compiler)
+static void compute_fields_layout(
+    Compiler *compiler,
+    Slice<TypeRef> field_types,
+    uint32_t *size,
+    uint32_t *alignment)
 {
-    uint32_t size = 0;
-
-    switch (this->kind) {
-    case TypeKind_Unknown:
-    case TypeKind_MAX:
-    case TypeKind_Void:
-    case TypeKind_UntypedInt:
-    case TypeKind_UntypedFloat:
-    case TypeKind_Function:
-    case TypeKind_Type: {
-        size = 0;
-        break;
-    }
-    case TypeKind_Int: {
-        size = this->int_.bits >> 3;
-        break;
-    }
-    case TypeKind_Float: {
-        size = this->float_.bits >> 3;
-        break;
-    }
-    case TypeKind_Array: {
-        uint32_t subtype_size =
-            this->array.sub_type.get(compiler).size_of(compiler);
-        uint32_t subtype_alignment =
-            this->array.sub_type.get(compiler).align_of(compiler);
-        uint32_t stride = LANG_ROUND_UP(subtype_alignment, subtype_size);
-        size = stride * this->array.size;
-        break;
-    }
-    case TypeKind_Slice: {
-        size = 16;
-        break;
-    }
-    case TypeKind_Bool: {
-        size = 1;
-        break;
-    }
-    case TypeKind_Pointer: {
-        size = 8;
-        break;
-    }
-    case TypeKind_Distinct: {
-        size = this->distinct.sub_type.get(compiler).size_of(compiler);
-        break;
-    }
-    case TypeKind_Struct: {
-        size = 0;
-        for (TypeRef field_type_ref : this->struct_->field_types) {
-            Type field_type = field_type_ref.get(compiler);
-            uint32_t field_align = field_type.align_of(compiler);
-            size = LANG_ROUND_UP(field_align, size); // Add padding
-
-            uint32_t field_size = field_type.size_of(compiler);
-            size += field_size;
+    *size = 0;
+    *alignment = 0;
+    for (size_t i = 0; i < field_types.len; ++i) {
+        Type *field_type = &compiler->types[field_types[i].id];
+        field_type->compute_layout(compiler);
+
+        if (field_type->alignment > *alignment) {
+            *alignment = field_type->alignment;
         }
-        break;
-    }
-    case TypeKind_Tuple: {
-        size = 0;
-        for (TypeRef field_type_ref : this->tuple.field_types) {
-            Type field_type = field_type_ref.get(compiler);
-            uint32_t field_align = field_type.align_of(compiler);
-            size = LANG_ROUND_UP(field_align, size); // Add padding
 
-            uint32_t field_size = field_type.size_of(compiler);
-            size += field_size;
+        if (field_type->alignment > 0) {
+            *size = LANG_ROUND_UP(field_type->alignment, *size); // Add padding
         }
-        break;
-    }
+        *size += field_type->size;
     }
-
-    uint32_t self_alignment = this->align_of(compiler);
-    size = LANG_ROUND_UP(self_alignment, size); // Round size up for alignment
-
-    return size;
 }
 
-uint32_t Type::align_of(Compiler *compiler)
+void Type::compute_layout(Compiler *compiler)
 {
+    if (this->has_layout) return;
+
+    uint32_t size = 0;
     uint32_t alignment = 0;
 
     switch (this->kind) {
@@ -1151,66 +1656,88 @@ uint32_t Type::align_of(Compiler *compiler)
     case TypeKind_UntypedFloat:
     case TypeKind_Function:
     case TypeKind_Type: {
+        size = 0;
         alignment = 0;
         break;
     }
     case TypeKind_Int: {
+        size = this->int_.bits >> 3;
         alignment = this->int_.bits >> 3;
         break;
     }
     case TypeKind_Float: {
+        size = this->float_.bits >> 3;
         alignment = this->float_.bits >> 3;
         break;
     }
     case TypeKind_Array: {
-        uint32_t subtype_alignment =
-            this->array.sub_type.get(compiler).align_of(compiler);
-        alignment = subtype_alignment;
+        Type *sub_type = &compiler->types[this->array.sub_type.id];
+        sub_type->compute_layout(compiler);
+        uint32_t stride = sub_type->size;
+        if (sub_type->alignment > 0) {
+            stride = LANG_ROUND_UP(sub_type->alignment, sub_type->size);
+        }
+        size = stride * this->array.size;
+        alignment = sub_type->alignment;
         break;
     }
     case TypeKind_Slice: {
+        size = 16;
         alignment = 8;
         break;
     }
     case TypeKind_Bool: {
+        size = 1;
         alignment = 1;
         break;
     }
     case TypeKind_Pointer: {
+        size = 8;
         alignment = 8;
         break;
     }
     case TypeKind_Distinct: {
-        alignment = this->distinct.sub_type.get(compiler).align_of(compiler);
+        Type *sub_type = &compiler->types[this->distinct.sub_type.id];
+        sub_type->compute_layout(compiler);
+        size = sub_type->size;
+        alignment = sub_type->alignment;
         break;
     }
     case TypeKind_Struct: {
-        alignment = 0;
-
-        for (TypeRef field_type_ref : this->struct_->field_types) {
-            Type field_type = field_type_ref.get(compiler);
-            uint32_t field_align = field_type.align_of(compiler);
-            if (field_align > alignment) {
-                alignment = field_align;
-            }
-        }
-
+        compute_fields_layout(
+            compiler,
+            this->struct_->field_types,
+            &size,
+            &alignment);
         break;
     }
     case TypeKind_Tuple: {
-        alignment = 0;
-
-        for (TypeRef field_type_ref : this->tuple.field_types) {
-            Type field_type = field_type_ref.get(compiler);
-            uint32_t field_align = field_type.align_of(compiler);
-            if (field_align > alignment) {
-                alignment = field_align;
-            }
-        }
-
+        compute_fields_layout(
+            compiler,
+            this->tuple.field_types,
+            &size,
+            &alignment);
         break;
     }
     }
 
-    return alignment;
+    if (alignment > 0) {
+        size = LANG_ROUND_UP(alignment, size); // Round size up for alignment
+    }
+
+    this->size = size;
+    this->alignment = alignment;
+    this->has_layout = true;
+}
+
+uint32_t Type::size_of(Compiler *compiler)
+{
+    this->compute_layout(compiler);
+    return this->size;
+}
+
+uint32_t Type::align_of(Compiler *compiler)
+{
+    this->compute_layout(compiler);
+    return this->alignment;
 }
@@ -75,6 +75,7 @@ struct File {
     String path;
     String text;
     size_t line_count;
+    size_t token_count;
 
     Scope *scope;
     Array<DeclRef> top_level_decls;
@@ -248,6 +249,12 @@ struct StructType {
 struct Type {
     TypeKind kind;
     String str;
+
+    // Cached layout, see Type::compute_layout. Frozen once computed
+    bool has_layout;
+    uint32_t size;
+    uint32_t alignment;
+
     union {
         struct {
             uint32_t bits;
@@ -284,6 +291,7 @@ struct Type {
 
     String to_internal_string(Compiler *compiler);
     String to_pretty_string(Compiler *compiler);
+    void compute_layout(Compiler *compiler);
     uint32_t align_of(Compiler *compiler);
     uint32_t size_of(Compiler *compiler);
 
@@ -594,7 +602,91 @@ enum AnalysisStateFlags : uint8_t {
     AnalysisStateFlags_Error = 1 << 1,
 };
 
+struct CompilerOptions {
+    // Number of declarations listed by the per-function profile report,
+    // zero disables profiling (--time-functions[=N])
+    uint32_t time_functions;
+    // Path of the JSON timing report (--time-report=json <file>)
+    const char *time_report_path;
+    // Read hardware performance counters around each phase (--perf-counters)
+    bool perf_counters;
+    // Pass pipeline run on the SIR module (-O0, -O1, -O2)
+    SIROptLevel opt_level;
+    // Frames are addressed through RSP and RBP is allocatable
+    // (-fomit-frame-pointer)
+    bool omit_frame_pointer;
+};
+
+enum ProfilePhase : uint8_t {
+    ProfilePhase_Parse,
+    ProfilePhase_Analysis,
+    ProfilePhase_SIRBuild,
+    ProfilePhase_Optimize,
+    ProfilePhase_X64,
+    ProfilePhase_Object,
+
+    ProfilePhase_COUNT,
+};
+
+enum PerfCounter : uint8_t {
+    PerfCounter_Cycles,
+    PerfCounter_Instructions,
+    PerfCounter_L1DMisses,
+    PerfCounter_LLCMisses,
+    PerfCounter_BranchMisses,
+
+    PerfCounter_COUNT,
+};
+
+struct PhaseStats {
+    Clock clock;
+    double cpu_start;
+    double wall_time;
+    double cpu_time;
+    uint64_t counter_start[PerfCounter_COUNT];
+    uint64_t counters[PerfCounter_COUNT];
+};
+
+struct ObjectSectionStats {
+    String name;
+    size_t size;
+};
+
+struct CompileStats {
+    PhaseStats phases[ProfilePhase_COUNT];
+    double total_wall_time;
+    double total_cpu_time;
+    size_t sir_inst_count;
+    Array<SIRPassStats> passes;
+    Array<ObjectSectionStats> sections;
+    size_t relocation_count;
+    // perf_event_open file descriptors, -1 when a counter is unavailable
+    int perf_fds[PerfCounter_COUNT];
+    bool has_perf_counters;
+};
+
+struct DeclProfile {
+    double time[ProfilePhase_COUNT];
+    uint64_t alloc_count[ProfilePhase_COUNT];
+    // SIR instructions for SIRBuild, machine instructions for X64
+    uint64_t inst_count[ProfilePhase_COUNT];
+    uint64_t ast_node_count;
+    uint64_t code_size;
+};
+
+// Counters accumulated by a profiled declaration while it is on top of the
+// profile stack, nested declarations pause their parent
+struct DeclProfileFrame {
+    ProfilePhase phase;
+    Clock clock;
+    uint64_t alloc_count;
+    uint64_t inst_count;
+    uint64_t ast_node_count;
+    DeclProfile accumulated;
+};
+
 struct Compiler {
+    CompilerOptions options;
     ArenaAllocator *arena;
     StringMap<TokenKind> keyword_map;
     StringMap<BuiltinFunction> builtin_function_map;
@@ -639,7 +731,12 @@ struct Compiler {
     TypeRef usize_type;
     TypeRef isize_type;
 
-    static Compiler create();
+    CompileStats stats;
+    Array<DeclProfile> decl_profiles;
+    Array<DeclProfileFrame> profile_frames;
+    SIRModule *profile_module; // Module whose instructions are counted
+
+    static Compiler create(const CompilerOptions &options);
     void destroy();
 
     TypeRef get_cached_type(Type &type);
@@ -664,6 +761,21 @@ struct Compiler {
     void halt_compilation();
     void print_errors();
 
+    void open_perf_counters();
+    void close_perf_counters();
+    void begin_phase(ProfilePhase phase);
+    void end_phase(ProfilePhase phase);
+    void print_time_summary(FileRef file_ref);
+    void print_perf_counters();
+    void print_pass_stats();
+    void write_time_report(FileRef file_ref);
+
+    bool should_profile_decl(DeclRef decl_ref);
+    void begin_decl_profile(ProfilePhase phase);
+    void end_decl_profile(DeclRef decl_ref);
+    DeclProfile *get_decl_profile(DeclRef decl_ref);
+    void print_decl_profiles();
+
     LANG_INLINE
     FileRef add_file(const File &file)
     {
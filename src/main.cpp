@@ -1,16 +1,83 @@
 #include "compiler.hpp"
 #include <stdio.h>
 
+static void print_usage(const char *program)
+{
+    fprintf(
+        stderr,
+        "error: expected command syntax: %s [options] <filename>\n"
+        "options:\n"
+        "  --time-functions[=N]       print the N most expensive declarations "
+        "(default: 10)\n"
+        "  --time-report=json <file>  write phase timings and counters as "
+        "JSON\n"
+        "  --perf-counters            read hardware performance counters "
+        "per phase\n"
+        "  -O0, -O1, -O2              optimization level (default: -O0)\n"
+        "  -fomit-frame-pointer       address the stack through RSP and "
+        "allocate RBP\n",
+        program);
+}
+
+static bool has_prefix(const String &str, const String &prefix)
+{
+    return str.len >= prefix.len && String(str.ptr, prefix.len).equal(prefix);
+}
+
 int main(int argc, const char *argv[])
 {
-    if (argc < 2)  {
-        fprintf(stderr, "error: expected command syntax: %s <filename>\n", argv[0]);
+    CompilerOptions options = {};
+    const char *path = nullptr;
+
+    for (int i = 1; i < argc; ++i) {
+        String arg = argv[i];
+        String time_functions_flag = "--time-functions";
+
+        if (has_prefix(arg, time_functions_flag)) {
+            if (arg.len == time_functions_flag.len) {
+                options.time_functions = 10;
+            } else if (arg[time_functions_flag.len] == '=') {
+                options.time_functions = (uint32_t)strtoul(
+                    arg.ptr + time_functions_flag.len + 1, NULL, 10);
+            } else {
+                print_usage(argv[0]);
+                exit(1);
+            }
+        } else if (arg.equal("--time-report=json")) {
+            if (i + 1 >= argc) {
+                print_usage(argv[0]);
+                exit(1);
+            }
+            options.time_report_path = argv[++i];
+        } else if (arg.equal("--perf-counters")) {
+            options.perf_counters = true;
+        } else if (arg.equal("-O0")) {
+            options.opt_level = SIROptLevel_O0;
+        } else if (arg.equal("-O1")) {
+            options.opt_level = SIROptLevel_O1;
+        } else if (arg.equal("-O2")) {
+            options.opt_level = SIROptLevel_O2;
+        } else if (arg.equal("-fomit-frame-pointer")) {
+            options.omit_frame_pointer = true;
+        } else if (arg.len > 0 && arg[0] == '-') {
+            fprintf(stderr, "error: unknown option: '%s'\n", argv[i]);
+            exit(1);
+        } else if (!path) {
+            path = argv[i];
+        } else {
+            print_usage(argv[0]);
+            exit(1);
+        }
+    }
+
+    if (!path) {
+        print_usage(argv[0]);
         exit(1);
     }
 
-    Compiler compiler = Compiler::create();
+    Compiler compiler = Compiler::create(options);
 
-    compiler.compile(argv[1]);
+    compiler.compile(path);
 
     compiler.destroy();
     return 0;
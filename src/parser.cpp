@@ -2196,10 +2196,25 @@ void parse_file(Compiler *compiler, FileRef file_ref)
             compiler->halt_compilation();
         }
 
-        parse_top_level_decl(compiler, &parser_state, &file.top_level_decls);
+        if (compiler->options.time_functions > 0) {
+            size_t first_decl_index = file.top_level_decls.len;
+            compiler->begin_decl_profile(ProfilePhase_Parse);
+            parse_top_level_decl(
+                compiler, &parser_state, &file.top_level_decls);
+            if (file.top_level_decls.len > first_decl_index) {
+                compiler->end_decl_profile(
+                    file.top_level_decls[first_decl_index]);
+            } else {
+                compiler->end_decl_profile({0});
+            }
+        } else {
+            parse_top_level_decl(
+                compiler, &parser_state, &file.top_level_decls);
+        }
     }
 
     file.line_count = parser_state.tokens[parser_state.tokens.len - 1].loc.line;
+    file.token_count = parser_state.tokens.len;
 
     compiler->files[file_ref.id] = file;
 